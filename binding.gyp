@@ -1,8 +1,50 @@
 {
+  'variables': {
+    # Everything but the Node.js bindings, shared by the addon and the CLI
+    'core_sources': [
+      'src/usb_common.cc',
+      'src/change_detector.cc',
+      'src/device_fields.cc',
+      'src/device_history.cc',
+      'src/device_id.cc',
+      'src/device_registry.cc',
+      'src/resolvers.cc',
+      'src/usb_ids.cc',
+      'src/utils/logger.cc',
+      'src/utils/mapped_file.cc',
+      'src/utils/ring_log.cc',
+      'src/utils/trace.cc'
+    ],
+  },
   'target_defaults': {
 
     'conditions': [
+      ['OS=="mac"', {
+        'sources': [
+          'src/mac/subdevil.cc',
+          'src/mac/interop.cc'
+        ],
+        'cflags!': [ '-fno-exceptions' ],
+        'cflags_cc!': [ '-fno-exceptions' ],
+        'xcode_settings': {
+          'MACOSX_DEPLOYMENT_TARGET': '10.9',
+          'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
+          'OTHER_LDFLAGS': [
+            '-framework Foundation',
+            '-framework IOKit',
+            '-framework DiskArbitration'
+          ],
+        },
+      }],
       ['OS=="win"', {
+        'sources': [
+          'src/win/subdevil.cc',
+        ],
+        'link_settings': {
+           'libraries': [
+             'setupapi.lib'
+           ]
+        },
         'msvs_disabled_warnings': [
           4530,  # C++ exception handler used, but unwind semantics are not enabled
           4506,  # no definition for inline function
@@ -14,38 +56,51 @@
     {
       'target_name': 'subdevil',
       'sources': [
-        'src/usb_common.cc',
-        'src/bindings.cc',
-        'src/utils/logger.cc'
+        '<@(core_sources)',
+        'src/shared_snapshot.cc',
+        'src/bindings.cc'
       ],
-      'conditions': [
-        ['OS=="mac"', {
-          'sources': [
-            'src/mac/subdevil.cc',
-            'src/mac/interop.cc'
-          ],
-          'cflags!': [ '-fno-exceptions' ],
-          'cflags_cc!': [ '-fno-exceptions' ],
-          'xcode_settings': {
-            'MACOSX_DEPLOYMENT_TARGET': '10.9',
-            'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
-            'OTHER_LDFLAGS': [
-              '-framework Foundation',
-              '-framework IOKit',
-              '-framework DiskArbitration'
-            ],
-          },
-        }],
-        ['OS=="win"', {
-          'sources': [
-            'src/win/subdevil.cc',
-          ],
-          'link_settings': {
-             'libraries': [
-               'setupapi.lib'
-             ]
-          }
-        }]
+    },
+    {
+      # Node-free command line tool, see src/cli/main.cc
+      'target_name': 'subdevil-cli',
+      'type': 'executable',
+      'sources': [
+        '<@(core_sources)',
+        'src/cli/main.cc'
+      ],
+    },
+    {
+      # Native tests against a fake backend, see test/native/main.cc
+      'target_name': 'subdevil-tests',
+      'type': 'executable',
+      'sources': [
+        '<@(core_sources)',
+        'src/shared_snapshot.cc',
+        'test/native/fake_backend.cc',
+        'test/native/main.cc',
+        'test/native/batch_reads_test.cc',
+        'test/native/deadline_test.cc',
+        'test/native/device_history_test.cc',
+        'test/native/device_fields_test.cc',
+        'test/native/device_id_test.cc',
+        'test/native/json_writer_test.cc',
+        'test/native/logger_test.cc',
+        'test/native/lru_cache_test.cc',
+        'test/native/passive_test.cc',
+        'test/native/registry_test.cc',
+        'test/native/resolvers_test.cc',
+        'test/native/shared_snapshot_test.cc',
+        'test/native/storm_test.cc',
+        'test/native/string_pool_test.cc',
+        'test/native/trace_test.cc',
+        'test/native/usb_ids_test.cc'
+      ],
+      # Replaced by the fake backend
+      'sources!': [
+        'src/mac/subdevil.cc',
+        'src/mac/interop.cc',
+        'src/win/subdevil.cc'
       ],
     }
   ]
@@ -1,8 +1,27 @@
 #include "subdevil.h"
+#include "change_detector.h"
+#include "device_fields.h"
+#include "device_history.h"
+#include "device_registry.h"
+#include "resolvers.h"
+#include "shared_snapshot.h"
+#include "usb_common.h"
+#include "usb_ids.h"
 #include "utils.h"
 
 #include <v8.h>
 #include <node.h>
+#include <uv.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <stdio.h>
 
 // Throws a JS error and returns from the current function
 #define THROW_AND_RETURN(isolate, msg)                                  \
@@ -27,6 +46,8 @@ namespace Subdevil
     using v8::String;
     using v8::Number;
     using v8::Boolean;
+    using v8::Function;
+    using v8::HandleScope;
     using v8::Object;
     using v8::Array;
     using v8::Value;
@@ -34,10 +55,6 @@ namespace Subdevil
     using v8::Undefined;
 
 
-    static Local<Object> USBDrive_to_Object(Isolate *isolate, Subdevil::USBDevicePtr usbDrive)
-    {
-      Local<Object> obj = Object::New(isolate);
-
 #define OBJ_ATTR_STR(name, val)                                       \
       do {                                                            \
         Local<String> _name = String::NewFromUtf8(isolate, name);     \
@@ -50,6 +67,19 @@ namespace Subdevil
       }                                                               \
       while (0)
 
+#define OBJ_ATTR_CSTR(name, val)                                      \
+      do {                                                            \
+        Local<String> _name = String::NewFromUtf8(isolate, name);     \
+        const char *_val = val;                                       \
+        if (_val != nullptr) {                                        \
+          obj->Set(_name, String::NewFromUtf8(isolate, _val));        \
+        }                                                             \
+        else {                                                        \
+          obj->Set(_name, Null(isolate));                             \
+        }                                                             \
+      }                                                               \
+      while (0)
+
 #define OBJ_ATTR_NUMBER(name, val)                                      \
       do {                                                              \
         Local<String> _name = String::NewFromUtf8(isolate, name);       \
@@ -57,18 +87,147 @@ namespace Subdevil
       }                                                                 \
       while(0)
 
-      OBJ_ATTR_STR("id", usbDrive->uid);
-      OBJ_ATTR_NUMBER("productId", usbDrive->productID);
-      OBJ_ATTR_NUMBER("vendorId", usbDrive->vendorID);
-      OBJ_ATTR_STR("product", usbDrive->product);
-      OBJ_ATTR_STR("serialNumber", usbDrive->serialNumber);
-      OBJ_ATTR_STR("manufacturer", usbDrive->vendor);
-      OBJ_ATTR_STR("mount", usbDrive->mountPoint);
+    /**
+     * Where each field came from: "device" if the backend opened the device
+     * to read it, "cache" if it came from data the OS already had.
+     */
+    static Local<Object> _sources(Isolate *isolate, const Subdevil::USBDevicePtr &usbDrive)
+    {
+      Local<Object> sources = Object::New(isolate);
+
+      for (size_t i = 0; i < FIELD_SOURCE_COUNT; i++) {
+        sources->Set(String::NewFromUtf8(isolate, FIELD_SOURCES[i].name),
+                     String::NewFromUtf8(isolate, fieldSource(*usbDrive, FIELD_SOURCES[i])));
+      }
+
+      return sources;
+    }
+
+    static Local<Array> _volumes(Isolate *isolate, const std::vector<Volume> &volumes)
+    {
+      Local<Array> array = Array::New(isolate, static_cast<int>(volumes.size()));
+
+      for (size_t i = 0; i < volumes.size(); i++) {
+        const Volume &volume = volumes[i];
+        Local<Object> obj = Object::New(isolate);
+
+        OBJ_ATTR_STR("node", volume.node);
+        OBJ_ATTR_STR("label", volume.label);
+        OBJ_ATTR_STR("uuid", volume.uuid);
+
+        Local<Array> mountPoints = Array::New(isolate, static_cast<int>(volume.mountPoints.size()));
+
+        for (size_t j = 0; j < volume.mountPoints.size(); j++) {
+          mountPoints->Set(static_cast<uint32_t>(j), String::NewFromUtf8(isolate, volume.mountPoints[j].c_str()));
+        }
+
+        obj->Set(String::NewFromUtf8(isolate, "mountPoints"), mountPoints);
+        array->Set(static_cast<uint32_t>(i), obj);
+      }
+
+      return array;
+    }
+
+    // Sets the public fields of a device on a JS object
+    struct FieldMarshaller {
+      Isolate *isolate;
+      Local<Object> obj;
+      const USBDevice &device;
+
+      FieldMarshaller(Isolate *isolate, Local<Object> obj, const USBDevice &device)
+        : isolate(isolate), obj(obj), device(device) {}
+
+      Local<Value> value(const std::string &value)
+      {
+        if (value.empty())
+          return Null(isolate);
+
+        return String::NewFromUtf8(isolate, value.c_str());
+      }
+
+      Local<Value> value(const Utils::InternedString &value) { return this->value(value.str()); }
+      Local<Value> value(int value) { return Number::New(isolate, value); }
+      Local<Value> value(unsigned value) { return Number::New(isolate, value); }
+      Local<Value> value(uint64_t value) { return Number::New(isolate, static_cast<double>(value)); }
+      Local<Value> value(bool value) { return Boolean::New(isolate, value); }
+      Local<Value> value(const std::vector<Volume> &volumes) { return _volumes(isolate, volumes); }
+
+      Local<Value> value(std::chrono::steady_clock::time_point value)
+      {
+        return Number::New(isolate, static_cast<double>(epochMilliseconds(value)));
+      }
+
+      template<typename T>
+      void operator()(const Field &field, T USBDevice::*member)
+      {
+        if (isReported(field, device))
+          obj->Set(String::NewFromUtf8(isolate, field.name), value(device.*member));
+      }
+    };
+
+    static Local<Object> USBDrive_to_Object(Isolate *isolate, Subdevil::USBDevicePtr usbDrive)
+    {
+      Utils::TraceSpan span("marshalDevice");
+      span.setUid(usbDrive->uid);
+
+      Local<Object> obj = Object::New(isolate);
+
+      // Late lookups may still be writing to the device
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      FieldMarshaller marshaller(isolate, obj, *usbDrive);
+      forEachField(marshaller);
+
+      const UsbIdsDatabase &usbIds = UsbIdsDatabase::instance();
+
+      OBJ_ATTR_CSTR("vendorName", usbIds.vendorName(usbDrive->vendorID));
+      OBJ_ATTR_CSTR("productName", usbIds.productName(usbDrive->vendorID, usbDrive->productID));
+
+      obj->Set(String::NewFromUtf8(isolate, "sources"), _sources(isolate, usbDrive));
 
-#undef OBJ_ATTR_STR
       return obj;
     }
 
+    /**
+     * Read scan options from an optional JS options object.
+     */
+    static ScanOptions _scanOptions(Isolate *isolate, Local<Value> value)
+    {
+      ScanOptions options;
+
+      if(!value->IsObject())
+        return options;
+
+      Local<Object> obj = value->ToObject();
+      Local<Value> deadlineMs = obj->Get(String::NewFromUtf8(isolate, "deadlineMs"));
+
+      if(deadlineMs->IsNumber() && deadlineMs->NumberValue() > 0) {
+        options.deadline = std::chrono::milliseconds(static_cast<int64_t>(deadlineMs->NumberValue()));
+      }
+
+      Local<Value> passive = obj->Get(String::NewFromUtf8(isolate, "passive"));
+
+      options.passive = passive->IsTrue();
+
+      Local<Value> batchReads = obj->Get(String::NewFromUtf8(isolate, "batchReads"));
+
+      options.batchReads = !batchReads->IsFalse();
+
+      Local<Value> resolve = obj->Get(String::NewFromUtf8(isolate, "resolve"));
+
+      if(resolve->IsArray()) {
+        Local<Array> names = Local<Array>::Cast(resolve);
+
+        for(uint32_t i = 0; i < names->Length(); i++) {
+          String::Utf8Value name(names->Get(i)->ToString());
+
+          options.resolve |= resolverFromName(*name);
+        }
+      }
+
+      return options;
+    }
+
     void Unmount(const FunctionCallbackInfo<Value> &info)
     {
       auto isolate = info.GetIsolate();
@@ -103,7 +262,29 @@ namespace Subdevil
 
       String::Utf8Value str(info[0]->ToString());
 
-      auto usbDrive = Subdevil::getDevice(*str);
+      Subdevil::USBDevicePtr usbDrive;
+      Local<Value> maxAgeMs;
+      Local<Value> deadlineMs;
+
+      if(info.Length() > 1 && info[1]->IsObject()) {
+        maxAgeMs = info[1]->ToObject()->Get(String::NewFromUtf8(isolate, "maxAgeMs"));
+        deadlineMs = info[1]->ToObject()->Get(String::NewFromUtf8(isolate, "deadlineMs"));
+      }
+
+      if(!maxAgeMs.IsEmpty() && maxAgeMs->IsNumber() && maxAgeMs->NumberValue() >= 0) {
+        std::chrono::milliseconds maxAge(static_cast<int64_t>(maxAgeMs->NumberValue()));
+
+        // This runs on the JS thread, so the refresh always has a deadline
+        if(deadlineMs->IsNumber() && deadlineMs->NumberValue() > 0) {
+          std::chrono::milliseconds deadline(static_cast<int64_t>(deadlineMs->NumberValue()));
+
+          usbDrive = Subdevil::getDevice(*str, maxAge, deadline);
+        } else {
+          usbDrive = Subdevil::getDevice(*str, maxAge);
+        }
+      } else {
+        usbDrive = Subdevil::getDevice(*str);
+      }
 
       if(usbDrive == NULL) {
         info.GetReturnValue().SetNull();
@@ -112,10 +293,49 @@ namespace Subdevil
       }
     }
 
-    void PollDevices(const FunctionCallbackInfo<Value> &info)
+    /**
+     * Fingerprint of everything poll() reports about the devices, except
+     * refreshedAt, as 16 hex digits.
+     */
+    static std::string _fingerprint(const std::vector<USBDevicePtr> &devices)
+    {
+      const UsbIdsDatabase &usbIds = UsbIdsDatabase::instance();
+      std::hash<std::string> hashString;
+      uint64_t hash = 0;
+
+      auto mix = [&hash](uint64_t value) {
+        hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+      };
+
+      auto mixName = [&mix, &hashString](const char *name) {
+        mix(name != nullptr ? hashString(name) : 0);
+      };
+
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      mix(devices.size());
+
+      for (const USBDevicePtr &device : devices) {
+        mix(contentHash(*device));
+        mix(device->incomplete);
+        mix(device->liveFields);
+        mixName(usbIds.vendorName(device->vendorID));
+        mixName(usbIds.productName(device->vendorID, device->productID));
+      }
+
+      char tag[17];
+      snprintf(tag, sizeof(tag), "%016llx", static_cast<unsigned long long>(hash));
+
+      return tag;
+    }
+
+    static void _returnDevices(const FunctionCallbackInfo<Value> &info,
+                               const std::vector<USBDevicePtr> &devices,
+                               const std::string &tag = "")
     {
       auto isolate = info.GetIsolate();
-      auto devices = Subdevil::getDevices();
+
+      Utils::TraceSpan span("marshalDevices");
 
       Handle<Array> array = Array::New(isolate, static_cast<int>(devices.size()));
 
@@ -128,9 +348,391 @@ namespace Subdevil
         array->Set((int)i, device_obj);
       }
 
+      if(!tag.empty())
+        array->Set(String::NewFromUtf8(isolate, "tag"), String::NewFromUtf8(isolate, tag.c_str()));
+
       info.GetReturnValue().Set(array);
     }
 
+    void PollDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      auto devices = Subdevil::getDevices(_scanOptions(isolate, info[0]));
+      std::string tag = _fingerprint(devices);
+
+      // Unchanged since the caller's last poll, skip creating the objects
+      if(info.Length() > 1 && info[1]->IsString() && tag == *String::Utf8Value(info[1])) {
+        info.GetReturnValue().SetNull();
+        return;
+      }
+
+      _returnDevices(info, devices, tag);
+    }
+
+    void FindDevices(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsObject())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a query object");
+
+      Local<Object> obj = info[0]->ToObject();
+      DeviceQuery query;
+
+      Local<Value> id = obj->Get(String::NewFromUtf8(isolate, "id"));
+      Local<Value> serialNumber = obj->Get(String::NewFromUtf8(isolate, "serialNumber"));
+      Local<Value> vendorId = obj->Get(String::NewFromUtf8(isolate, "vendorId"));
+      Local<Value> productId = obj->Get(String::NewFromUtf8(isolate, "productId"));
+      Local<Value> mount = obj->Get(String::NewFromUtf8(isolate, "mount"));
+      Local<Value> mounted = obj->Get(String::NewFromUtf8(isolate, "mounted"));
+
+      if(id->IsString())
+        query.uid = *String::Utf8Value(id);
+      if(serialNumber->IsString())
+        query.serialNumber = *String::Utf8Value(serialNumber);
+      if(vendorId->IsNumber())
+        query.vendorID = static_cast<int>(vendorId->NumberValue());
+      if(productId->IsNumber())
+        query.productID = static_cast<int>(productId->NumberValue());
+      if(mount->IsString())
+        query.mountPoint = *String::Utf8Value(mount);
+
+      query.mounted = mounted->IsTrue();
+
+      auto devices = Subdevil::findDevices(query, _scanOptions(isolate, info[1]));
+
+      _returnDevices(info, devices);
+    }
+
+    void SharedOpen(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 2)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString() || !info[1]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected a snapshot name and a heartbeat timeout");
+
+      String::Utf8Value name(info[0]->ToString());
+      std::chrono::milliseconds timeout(static_cast<int64_t>(info[1]->NumberValue()));
+
+      bool ok = SharedSnapshot::instance().open(*name, timeout);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, ok));
+    }
+
+    void SharedTick(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      SharedSnapshot &snapshot = SharedSnapshot::instance();
+
+      snapshot.tick();
+
+      info.GetReturnValue().Set(Boolean::New(isolate, snapshot.isPublisher()));
+    }
+
+    void SharedPoll(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      std::vector<USBDevicePtr> devices;
+
+      if(!SharedSnapshot::instance().read(devices)) {
+        info.GetReturnValue().SetNull();
+        return;
+      }
+
+      // Tagged like poll() results, false if the caller's tag still matches
+      std::string tag = _fingerprint(devices);
+
+      if(info.Length() > 0 && info[0]->IsString() && tag == *String::Utf8Value(info[0])) {
+        info.GetReturnValue().Set(Boolean::New(isolate, false));
+        return;
+      }
+
+      _returnDevices(info, devices, tag);
+    }
+
+    void SharedClose(const FunctionCallbackInfo<Value> &info)
+    {
+      SharedSnapshot::instance().close();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////
+    // Incremental scans
+    ////////////////////////////////////////////////////////////////////////////////
+    // Devices a scan enumerates ahead of JS. The scan thread waits once
+    // this many are ready, so a scan that is stopped early doesn't go on.
+    static const size_t SCAN_QUEUE_SIZE = 4;
+
+    /**
+     * A scan enumerating on its own thread, handing devices to JS through
+     * a bounded queue. Owned by _scanners() until JS closes it or the JS
+     * handle is garbage collected, and by the scan thread until it exits.
+     */
+    struct ScanJob {
+      explicit ScanJob(const ScanOptions &options) : scanner(options) {}
+
+      DeviceScanner scanner;   // Only used by the scan thread until it's joined.
+      std::thread thread;
+
+      std::mutex mutex;
+      std::condition_variable space;
+      std::deque<USBDevicePtr> queue;
+      bool finished = false;   // The scanner returned its last device.
+      bool cancelled = false;  // JS closed the scan or dropped its handle.
+      bool waiting = false;    // JS waits for the next device.
+
+      uv_async_t async;        // Wakes up JS once a device is ready.
+      Persistent<Function> callback;
+      Persistent<Object> handle;
+    };
+
+    typedef std::shared_ptr<ScanJob> ScanJobPtr;
+
+    static std::unordered_map<ScanJob *, ScanJobPtr> &_scanners()
+    {
+      // Never destroyed, scan threads may still be running at exit
+      static std::unordered_map<ScanJob *, ScanJobPtr> *scanners =
+        new std::unordered_map<ScanJob *, ScanJobPtr>();
+      return *scanners;
+    }
+
+    static void _produce(ScanJobPtr job)
+    {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(job->mutex);
+
+          job->space.wait(lock, [&job]() { return job->cancelled || job->queue.size() < SCAN_QUEUE_SIZE; });
+
+          if (job->cancelled)
+            break;
+        }
+
+        USBDevicePtr device = job->scanner.next();
+
+        std::lock_guard<std::mutex> lock(job->mutex);
+
+        if (device == nullptr) {
+          job->finished = true;
+        } else {
+          job->queue.push_back(device);
+        }
+
+        if (job->waiting)
+          uv_async_send(&job->async);
+
+        if (job->finished)
+          break;
+      }
+
+      job->scanner.close();
+    }
+
+    static void _onScanAsync(uv_async_t *async)
+    {
+      ScanJobPtr job = *static_cast<ScanJobPtr *>(async->data);
+      Isolate *isolate = Isolate::GetCurrent();
+      HandleScope scope(isolate);
+      Local<Function> callback;
+
+      {
+        std::lock_guard<std::mutex> lock(job->mutex);
+
+        if (!job->waiting || (job->queue.empty() && !job->finished))
+          return;
+
+        job->waiting = false;
+        callback = Local<Function>::New(isolate, job->callback);
+        job->callback.Reset();
+      }
+
+      uv_unref(reinterpret_cast<uv_handle_t *>(&job->async));
+
+      node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), callback, 0, nullptr);
+    }
+
+    static void _onScanAsyncClosed(uv_handle_t *async)
+    {
+      delete static_cast<ScanJobPtr *>(async->data);
+    }
+
+    /**
+     * Stop the scan thread, and with join wait for it, so the scanner can
+     * be used again. Without, the thread closes the scanner once the
+     * device it is reading is done.
+     */
+    static void _cancelScan(const ScanJobPtr &job, bool join)
+    {
+      {
+        std::lock_guard<std::mutex> lock(job->mutex);
+
+        job->cancelled = true;
+        job->waiting = false;
+      }
+
+      job->space.notify_one();
+
+      if (join)
+        job->thread.join();
+      else
+        job->thread.detach();
+
+      job->callback.Reset();
+      uv_close(reinterpret_cast<uv_handle_t *>(&job->async), _onScanAsyncClosed);
+
+      _scanners().erase(job.get());
+    }
+
+    static void _closeDroppedScan(const v8::WeakCallbackInfo<ScanJob> &data)
+    {
+      auto it = _scanners().find(data.GetParameter());
+
+      if (it == _scanners().end())
+        return;
+
+      CORE_DEBUG("Closing a scan that was dropped without being closed");
+
+      _cancelScan(it->second, false);
+    }
+
+    // Scans that are never closed end once their handle is collected. V8
+    // only allows resetting the handle while it collects, the scan is
+    // closed in the second pass.
+    static void _onScanHandleCollected(const v8::WeakCallbackInfo<ScanJob> &data)
+    {
+      auto it = _scanners().find(data.GetParameter());
+
+      if (it == _scanners().end())
+        return;
+
+      it->second->handle.Reset();
+      data.SetSecondPassCallback(_closeDroppedScan);
+    }
+
+    static Local<Object> ScanMetrics_to_Object(Isolate *isolate, const ScanMetrics &metrics)
+    {
+      Local<Object> obj = Object::New(isolate);
+
+      obj->Set(String::NewFromUtf8(isolate, "count"),
+               Number::New(isolate, static_cast<double>(metrics.deviceCount)));
+      obj->Set(String::NewFromUtf8(isolate, "firstDeviceMs"),
+               Number::New(isolate, metrics.firstDevice.count() / 1000.0));
+      obj->Set(String::NewFromUtf8(isolate, "totalMs"),
+               Number::New(isolate, metrics.total.count() / 1000.0));
+      obj->Set(String::NewFromUtf8(isolate, "osCalls"),
+               Number::New(isolate, static_cast<double>(metrics.osCalls)));
+
+      return obj;
+    }
+
+    static ScanJobPtr _scanArgument(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1 || !info[0]->IsObject() || info[0]->ToObject()->InternalFieldCount() != 1) {
+        isolate->ThrowException(Exception::TypeError(
+          String::NewFromUtf8(isolate, "Expected the first argument to be a scan handle")));
+        return nullptr;
+      }
+
+      auto job = static_cast<ScanJob *>(info[0]->ToObject()->GetAlignedPointerFromInternalField(0));
+      auto it = _scanners().find(job);
+
+      if(it == _scanners().end()) {
+        isolate->ThrowException(Exception::Error(
+          String::NewFromUtf8(isolate, "Unknown or closed scan handle")));
+        return nullptr;
+      }
+
+      return it->second;
+    }
+
+    void ScanOpen(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      ScanJobPtr job = std::make_shared<ScanJob>(_scanOptions(isolate, info[0]));
+
+      Local<v8::ObjectTemplate> handleTemplate = v8::ObjectTemplate::New(isolate);
+      handleTemplate->SetInternalFieldCount(1);
+
+      Local<Object> handle = handleTemplate->NewInstance();
+      handle->SetAlignedPointerInInternalField(0, job.get());
+
+      job->handle.Reset(isolate, handle);
+      job->handle.SetWeak(job.get(), _onScanHandleCollected, v8::WeakCallbackType::kParameter);
+
+      // Only keeps the process alive while JS waits for a device
+      uv_async_init(uv_default_loop(), &job->async, _onScanAsync);
+      uv_unref(reinterpret_cast<uv_handle_t *>(&job->async));
+      job->async.data = new ScanJobPtr(job);
+
+      _scanners()[job.get()] = job;
+      job->thread = std::thread(_produce, job);
+
+      info.GetReturnValue().Set(handle);
+    }
+
+    /**
+     * The next device, null once there are no more, or undefined if none
+     * is ready yet. Then the callback is called once one is, and scanNext()
+     * returns it.
+     */
+    void ScanNext(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      ScanJobPtr job = _scanArgument(info);
+
+      if(job == nullptr)
+        return;
+
+      if(info.Length() < 2 || !info[1]->IsFunction())
+        THROW_AND_RETURN(isolate, "Expected the second argument to be a callback");
+
+      USBDevicePtr usbDrive;
+
+      {
+        std::lock_guard<std::mutex> lock(job->mutex);
+
+        if(!job->queue.empty()) {
+          usbDrive = job->queue.front();
+          job->queue.pop_front();
+        } else if(!job->finished) {
+          job->waiting = true;
+          job->callback.Reset(isolate, Local<Function>::Cast(info[1]));
+        }
+      }
+
+      if(usbDrive != nullptr) {
+        job->space.notify_one();
+        info.GetReturnValue().Set(USBDrive_to_Object(isolate, usbDrive));
+      } else if(job->waiting) {
+        uv_ref(reinterpret_cast<uv_handle_t *>(&job->async));
+        info.GetReturnValue().SetUndefined();
+      } else {
+        info.GetReturnValue().SetNull();
+      }
+    }
+
+    void ScanClose(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      ScanJobPtr job = _scanArgument(info);
+
+      if(job == nullptr)
+        return;
+
+      job->handle.Reset();
+
+      _cancelScan(job, true);
+
+      info.GetReturnValue().Set(ScanMetrics_to_Object(isolate, job->scanner.metrics()));
+    }
+
     void SetLogFile(const FunctionCallbackInfo<Value> &info)
     {
       auto isolate = info.GetIsolate();
@@ -148,15 +750,322 @@ namespace Subdevil
       info.GetReturnValue().Set(Undefined(isolate));
     }
 
+    void SetLogRing(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 2)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString() || !info[1]->IsNumber() || info[1]->NumberValue() < 1)
+        THROW_AND_RETURN(isolate, "Expected a file path and a size in bytes");
+
+      String::Utf8Value str(info[0]->ToString());
+      size_t size = static_cast<size_t>(info[1]->NumberValue());
+
+      bool ok = Logger::instance().setLogRing(*str, size);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, ok));
+    }
+
+    void SetTracing(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      Utils::Tracer::instance().setEnabled(info[0]->BooleanValue());
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void DumpTrace(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      String::Utf8Value str(info[0]->ToString());
+
+      bool ok = Utils::Tracer::instance().dump(*str);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, ok));
+    }
+
+    void ChangeToken(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      uint64_t token = ChangeDetector::instance().token();
+
+      info.GetReturnValue().Set(Number::New(isolate, static_cast<double>(token)));
+    }
+
+    void HasChanged(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a change token");
+
+      uint64_t token = static_cast<uint64_t>(info[0]->NumberValue());
+      bool changed = ChangeDetector::instance().hasChanged(token);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, changed));
+    }
+
+    // Hands change notifications from the OS threads to the JS listener.
+    // Sends made before the callback runs are coalesced into one call.
+    static uv_async_t gChangeAsync;
+    static bool gChangeAsyncInitialized = false;
+    static Persistent<Function> gChangeListener;
+
+    static void _onChangeAsync(uv_async_t *)
+    {
+      Isolate *isolate = Isolate::GetCurrent();
+      HandleScope scope(isolate);
+
+      if (gChangeListener.IsEmpty())
+        return;
+
+      Local<Function> listener = Local<Function>::New(isolate, gChangeListener);
+
+      node::MakeCallback(isolate, isolate->GetCurrentContext()->Global(), listener, 0, nullptr);
+    }
+
+    void OnChange(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsFunction()) {
+        // Idle handles don't keep the process alive
+        ChangeDetector::instance().setListener(std::function<void()>());
+        gChangeListener.Reset();
+
+        if (gChangeAsyncInitialized)
+          uv_unref(reinterpret_cast<uv_handle_t *>(&gChangeAsync));
+
+        info.GetReturnValue().Set(Boolean::New(isolate, false));
+        return;
+      }
+
+      if (!gChangeAsyncInitialized) {
+        uv_async_init(uv_default_loop(), &gChangeAsync, _onChangeAsync);
+        gChangeAsyncInitialized = true;
+      }
+
+      gChangeListener.Reset(isolate, Local<Function>::Cast(info[0]));
+      uv_ref(reinterpret_cast<uv_handle_t *>(&gChangeAsync));
+
+      bool watching = ChangeDetector::instance().setListener([]() {
+          uv_async_send(&gChangeAsync);
+        });
+
+      info.GetReturnValue().Set(Boolean::New(isolate, watching));
+    }
+
+    void EventLatency(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      bool reset = info.Length() > 0 && info[0]->BooleanValue();
+
+      Subdevil::EventLatency latency = ChangeDetector::instance().latency(reset);
+      Local<Object> obj = Object::New(isolate);
+
+      obj->Set(String::NewFromUtf8(isolate, "count"),
+               Number::New(isolate, static_cast<double>(latency.count)));
+      obj->Set(String::NewFromUtf8(isolate, "p50Ms"),
+               Number::New(isolate, latency.p50.count() / 1000.0));
+      obj->Set(String::NewFromUtf8(isolate, "p99Ms"),
+               Number::New(isolate, latency.p99.count() / 1000.0));
+      obj->Set(String::NewFromUtf8(isolate, "p999Ms"),
+               Number::New(isolate, latency.p999.count() / 1000.0));
+      obj->Set(String::NewFromUtf8(isolate, "maxMs"),
+               Number::New(isolate, latency.max.count() / 1000.0));
+
+      info.GetReturnValue().Set(obj);
+    }
+
+    void HistoryOpen(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 3)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be of type string");
+
+      if(!info[1]->IsNumber() || !info[2]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the segment limits to be numbers");
+
+      String::Utf8Value path(info[0]->ToString());
+      uint32_t segmentRecords = info[1]->Uint32Value();
+      uint32_t maxSegments = info[2]->Uint32Value();
+
+      bool ok = DeviceHistory::instance().open(*path, segmentRecords, maxSegments);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, ok));
+    }
+
+    void HistoryClose(const FunctionCallbackInfo<Value> &info)
+    {
+      DeviceHistory::instance().close();
+
+      info.GetReturnValue().Set(Undefined(info.GetIsolate()));
+    }
+
+    void HistoryQuery(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 2)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the serial number to be of type string");
+
+      if(!info[1]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the second argument to be a time in milliseconds");
+
+      String::Utf8Value serialNumber(info[0]->ToString());
+      int64_t sinceMs = static_cast<int64_t>(info[1]->NumberValue());
+
+      std::vector<HistoryEvent> events = DeviceHistory::instance().query(*serialNumber, sinceMs);
+      Local<Array> array = Array::New(isolate, static_cast<int>(events.size()));
+
+      for (size_t i = 0; i < events.size(); ++i) {
+        const HistoryEvent &event = events[i];
+        Local<Object> obj = Object::New(isolate);
+
+        obj->Set(String::NewFromUtf8(isolate, "type"),
+                 String::NewFromUtf8(isolate, historyEventName(event.type)));
+        OBJ_ATTR_NUMBER("time", event.timeMs);
+        OBJ_ATTR_STR("serialNumber", event.serialNumber);
+        OBJ_ATTR_NUMBER("vendorId", event.vendorID);
+        OBJ_ATTR_NUMBER("productId", event.productID);
+        OBJ_ATTR_STR("mount", event.mountPoint);
+
+        if (event.durationMs >= 0) {
+          OBJ_ATTR_NUMBER("durationMs", event.durationMs);
+        } else {
+          obj->Set(String::NewFromUtf8(isolate, "durationMs"), Null(isolate));
+        }
+
+        array->Set(static_cast<uint32_t>(i), obj);
+      }
+
+      info.GetReturnValue().Set(array);
+    }
+
+    void SetHandleBudget(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 1)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the first argument to be a number");
+
+      Subdevil::setHandleBudget(info[0]->Uint32Value());
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void SetDepartedLimits(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 2)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsNumber() || !info[1]->IsNumber())
+        THROW_AND_RETURN(isolate, "Expected the age and count limits to be numbers");
+
+      std::chrono::milliseconds maxAge(static_cast<int64_t>(info[0]->NumberValue()));
+
+      Subdevil::setDepartedLimits(maxAge, info[1]->Uint32Value());
+
+      info.GetReturnValue().Set(Undefined(isolate));
+    }
+
+    void RegistryStats(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+      Subdevil::RegistryStats stats = DeviceRegistry::instance().stats();
+      Local<Object> obj = Object::New(isolate);
+
+      OBJ_ATTR_NUMBER("generation", stats.generation);
+      OBJ_ATTR_NUMBER("present", stats.present);
+      OBJ_ATTR_NUMBER("departed", stats.departed);
+      OBJ_ATTR_NUMBER("evicted", stats.evicted);
+
+      info.GetReturnValue().Set(obj);
+    }
+
+    void SetUsbIds(const FunctionCallbackInfo<Value> &info)
+    {
+      auto isolate = info.GetIsolate();
+
+      if(info.Length() < 2)
+        THROW_AND_RETURN(isolate, "Wrong number of arguments");
+
+      if(!info[0]->IsString() || !info[1]->IsString())
+        THROW_AND_RETURN(isolate, "Expected the usb.ids and index paths to be of type string");
+
+      String::Utf8Value idsPath(info[0]->ToString());
+      String::Utf8Value indexPath(info[1]->ToString());
+
+      bool ok = UsbIdsDatabase::instance().load(*idsPath, *indexPath);
+
+      info.GetReturnValue().Set(Boolean::New(isolate, ok));
+    }
+
     void Init(Handle<Object> exports)
     {
       Logger::instance().setLogFile("usb-driver.log");
 
       NODE_SET_METHOD(exports, "setLogFile", SetLogFile);
+      NODE_SET_METHOD(exports, "setLogRing", SetLogRing);
+      NODE_SET_METHOD(exports, "setTracing", SetTracing);
+      NODE_SET_METHOD(exports, "dumpTrace", DumpTrace);
+      NODE_SET_METHOD(exports, "setUsbIds", SetUsbIds);
+      NODE_SET_METHOD(exports, "setHandleBudget", SetHandleBudget);
+      NODE_SET_METHOD(exports, "setDepartedLimits", SetDepartedLimits);
+      NODE_SET_METHOD(exports, "registryStats", RegistryStats);
       NODE_SET_METHOD(exports, "unmount", Unmount);
       NODE_SET_METHOD(exports, "get", GetDevice);
       NODE_SET_METHOD(exports, "poll", PollDevices);
+      NODE_SET_METHOD(exports, "find", FindDevices);
+      NODE_SET_METHOD(exports, "scanOpen", ScanOpen);
+      NODE_SET_METHOD(exports, "scanNext", ScanNext);
+      NODE_SET_METHOD(exports, "scanClose", ScanClose);
+      NODE_SET_METHOD(exports, "changeToken", ChangeToken);
+      NODE_SET_METHOD(exports, "hasChanged", HasChanged);
+      NODE_SET_METHOD(exports, "onChange", OnChange);
+      NODE_SET_METHOD(exports, "eventLatency", EventLatency);
+      NODE_SET_METHOD(exports, "historyOpen", HistoryOpen);
+      NODE_SET_METHOD(exports, "historyClose", HistoryClose);
+      NODE_SET_METHOD(exports, "historyQuery", HistoryQuery);
+      NODE_SET_METHOD(exports, "sharedOpen", SharedOpen);
+      NODE_SET_METHOD(exports, "sharedTick", SharedTick);
+      NODE_SET_METHOD(exports, "sharedPoll", SharedPoll);
+      NODE_SET_METHOD(exports, "sharedClose", SharedClose);
     }
+#undef OBJ_ATTR_STR
+#undef OBJ_ATTR_CSTR
+#undef OBJ_ATTR_NUMBER
   }  // namespace NodeJS
 } // namepsace Subdevil
 
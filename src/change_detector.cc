@@ -0,0 +1,115 @@
+#include "change_detector.h"
+#include "utils.h"
+
+namespace Subdevil
+{
+  static int64_t _nowUs()
+  {
+    using namespace std::chrono;
+
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  ChangeDetector::ChangeDetector()
+    : m_counter(0), m_watching(false), m_pendingSinceUs(0)
+  {
+  }
+
+  void ChangeDetector::ensureStarted()
+  {
+    std::call_once(m_started, [this]() {
+        m_watching = start();
+
+        if (!m_watching)
+          CORE_WARNING("Device change notifications unavailable, every check reports a change");
+      });
+  }
+
+  uint64_t ChangeDetector::token()
+  {
+    ensureStarted();
+
+    return m_counter.load();
+  }
+
+  bool ChangeDetector::hasChanged(uint64_t token)
+  {
+    ensureStarted();
+
+    return !m_watching || m_counter.load() != token;
+  }
+
+  void ChangeDetector::notify()
+  {
+    int64_t none = 0;
+
+    // Only the first change since the last scan counts
+    m_pendingSinceUs.compare_exchange_strong(none, _nowUs());
+
+    ++m_counter;
+
+    std::lock_guard<std::mutex> lock(m_listenerMutex);
+
+    if (m_listener)
+      m_listener();
+  }
+
+  bool ChangeDetector::setListener(const std::function<void()> &listener)
+  {
+    ensureStarted();
+
+    std::lock_guard<std::mutex> lock(m_listenerMutex);
+    m_listener = listener;
+
+    return m_watching;
+  }
+
+  ChangeDetector::Observation ChangeDetector::beginObservation() const
+  {
+    Observation observation;
+    observation.token = m_counter.load();
+    observation.startUs = _nowUs();
+    observation.pendingSinceUs = m_pendingSinceUs.load();
+
+    return observation;
+  }
+
+  void ChangeDetector::endObservation(const Observation &observation)
+  {
+    if (!m_watching || observation.pendingSinceUs == 0)
+      return;
+
+    int64_t now = _nowUs();
+
+    {
+      std::lock_guard<std::mutex> lock(m_latencyMutex);
+      m_latency.record(now - observation.pendingSinceUs);
+    }
+
+    // Changes that came in during the scan are left for the next one,
+    // dated to the start of this one at the latest
+    int64_t expected = observation.pendingSinceUs;
+    int64_t next = m_counter.load() != observation.token ? observation.startUs : 0;
+
+    m_pendingSinceUs.compare_exchange_strong(expected, next);
+  }
+
+  EventLatency ChangeDetector::latency(bool reset)
+  {
+    using std::chrono::microseconds;
+
+    std::lock_guard<std::mutex> lock(m_latencyMutex);
+
+    EventLatency latency;
+    latency.count = m_latency.count();
+    latency.p50   = microseconds(m_latency.percentile(50));
+    latency.p99   = microseconds(m_latency.percentile(99));
+    latency.p999  = microseconds(m_latency.percentile(99.9));
+    latency.max   = microseconds(m_latency.max());
+
+    if (reset)
+      m_latency.reset();
+
+    return latency;
+  }
+}
@@ -0,0 +1,112 @@
+#ifndef _SUBDEVIL_CHANGE_DETECTOR_H__
+#define _SUBDEVIL_CHANGE_DETECTOR_H__
+
+#include "utils/latency_histogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+
+namespace Subdevil
+{
+  // Time from the OS reporting a change to a scan that picked it up
+  typedef struct EventLatency {
+    uint64_t count;                 // Changes picked up by scans.
+    std::chrono::microseconds p50;
+    std::chrono::microseconds p99;
+    std::chrono::microseconds p999;
+    std::chrono::microseconds max;
+  } EventLatency;
+
+  /**
+   * Counts device and mount changes reported by the OS, so callers can
+   * skip a full enumeration when nothing has changed. The backends
+   * subscribe to OS notifications in start() and call notify() from
+   * whichever thread those arrive on.
+   */
+  class ChangeDetector
+  {
+  public:
+    // What a scan saw of pending changes when it started
+    typedef struct Observation {
+      uint64_t token;
+      int64_t startUs;
+      int64_t pendingSinceUs;
+    } Observation;
+
+    static ChangeDetector &instance()
+    {
+      static ChangeDetector instance;
+      return instance;
+    }
+
+    /**
+     * Get a token for the current state. Starts watching the OS on the
+     * first call.
+     */
+    uint64_t token();
+    /**
+     * Check if anything changed since the token was taken. Always true if
+     * the OS notifications are unavailable.
+     */
+    bool hasChanged(uint64_t token);
+
+    /**
+     * Record a change. Safe to call from any thread.
+     */
+    void notify();
+
+    /**
+     * Call the listener after every change, on the thread that reported
+     * it, so it has to be quick. Pass an empty function to remove it.
+     * Returns whether changes are reported at all.
+     */
+    bool setListener(const std::function<void()> &listener);
+
+    bool isWatching() const { return m_watching; }
+
+    /**
+     * Called by scans before they read the OS state, and once they are
+     * done. The time from the first change a scan picks up to the end of
+     * the scan is recorded as event latency. Changes that arrive during a
+     * scan may or may not be seen by it; they are counted from the start
+     * of the scan by the next one, which overestimates their latency by at
+     * most the scan time. Nothing is recorded unless watching.
+     */
+    Observation beginObservation() const;
+    void endObservation(const Observation &observation);
+
+    /**
+     * Percentiles of the event latency recorded so far.
+     */
+    EventLatency latency(bool reset = false);
+
+  private:
+    ChangeDetector();
+    ChangeDetector(const ChangeDetector &);
+    ChangeDetector &operator=(const ChangeDetector &);
+
+    // Implemented by the backends
+    bool start();
+
+    void ensureStarted();
+
+    std::atomic<uint64_t> m_counter;
+    std::once_flag m_started;
+    // Set by the first caller of ensureStarted(), read without it
+    std::atomic<bool> m_watching;
+
+    std::mutex m_listenerMutex;
+    std::function<void()> m_listener;
+
+    // Steady clock time of the first change no scan has picked up yet, 0
+    // if there is none
+    std::atomic<int64_t> m_pendingSinceUs;
+    std::mutex m_latencyMutex;
+    Utils::LatencyHistogram m_latency;
+  };
+}
+
+#endif // _SUBDEVIL_CHANGE_DETECTOR_H__
@@ -0,0 +1,467 @@
+#include "../subdevil.h"
+#include "../change_detector.h"
+#include "../device_fields.h"
+#include "../device_registry.h"
+#include "../resolvers.h"
+#include "../usb_common.h"
+#include "../usb_ids.h"
+#include "../utils.h"
+#include "../utils/json_writer.h"
+#include "../utils/ring_log.h"
+
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace Subdevil;
+using Subdevil::Utils::JsonWriter;
+
+////////////////////////////////////////////////////////////////////////////////
+// Command line interface
+//
+// Lists devices without starting Node.js:
+//
+//   subdevil-cli list [--json]
+//   subdevil-cli get <key>
+//   subdevil-cli watch [--interval <ms>]
+//   subdevil-cli log <file>
+//
+// Devices are printed as NDJSON, one object per line, unless --json asks for
+// a single array.
+////////////////////////////////////////////////////////////////////////////////
+struct Options {
+  const char *command = nullptr;
+  const char *id = nullptr;
+  const char *usbIds = nullptr;
+  const char *logFile = nullptr;
+  const char *logRing = nullptr;
+  const char *trace = nullptr;
+  bool json = false;
+  bool stats = false;
+  int intervalMs = 500;
+  ScanOptions scan;
+};
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: subdevil-cli <command> [options]\n"
+          "\n"
+          "Commands:\n"
+          "  list             Print all connected devices\n"
+          "  get <key>        Print the device with the given serial number or\n"
+          "                   vendor:product@location key\n"
+          "  watch            Print devices as they are added and removed\n"
+          "  log <file>       Print the entries of a ring log file\n"
+          "\n"
+          "Options:\n"
+          "  --json           Print a JSON array instead of NDJSON (list)\n"
+          "  --deadline <ms>  Time budget for the lookups of each device\n"
+          "  --resolve <list> Device nodes to look up: tty,hidraw,block\n"
+          "  --passive        Never open devices, only report cached data\n"
+          "  --no-batch       Query the OS per device instead of once per scan\n"
+          "  --stats          Print scan time and OS call count to stderr (list)\n"
+          "  --interval <ms>  How often to check for changes (watch, default 500)\n"
+          "  --usb-ids <path> Resolve names from a usb.ids file\n"
+          "  --log <path>     Write debug output to a file instead of stderr\n"
+          "  --log-ring <path> Write debug output to a 1MB ring log file\n"
+          "  --trace <path>   Write a Chrome trace of the command to a file\n");
+}
+
+/**
+ * Keep the compiled usb.ids index where the Node.js module keeps it, so
+ * both share it.
+ */
+static std::string defaultIndexPath(const std::string &idsPath)
+{
+#ifdef _WIN32
+  const char *vars[] = { "TEMP", "TMP" };
+  const char *fallback = "C:\\Windows\\Temp";
+  const char separator = '\\';
+#else
+  const char *vars[] = { "TMPDIR", "TMP", "TEMP" };
+  const char *fallback = "/tmp";
+  const char separator = '/';
+#endif
+  std::string dir = fallback;
+
+  for (const char *var : vars) {
+    const char *value = getenv(var);
+
+    if (value != nullptr && value[0] != '\0') {
+      dir = value;
+      break;
+    }
+  }
+
+  if (dir.size() > 1 && dir[dir.size() - 1] == separator)
+    dir.erase(dir.size() - 1);
+
+  size_t slash = idsPath.find_last_of("/\\");
+  std::string basename = slash == std::string::npos ? idsPath : idsPath.substr(slash + 1);
+
+  return dir + separator + "subdevil-" + basename + ".idx";
+}
+
+/**
+ * Parse a comma separated list of resolver names.
+ */
+static bool parseResolvers(const std::string &list, unsigned &resolve)
+{
+  size_t start = 0;
+
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+
+    if (end == std::string::npos)
+      end = list.size();
+
+    unsigned resolver = resolverFromName(list.substr(start, end - start));
+
+    if (resolver == 0)
+      return false;
+
+    resolve |= resolver;
+    start = end + 1;
+  }
+
+  return true;
+}
+
+static bool parseOptions(int argc, char **argv, Options &options)
+{
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if (strcmp(arg, "--json") == 0) {
+      options.json = true;
+    } else if (strcmp(arg, "--deadline") == 0 && hasValue) {
+      options.scan.deadline = std::chrono::milliseconds(atoi(argv[++i]));
+    } else if (strcmp(arg, "--passive") == 0) {
+      options.scan.passive = true;
+    } else if (strcmp(arg, "--no-batch") == 0) {
+      options.scan.batchReads = false;
+    } else if (strcmp(arg, "--stats") == 0) {
+      options.stats = true;
+    } else if (strcmp(arg, "--resolve") == 0 && hasValue) {
+      if (!parseResolvers(argv[++i], options.scan.resolve))
+        return false;
+    } else if (strcmp(arg, "--interval") == 0 && hasValue) {
+      options.intervalMs = atoi(argv[++i]);
+    } else if (strcmp(arg, "--usb-ids") == 0 && hasValue) {
+      options.usbIds = argv[++i];
+    } else if (strcmp(arg, "--log") == 0 && hasValue) {
+      options.logFile = argv[++i];
+    } else if (strcmp(arg, "--log-ring") == 0 && hasValue) {
+      options.logRing = argv[++i];
+    } else if (strcmp(arg, "--trace") == 0 && hasValue) {
+      options.trace = argv[++i];
+    } else if (arg[0] == '-') {
+      return false;
+    } else if (options.command == nullptr) {
+      options.command = arg;
+    } else if (options.id == nullptr) {
+      options.id = arg;
+    } else {
+      return false;
+    }
+  }
+
+  return options.command != nullptr && options.intervalMs > 0;
+}
+
+// Writes the public fields of a device
+struct FieldWriter {
+  JsonWriter &writer;
+  const USBDevice &device;
+
+  FieldWriter(JsonWriter &writer, const USBDevice &device)
+    : writer(writer), device(device) {}
+
+  void value(const std::string &value) { value.empty() ? writer.null() : writer.string(value); }
+  void value(const Utils::InternedString &value) { this->value(value.str()); }
+  void value(int value) { writer.number(value); }
+  void value(unsigned value) { writer.number(value); }
+  void value(uint64_t value) { writer.number(static_cast<long long>(value)); }
+  void value(bool value) { writer.boolean(value); }
+  void value(std::chrono::steady_clock::time_point value) { writer.number(epochMilliseconds(value)); }
+
+  void value(const std::vector<Volume> &volumes)
+  {
+    writer.beginArray();
+
+    for (const Volume &volume : volumes) {
+      writer.beginObject();
+      writer.key("node");
+      value(volume.node);
+      writer.key("label");
+      value(volume.label);
+      writer.key("uuid");
+      value(volume.uuid);
+      writer.key("mountPoints");
+      writer.beginArray();
+
+      for (const std::string &mountPoint : volume.mountPoints)
+        writer.string(mountPoint);
+
+      writer.endArray();
+      writer.endObject();
+    }
+
+    writer.endArray();
+  }
+
+  template<typename T>
+  void operator()(const Field &field, T USBDevice::*member)
+  {
+    if (isReported(field, device)) {
+      writer.key(field.name);
+      value(device.*member);
+    }
+  }
+};
+
+/**
+ * vendor:product@location in hex, which stays the same between runs as
+ * long as the device stays on the same port.
+ */
+static std::string locationKey(const USBDevice &device)
+{
+  char key[32];
+
+  snprintf(key, sizeof(key), "%04x:%04x@%08x", device.vendorID, device.productID,
+           static_cast<unsigned>(device.locationID));
+
+  return key;
+}
+
+/**
+ * What get looks devices up by. IDs are handed out by each process in the
+ * order devices are found, so an ID printed by one run means nothing to
+ * the next.
+ */
+static std::string stableKey(const USBDevice &device)
+{
+  return device.serialNumber.empty() ? locationKey(device) : device.serialNumber;
+}
+
+static void writeDevice(JsonWriter &writer, const USBDevice &device)
+{
+  const UsbIdsDatabase &usbIds = UsbIdsDatabase::instance();
+
+  auto optionalCString = [&writer](const char *name, const char *value) {
+    writer.key(name);
+    value == nullptr ? writer.null() : writer.string(value);
+  };
+
+  writer.beginObject();
+
+  FieldWriter fields(writer, device);
+  forEachField(fields);
+
+  writer.key("key");
+  writer.string(stableKey(device));
+
+  optionalCString("vendorName", usbIds.vendorName(device.vendorID));
+  optionalCString("productName", usbIds.productName(device.vendorID, device.productID));
+
+  writer.key("sources");
+  writer.beginObject();
+
+  for (size_t i = 0; i < FIELD_SOURCE_COUNT; i++) {
+    writer.key(FIELD_SOURCES[i].name);
+    writer.string(fieldSource(device, FIELD_SOURCES[i]));
+  }
+
+  writer.endObject();
+
+  writer.endObject();
+}
+
+static int list(const Options &options)
+{
+  JsonWriter writer(stdout);
+  DeviceScanner scanner(options.scan);
+
+  if (options.json)
+    writer.beginArray();
+
+  // Print devices as they are found
+  while (auto device = scanner.next()) {
+    std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+    writeDevice(writer, *device);
+
+    if (!options.json)
+      writer.newline();
+  }
+
+  if (options.json) {
+    writer.endArray();
+    writer.newline();
+  }
+
+  if (options.stats) {
+    ScanMetrics metrics = scanner.metrics();
+
+    writer.flush();
+    fprintf(stderr, "%zu devices, first after %.3fms, total %.3fms, %llu OS calls\n",
+            metrics.deviceCount, metrics.firstDevice.count() / 1000.0,
+            metrics.total.count() / 1000.0, static_cast<unsigned long long>(metrics.osCalls));
+  }
+
+  return 0;
+}
+
+static int get(const Options &options)
+{
+  if (options.id == nullptr) {
+    usage();
+    return 2;
+  }
+
+  DeviceScanner scanner(options.scan);
+
+  while (auto device = scanner.next()) {
+    std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+    // Devices with a serial number can be found by location as well
+    if ((!device->serialNumber.empty() && device->serialNumber == options.id) ||
+        locationKey(*device) == options.id) {
+      JsonWriter writer(stdout);
+
+      writeDevice(writer, *device);
+      writer.newline();
+
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "No device with key %s\n", options.id);
+
+  return 1;
+}
+
+static int watch(const Options &options)
+{
+  ChangeDetector &detector = ChangeDetector::instance();
+  std::set<std::string> present;
+  bool first = true;
+  uint64_t token = 0;
+
+  while (true) {
+    if (first || detector.hasChanged(token)) {
+      token = detector.token();
+
+      JsonWriter writer(stdout);
+      std::set<std::string> seen;
+
+      for (const USBDevicePtr &device : getDevices(options.scan)) {
+        seen.insert(device->uid);
+
+        if (present.count(device->uid) == 0) {
+          std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+          writer.beginObject();
+          writer.key("event");
+          writer.string("add");
+          writer.key("device");
+          writeDevice(writer, *device);
+          writer.endObject();
+          writer.newline();
+        }
+      }
+
+      for (const std::string &uid : present) {
+        if (seen.count(uid) == 0) {
+          writer.beginObject();
+          writer.key("event");
+          writer.string("remove");
+          writer.key("id");
+          writer.string(uid);
+          writer.endObject();
+          writer.newline();
+        }
+      }
+
+      present.swap(seen);
+      first = false;
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.intervalMs));
+  }
+
+  return 0;
+}
+
+static int decodeLog(const Options &options)
+{
+  if (options.id == nullptr) {
+    usage();
+    return 2;
+  }
+
+  if (!Utils::RingLog::decode(options.id, stdout)) {
+    fprintf(stderr, "Not a ring log file: %s\n", options.id);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int runCommand(const Options &options)
+{
+  if (strcmp(options.command, "list") == 0)
+    return list(options);
+
+  if (strcmp(options.command, "get") == 0)
+    return get(options);
+
+  if (strcmp(options.command, "watch") == 0)
+    return watch(options);
+
+  usage();
+
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+
+  if (!parseOptions(argc, argv, options)) {
+    usage();
+    return 2;
+  }
+
+  // Keep stdout for the device output
+  Logger::instance().setLogStream(stderr);
+
+  if (options.logFile != nullptr)
+    Logger::instance().setLogFile(options.logFile);
+
+  if (options.logRing != nullptr)
+    Logger::instance().setLogRing(options.logRing, 1024 * 1024);
+
+  if (strcmp(options.command, "log") == 0)
+    return decodeLog(options);
+
+  if (options.trace != nullptr)
+    Utils::Tracer::instance().setEnabled(true);
+
+  if (options.usbIds != nullptr) {
+    UsbIdsDatabase::instance().load(options.usbIds, defaultIndexPath(options.usbIds));
+  }
+
+  int status = runCommand(options);
+
+  if (options.trace != nullptr && !Utils::Tracer::instance().dump(options.trace))
+    status = 1;
+
+  return status;
+}
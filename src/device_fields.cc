@@ -0,0 +1,340 @@
+#include "device_fields.h"
+
+#include <string.h>
+
+namespace Subdevil
+{
+  static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+  static const uint64_t FNV_PRIME  = 0x100000001b3ULL;
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Population
+  ////////////////////////////////////////////////////////////////////////////////
+  struct DescriptorCopier {
+    const USBDevice &from;
+    USBDevice &to;
+
+    DescriptorCopier(const USBDevice &from, USBDevice &to) : from(from), to(to) {}
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*member)
+    {
+      if (field.flags & FIELD_DESCRIPTOR)
+        to.*member = from.*member;
+    }
+  };
+
+  void copyDescriptorFields(const USBDevice &from, USBDevice &to)
+  {
+    DescriptorCopier copier(from, to);
+    forEachField(copier);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Hashing
+  ////////////////////////////////////////////////////////////////////////////////
+  struct Hasher {
+    const USBDevice &device;
+    uint64_t hash = FNV_OFFSET;
+
+    explicit Hasher(const USBDevice &device) : device(device) {}
+
+    void bytes(const void *data, size_t size)
+    {
+      const unsigned char *p = static_cast<const unsigned char *>(data);
+
+      for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+      }
+    }
+
+    template<typename T>
+    void value(const T &value)
+    {
+      bytes(&value, sizeof(value));
+    }
+
+    // Length prefixed, so "ab" + "c" and "a" + "bc" differ
+    void value(const std::string &value)
+    {
+      this->value(static_cast<uint64_t>(value.size()));
+      bytes(value.data(), value.size());
+    }
+
+    void value(const Utils::InternedString &value)
+    {
+      this->value(value.str());
+    }
+
+    void value(const std::vector<Volume> &volumes)
+    {
+      value(static_cast<uint64_t>(volumes.size()));
+
+      for (const Volume &volume : volumes) {
+        value(volume.node);
+        value(volume.label);
+        value(volume.uuid);
+        value(static_cast<uint64_t>(volume.mountPoints.size()));
+
+        for (const std::string &mountPoint : volume.mountPoints) {
+          value(mountPoint);
+        }
+      }
+    }
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*member)
+    {
+      if (field.flags & FIELD_CONTENT)
+        value(device.*member);
+    }
+  };
+
+  uint64_t contentHash(const USBDevice &device)
+  {
+    Hasher hasher(device);
+    forEachField(hasher);
+
+    return hasher.hash;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Diffing
+  ////////////////////////////////////////////////////////////////////////////////
+  static bool operator==(const Volume &a, const Volume &b)
+  {
+    return a.node == b.node && a.label == b.label && a.uuid == b.uuid &&
+      a.mountPoints == b.mountPoints;
+  }
+
+  struct Differ {
+    const USBDevice &a;
+    const USBDevice &b;
+    std::vector<const char *> &changed;
+
+    Differ(const USBDevice &a, const USBDevice &b, std::vector<const char *> &changed)
+      : a(a), b(b), changed(changed) {}
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*member)
+    {
+      if (!(field.flags & FIELD_VOLATILE) && !(a.*member == b.*member))
+        changed.push_back(field.name);
+    }
+  };
+
+  void diffFields(const USBDevice &a, const USBDevice &b, std::vector<const char *> &changed)
+  {
+    Differ differ(a, b, changed);
+
+    changed.clear();
+    forEachField(differ);
+  }
+
+  std::vector<const char *> diffFields(const USBDevice &a, const USBDevice &b)
+  {
+    std::vector<const char *> changed;
+
+    // One allocation instead of one per doubling; few updates change more
+    changed.reserve(8);
+    diffFields(a, b, changed);
+
+    return changed;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Serialization
+  ////////////////////////////////////////////////////////////////////////////////
+  // Hashes the field names, flags and sizes, so data written with a
+  // different schema is rejected
+  struct SchemaHasher {
+    uint64_t hash = FNV_OFFSET;
+
+    void bytes(const void *data, size_t size)
+    {
+      const unsigned char *p = static_cast<const unsigned char *>(data);
+
+      for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ p[i]) * FNV_PRIME;
+      }
+    }
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*)
+    {
+      uint32_t size = sizeof(T);
+
+      bytes(field.name, strlen(field.name) + 1);
+      bytes(&field.flags, sizeof(field.flags));
+      bytes(&field.resolver, sizeof(field.resolver));
+      bytes(&size, sizeof(size));
+    }
+  };
+
+  static uint32_t _schemaSignature()
+  {
+    static const uint32_t signature = []() {
+      SchemaHasher schema;
+      forEachField(schema);
+
+      return static_cast<uint32_t>(schema.hash ^ (schema.hash >> 32));
+    }();
+
+    return signature;
+  }
+
+  // Fixed width values are written in host byte order, the data is not
+  // meant to move between machines
+  struct Writer {
+    const USBDevice &device;
+    std::string &out;
+
+    Writer(const USBDevice &device, std::string &out) : device(device), out(out) {}
+
+    template<typename T>
+    void value(const T &value)
+    {
+      out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void value(const std::string &value)
+    {
+      this->value(static_cast<uint32_t>(value.size()));
+      out.append(value);
+    }
+
+    void value(const Utils::InternedString &value)
+    {
+      this->value(value.str());
+    }
+
+    void value(const std::vector<Volume> &volumes)
+    {
+      value(static_cast<uint32_t>(volumes.size()));
+
+      for (const Volume &volume : volumes) {
+        value(volume.node);
+        value(volume.label);
+        value(volume.uuid);
+        value(static_cast<uint32_t>(volume.mountPoints.size()));
+
+        for (const std::string &mountPoint : volume.mountPoints) {
+          value(mountPoint);
+        }
+      }
+    }
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*member)
+    {
+      if (field.flags & FIELD_CONTENT)
+        value(device.*member);
+    }
+  };
+
+  struct Reader {
+    USBDevice &device;
+    const std::string &data;
+    size_t offset;
+    bool ok = true;
+
+    Reader(USBDevice &device, const std::string &data, size_t offset)
+      : device(device), data(data), offset(offset) {}
+
+    template<typename T>
+    void value(T &value)
+    {
+      if (!ok || data.size() - offset < sizeof(value)) {
+        ok = false;
+        return;
+      }
+
+      memcpy(&value, data.data() + offset, sizeof(value));
+      offset += sizeof(value);
+    }
+
+    void value(std::string &value)
+    {
+      uint32_t size = 0;
+      this->value(size);
+
+      if (!ok || data.size() - offset < size) {
+        ok = false;
+        return;
+      }
+
+      value.assign(data, offset, size);
+      offset += size;
+    }
+
+    void value(Utils::InternedString &value)
+    {
+      std::string str;
+      this->value(str);
+
+      if (ok)
+        value = str;
+    }
+
+    void value(std::vector<Volume> &volumes)
+    {
+      uint32_t count = 0;
+      value(count);
+
+      volumes.clear();
+
+      for (uint32_t i = 0; i < count && ok; ++i) {
+        Volume volume;
+        uint32_t mountCount = 0;
+
+        value(volume.node);
+        value(volume.label);
+        value(volume.uuid);
+        value(mountCount);
+
+        for (uint32_t j = 0; j < mountCount && ok; ++j) {
+          std::string mountPoint;
+          value(mountPoint);
+          volume.mountPoints.push_back(mountPoint);
+        }
+
+        volumes.push_back(volume);
+      }
+    }
+
+    template<typename T>
+    void operator()(const Field &field, T USBDevice::*member)
+    {
+      if (field.flags & FIELD_CONTENT)
+        value(device.*member);
+    }
+  };
+
+  void serializeDevice(const USBDevice &device, std::string &out)
+  {
+    Writer writer(device, out);
+
+    writer.value(_schemaSignature());
+    forEachField(writer);
+  }
+
+  bool deserializeDevice(const std::string &data, size_t *offset, USBDevice &device)
+  {
+    Reader reader(device, data, *offset);
+    uint32_t signature = 0;
+
+    reader.value(signature);
+
+    if (!reader.ok || signature != _schemaSignature())
+      return false;
+
+    forEachField(reader);
+
+    if (!reader.ok)
+      return false;
+
+    *offset = reader.offset;
+
+    return true;
+  }
+}
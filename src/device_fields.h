@@ -0,0 +1,107 @@
+#ifndef _SUBDEVIL_DEVICE_FIELDS_H__
+#define _SUBDEVIL_DEVICE_FIELDS_H__
+
+#include "subdevil.h"
+#include "resolvers.h"
+
+#include <string>
+#include <vector>
+
+namespace Subdevil
+{
+  // How a field is used
+  enum FieldFlag {
+    FIELD_PUBLIC     = 1 << 0,  // Reported to JS and by the CLI under its name.
+    FIELD_CONTENT    = 1 << 1,  // Read from the OS. Hashed, diffed and serialized.
+    FIELD_VOLATILE   = 1 << 2,  // Changes on every read. Not diffed.
+    FIELD_DESCRIPTOR = 1 << 3,  // Read by every scan, before any lookups.
+  };
+
+  typedef struct Field {
+    const char *name;
+    unsigned flags;
+    unsigned resolver;  // Only reported once this resolver has run, 0 for always.
+  } Field;
+
+  /**
+   * The schema of USBDevice. Calls visitor(field, member) with a pointer
+   * to each member, public fields in the order they are reported. Members
+   * keep their static type, so visitors overload operator() per field type
+   * and a walk compiles down to straight line code without any lookups. A
+   * field added here is picked up by JS marshalling, the CLI, hashing,
+   * diffing and serialization.
+   *
+   * vendorName, productName and sources are reported as well, but are not
+   * members: the names are looked up in the usb.ids database and the
+   * sources come from liveFields through FIELD_SOURCES. The marshallers
+   * add them after the walk.
+   */
+  template<typename Visitor>
+  inline void forEachField(Visitor &visitor)
+  {
+    visitor(Field{"id",           FIELD_PUBLIC | FIELD_CONTENT,                    0}, &USBDevice::uid);
+    visitor(Field{"productId",    FIELD_PUBLIC | FIELD_CONTENT | FIELD_DESCRIPTOR, 0}, &USBDevice::productID);
+    visitor(Field{"vendorId",     FIELD_PUBLIC | FIELD_CONTENT | FIELD_DESCRIPTOR, 0}, &USBDevice::vendorID);
+    visitor(Field{"product",      FIELD_PUBLIC | FIELD_CONTENT | FIELD_DESCRIPTOR, 0}, &USBDevice::product);
+    visitor(Field{"serialNumber", FIELD_PUBLIC | FIELD_CONTENT | FIELD_DESCRIPTOR, 0}, &USBDevice::serialNumber);
+    visitor(Field{"manufacturer", FIELD_PUBLIC | FIELD_CONTENT | FIELD_DESCRIPTOR, 0}, &USBDevice::vendor);
+    visitor(Field{"mount",        FIELD_PUBLIC | FIELD_CONTENT,                    0}, &USBDevice::mountPoint);
+    visitor(Field{"volumes",      FIELD_PUBLIC | FIELD_CONTENT,                    0}, &USBDevice::volumes);
+    visitor(Field{"incomplete",   FIELD_PUBLIC,                                    0}, &USBDevice::incomplete);
+    visitor(Field{"refreshedAt",  FIELD_PUBLIC | FIELD_VOLATILE,                   0}, &USBDevice::refreshedAt);
+    visitor(Field{"tty",          FIELD_PUBLIC | FIELD_CONTENT,                    RESOLVE_TTY}, &USBDevice::ttyPath);
+    visitor(Field{"hidraw",       FIELD_PUBLIC | FIELD_CONTENT,                    RESOLVE_HIDRAW}, &USBDevice::hidPath);
+    visitor(Field{"block",        FIELD_PUBLIC | FIELD_CONTENT,                    RESOLVE_BLOCK}, &USBDevice::blockPath);
+    visitor(Field{"locationId",   FIELD_CONTENT | FIELD_DESCRIPTOR,                0}, &USBDevice::locationID);
+    visitor(Field{"resolved",     FIELD_CONTENT,                                   0}, &USBDevice::resolved);
+    visitor(Field{"sessionId",    FIELD_CONTENT,                                   0}, &USBDevice::sessionID);
+    visitor(Field{"devicePath",   FIELD_CONTENT | FIELD_DESCRIPTOR,                0}, &USBDevice::devicePath);
+  }
+
+  /**
+   * Whether a field is reported for the device, i.e. it is public and
+   * its resolver, if any, has run.
+   */
+  inline bool isReported(const Field &field, const USBDevice &device)
+  {
+    return (field.flags & FIELD_PUBLIC) && (device.resolved & field.resolver) == field.resolver;
+  }
+
+  /**
+   * Copy the descriptor fields a backend read into the registry's device,
+   * leaving the ones lookups and resolvers fill in alone. Call with the
+   * update mutex held.
+   */
+  void copyDescriptorFields(const USBDevice &from, USBDevice &to);
+
+  /**
+   * 64 bit FNV-1a hash of the content fields. Equal for devices the OS
+   * reported the same way.
+   */
+  uint64_t contentHash(const USBDevice &device);
+
+  /**
+   * Names of the fields that differ between two versions of a device,
+   * except volatile ones.
+   */
+  std::vector<const char *> diffFields(const USBDevice &a, const USBDevice &b);
+  /**
+   * Same, into a vector the caller keeps, so diffing many devices doesn't
+   * allocate once it has grown.
+   */
+  void diffFields(const USBDevice &a, const USBDevice &b, std::vector<const char *> &changed);
+
+  /**
+   * Append the content fields of a device to a byte string, in a compact
+   * binary format that deserializeDevice() reads back.
+   */
+  void serializeDevice(const USBDevice &device, std::string &out);
+  /**
+   * Read a device written by serializeDevice() at *offset, and advance
+   * the offset past it. Returns false if the data is truncated or was
+   * written with a different schema.
+   */
+  bool deserializeDevice(const std::string &data, size_t *offset, USBDevice &device);
+}
+
+#endif // _SUBDEVIL_DEVICE_FIELDS_H__
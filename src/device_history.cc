@@ -0,0 +1,605 @@
+#include "device_history.h"
+#include "utils.h"
+#include "utils/mapped_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+namespace Subdevil
+{
+  static const char MANIFEST_MAGIC[8] = { 'S', 'D', 'V', 'H', 'I', 'S', 'T', '1' };
+  static const char INDEX_MAGIC[8]    = { 'S', 'D', 'V', 'H', 'I', 'D', 'X', '1' };
+  // Marks a whole record. Zeroed padding after a torn write doesn't match.
+  static const uint32_t RECORD_MAGIC  = 0x53444845;
+
+  // Bytes stored of serial numbers and mount points, including the NUL
+  static const size_t HISTORY_STRING_SIZE = 48;
+
+  static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+  static const uint64_t FNV_PRIME  = 0x100000001b3ULL;
+
+  struct Manifest {
+    char magic[8];
+    uint32_t first;  // Oldest live segment.
+    uint32_t last;   // Active segment.
+  };
+
+  // Records are written in host byte order, the log is not meant to move
+  // between machines
+  struct HistoryRecord {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t reserved;
+    int32_t vendorID;
+    int32_t productID;
+    int64_t timeMs;
+    uint64_t deviceKey;
+    char serialNumber[HISTORY_STRING_SIZE];
+    char mountPoint[HISTORY_STRING_SIZE];
+  };
+
+  static_assert(sizeof(HistoryRecord) == 128, "History records must be 128 bytes");
+
+  struct IndexHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    int64_t firstTimeMs;
+    int64_t lastTimeMs;
+  };
+
+  struct IndexEntry {
+    uint64_t deviceKey;
+    uint32_t record;
+    uint32_t reserved;
+  };
+
+  static uint64_t _fnv(uint64_t hash, const void *data, size_t size)
+  {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ p[i]) * FNV_PRIME;
+    }
+
+    return hash;
+  }
+
+  uint64_t historyDeviceKey(const std::string &serialNumber, int vendorID, int productID,
+                            int locationID)
+  {
+    // Prefixed, so a serial number can't collide with the IDs of a device
+    // without one. Only the stored part of the serial number counts.
+    if (!serialNumber.empty()) {
+      size_t size = std::min<size_t>(serialNumber.size(), HISTORY_STRING_SIZE - 1);
+      return _fnv(_fnv(FNV_OFFSET, "s", 1), serialNumber.data(), size);
+    }
+
+    int32_t ids[3] = { vendorID, productID, locationID };
+
+    return _fnv(_fnv(FNV_OFFSET, "l", 1), ids, sizeof(ids));
+  }
+
+  const char *historyEventName(HistoryEventType type)
+  {
+    switch (type) {
+      case HISTORY_ADD:     return "add";
+      case HISTORY_REMOVE:  return "remove";
+      case HISTORY_MOUNT:   return "mount";
+      case HISTORY_UNMOUNT: return "unmount";
+    }
+
+    return "unknown";
+  }
+
+  static void _copyString(char *dst, size_t size, const std::string &src)
+  {
+    size_t len = std::min(src.size(), size - 1);
+
+    memcpy(dst, src.data(), len);
+    memset(dst + len, 0, size - len);
+  }
+
+  static std::string _readString(const char *src, size_t size)
+  {
+    return std::string(src, strnlen(src, size));
+  }
+
+  static bool _readFile(const std::string &path, std::string &data)
+  {
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (file == nullptr)
+      return false;
+
+    char buffer[64 * 1024];
+    size_t read;
+
+    data.clear();
+
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      data.append(buffer, read);
+    }
+
+    fclose(file);
+
+    return true;
+  }
+
+  static bool _writeFile(const std::string &path, const std::string &data)
+  {
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (file == nullptr)
+      return false;
+
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+
+    if (fclose(file) != 0)
+      ok = false;
+
+    return ok;
+  }
+
+  static bool _replaceFile(const std::string &from, const std::string &to)
+  {
+#ifdef _WIN32
+    // Windows doesn't rename over an existing file
+    remove(to.c_str());
+#endif
+    return rename(from.c_str(), to.c_str()) == 0;
+  }
+
+  /**
+   * The whole records of a segment. A segment that is missing, because
+   * compaction was interrupted, is empty.
+   */
+  static std::vector<HistoryRecord> _readRecords(const std::string &path)
+  {
+    std::string data;
+    std::vector<HistoryRecord> records;
+
+    if (!_readFile(path, data))
+      return records;
+
+    records.resize(data.size() / sizeof(HistoryRecord));
+
+    if (!records.empty())
+      memcpy(&records[0], data.data(), records.size() * sizeof(HistoryRecord));
+
+    return records;
+  }
+
+  static bool _writeIndex(const std::string &path, const std::vector<HistoryRecord> &records)
+  {
+    IndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.count = 0;
+    header.reserved = 0;
+    header.firstTimeMs = INT64_MAX;
+    header.lastTimeMs = INT64_MIN;
+
+    std::vector<IndexEntry> entries;
+    entries.reserve(records.size());
+
+    for (size_t i = 0; i < records.size(); ++i) {
+      const HistoryRecord &record = records[i];
+
+      if (record.magic != RECORD_MAGIC)
+        continue;
+
+      IndexEntry entry;
+      entry.deviceKey = record.deviceKey;
+      entry.record = static_cast<uint32_t>(i);
+      entry.reserved = 0;
+      entries.push_back(entry);
+
+      header.firstTimeMs = std::min(header.firstTimeMs, record.timeMs);
+      header.lastTimeMs = std::max(header.lastTimeMs, record.timeMs);
+    }
+
+    // Stable, so the records of a device stay in the order they were written
+    std::stable_sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b) {
+      return a.deviceKey < b.deviceKey;
+    });
+
+    header.count = static_cast<uint32_t>(entries.size());
+
+    std::string data(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    if (!entries.empty())
+      data.append(reinterpret_cast<const char *>(&entries[0]), entries.size() * sizeof(IndexEntry));
+
+    return _writeFile(path, data);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Segments
+  ////////////////////////////////////////////////////////////////////////////////
+  std::string DeviceHistory::segmentPath(uint32_t segment) const
+  {
+    return m_path + "." + std::to_string(segment);
+  }
+
+  std::string DeviceHistory::indexPath(uint32_t segment) const
+  {
+    return segmentPath(segment) + ".idx";
+  }
+
+  std::string DeviceHistory::manifestTempPath() const
+  {
+    return m_path + ".tmp";
+  }
+
+  // Written next to the manifest and renamed over it, so a crash leaves
+  // either the old or the new one
+  bool DeviceHistory::writeManifest()
+  {
+    Manifest manifest;
+    memcpy(manifest.magic, MANIFEST_MAGIC, sizeof(manifest.magic));
+    manifest.first = m_first;
+    manifest.last = m_last;
+
+    std::string tmp = manifestTempPath();
+
+    if (!_writeFile(tmp, std::string(reinterpret_cast<const char *>(&manifest), sizeof(manifest))) ||
+        !_replaceFile(tmp, m_path)) {
+      remove(tmp.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  bool DeviceHistory::openActive()
+  {
+    std::string path = segmentPath(m_last);
+    std::string data;
+
+    m_activeIndex.clear();
+    m_activeRecords = 0;
+
+    if (_readFile(path, data)) {
+      m_activeRecords = static_cast<uint32_t>(data.size() / sizeof(HistoryRecord));
+
+      for (uint32_t i = 0; i < m_activeRecords; ++i) {
+        HistoryRecord record;
+        memcpy(&record, data.data() + i * sizeof(HistoryRecord), sizeof(HistoryRecord));
+
+        if (record.magic == RECORD_MAGIC)
+          m_activeIndex[record.deviceKey].push_back(i);
+      }
+    }
+
+    m_pActive = fopen(path.c_str(), "ab");
+
+    if (m_pActive == nullptr) {
+      CORE_ERROR("Failed to open history segment " + path);
+      return false;
+    }
+
+    // Pad a record torn by a crash, so the next one starts on a boundary
+    size_t torn = data.size() % sizeof(HistoryRecord);
+
+    if (torn > 0) {
+      char zeros[sizeof(HistoryRecord)] = {};
+
+      fwrite(zeros, 1, sizeof(HistoryRecord) - torn, m_pActive);
+      m_activeRecords++;
+    }
+
+    return true;
+  }
+
+  bool DeviceHistory::seal()
+  {
+    fclose(m_pActive);
+    m_pActive = nullptr;
+
+    if (!_writeIndex(indexPath(m_last), _readRecords(segmentPath(m_last)))) {
+      CORE_ERROR("Failed to write history index " + indexPath(m_last));
+      return false;
+    }
+
+    m_last++;
+
+    if (!writeManifest() || !openActive())
+      return false;
+
+    if (m_last - m_first > m_maxSegments)
+      compact();
+
+    return true;
+  }
+
+  void DeviceHistory::compact()
+  {
+    while (m_last - m_first > m_maxSegments) {
+      uint32_t oldest = m_first;
+      uint32_t next = m_first + 1;
+      std::vector<HistoryRecord> records = _readRecords(segmentPath(oldest));
+      std::vector<HistoryRecord> newer = _readRecords(segmentPath(next));
+
+      records.insert(records.end(), newer.begin(), newer.end());
+
+      // Mount history goes first. Of the adds and removes, the newest
+      // segment's worth is kept, so a compacted segment is never larger
+      // than a sealed one and compacting costs the same however long the
+      // history is.
+      std::vector<HistoryRecord> kept;
+
+      for (const HistoryRecord &record : records) {
+        if (record.magic == RECORD_MAGIC && (record.type == HISTORY_ADD || record.type == HISTORY_REMOVE))
+          kept.push_back(record);
+      }
+
+      if (kept.size() > m_segmentRecords)
+        kept.erase(kept.begin(), kept.end() - m_segmentRecords);
+
+      // Nothing of the oldest segment is left, and the newer one is kept as is
+      bool unchanged = kept.size() == newer.size() &&
+        (kept.empty() || memcmp(&kept[0], &newer[0], kept.size() * sizeof(HistoryRecord)) == 0);
+
+      if (!unchanged) {
+        std::string data;
+        std::string tmp = segmentPath(next) + ".tmp";
+
+        if (!kept.empty())
+          data.assign(reinterpret_cast<const char *>(&kept[0]), kept.size() * sizeof(HistoryRecord));
+
+        if (!_writeFile(tmp, data) || !_replaceFile(tmp, segmentPath(next)) ||
+            !_writeIndex(indexPath(next), kept)) {
+          CORE_ERROR("Failed to compact history segment " + segmentPath(next));
+          remove(tmp.c_str());
+          return;
+        }
+      }
+
+      remove(segmentPath(oldest).c_str());
+      remove(indexPath(oldest).c_str());
+      m_first = next;
+
+      if (!writeManifest())
+        return;
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Public API
+  ////////////////////////////////////////////////////////////////////////////////
+  bool DeviceHistory::open(const std::string &path, uint32_t segmentRecords, uint32_t maxSegments)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_pActive != nullptr) {
+      fclose(m_pActive);
+      m_pActive = nullptr;
+      m_open.store(false);
+    }
+
+    m_path = path;
+    m_segmentRecords = std::max<uint32_t>(segmentRecords, 1);
+    m_maxSegments = std::max<uint32_t>(maxSegments, 1);
+    m_first = 0;
+    m_last = 0;
+
+    std::string data;
+    bool found = _readFile(m_path, data);
+
+    // Windows can't rename over the old manifest, so a crash while it's
+    // replaced may leave just the new one. A torn one is ignored.
+    bool recovered = !found && _readFile(manifestTempPath(), data) && data.size() == sizeof(Manifest);
+
+    if (found || recovered) {
+      Manifest manifest;
+
+      if (data.size() != sizeof(manifest)) {
+        CORE_ERROR(m_path + " is not a device history");
+        return false;
+      }
+
+      memcpy(&manifest, data.data(), sizeof(manifest));
+
+      if (memcmp(manifest.magic, MANIFEST_MAGIC, sizeof(manifest.magic)) != 0 || manifest.first > manifest.last) {
+        CORE_ERROR(m_path + " is not a device history");
+        return false;
+      }
+
+      m_first = manifest.first;
+      m_last = manifest.last;
+
+      if (recovered && !writeManifest()) {
+        CORE_ERROR("Failed to restore device history " + m_path);
+        return false;
+      }
+    } else if (!writeManifest()) {
+      CORE_ERROR("Failed to create device history " + m_path);
+      return false;
+    }
+
+    if (!openActive())
+      return false;
+
+    // The limits may have been lowered since the last run
+    compact();
+
+    m_open.store(true);
+
+    return true;
+  }
+
+  void DeviceHistory::close()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_open.store(false);
+
+    if (m_pActive != nullptr) {
+      fclose(m_pActive);
+      m_pActive = nullptr;
+    }
+
+    m_activeIndex.clear();
+  }
+
+  void DeviceHistory::append(const std::vector<HistoryEvent> &events)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_pActive == nullptr)
+      return;
+
+    for (const HistoryEvent &event : events) {
+      if (m_activeRecords >= m_segmentRecords && !seal()) {
+        m_open.store(false);
+        return;
+      }
+
+      HistoryRecord record;
+      record.magic     = RECORD_MAGIC;
+      record.type      = static_cast<uint16_t>(event.type);
+      record.reserved  = 0;
+      record.vendorID  = event.vendorID;
+      record.productID = event.productID;
+      record.timeMs    = event.timeMs;
+      record.deviceKey = event.deviceKey;
+      _copyString(record.serialNumber, sizeof(record.serialNumber), event.serialNumber);
+      _copyString(record.mountPoint, sizeof(record.mountPoint), event.mountPoint);
+
+      if (fwrite(&record, sizeof(record), 1, m_pActive) != 1) {
+        CORE_ERROR("Failed to append to history segment " + segmentPath(m_last));
+        return;
+      }
+
+      m_activeIndex[record.deviceKey].push_back(m_activeRecords++);
+    }
+
+    fflush(m_pActive);
+  }
+
+  void DeviceHistory::querySealed(uint32_t segment, uint64_t key, int64_t sinceMs, std::vector<HistoryRecord> &records)
+  {
+    Utils::MappedFile index;
+
+    if (!index.open(indexPath(segment)) || index.size() < sizeof(IndexHeader))
+      return;
+
+    const IndexHeader *header = reinterpret_cast<const IndexHeader *>(index.data());
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        index.size() < sizeof(IndexHeader) + header->count * sizeof(IndexEntry)) {
+      CORE_WARNING("Ignoring damaged history index " + indexPath(segment));
+      return;
+    }
+
+    if (header->count == 0 || header->lastTimeMs < sinceMs)
+      return;
+
+    const IndexEntry *begin = reinterpret_cast<const IndexEntry *>(index.data() + sizeof(IndexHeader));
+    const IndexEntry *end = begin + header->count;
+    const IndexEntry *it = std::lower_bound(begin, end, key, [](const IndexEntry &entry, uint64_t key) {
+      return entry.deviceKey < key;
+    });
+
+    if (it == end || it->deviceKey != key)
+      return;
+
+    FILE *file = fopen(segmentPath(segment).c_str(), "rb");
+
+    if (file == nullptr)
+      return;
+
+    for (; it != end && it->deviceKey == key; ++it) {
+      HistoryRecord record;
+
+      if (fseek(file, static_cast<long>(it->record) * sizeof(HistoryRecord), SEEK_SET) != 0 ||
+          fread(&record, sizeof(record), 1, file) != 1)
+        break;
+
+      if (record.magic == RECORD_MAGIC && record.timeMs >= sinceMs)
+        records.push_back(record);
+    }
+
+    fclose(file);
+  }
+
+  std::vector<HistoryEvent> DeviceHistory::query(const std::string &serialNumber, int64_t sinceMs)
+  {
+    std::vector<HistoryEvent> events;
+
+    if (serialNumber.empty())
+      return events;
+
+    uint64_t key = historyDeviceKey(serialNumber, 0, 0, 0);
+    std::vector<HistoryRecord> records;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_pActive == nullptr)
+        return events;
+
+      for (uint32_t segment = m_first; segment < m_last; ++segment) {
+        querySealed(segment, key, sinceMs, records);
+      }
+
+      auto it = m_activeIndex.find(key);
+
+      if (it != m_activeIndex.end()) {
+        FILE *file = fopen(segmentPath(m_last).c_str(), "rb");
+
+        for (uint32_t i = 0; file != nullptr && i < it->second.size(); ++i) {
+          HistoryRecord record;
+
+          if (fseek(file, static_cast<long>(it->second[i]) * sizeof(HistoryRecord), SEEK_SET) != 0 ||
+              fread(&record, sizeof(record), 1, file) != 1)
+            break;
+
+          if (record.magic == RECORD_MAGIC && record.timeMs >= sinceMs)
+            records.push_back(record);
+        }
+
+        if (file != nullptr)
+          fclose(file);
+      }
+    }
+
+    // Records are in write order already, apart from clock adjustments
+    std::stable_sort(records.begin(), records.end(), [](const HistoryRecord &a, const HistoryRecord &b) {
+      return a.timeMs < b.timeMs;
+    });
+
+    std::string stored = serialNumber.substr(0, HISTORY_STRING_SIZE - 1);
+    int64_t addedMs = -1;
+
+    for (const HistoryRecord &record : records) {
+      HistoryEvent event;
+      event.type         = static_cast<HistoryEventType>(record.type);
+      event.timeMs       = record.timeMs;
+      event.deviceKey    = record.deviceKey;
+      event.vendorID     = record.vendorID;
+      event.productID    = record.productID;
+      event.serialNumber = _readString(record.serialNumber, sizeof(record.serialNumber));
+      event.mountPoint   = _readString(record.mountPoint, sizeof(record.mountPoint));
+      event.durationMs   = -1;
+
+      // Hash collisions
+      if (event.serialNumber != stored)
+        continue;
+
+      if (event.type == HISTORY_ADD) {
+        addedMs = event.timeMs;
+      } else if (event.type == HISTORY_REMOVE) {
+        if (addedMs >= 0)
+          event.durationMs = event.timeMs - addedMs;
+
+        addedMs = -1;
+      }
+
+      events.push_back(event);
+    }
+
+    return events;
+  }
+}
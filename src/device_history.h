@@ -0,0 +1,115 @@
+#ifndef _SUBDEVIL_DEVICE_HISTORY_H__
+#define _SUBDEVIL_DEVICE_HISTORY_H__
+
+#include "subdevil.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace Subdevil
+{
+  enum HistoryEventType {
+    HISTORY_ADD = 1,
+    HISTORY_REMOVE,
+    HISTORY_MOUNT,
+    HISTORY_UNMOUNT,
+  };
+
+  typedef struct HistoryEvent {
+    HistoryEventType type;
+    int64_t timeMs;            // Milliseconds since the epoch.
+    uint64_t deviceKey;        // Same for the device across processes, see historyDeviceKey().
+    int vendorID;
+    int productID;
+    std::string serialNumber;  // Truncated to 47 bytes.
+    std::string mountPoint;    // Mount and unmount events only. Truncated to 47 bytes.
+    int64_t durationMs;        // Remove events: time since the add, -1 if not in the results.
+  } HistoryEvent;
+
+  /**
+   * The key a device's events are stored under: derived from its serial
+   * number, or from its vendor, product and location IDs if it has none.
+   */
+  uint64_t historyDeviceKey(const std::string &serialNumber, int vendorID, int productID,
+                            int locationID);
+
+  const char *historyEventName(HistoryEventType type);
+
+  // The on-disk form of an event, see device_history.cc
+  struct HistoryRecord;
+
+  /**
+   * Opt-in log of the devices added, removed, mounted and unmounted
+   * between full scans, kept across processes.
+   *
+   * Events are appended as fixed size records to numbered segment files
+   * next to a small manifest at the given path. Once a segment is full it
+   * is sealed with a sidecar index of its records sorted by device key,
+   * so lookups read the index and the matching records instead of the
+   * whole log. When there are more sealed segments than allowed, the two
+   * oldest are compacted into one: mount and unmount events are dropped,
+   * and of the adds and removes at most a segment's worth, the newest,
+   * are kept. So the log never holds more than maxSegments + 1 segments.
+   *
+   * Meant for a single writing process per path.
+   */
+  class DeviceHistory
+  {
+  public:
+    static DeviceHistory &instance()
+    {
+      static DeviceHistory instance;
+      return instance;
+    }
+
+    /**
+     * Start recording to the log at the given path, creating it if needed.
+     */
+    bool open(const std::string &path, uint32_t segmentRecords = 65536, uint32_t maxSegments = 32);
+    void close();
+
+    bool isOpen() const { return m_open.load(); }
+
+    void append(const std::vector<HistoryEvent> &events);
+
+    /**
+     * Events of the device with the given serial number since the given
+     * time, oldest first.
+     */
+    std::vector<HistoryEvent> query(const std::string &serialNumber, int64_t sinceMs);
+
+  private:
+    DeviceHistory() : m_open(false), m_pActive(nullptr) {}
+    DeviceHistory(const DeviceHistory &);
+    DeviceHistory &operator=(const DeviceHistory &);
+
+    std::string segmentPath(uint32_t segment) const;
+    std::string indexPath(uint32_t segment) const;
+    std::string manifestTempPath() const;
+    bool writeManifest();
+    bool openActive();
+    bool seal();
+    void compact();
+    void querySealed(uint32_t segment, uint64_t key, int64_t sinceMs, std::vector<HistoryRecord> &records);
+
+    std::atomic<bool> m_open;
+    std::mutex m_mutex;
+    std::string m_path;
+    uint32_t m_segmentRecords;
+    uint32_t m_maxSegments;
+    // Live segments are always first..last, the last one is active
+    uint32_t m_first;
+    uint32_t m_last;
+    FILE *m_pActive;
+    uint32_t m_activeRecords;
+    // Record numbers of the active segment by device key
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_activeIndex;
+  };
+}
+
+#endif // _SUBDEVIL_DEVICE_HISTORY_H__
@@ -0,0 +1,162 @@
+#include "device_id.h"
+
+#include <string.h>
+
+namespace Subdevil
+{
+  ////////////////////////////////////////////////////////////////////////////////
+  // Hex decoding
+  ////////////////////////////////////////////////////////////////////////////////
+  static const uint32_t ONES = 0x01010101;
+  static const uint32_t HIGH_BITS = 0x80808080;
+
+  // Sets the high bit of each byte of x within [lo, hi]. Bytes must be < 0x80.
+  static inline uint32_t _bytesInRange(uint32_t x, uint32_t lo, uint32_t hi)
+  {
+    uint32_t atLeastLo = (x + (0x80 - lo) * ONES) & HIGH_BITS;
+    uint32_t aboveHi   = (x + (0x7F - hi) * ONES) & HIGH_BITS;
+
+    return atLeastLo & ~aboveHi;
+  }
+
+  /**
+   * Decode exactly four hex digits, all four bytes at once.
+   */
+  static inline bool _hex4(const char *p, uint16_t &value)
+  {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    // First digit in the top byte
+    uint32_t x = (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+      (static_cast<uint32_t>(u[2]) << 8) | u[3];
+
+    if (x & HIGH_BITS)
+      return false;
+
+    // Letters become lower case. Only 'A'-'F' and 'a'-'f' land in 'a'-'f'.
+    uint32_t lower  = x | (0x20 * ONES);
+    uint32_t digits = _bytesInRange(x, '0', '9');
+    uint32_t alpha  = _bytesInRange(lower, 'a', 'f');
+
+    if ((digits | alpha) != HIGH_BITS)
+      return false;
+
+    // '0'-'9' -> 0-9, 'a'-'f' -> 1-6 + 9
+    uint32_t nibbles = (lower & (0x0F * ONES)) + (alpha >> 7) * 9;
+    uint32_t pairs   = (nibbles | (nibbles >> 4)) & 0x00FF00FF;
+
+    value = static_cast<uint16_t>(((pairs >> 8) & 0xFF00) | (pairs & 0xFF));
+
+    return true;
+  }
+
+  /**
+   * Decode 1 to 4 hex digits up to the end or a non hex character.
+   */
+  static inline bool _hexUpTo4(const char *&p, const char *end, uint16_t &value)
+  {
+    uint32_t result = 0;
+    int count = 0;
+
+    for (; p < end && count < 5; ++p, ++count) {
+      uint32_t c = static_cast<unsigned char>(*p);
+      uint32_t digit;
+
+      if (c - '0' < 10)               digit = c - '0';
+      else if ((c | 0x20) - 'a' < 6)  digit = (c | 0x20) - 'a' + 10;
+      else                            break;
+
+      result = (result << 4) | digit;
+    }
+
+    if (count == 0 || count > 4)
+      return false;
+
+    value = static_cast<uint16_t>(result);
+
+    return true;
+  }
+
+  static inline bool _startsWith(const char *str, size_t len, const char *prefix, size_t prefixLen)
+  {
+    return len >= prefixLen && memcmp(str, prefix, prefixLen) == 0;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Formats
+  ////////////////////////////////////////////////////////////////////////////////
+  bool parseInstanceID(const char *str, size_t len, DeviceIDView &id)
+  {
+    // USB\VID_xxxx&PID_xxxx
+    static const size_t HEADER_LEN = 21;
+
+    if (len < HEADER_LEN ||
+        memcmp(str, "USB\\VID_", 8) != 0 || str[12] != '&' || memcmp(str + 13, "PID_", 4) != 0 ||
+        !_hex4(str + 8, id.vendorID) || !_hex4(str + 17, id.productID)) {
+      return false;
+    }
+
+    id.serial = str + len;
+    id.serialLength = 0;
+
+    const char *p = str + HEADER_LEN;
+    const char *end = str + len;
+
+    // Interface IDs continue with &MI_xx and carry no serial
+    if (p == end || *p != '\\')
+      return p == end || *p == '&';
+
+    const char *serial = ++p;
+
+    while (p < end && *p != '&')
+      ++p;
+
+    id.serial = serial;
+    id.serialLength = static_cast<size_t>(p - serial);
+
+    return true;
+  }
+
+  bool parseModalias(const char *str, size_t len, DeviceIDView &id)
+  {
+    // usb:vXXXXpXXXX
+    if (len < 14 || memcmp(str, "usb:v", 5) != 0 || str[9] != 'p' ||
+        !_hex4(str + 5, id.vendorID) || !_hex4(str + 10, id.productID)) {
+      return false;
+    }
+
+    id.serial = str + len;
+    id.serialLength = 0;
+
+    return true;
+  }
+
+  bool parseUeventProduct(const char *str, size_t len, DeviceIDView &id)
+  {
+    const char *p = str;
+    const char *end = str + len;
+
+    if (_startsWith(str, len, "PRODUCT=", 8))
+      p += 8;
+
+    if (!_hexUpTo4(p, end, id.vendorID) || p == end || *p++ != '/' ||
+        !_hexUpTo4(p, end, id.productID) || (p != end && *p != '/')) {
+      return false;
+    }
+
+    id.serial = end;
+    id.serialLength = 0;
+
+    return true;
+  }
+
+  bool parseDeviceID(const char *str, size_t len, DeviceIDView &id)
+  {
+    if (_startsWith(str, len, "USB\\", 4))
+      return parseInstanceID(str, len, id);
+
+    if (_startsWith(str, len, "usb:", 4))
+      return parseModalias(str, len, id);
+
+    return parseUeventProduct(str, len, id);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef _SUBDEVIL_DEVICE_ID_H__
+#define _SUBDEVIL_DEVICE_ID_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Subdevil
+{
+  /**
+   * Vendor and product IDs parsed from an OS device identifier. The serial
+   * number, when the format carries one, points into the parsed string
+   * and is not NUL terminated.
+   */
+  typedef struct DeviceIDView {
+    uint16_t vendorID;
+    uint16_t productID;
+    const char *serial;
+    size_t serialLength;
+  } DeviceIDView;
+
+  /**
+   * Parse a Windows device instance ID:
+   * USB\VID_xxxx&PID_xxxx\SERIAL, or USB\VID_xxxx&PID_xxxx&MI_xx\... for
+   * interfaces of composite devices, which have no serial.
+   */
+  bool parseInstanceID(const char *str, size_t len, DeviceIDView &id);
+
+  /**
+   * Parse a modalias: usb:vXXXXpXXXXd...
+   */
+  bool parseModalias(const char *str, size_t len, DeviceIDView &id);
+
+  /**
+   * Parse a uevent PRODUCT value, with or without the PRODUCT= prefix:
+   * vid/pid/bcdDevice in unpadded hex.
+   */
+  bool parseUeventProduct(const char *str, size_t len, DeviceIDView &id);
+
+  /**
+   * Parse any of the above, picking the format from the prefix.
+   */
+  bool parseDeviceID(const char *str, size_t len, DeviceIDView &id);
+}
+
+#endif // _SUBDEVIL_DEVICE_ID_H__
@@ -0,0 +1,509 @@
+#include "device_registry.h"
+#include "change_detector.h"
+#include "usb_common.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iterator>
+#include <unordered_set>
+
+namespace Subdevil
+{
+  static uint32_t _vendorProductKey(int vendorID, int productID)
+  {
+    return (static_cast<uint32_t>(vendorID & 0xFFFF) << 16) | static_cast<uint32_t>(productID & 0xFFFF);
+  }
+
+  /**
+   * Mount points are matched without trailing separators, and on Windows
+   * case insensitively, so "E:", "e:\" and "E:\" are the same.
+   */
+  static std::string _mountKey(std::string path)
+  {
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\'))
+      path.pop_back();
+
+#ifdef _WIN32
+    std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+#endif
+
+    return path;
+  }
+
+  static int64_t _nowEpochMs()
+  {
+    using namespace std::chrono;
+
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  template<typename Keys>
+  static void _historyEvent(std::vector<HistoryEvent> *events, HistoryEventType type, const Keys &keys,
+                            const std::string &mountPoint = "")
+  {
+    if (events == nullptr)
+      return;
+
+    HistoryEvent event;
+    event.type         = type;
+    event.timeMs       = _nowEpochMs();
+    event.deviceKey    = historyDeviceKey(keys.serialNumber, keys.vendorID, keys.productID, keys.locationID);
+    event.vendorID     = keys.vendorID;
+    event.productID    = keys.productID;
+    event.serialNumber = keys.serialNumber;
+    event.mountPoint   = mountPoint;
+    event.durationMs   = -1;
+
+    events->push_back(event);
+  }
+
+  template<typename Index, typename Key>
+  static void _erase(Index &index, const Key &key, const USBDevice *device)
+  {
+    auto range = index.equal_range(key);
+
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second.get() == device) {
+        index.erase(it);
+        return;
+      }
+    }
+  }
+
+  template<typename Index, typename Key>
+  static void _collect(const Index &index, const Key &key, std::vector<USBDevicePtr> &devices)
+  {
+    auto range = index.equal_range(key);
+
+    for (auto it = range.first; it != range.second; ++it) {
+      devices.push_back(it->second);
+    }
+  }
+
+  USBDevicePtr DeviceRegistry::create() const
+  {
+    // Single allocation for the reference count and the device
+    USBDevicePtr device = std::make_shared<USBDevice>();
+
+    device->locationID = 0;
+    device->productID  = 0;
+    device->vendorID   = 0;
+    device->incomplete = false;
+    device->resolved   = 0;
+    device->sessionID  = 0;
+    device->liveFields = 0;
+
+    return device;
+  }
+
+  USBDevicePtr DeviceRegistry::findOrCreate(int locationID)
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    USBDevicePtr &device = m_byLocationID[locationID];
+
+    if (device == nullptr) {
+      device = create();
+      device->locationID = locationID;
+    }
+
+    return device;
+  }
+
+  void DeviceRegistry::add(const USBDevicePtr &device)
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    Entry &entry = m_devices[device->uid];
+
+    // Seen again, so no longer departed
+    if (entry.device != nullptr && entry.departed)
+      m_departed.erase(entry.departedIt);
+
+    entry.device = device;
+    entry.seenGeneration = m_generation;
+    entry.departed = false;
+
+    m_byLocationID[device->locationID] = device;
+  }
+
+  USBDevicePtr DeviceRegistry::find(const std::string &uid) const
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    auto it = m_devices.find(uid);
+
+    return it != m_devices.end() && !it->second.departed ? it->second.device : nullptr;
+  }
+
+  USBDevicePtr DeviceRegistry::findByLocationID(int locationID) const
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    auto it = m_byLocationID.find(locationID);
+
+    return it != m_byLocationID.end() ? it->second : nullptr;
+  }
+
+  size_t DeviceRegistry::size() const
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    return m_devices.size();
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Departed devices
+  ////////////////////////////////////////////////////////////////////////////////
+  void DeviceRegistry::setDepartedLimits(std::chrono::milliseconds maxAge, size_t maxCount)
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    m_maxDepartedAge = maxAge;
+    m_maxDeparted = maxCount;
+  }
+
+  RegistryStats DeviceRegistry::stats() const
+  {
+    std::lock_guard<std::mutex> lock(m_updateMutex);
+
+    RegistryStats stats;
+    stats.generation = m_generation;
+    stats.departed   = m_departed.size();
+    stats.present    = m_devices.size() - stats.departed;
+    stats.evicted    = m_evicted;
+
+    return stats;
+  }
+
+  void DeviceRegistry::markDeparted(std::chrono::steady_clock::time_point now)
+  {
+    for (auto it = m_devices.begin(); it != m_devices.end();) {
+      Entry &entry = it->second;
+      auto next = std::next(it);
+
+      if (!entry.departed && entry.seenGeneration < m_generation) {
+        // The device was registered again under a new UID, once its serial
+        // number was read, so this one is just an alias
+        if (entry.device->uid != it->first) {
+          erase(it);
+        } else {
+          entry.departed = true;
+          entry.departedAt = now;
+          entry.departedIt = m_departed.insert(m_departed.end(), it->first);
+        }
+      }
+
+      it = next;
+    }
+  }
+
+  void DeviceRegistry::evictDeparted(std::chrono::steady_clock::time_point now)
+  {
+    while (!m_departed.empty()) {
+      auto it = m_devices.find(m_departed.front());
+
+      if (m_departed.size() <= m_maxDeparted && now - it->second.departedAt <= m_maxDepartedAge)
+        break;
+
+      erase(it);
+      m_evicted++;
+    }
+  }
+
+  void DeviceRegistry::erase(std::unordered_map<std::string, Entry>::iterator it)
+  {
+    const Entry &entry = it->second;
+    auto location = m_byLocationID.find(entry.device->locationID);
+
+    // Another device may have been plugged in at the same location since
+    if (location != m_byLocationID.end() && location->second == entry.device &&
+        entry.device->uid == it->first)
+      m_byLocationID.erase(location);
+
+    if (entry.departed)
+      m_departed.erase(entry.departedIt);
+
+    m_devices.erase(it);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Connected devices
+  ////////////////////////////////////////////////////////////////////////////////
+  void DeviceRegistry::index(const USBDevicePtr &device, std::vector<HistoryEvent> *events)
+  {
+    IndexKeys keys;
+    keys.device       = device;
+    keys.uid          = device->uid;
+    keys.serialNumber = device->serialNumber;
+    keys.vendorID     = device->vendorID;
+    keys.productID    = device->productID;
+    keys.locationID   = device->locationID;
+
+    for (const Volume &volume : device->volumes) {
+      for (const std::string &mountPoint : volume.mountPoints) {
+        std::string key = _mountKey(mountPoint);
+
+        if (std::find(keys.mountPoints.begin(), keys.mountPoints.end(), key) == keys.mountPoints.end())
+          keys.mountPoints.push_back(key);
+      }
+    }
+
+    auto it = m_connected.find(device.get());
+
+    if (it != m_connected.end()) {
+      const IndexKeys &old = it->second;
+
+      if (old.uid == keys.uid && old.serialNumber == keys.serialNumber && old.vendorID == keys.vendorID &&
+          old.productID == keys.productID && old.locationID == keys.locationID &&
+          old.mountPoints == keys.mountPoints)
+        return;
+
+      // A serial number read late makes the device a different one in
+      // the history, so it's logged as added under that
+      if (old.serialNumber != keys.serialNumber) {
+        _historyEvent(events, HISTORY_ADD, keys);
+
+        for (const std::string &mountPoint : keys.mountPoints) {
+          _historyEvent(events, HISTORY_MOUNT, keys, mountPoint);
+        }
+      } else {
+        for (const std::string &mountPoint : old.mountPoints) {
+          if (std::find(keys.mountPoints.begin(), keys.mountPoints.end(), mountPoint) == keys.mountPoints.end())
+            _historyEvent(events, HISTORY_UNMOUNT, keys, mountPoint);
+        }
+
+        for (const std::string &mountPoint : keys.mountPoints) {
+          if (std::find(old.mountPoints.begin(), old.mountPoints.end(), mountPoint) == old.mountPoints.end())
+            _historyEvent(events, HISTORY_MOUNT, keys, mountPoint);
+        }
+      }
+
+      unindex(old);
+    } else {
+      _historyEvent(events, HISTORY_ADD, keys);
+
+      for (const std::string &mountPoint : keys.mountPoints) {
+        _historyEvent(events, HISTORY_MOUNT, keys, mountPoint);
+      }
+    }
+
+    m_byUid[keys.uid] = device;
+
+    if (!keys.serialNumber.empty())
+      m_bySerialNumber.insert(std::make_pair(keys.serialNumber, device));
+
+    m_byVendorProduct.insert(std::make_pair(_vendorProductKey(keys.vendorID, keys.productID), device));
+    m_byVendor.insert(std::make_pair(keys.vendorID, device));
+
+    for (const std::string &mountPoint : keys.mountPoints) {
+      m_byMountPoint.insert(std::make_pair(mountPoint, device));
+    }
+
+    m_connected[device.get()] = keys;
+  }
+
+  void DeviceRegistry::unindex(const IndexKeys &keys)
+  {
+    const USBDevice *device = keys.device.get();
+    auto uid = m_byUid.find(keys.uid);
+
+    if (uid != m_byUid.end() && uid->second.get() == device)
+      m_byUid.erase(uid);
+
+    if (!keys.serialNumber.empty())
+      _erase(m_bySerialNumber, keys.serialNumber, device);
+
+    _erase(m_byVendorProduct, _vendorProductKey(keys.vendorID, keys.productID), device);
+    _erase(m_byVendor, keys.vendorID, device);
+
+    for (const std::string &mountPoint : keys.mountPoints) {
+      _erase(m_byMountPoint, mountPoint, device);
+    }
+  }
+
+  void DeviceRegistry::setConnected(const std::vector<USBDevicePtr> &devices, uint64_t token)
+  {
+    DeviceHistory &history = DeviceHistory::instance();
+    std::vector<HistoryEvent> events;
+    std::vector<HistoryEvent> *pEvents = history.isOpen() ? &events : nullptr;
+
+    {
+      std::lock_guard<std::mutex> updateLock(m_updateMutex);
+      std::lock_guard<std::mutex> lock(m_indexMutex);
+
+      std::unordered_set<const USBDevice *> current;
+
+      for (const USBDevicePtr &device : devices) {
+        current.insert(device.get());
+        index(device, pEvents);
+      }
+
+      for (auto it = m_connected.begin(); it != m_connected.end();) {
+        if (current.count(it->first) == 0) {
+          _historyEvent(pEvents, HISTORY_REMOVE, it->second);
+          unindex(it->second);
+          it = m_connected.erase(it);
+        } else {
+          ++it;
+        }
+      }
+
+      m_hasConnected = true;
+      m_connectedToken = token;
+
+      // A new generation: whatever this scan didn't find has departed
+      m_generation++;
+
+      for (const USBDevicePtr &device : devices) {
+        auto it = m_devices.find(device->uid);
+
+        if (it != m_devices.end() && it->second.device == device)
+          it->second.seenGeneration = m_generation;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+
+      markDeparted(now);
+      evictDeparted(now);
+    }
+
+    // File writes stay out of the locks lookups take
+    if (!events.empty())
+      history.append(events);
+  }
+
+  void DeviceRegistry::reindex(const USBDevicePtr &device, std::vector<HistoryEvent> &events)
+  {
+    std::lock_guard<std::mutex> lock(m_indexMutex);
+
+    if (m_connected.count(device.get()) > 0)
+      index(device, DeviceHistory::instance().isOpen() ? &events : nullptr);
+  }
+
+  bool DeviceRegistry::connectedToken(uint64_t *token) const
+  {
+    std::lock_guard<std::mutex> lock(m_indexMutex);
+
+    *token = m_connectedToken;
+
+    return m_hasConnected;
+  }
+
+  std::vector<USBDevicePtr> DeviceRegistry::findConnected(const DeviceQuery &query) const
+  {
+    std::lock_guard<std::mutex> lock(m_indexMutex);
+
+    std::string mountPoint = query.mountPoint.empty() ? "" : _mountKey(query.mountPoint);
+    std::vector<USBDevicePtr> candidates;
+
+    // Start from the most selective index, then check the other criteria
+    if (!query.uid.empty()) {
+      auto it = m_byUid.find(query.uid);
+
+      if (it != m_byUid.end())
+        candidates.push_back(it->second);
+    } else if (!query.serialNumber.empty()) {
+      _collect(m_bySerialNumber, query.serialNumber, candidates);
+    } else if (!mountPoint.empty()) {
+      _collect(m_byMountPoint, mountPoint, candidates);
+    } else if (query.vendorID >= 0 && query.productID >= 0) {
+      _collect(m_byVendorProduct, _vendorProductKey(query.vendorID, query.productID), candidates);
+    } else if (query.vendorID >= 0) {
+      _collect(m_byVendor, query.vendorID, candidates);
+    } else {
+      for (const auto &connected : m_connected) {
+        candidates.push_back(connected.second.device);
+      }
+    }
+
+    std::vector<USBDevicePtr> devices;
+
+    for (const USBDevicePtr &device : candidates) {
+      const IndexKeys &keys = m_connected.at(device.get());
+
+      if (!query.uid.empty() && keys.uid != query.uid)
+        continue;
+      if (!query.serialNumber.empty() && keys.serialNumber != query.serialNumber)
+        continue;
+      if (query.vendorID >= 0 && keys.vendorID != query.vendorID)
+        continue;
+      if (query.productID >= 0 && keys.productID != query.productID)
+        continue;
+      if (!mountPoint.empty() &&
+          std::find(keys.mountPoints.begin(), keys.mountPoints.end(), mountPoint) == keys.mountPoints.end())
+        continue;
+      if (query.mounted && keys.mountPoints.empty())
+        continue;
+
+      devices.push_back(device);
+    }
+
+    return devices;
+  }
+
+  USBDevicePtr getDevice(const std::string &uid)
+  {
+    return DeviceRegistry::instance().find(uid);
+  }
+
+  USBDevicePtr getDevice(const std::string &uid, std::chrono::milliseconds maxAge,
+                         std::chrono::milliseconds deadline)
+  {
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    USBDevicePtr device = registry.find(uid);
+
+    if(device == nullptr)
+      return nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
+
+      if(std::chrono::steady_clock::now() - device->refreshedAt <= maxAge)
+        return device;
+    }
+
+    CORE_DEBUG("Refreshing device " + uid);
+
+    device = refreshDevice(device, std::chrono::steady_clock::now() + deadline);
+
+    bool connected = false;
+
+    if(device != nullptr) {
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
+
+      // Another device may have taken the device path
+      connected = device->uid == uid;
+
+      if(connected)
+        device->refreshedAt = std::chrono::steady_clock::now();
+    }
+
+    if(!connected) {
+      CORE_DEBUG("Device " + uid + " is no longer connected");
+      return nullptr;
+    }
+
+    return device;
+  }
+
+  void setDepartedLimits(std::chrono::milliseconds maxAge, size_t maxCount)
+  {
+    DeviceRegistry::instance().setDepartedLimits(maxAge, maxCount);
+  }
+
+  std::vector<USBDevicePtr> findDevices(const DeviceQuery &query, const ScanOptions &options)
+  {
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    uint64_t token;
+
+    if (!registry.connectedToken(&token) || ChangeDetector::instance().hasChanged(token)) {
+      CORE_DEBUG("Devices changed since the last scan, scanning before the lookup");
+      getDevices(options);
+    }
+
+    return registry.findConnected(query);
+  }
+}
@@ -0,0 +1,165 @@
+#ifndef _SUBDEVIL_DEVICE_REGISTRY_H__
+#define _SUBDEVIL_DEVICE_REGISTRY_H__
+
+#include "subdevil.h"
+#include "device_history.h"
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Subdevil
+{
+  typedef struct RegistryStats {
+    uint64_t generation;  // Full scans so far.
+    size_t present;       // Devices found by the last full scan, or seen since.
+    size_t departed;      // Devices kept as tombstones.
+    uint64_t evicted;     // Tombstones dropped so far.
+  } RegistryStats;
+
+  /**
+   * Every device seen by the backends, indexed by UID and by location ID.
+   * The devices found by the last full scan are also indexed by serial
+   * number, vendor and product ID and mount point.
+   *
+   * Each full scan starts a new generation. Devices it didn't find are
+   * marked as departed: they are no longer returned by UID, but stay
+   * around as tombstones, so a device plugged back in is matched by its
+   * location and keeps what was resolved for it. Tombstones are dropped
+   * once they are older than the age limit, oldest first beyond the
+   * count limit.
+   */
+  class DeviceRegistry
+  {
+  public:
+    static DeviceRegistry &instance()
+    {
+      static DeviceRegistry instance;
+      return instance;
+    }
+
+    /**
+     * Allocate a new, unregistered device.
+     */
+    USBDevicePtr create() const;
+    /**
+     * The device registered at the location, or a new device claiming it.
+     * Scans running at the same time get the same device for the same
+     * location, so it's never registered twice.
+     */
+    USBDevicePtr findOrCreate(int locationID);
+
+    /**
+     * Register the device under its current UID and location ID.
+     */
+    void add(const USBDevicePtr &device);
+
+    /**
+     * Find a device by UID. Returns nullptr for unknown UIDs.
+     */
+    USBDevicePtr find(const std::string &uid) const;
+    /**
+     * Find a device by USB location ID. Returns nullptr if no device
+     * has been registered at that location.
+     */
+    USBDevicePtr findByLocationID(int locationID) const;
+
+    size_t size() const;
+
+    /**
+     * Limit how long and how many departed devices are kept. Applied at
+     * the next full scan.
+     */
+    void setDepartedLimits(std::chrono::milliseconds maxAge, size_t maxCount);
+    RegistryStats stats() const;
+
+    /**
+     * Replace the connected devices with the result of a full scan that
+     * started at the given change token.
+     */
+    void setConnected(const std::vector<USBDevicePtr> &devices, uint64_t token);
+    /**
+     * Update the indexes after fields of a device changed. Does nothing
+     * for devices that aren't connected. Call with the update mutex held,
+     * and append the history events it collects once it is released.
+     */
+    void reindex(const USBDevicePtr &device, std::vector<HistoryEvent> &events);
+    /**
+     * The change token the connected devices are current as of. Returns
+     * false if there hasn't been a full scan yet.
+     */
+    bool connectedToken(uint64_t *token) const;
+    /**
+     * Connected devices that match the query, in no particular order.
+     */
+    std::vector<USBDevicePtr> findConnected(const DeviceQuery &query) const;
+
+    /**
+     * Guards device fields that background lookups write to, and the
+     * devices by UID and location. Hold it while reading a device that
+     * may be incomplete, but not while calling the other methods, which
+     * take it themselves.
+     */
+    std::mutex &updateMutex() { return m_updateMutex; }
+
+  private:
+    DeviceRegistry() {}
+    DeviceRegistry(const DeviceRegistry &);
+    DeviceRegistry &operator=(const DeviceRegistry &);
+
+    // What a connected device was indexed under. Also used to match
+    // queries, so devices are never read without the update mutex.
+    struct IndexKeys {
+      USBDevicePtr device;
+      std::string uid;
+      std::string serialNumber;
+      int vendorID;
+      int productID;
+      int locationID;
+      std::vector<std::string> mountPoints;
+    };
+
+    // Collects history events into events if it isn't nullptr
+    void index(const USBDevicePtr &device, std::vector<HistoryEvent> *events);
+    void unindex(const IndexKeys &keys);
+
+    struct Entry {
+      USBDevicePtr device;
+      uint64_t seenGeneration;  // Last full scan that found the device.
+      bool departed;
+      std::chrono::steady_clock::time_point departedAt;
+      std::list<std::string>::iterator departedIt;  // Into m_departed.
+    };
+
+    // Call with the update mutex held
+    void markDeparted(std::chrono::steady_clock::time_point now);
+    void evictDeparted(std::chrono::steady_clock::time_point now);
+    void erase(std::unordered_map<std::string, Entry>::iterator it);
+
+    std::unordered_map<std::string, Entry> m_devices;
+    std::unordered_map<int, USBDevicePtr> m_byLocationID;
+    uint64_t m_generation = 0;
+    // UIDs of departed devices, in the order they departed
+    std::list<std::string> m_departed;
+    std::chrono::milliseconds m_maxDepartedAge = std::chrono::hours(1);
+    size_t m_maxDeparted = 256;
+    uint64_t m_evicted = 0;
+    mutable std::mutex m_updateMutex;
+
+    // Connected devices only. Lock order is m_updateMutex, then this.
+    mutable std::mutex m_indexMutex;
+    std::unordered_map<const USBDevice *, IndexKeys> m_connected;
+    std::unordered_map<std::string, USBDevicePtr> m_byUid;
+    std::unordered_multimap<std::string, USBDevicePtr> m_bySerialNumber;
+    std::unordered_multimap<uint32_t, USBDevicePtr> m_byVendorProduct;
+    std::unordered_multimap<int, USBDevicePtr> m_byVendor;
+    std::unordered_multimap<std::string, USBDevicePtr> m_byMountPoint;
+    bool m_hasConnected = false;
+    uint64_t m_connectedToken = 0;
+  };
+}
+
+#endif // _SUBDEVIL_DEVICE_REGISTRY_H__
@@ -1,11 +1,23 @@
 #include "../subdevil.h"
 #include "../usb_common.h"
+#include "../device_registry.h"
+#include "../change_detector.h"
+#include "../device_fields.h"
+#include "../resolvers.h"
 #include "../utils.h"
+#include "../utils/lru_cache.h"
 #include "interop.h"
 
 #include <sys/param.h>
 
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <mach/mach_error.h>
 #include <mach/mach_port.h>
@@ -15,10 +27,12 @@
 #include <IOKit/IOCFPlugIn.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/storage/IOStorageDeviceCharacteristics.h>
+#include <IOKit/storage/IOMedia.h>
+#include <IOKit/serial/IOSerialKeys.h>
 
 #include <DiskArbitration/DiskArbitration.h>
 
-#include <unordered_map>
+#include <dispatch/dispatch.h>
 
 
 // The current OSX version
@@ -30,79 +44,442 @@ const char *SERVICE_MATCHER = CURRENT_SUPPORTED_VERSION < EL_CAPITAN ? "IOUSBDev
 
 namespace Subdevil
 {
-  typedef std::unordered_map<std::string, USBDevicePtr> DeviceMap;
-
-  // TODO: Remove me!
-  static DeviceMap gAllDevices;
-
   bool unmount(const std::string &uid)
   {
     USBDevicePtr usbInfo = getDevice(uid);
 
     // Only unmount if we're actually mounted
-    if (usbInfo != nullptr && !usbInfo->mountPoint.empty()) {
-      DASessionRef daSession = DASessionCreate(kCFAllocatorDefault);
-      assert(daSession != nullptr);
-
-      // Attempt to actually reference the path
-      CFURLRef volumePath = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault,
-                                                                    (const UInt8 *)usbInfo->mountPoint.c_str(),
-                                                                    usbInfo->mountPoint.size(),
-                                                                    true);
-      assert(volumePath != nullptr);
-
-      // Attempt to get a disk reference
-      DADiskRef disk = DADiskCreateFromVolumePath(kCFAllocatorDefault,
-                                                  daSession,
-                                                  volumePath);
+    if (usbInfo == nullptr || usbInfo->mountPoint.empty()) {
+      return false;
+    }
+
+    std::vector<Volume> volumes;
+    {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+      volumes = usbInfo->volumes;
+    }
+
+    DASessionRef daSession = DASessionCreate(kCFAllocatorDefault);
+    assert(daSession != nullptr);
+
+    bool unmounted = false;
+
+    for (const Volume &volume : volumes) {
+      if (volume.mountPoints.empty()) {
+        continue;
+      }
+
+      // Attempt to get a disk reference, the node is /dev/<BSD name>
+      DADiskRef disk = DADiskCreateFromBSDName(kCFAllocatorDefault,
+                                               daSession,
+                                               volume.node.c_str() + strlen("/dev/"));
 
       if (disk != nullptr)
         {
-          // Attempt to unmount the disk
+          // Attempt to actually unmount the disk
           // TODO: pass error callback and escalate error to JS.
           DADiskUnmount(disk, kDADiskUnmountOptionDefault, nullptr, NULL);
           CFRelease(disk);
 
-          // Rewrite mount as empty
-          usbInfo->mountPoint = "";
+          unmounted = true;
+        }
+    }
+
+    CFRelease(daSession);
+
+    if (unmounted) {
+      // Rewrite mounts as empty
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      for (Volume &volume : usbInfo->volumes) {
+        volume.mountPoints.clear();
+      }
+
+      usbInfo->mountPoint = "";
+    }
+
+    return unmounted;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Resolvers
+  ////////////////////////////////////////////////////////////////////////////////
+  static std::string _stringProperty(io_registry_entry_t entry, CFStringRef key)
+  {
+    std::string value;
+    CFTypeRef ref = IORegistryEntryCreateCFProperty(entry, key, kCFAllocatorDefault, kNilOptions);
+    countOSCall();
+
+    if (ref != nullptr) {
+      if (CFGetTypeID(ref) == CFStringGetTypeID())
+        value = cfStringRefToCString(static_cast<CFStringRef>(ref));
+
+      CFRelease(ref);
+    }
+
+    return value;
+  }
+
+  static int _intProperty(io_registry_entry_t entry, CFStringRef key)
+  {
+    int value = -1;
+    CFTypeRef ref = IORegistryEntryCreateCFProperty(entry, key, kCFAllocatorDefault, kNilOptions);
+    countOSCall();
+
+    if (ref != nullptr) {
+      if (CFGetTypeID(ref) == CFNumberGetTypeID())
+        CFNumberGetValue(static_cast<CFNumberRef>(ref), kCFNumberIntType, &value);
+
+      CFRelease(ref);
+    }
+
+    return value;
+  }
+
+  /**
+   * Describe the volumes with the given BSD names through one
+   * DiskArbitration session. This can block on an unresponsive disk.
+   */
+  static std::vector<Volume> _volumesForBSDNames(const std::vector<std::string> &bsdNames)
+  {
+    std::vector<Volume> volumes;
+
+    DASessionRef daSession = DASessionCreate(kCFAllocatorDefault);
+    assert(daSession != nullptr);
+
+    for (const std::string &bsdName : bsdNames) {
+      Volume volume;
+      volume.node = "/dev/" + bsdName;
+
+      CORE_DEBUG("Creating disk interface for " + volume.node);
+
+      DADiskRef disk = DADiskCreateFromBSDName(kCFAllocatorDefault,
+                                               daSession, bsdName.c_str());
+      countOSCall();
+
+      if (disk == nullptr) {
+        continue;
+      }
+
+      CFDictionaryRef desc = DADiskCopyDescription(disk);
+      countOSCall();
 
-          return true;
+      if (desc != nullptr) {
+        CFURLRef url    = static_cast<CFURLRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumePathKey));
+        CFStringRef name = static_cast<CFStringRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumeNameKey));
+        CFUUIDRef uuid  = static_cast<CFUUIDRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumeUUIDKey));
+
+        char volumePath[MAXPATHLEN];
+
+        if(url == nullptr)
+        {
+          CORE_DEBUG("Disk has no volume path.");
+        }
+        else if(!CFURLGetFileSystemRepresentation(url, true, (UInt8*) volumePath, MAXPATHLEN))
+        {
+          CORE_ERROR("Could not get the file system representation of the volume path.");
+        }
+        else if(strlen(volumePath))
+        {
+          volume.mountPoints.push_back(volumePath);
+
+          CORE_INFO("Found volume path: " + volume.mountPoints.back());
         }
 
-      CFRelease(volumePath);
-      CFRelease(daSession);
+        if (name != nullptr) {
+          volume.label = cfStringRefToCString(name);
+        }
+
+        if (uuid != nullptr) {
+          CFStringRef uuidString = CFUUIDCreateString(kCFAllocatorDefault, uuid);
+          volume.uuid = cfStringRefToCString(uuidString);
+          CFRelease(uuidString);
+        }
+
+        CFRelease(desc);
+      }
+
+      CFRelease(disk);
+
+      volumes.push_back(volume);
     }
 
-    return false;
+    CFRelease(daSession);
+
+    return volumes;
   }
 
-  USBDevicePtr getDevice(const std::string &uid)
+  /**
+   * The BSD names of the leaf media below the USB device: its partitions,
+   * or the whole disk when it isn't partitioned.
+   */
+  static std::vector<std::string> _partitionBSDNames(io_service_t usbService)
   {
-    return gAllDevices[uid];
+    Utils::TraceSpan span("findPartitions");
+
+    std::vector<std::string> bsdNames;
+
+    io_iterator_t iter;
+    kern_return_t kr = IORegistryEntryCreateIterator(usbService, kIOServicePlane,
+                                                     kIORegistryIterateRecursively, &iter);
+    countOSCall();
+
+    if (kr != kIOReturnSuccess) {
+      CORE_ERROR("IORegistryEntryCreateIterator() failed: " + std::string(mach_error_string(kr)));
+      return bsdNames;
+    }
+
+    io_registry_entry_t entry;
+
+    while ((entry = IOIteratorNext(iter)) != 0) {
+      countOSCall(2);
+
+      if (IOObjectConformsTo(entry, kIOMediaClass)) {
+        CFTypeRef leaf = IORegistryEntryCreateCFProperty(entry, CFSTR(kIOMediaLeafKey),
+                                                         kCFAllocatorDefault, kNilOptions);
+        countOSCall();
+
+        if (leaf == kCFBooleanTrue) {
+          std::string bsdName = _stringProperty(entry, CFSTR(kIOBSDNameKey));
+
+          if (!bsdName.empty())
+            bsdNames.push_back(bsdName);
+        }
+
+        if (leaf != nullptr)
+          CFRelease(leaf);
+      }
+
+      IOObjectRelease(entry);
+    }
+
+    IOObjectRelease(iter);
+
+    return bsdNames;
   }
 
-  static USBDevicePtr _findDeviceByLocationID(const DeviceMap &map, int locationID)
+  /**
+   * The registry entry ID of the closest USB device above an entry, or 0.
+   */
+  static uint64_t _usbDeviceAbove(io_registry_entry_t entry)
   {
-    for(auto it = map.begin(); it != map.end(); ++it) {
-      auto device = it->second;
+    uint64_t entryID = 0;
+
+    IOObjectRetain(entry);
+
+    while (entryID == 0) {
+      io_registry_entry_t parent;
+
+      countOSCall(2);
 
-      if(device->locationID == locationID) {
-        return device;
+      if (IORegistryEntryGetParentEntry(entry, kIOServicePlane, &parent) != kIOReturnSuccess)
+        break;
+
+      IOObjectRelease(entry);
+      entry = parent;
+
+      if (IOObjectConformsTo(entry, SERVICE_MATCHER)) {
+        countOSCall();
+        IORegistryEntryGetRegistryEntryID(entry, &entryID);
       }
     }
 
-    return nullptr;
+    IOObjectRelease(entry);
+
+    return entryID;
+  }
+
+  /**
+   * The leaf media of every USB device, indexed by the registry entry ID
+   * of the device. Built with one matching query for all leaf media the
+   * first time a device asks for its partitions, so devices without media
+   * cost nothing and the registry below each device isn't walked.
+   */
+  class MediaIndex
+  {
+  public:
+    /**
+     * Get the BSD names of the leaf media below the device, in partition
+     * order. Returns false if the index couldn't be built.
+     */
+    bool bsdNames(io_service_t usbService, std::vector<std::string> &bsdNames)
+    {
+      std::call_once(m_built, &MediaIndex::build, this);
+
+      if (!m_ok)
+        return false;
+
+      uint64_t entryID = 0;
+
+      countOSCall();
+
+      if (IORegistryEntryGetRegistryEntryID(usbService, &entryID) != kIOReturnSuccess)
+        return false;
+
+      auto it = m_byDevice.find(entryID);
+
+      if (it != m_byDevice.end())
+        bsdNames = it->second;
+
+      return true;
+    }
+
+  private:
+    void build()
+    {
+      Utils::TraceSpan span("buildMediaIndex");
+
+      CFMutableDictionaryRef matching = IOServiceMatching(kIOMediaClass);
+
+      assert(matching != nullptr);
+
+      CFDictionarySetValue(matching, CFSTR(kIOMediaLeafKey), kCFBooleanTrue);
+
+      io_iterator_t iter;
+
+      // Consumes the matching dictionary
+      kern_return_t kr = IOServiceGetMatchingServices(kIOMasterPortDefault, matching, &iter);
+      countOSCall();
+
+      if (kr != kIOReturnSuccess) {
+        CORE_ERROR("IOServiceGetMatchingServices() failed: " + std::string(mach_error_string(kr)));
+        return;
+      }
+
+      io_service_t media;
+
+      while ((media = IOIteratorNext(iter)) != 0) {
+        countOSCall();
+
+        std::string bsdName = _stringProperty(media, CFSTR(kIOBSDNameKey));
+        uint64_t deviceID = bsdName.empty() ? 0 : _usbDeviceAbove(media);
+
+        if (deviceID != 0)
+          m_byDevice[deviceID].push_back(bsdName);
+
+        IOObjectRelease(media);
+      }
+
+      IOObjectRelease(iter);
+
+      // disk2s2 before disk2s10
+      for (auto &device : m_byDevice) {
+        std::sort(device.second.begin(), device.second.end(),
+                  [](const std::string &a, const std::string &b) {
+                    return a.size() != b.size() ? a.size() < b.size() : a < b;
+                  });
+      }
+
+      m_ok = true;
+    }
+
+    std::once_flag m_built;
+    bool m_ok = false;
+    std::unordered_map<uint64_t, std::vector<std::string>> m_byDevice;
+  };
+
+  /**
+   * Run the pending resolvers in a single pass over the children of the
+   * USB device. Interfaces are visited before the nodes created for them,
+   * so resolvers only look for nodes once an interface of a matching
+   * class has been seen.
+   */
+  static ResolvedNodes _resolveNodes(io_service_t usbService, const std::string &uid, unsigned pending)
+  {
+    Utils::TraceSpan span("resolveNodes");
+    span.setUid(uid);
+
+    unsigned applicable = resolversForClass(_intProperty(usbService, CFSTR(kUSBDeviceClass)));
+    unsigned found = 0;
+    ResolvedNodes nodes;
+
+    io_iterator_t iter;
+    kern_return_t kr = IORegistryEntryCreateIterator(usbService, kIOServicePlane,
+                                                     kIORegistryIterateRecursively, &iter);
+    countOSCall();
+
+    if (kr != kIOReturnSuccess) {
+      CORE_ERROR("IORegistryEntryCreateIterator() failed: " + std::string(mach_error_string(kr)));
+      return nodes;
+    }
+
+    io_registry_entry_t entry;
+
+    while ((entry = IOIteratorNext(iter)) != 0 && found != pending) {
+      unsigned wanted = pending & applicable & ~found;
+
+      countOSCall(2);
+
+      if (IOObjectConformsTo(entry, "IOUSBHostInterface") || IOObjectConformsTo(entry, "IOUSBInterface")) {
+        applicable |= resolversForClass(_intProperty(entry, CFSTR(kUSBInterfaceClass)));
+      }
+      else if ((wanted & RESOLVE_TTY) && IOObjectConformsTo(entry, kIOSerialBSDServiceValue)) {
+        setResolved(nodes, RESOLVE_TTY, _stringProperty(entry, CFSTR(kIOCalloutDeviceKey)));
+        found |= RESOLVE_TTY;
+      }
+      else if ((wanted & RESOLVE_HIDRAW) && IOObjectConformsTo(entry, "IOHIDDevice")) {
+        // There are no raw HID nodes, IOHIDDevice is opened by its registry path
+        io_string_t path;
+
+        if (IORegistryEntryGetPath(entry, kIOServicePlane, path) == kIOReturnSuccess) {
+          setResolved(nodes, RESOLVE_HIDRAW, path);
+          found |= RESOLVE_HIDRAW;
+        }
+      }
+      else if ((wanted & RESOLVE_BLOCK) && IOObjectConformsTo(entry, kIOMediaClass)) {
+        CFTypeRef whole = IORegistryEntryCreateCFProperty(entry, CFSTR(kIOMediaWholeKey),
+                                                          kCFAllocatorDefault, kNilOptions);
+
+        if (whole == kCFBooleanTrue) {
+          setResolved(nodes, RESOLVE_BLOCK, "/dev/" + _stringProperty(entry, CFSTR(kIOBSDNameKey)));
+          found |= RESOLVE_BLOCK;
+        }
+
+        if (whole != nullptr)
+          CFRelease(whole);
+      }
+
+      IOObjectRelease(entry);
+    }
+
+    if (entry != 0)
+      IOObjectRelease(entry);
+
+    IOObjectRelease(iter);
+
+    // Cache the absence of nodes the device can't have. Nodes of a
+    // matching class may still be attaching, so those are retried.
+    unsigned missing = pending & ~applicable;
+
+    if (missing & RESOLVE_TTY)
+      setResolved(nodes, RESOLVE_TTY, "");
+    if (missing & RESOLVE_HIDRAW)
+      setResolved(nodes, RESOLVE_HIDRAW, "");
+    if (missing & RESOLVE_BLOCK)
+      setResolved(nodes, RESOLVE_BLOCK, "");
+
+    return nodes;
   }
 
   // TODO: Make this referentialy transparent, in the way that it
-  // TODO: doesn't modify gAllDevices.
-  static USBDevicePtr usbServiceObject(io_service_t usbService)
+  // TODO: doesn't modify the device registry.
+  static USBDevicePtr usbServiceObject(io_service_t usbService, const ScanOptions &options,
+                                       std::chrono::steady_clock::time_point deadline,
+                                       MediaIndex *mediaIndex)
   {
+    Utils::TraceSpan span("extractDevice");
+
     CFMutableDictionaryRef properties;
-    kern_return_t kr = IORegistryEntryCreateCFProperties(usbService,
-                                                         &properties,
-                                                         kCFAllocatorDefault,
-                                                         kNilOptions);
+    kern_return_t kr;
+    {
+      Utils::TraceSpan readSpan("readProperties");
+
+      kr = IORegistryEntryCreateCFProperties(usbService,
+                                             &properties,
+                                             kCFAllocatorDefault,
+                                             kNilOptions);
+      countOSCall();
+    }
 
     CORE_DEBUG("Creating kernel interface...");
 
@@ -116,86 +493,204 @@ namespace Subdevil
 
     CORE_DEBUG("Received location ID: " + std::to_string(locationID));
 
-    // Attempt to receive the device
-    USBDevicePtr usbInfo = _findDeviceByLocationID(gAllDevices, locationID);
+    // Attempt to receive the device, or create a new one. Other scans
+    // get the same one for this location.
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    USBDevicePtr usbInfo = registry.findOrCreate(locationID);
 
-    if (usbInfo == nullptr) {
-      CORE_DEBUG("USB device not found, creating a new one...");
-      // We don't have one, so create a new one
-      usbInfo = USBDevicePtr(new USBDevice);
-    }
-
-    usbInfo->locationID    = locationID;
-    usbInfo->vendorID      = PROP_VAL_INT(properties, kUSBVendorID);
-    usbInfo->productID     = PROP_VAL_INT(properties, kUSBProductID);
-    usbInfo->serialNumber  = PROP_VAL_STR(properties, kUSBSerialNumberString);
-    usbInfo->product       = PROP_VAL_STR(properties, kUSBProductString);
-    usbInfo->vendor        = PROP_VAL_STR(properties, kUSBVendorString);
-    usbInfo->uid           = uniqueDeviceID(usbInfo);
+    USBDevice descriptor = USBDevice();
+    descriptor.locationID   = locationID;
+    descriptor.vendorID     = PROP_VAL_INT(properties, kUSBVendorID);
+    descriptor.productID    = PROP_VAL_INT(properties, kUSBProductID);
+    descriptor.serialNumber = PROP_VAL_STR(properties, kUSBSerialNumberString);
+    descriptor.product      = PROP_VAL_STR(properties, kUSBProductString);
+    descriptor.vendor       = PROP_VAL_STR(properties, kUSBVendorString);
 
     CFRelease(properties);
 
-    // Register in storage
-    gAllDevices[usbInfo->uid] = usbInfo;
+    io_string_t registryPath;
 
-    CORE_DEBUG("Attempting to access BSD name...");
+    countOSCall();
 
-    CFStringRef bsdName = (CFStringRef)IORegistryEntrySearchCFProperty(usbService,
-                                                                       kIOServicePlane,
-                                                                       CFSTR(kIOBSDNameKey),
-                                                                       kCFAllocatorDefault,
-                                                                       kIORegistryIterateRecursively);
-    if (bsdName != nullptr) {
-      char bsdNameBuf[4096];
-      sprintf( bsdNameBuf, "/dev/%ss1", cfStringRefToCString(bsdName));
-      char* bsdNameC = &bsdNameBuf[0];
+    bool hasPath = IORegistryEntryGetPath(usbService, kIOServicePlane, registryPath) == kIOReturnSuccess;
 
-      CORE_INFO("Found BSD Name: " + std::string(bsdNameC));
+    if (hasPath)
+      descriptor.devicePath = registryPath;
 
-      DASessionRef daSession = DASessionCreate(kCFAllocatorDefault);
-      assert(daSession != nullptr);
+    std::string uid;
 
-      CORE_DEBUG("Creating disk interface..");
+    {
+      // Late lookups of an earlier scan may be reindexing the device
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
 
-      DADiskRef disk = DADiskCreateFromBSDName(kCFAllocatorDefault,
-                                               daSession, bsdNameC);
+      // Keep the path the device was found through before
+      if (!hasPath)
+        descriptor.devicePath = usbInfo->devicePath;
 
-      if (disk != nullptr) {
-        CORE_DEBUG("Creating description...");
+      copyDescriptorFields(descriptor, *usbInfo);
+      usbInfo->uid = uniqueDeviceID(usbInfo);
 
-        CFDictionaryRef desc = DADiskCopyDescription(disk);
+      uid = usbInfo->uid;
+    }
 
-        if (desc != nullptr) {
-          CFURLRef url    = static_cast<CFURLRef>(CFDictionaryGetValue(desc, kDADiskDescriptionVolumePathKey));
+    span.setUid(uid);
 
-          char volumePath[MAXPATHLEN];
+    // Register in storage
+    registry.add(usbInfo);
 
-          if(!CFURLGetFileSystemRepresentation(url, true, (UInt8*) volumePath, MAXPATHLEN))
-          {
-            CORE_ERROR("Could not get the file system representation of the volume path.");
-          }
-          else if(strlen(volumePath))
-          {
-              usbInfo->mountPoint = volumePath;
+    if (options.resolve != 0) {
+      // Registry entry IDs aren't reused, a re-plugged device gets a new one
+      uint64_t entryID = 0;
+      IORegistryEntryGetRegistryEntryID(usbService, &entryID);
+      countOSCall();
 
-              CORE_INFO("Found volume path: " + std::string(volumePath));
-          }
+      unsigned pending;
+      {
+        std::lock_guard<std::mutex> lock(registry.updateMutex());
+        pending = pendingResolvers(*usbInfo, options.resolve, entryID);
+      }
 
-          CFRelease(desc);
-        }
+      if (pending != 0) {
+        // The device is registered already, so the results are stored
+        // under the lock like the other fields
+        ResolvedNodes nodes = _resolveNodes(usbService, uid, pending);
 
-        CFRelease(disk);
-        CFRelease(daSession);
+        std::lock_guard<std::mutex> lock(registry.updateMutex());
+        storeResolved(*usbInfo, entryID, nodes);
       }
     }
 
+    CORE_DEBUG("Looking for partitions...");
+
+    std::vector<std::string> bsdNames;
+
+    if (mediaIndex == nullptr || !mediaIndex->bsdNames(usbService, bsdNames))
+      bsdNames = _partitionBSDNames(usbService);
+
+    if (!bsdNames.empty()) {
+      runSlowLookup(usbInfo, [bsdNames, uid]() {
+          Utils::TraceSpan span("resolveMount");
+          span.setUid(uid);
+
+          std::vector<Volume> volumes = _volumesForBSDNames(bsdNames);
+
+          return DeviceUpdate([volumes](USBDevice &device) {
+              device.volumes    = volumes;
+              device.mountPoint = firstMountPoint(volumes);
+            });
+        }, deadline);
+    }
+
     return usbInfo;
   }
 
-  std::vector<USBDevicePtr> getDevices()
+  ////////////////////////////////////////////////////////////////////////////////
+  // Handle cache
+  ////////////////////////////////////////////////////////////////////////////////
+  /**
+   * A reference to the registry entry of a known device, released once
+   * it's evicted and no refresh is using it anymore.
+   */
+  class ServiceHandle
+  {
+  public:
+    // Takes over the reference to the entry
+    explicit ServiceHandle(io_service_t service) : m_service(service), m_entryID(0)
+    {
+      IORegistryEntryGetRegistryEntryID(service, &m_entryID);
+      countOSCall();
+    }
+
+    ~ServiceHandle() { IOObjectRelease(m_service); }
+
+    io_service_t service() const { return m_service; }
+    uint64_t entryID() const { return m_entryID; }
+
+  private:
+    ServiceHandle(const ServiceHandle &);
+    ServiceHandle &operator=(const ServiceHandle &);
+
+    io_service_t m_service;
+    uint64_t m_entryID;
+  };
+
+  typedef std::shared_ptr<ServiceHandle> ServiceHandlePtr;
+
+  // By registry path
+  static Utils::LruCache<std::string, ServiceHandlePtr> &_serviceCache()
+  {
+    static Utils::LruCache<std::string, ServiceHandlePtr> cache(64);
+    return cache;
+  }
+
+  void setHandleBudget(size_t handles)
+  {
+    _serviceCache().setCapacity(handles);
+  }
+
+  USBDevicePtr refreshDevice(const USBDevicePtr &device, std::chrono::steady_clock::time_point deadline)
   {
+    Utils::LruCache<std::string, ServiceHandlePtr> &cache = _serviceCache();
+    std::string path;
+    ServiceHandlePtr handle;
+
+    // Run the resolvers that ran for the device before
+    ScanOptions options;
+    {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      path = device->devicePath;
+      options.resolve = device->resolved;
+    }
+
+    // Entries leave the service plane when the device is unplugged, even
+    // if the termination notification hasn't been handled yet
+    if (cache.get(path, &handle)) {
+      countOSCall();
+
+      if (!IORegistryEntryInPlane(handle->service(), kIOServicePlane)) {
+        cache.erase(path);
+        handle = nullptr;
+      }
+    }
+
+    if (handle == nullptr) {
+      // Registry paths are made of the ports the device hangs off, the
+      // entry is gone once it's unplugged
+      io_registry_entry_t usbService = IORegistryEntryFromPath(kIOMasterPortDefault, path.c_str());
+      countOSCall();
+
+      if (usbService == MACH_PORT_NULL) {
+        return nullptr;
+      }
+
+      handle = std::make_shared<ServiceHandle>(usbService);
+    }
+
+    // Without the media index, so only this device's partitions are looked up
+    USBDevicePtr usbInfo = usbServiceObject(handle->service(), options, deadline, nullptr);
+
+    if (usbInfo != nullptr && usbInfo->devicePath == path)
+      cache.put(path, handle);
+    else
+      cache.erase(path);
+
+    return usbInfo;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Scanning
+  ////////////////////////////////////////////////////////////////////////////////
+  struct DeviceScanner::Impl {
     mach_port_t masterPort;
-    kern_return_t kr = IOMasterPort(MACH_PORT_NULL, &masterPort);
+    io_iterator_t iter;
+    MediaIndex mediaIndex;
+  };
+
+  DeviceScanner::DeviceScanner(const ScanOptions &options)
+    : m_pImpl(new Impl()), m_options(options)
+  {
+    kern_return_t kr = IOMasterPort(MACH_PORT_NULL, &m_pImpl->masterPort);
 
     assert(kr == kIOReturnSuccess);
 
@@ -203,41 +698,143 @@ namespace Subdevil
 
     assert(usbMatching != nullptr);
 
-    std::vector<USBDevicePtr> devices;
-
-    io_iterator_t iter = 0;
     kr = IOServiceGetMatchingServices(kIOMasterPortDefault,
                                       usbMatching,
-                                      &iter);
+                                      &m_pImpl->iter);
 
-    if (kr != kIOReturnSuccess)
-      {
-        CORE_ERROR("IOServiceGetMatchingServices() failed: %s" + std::string(mach_error_string(kr)));
-      }
-    else
-      {
-        io_service_t usbService;
+    if (kr != kIOReturnSuccess) {
+      CORE_ERROR("IOServiceGetMatchingServices() failed: " + std::string(mach_error_string(kr)));
+
+      m_pImpl->iter = 0;
+    }
+  }
 
-        while ((usbService = IOIteratorNext(iter)) != 0) {
-          CORE_DEBUG("IOIteratorNext found USB device");
+  DeviceScanner::~DeviceScanner()
+  {
+    close();
+  }
+
+  USBDevicePtr DeviceScanner::fetch()
+  {
+    if (m_pImpl->iter == 0)
+      return nullptr;
 
-          USBDevicePtr usbInfo = usbServiceObject(usbService);
+    io_service_t usbService;
 
-          if (usbInfo != nullptr) {
-            CORE_DEBUG("Adding USB info to cache");
-            devices.push_back(usbInfo);
-          }
+    while ((usbService = IOIteratorNext(m_pImpl->iter)) != 0) {
+      CORE_DEBUG("IOIteratorNext found USB device");
+      countOSCall();
 
-          CORE_DEBUG("Releasing USB service resources");
-          IOObjectRelease(usbService);
-        }
+      MediaIndex *mediaIndex = options().batchReads ? &m_pImpl->mediaIndex : nullptr;
+      USBDevicePtr usbInfo = usbServiceObject(usbService, options(), deadline(), mediaIndex);
+
+      CORE_DEBUG("Releasing USB service resources");
+      IOObjectRelease(usbService);
+
+      if (usbInfo != nullptr) {
+        return usbInfo;
       }
+    }
+
+    return nullptr;
+  }
 
+  void DeviceScanner::release()
+  {
+    if (m_pImpl->iter != 0) {
+      IOObjectRelease(m_pImpl->iter);
+    }
 
     CORE_DEBUG("Deallocating master port");
-    mach_port_deallocate(mach_task_self(), masterPort);
+    mach_port_deallocate(mach_task_self(), m_pImpl->masterPort);
+  }
 
-    return devices;
+  ////////////////////////////////////////////////////////////////////////////////
+  // Change detection
+  ////////////////////////////////////////////////////////////////////////////////
+  static void _onServiceChange(void *refCon, io_iterator_t iter)
+  {
+    bool terminated = strcmp(static_cast<const char *>(refCon), kIOTerminatedNotification) == 0;
+    std::unordered_set<uint64_t> entryIDs;
+    io_service_t service;
+
+    // Drain the iterator to re-arm the notification
+    while ((service = IOIteratorNext(iter)) != 0) {
+      uint64_t entryID = 0;
+
+      if (terminated && IORegistryEntryGetRegistryEntryID(service, &entryID) == kIOReturnSuccess)
+        entryIDs.insert(entryID);
+
+      IOObjectRelease(service);
+    }
+
+    // Close the handles of unplugged devices right away
+    if (!entryIDs.empty()) {
+      _serviceCache().eraseIf([&entryIDs](const std::string &, const ServiceHandlePtr &handle) {
+          return entryIDs.count(handle->entryID()) > 0;
+        });
+    }
+
+    ChangeDetector::instance().notify();
+  }
+
+  static void _onDiskChange(DADiskRef disk, void *context)
+  {
+    ChangeDetector::instance().notify();
+  }
+
+  static void _onDiskDescriptionChange(DADiskRef disk, CFArrayRef keys, void *context)
+  {
+    ChangeDetector::instance().notify();
   }
 
+  bool ChangeDetector::start()
+  {
+    // Notifications are delivered on this queue for the life of the process
+    dispatch_queue_t queue = dispatch_queue_create("subdevil.changes", DISPATCH_QUEUE_SERIAL);
+
+    IONotificationPortRef port = IONotificationPortCreate(kIOMasterPortDefault);
+
+    if (port == nullptr) {
+      CORE_ERROR("IONotificationPortCreate() failed");
+      return false;
+    }
+
+    IONotificationPortSetDispatchQueue(port, queue);
+
+    const char *notifications[] = { kIOFirstMatchNotification, kIOTerminatedNotification };
+
+    for (const char *notification : notifications) {
+      io_iterator_t iter = 0;
+      // Consumed by IOServiceAddMatchingNotification
+      CFDictionaryRef matching = IOServiceMatching(SERVICE_MATCHER);
+
+      kern_return_t kr = IOServiceAddMatchingNotification(port, notification, matching,
+                                                          _onServiceChange,
+                                                          const_cast<char *>(notification), &iter);
+
+      if (kr != kIOReturnSuccess) {
+        CORE_ERROR("IOServiceAddMatchingNotification() failed: " + std::string(mach_error_string(kr)));
+        return false;
+      }
+
+      _onServiceChange(const_cast<char *>(notification), iter);
+    }
+
+    // Mounts and unmounts show up as volume path changes
+    DASessionRef daSession = DASessionCreate(kCFAllocatorDefault);
+
+    if (daSession == nullptr) {
+      CORE_ERROR("DASessionCreate() failed");
+      return false;
+    }
+
+    DARegisterDiskAppearedCallback(daSession, nullptr, _onDiskChange, nullptr);
+    DARegisterDiskDisappearedCallback(daSession, nullptr, _onDiskChange, nullptr);
+    DARegisterDiskDescriptionChangedCallback(daSession, nullptr, kDADiskDescriptionWatchVolumePath,
+                                             _onDiskDescriptionChange, nullptr);
+    DASessionSetDispatchQueue(daSession, queue);
+
+    return true;
+  }
 }
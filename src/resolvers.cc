@@ -0,0 +1,102 @@
+#include "resolvers.h"
+
+namespace Subdevil
+{
+  // USB class codes, see http://www.usb.org/developers/defined_class
+  const int CLASS_CDC             = 0x02;
+  const int CLASS_HID             = 0x03;
+  const int CLASS_MASS_STORAGE    = 0x08;
+  const int CLASS_CDC_DATA        = 0x0A;
+  const int CLASS_VENDOR_SPECIFIC = 0xFF;
+
+  unsigned resolverFromName(const std::string &name)
+  {
+    if (name == "tty")
+      return RESOLVE_TTY;
+    if (name == "hidraw")
+      return RESOLVE_HIDRAW;
+    if (name == "block")
+      return RESOLVE_BLOCK;
+
+    return 0;
+  }
+
+  unsigned resolversForClass(int usbClass)
+  {
+    switch (usbClass) {
+    case CLASS_CDC:
+    case CLASS_CDC_DATA:
+      return RESOLVE_TTY;
+    case CLASS_HID:
+      return RESOLVE_HIDRAW;
+    case CLASS_MASS_STORAGE:
+      return RESOLVE_BLOCK;
+    case CLASS_VENDOR_SPECIFIC:
+      // FTDI, CP210x and friends use their own class for serial ports
+      return RESOLVE_TTY;
+    default:
+      return 0;
+    }
+  }
+
+  unsigned pendingResolvers(USBDevice &device, unsigned requested, uint64_t sessionID)
+  {
+    if (sessionID == 0 || sessionID != device.sessionID) {
+      device.ttyPath.clear();
+      device.hidPath.clear();
+      device.blockPath.clear();
+      device.resolved  = 0;
+      device.sessionID = sessionID;
+      device.liveFields &= ~LIVE_BLOCK;
+    }
+
+    return requested & ~device.resolved;
+  }
+
+  void setResolved(USBDevice &device, Resolver resolver, const std::string &path)
+  {
+    switch (resolver) {
+    case RESOLVE_TTY:
+      device.ttyPath = path;
+      break;
+    case RESOLVE_HIDRAW:
+      device.hidPath = path;
+      break;
+    case RESOLVE_BLOCK:
+      device.blockPath = path;
+      break;
+    }
+
+    device.resolved |= resolver;
+  }
+
+  void setResolved(ResolvedNodes &nodes, Resolver resolver, const std::string &path)
+  {
+    switch (resolver) {
+    case RESOLVE_TTY:
+      nodes.ttyPath = path;
+      break;
+    case RESOLVE_HIDRAW:
+      nodes.hidPath = path;
+      break;
+    case RESOLVE_BLOCK:
+      nodes.blockPath = path;
+      break;
+    }
+
+    nodes.resolved |= resolver;
+  }
+
+  void storeResolved(USBDevice &device, uint64_t sessionID, const ResolvedNodes &nodes)
+  {
+    if (sessionID != device.sessionID)
+      return;
+
+    if (nodes.resolved & RESOLVE_TTY)
+      setResolved(device, RESOLVE_TTY, nodes.ttyPath);
+    if (nodes.resolved & RESOLVE_HIDRAW)
+      setResolved(device, RESOLVE_HIDRAW, nodes.hidPath);
+    if (nodes.resolved & RESOLVE_BLOCK)
+      setResolved(device, RESOLVE_BLOCK, nodes.blockPath);
+  }
+}
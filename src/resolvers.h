@@ -0,0 +1,68 @@
+#ifndef _SUBDEVIL_RESOLVERS_H__
+#define _SUBDEVIL_RESOLVERS_H__
+
+#include "subdevil.h"
+
+#include <stdint.h>
+#include <string>
+
+namespace Subdevil
+{
+  /**
+   * Class specific lookups of the nodes a device can be opened through.
+   * Combined as a bitmask in ScanOptions::resolve.
+   */
+  enum Resolver {
+    RESOLVE_TTY    = 1 << 0,  // Serial port of CDC ACM devices and USB serial adapters
+    RESOLVE_HIDRAW = 1 << 1,  // Raw HID node
+    RESOLVE_BLOCK  = 1 << 2,  // Whole disk block device
+  };
+
+  /**
+   * The resolver with the given name ("tty", "hidraw" or "block"),
+   * or 0 for an unknown name.
+   */
+  unsigned resolverFromName(const std::string &name);
+
+  /**
+   * The resolvers that apply to a USB device or interface class.
+   */
+  unsigned resolversForClass(int usbClass);
+
+  /**
+   * Resolver results collected without touching the device, which
+   * other threads may be reading.
+   */
+  typedef struct ResolvedNodes {
+    unsigned resolved = 0;  // Resolvers with a result, see setResolved().
+    std::string ttyPath;
+    std::string hidPath;
+    std::string blockPath;
+  } ResolvedNodes;
+
+  /**
+   * The requested resolvers that still have to run for the device.
+   * Results are cached per device and dropped once the session ID
+   * changes, which happens when the device is re-plugged. A session
+   * ID of 0 means the backend can't tell, so nothing is cached.
+   * Call with the update mutex held.
+   */
+  unsigned pendingResolvers(USBDevice &device, unsigned requested, uint64_t sessionID);
+
+  /**
+   * Store the result of a resolver. An empty path is cached as well,
+   * so devices without a matching node aren't resolved again. Call with
+   * the update mutex held.
+   */
+  void setResolved(USBDevice &device, Resolver resolver, const std::string &path);
+  void setResolved(ResolvedNodes &nodes, Resolver resolver, const std::string &path);
+
+  /**
+   * Store the results of resolvers run for the given session. Results
+   * for a device that has been re-plugged since are dropped. Call with
+   * the update mutex held.
+   */
+  void storeResolved(USBDevice &device, uint64_t sessionID, const ResolvedNodes &nodes);
+}
+
+#endif // _SUBDEVIL_RESOLVERS_H__
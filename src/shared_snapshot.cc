@@ -0,0 +1,370 @@
+#include "shared_snapshot.h"
+#include "change_detector.h"
+#include "device_fields.h"
+#include "device_registry.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const uint32_t SNAPSHOT_MAGIC = 0x53445348; // "SDSH"
+static const uint32_t SNAPSHOT_VERSION = 2;
+// Bytes of serialized devices. No more than the records of version 1
+// took, so segments created by it are still large enough.
+static const uint32_t SNAPSHOT_CAPACITY = 176 * 1024;
+// Reader retries while a write is in progress before giving up
+static const int READ_RETRIES = 10000;
+
+namespace Subdevil
+{
+  // Devices are stored the way serializeDevice() writes them, followed
+  // by the fields it leaves out because they aren't content, so readers
+  // see everything a local scan reports
+  struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;                    // Size of data.
+    std::atomic<uint32_t> sequence;       // Odd while the publisher is writing.
+    std::atomic<int32_t> publisherPid;    // 0 if nobody publishes.
+    std::atomic<int64_t> heartbeatMs;     // Publisher's last tick, on the steady clock.
+    uint32_t deviceCount;
+    uint32_t dataSize;
+    char data[1];
+  };
+
+  static void _serializeState(const USBDevice &device, std::string &out)
+  {
+    uint32_t liveFields = device.liveFields;
+
+    out.push_back(device.incomplete ? 1 : 0);
+    out.append(reinterpret_cast<const char *>(&liveFields), sizeof(liveFields));
+  }
+
+  static bool _deserializeState(const std::string &data, size_t *offset, USBDevice &device)
+  {
+    uint32_t liveFields;
+
+    if (data.size() - *offset < 1 + sizeof(liveFields))
+      return false;
+
+    device.incomplete = data[*offset] != 0;
+    memcpy(&liveFields, data.data() + *offset + 1, sizeof(liveFields));
+    device.liveFields = liveFields;
+
+    *offset += 1 + sizeof(liveFields);
+
+    return true;
+  }
+
+  static int64_t _nowMs()
+  {
+    using namespace std::chrono;
+
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Whether the segment was written in the layout of this build
+  static bool _isCurrent(const SnapshotHeader *header)
+  {
+    return header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION &&
+      header->capacity <= SNAPSHOT_CAPACITY;
+  }
+
+  SharedSnapshot::SharedSnapshot()
+    : m_pHeader(nullptr), m_size(0), m_publisher(false), m_changeToken(0),
+      m_heartbeatTimeout(std::chrono::milliseconds::zero())
+  {
+  }
+
+#ifdef _WIN32
+  bool SharedSnapshot::open(const std::string &name, std::chrono::milliseconds heartbeatTimeout)
+  {
+    CORE_WARNING("Shared snapshots are not supported on Windows");
+    return false;
+  }
+
+  void SharedSnapshot::close()
+  {
+  }
+
+  bool SharedSnapshot::publisherAlive() const
+  {
+    return false;
+  }
+#else
+  bool SharedSnapshot::open(const std::string &name, std::chrono::milliseconds heartbeatTimeout)
+  {
+    close();
+
+    // OSX limits shared memory names to 31 characters
+    std::string shmName = ("/subdevil-" + name).substr(0, 31);
+    size_t size = offsetof(SnapshotHeader, data) + SNAPSHOT_CAPACITY;
+
+    int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT, 0600);
+
+    if (fd < 0) {
+      CORE_ERROR("shm_open() failed for " + shmName + ": " + strerror(errno));
+      return false;
+    }
+
+    struct stat st;
+
+    // Only the creator sizes the segment; OSX refuses to resize it again
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size == 0 && ftruncate(fd, static_cast<off_t>(size)) != 0) ||
+        (st.st_size != 0 && static_cast<size_t>(st.st_size) < size)) {
+      CORE_ERROR("Failed to size shared snapshot " + shmName + ": " + strerror(errno));
+      ::close(fd);
+      return false;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+      CORE_ERROR("Failed to map shared snapshot " + shmName + ": " + strerror(errno));
+      return false;
+    }
+
+    m_pHeader = static_cast<SnapshotHeader *>(data);
+    m_size = size;
+    m_heartbeatTimeout = heartbeatTimeout;
+
+    CORE_DEBUG("Opened shared snapshot " + shmName);
+
+    tick();
+
+    return true;
+  }
+
+  void SharedSnapshot::close()
+  {
+    if (m_pHeader == nullptr)
+      return;
+
+    if (m_publisher) {
+      // Let the next reader take over right away
+      int32_t pid = getpid();
+      m_pHeader->publisherPid.compare_exchange_strong(pid, 0);
+    }
+
+    munmap(m_pHeader, m_size);
+
+    m_pHeader = nullptr;
+    m_size = 0;
+    m_publisher = false;
+  }
+
+  bool SharedSnapshot::publisherAlive() const
+  {
+    int32_t pid = m_pHeader->publisherPid.load();
+
+    if (pid == 0)
+      return false;
+
+    // The heartbeat check stays on the read path; only look at the
+    // process once the heartbeat is stale.
+    if (_nowMs() - m_pHeader->heartbeatMs.load() <= m_heartbeatTimeout.count())
+      return true;
+
+    // A publisher that is only slow may still be writing, and two writers
+    // would break the seqlock, so it is only replaced once it has exited
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+      CORE_INFO("Snapshot publisher " + std::to_string(pid) + " has exited");
+      return false;
+    }
+
+    CORE_DEBUG("Snapshot publisher " + std::to_string(pid) + " stopped responding");
+
+    return true;
+  }
+#endif
+
+  bool SharedSnapshot::takeOver()
+  {
+#ifdef _WIN32
+    return false;
+#else
+    int32_t pid = m_pHeader->publisherPid.load();
+    int32_t self = getpid();
+
+    if (!m_pHeader->publisherPid.compare_exchange_strong(pid, self))
+      return false;
+
+    CORE_INFO("Taking over as snapshot publisher");
+
+    // New, or left behind by a build with another layout
+    if (!_isCurrent(m_pHeader)) {
+      if (m_pHeader->magic == SNAPSHOT_MAGIC)
+        CORE_INFO("Re-initializing shared snapshot of version " + std::to_string(m_pHeader->version));
+
+      // Readers reject the segment until it is initialized again
+      m_pHeader->magic       = 0;
+      std::atomic_thread_fence(std::memory_order_release);
+      m_pHeader->version     = SNAPSHOT_VERSION;
+      m_pHeader->capacity    = SNAPSHOT_CAPACITY;
+      m_pHeader->deviceCount = 0;
+      std::atomic_thread_fence(std::memory_order_release);
+      m_pHeader->magic       = SNAPSHOT_MAGIC;
+    }
+
+    m_pHeader->heartbeatMs.store(_nowMs());
+    m_publisher = true;
+
+    // Publish right away, whatever changed while nobody was watching
+    m_changeToken = ChangeDetector::instance().token();
+    publish(getDevices());
+
+    return true;
+#endif
+  }
+
+  void SharedSnapshot::tick()
+  {
+    if (m_pHeader == nullptr)
+      return;
+
+#ifndef _WIN32
+    if (m_publisher && m_pHeader->publisherPid.load() != getpid()) {
+      CORE_WARNING("Another process took over as snapshot publisher");
+      m_publisher = false;
+    }
+#endif
+
+    if (!m_publisher) {
+      if (!publisherAlive())
+        takeOver();
+
+      return;
+    }
+
+    m_pHeader->heartbeatMs.store(_nowMs());
+
+    ChangeDetector &detector = ChangeDetector::instance();
+
+    if (detector.hasChanged(m_changeToken)) {
+      m_changeToken = detector.token();
+      publish(getDevices());
+    }
+  }
+
+  void SharedSnapshot::publish(const std::vector<USBDevicePtr> &devices)
+  {
+    uint32_t capacity = m_pHeader->capacity;
+    uint32_t count = 0;
+    std::string data;
+
+    {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      for (const USBDevicePtr &device : devices) {
+        size_t size = data.size();
+
+        serializeDevice(*device, data);
+        _serializeState(*device, data);
+
+        if (data.size() > capacity) {
+          CORE_WARNING("Shared snapshot only holds " + std::to_string(count) + " of " +
+                       std::to_string(devices.size()) + " devices");
+          data.resize(size);
+          break;
+        }
+
+        count++;
+      }
+    }
+
+#ifndef _WIN32
+    // Checked right before writing, in case a reader took over in between
+    if (m_pHeader->publisherPid.load() != getpid()) {
+      CORE_WARNING("Another process took over as snapshot publisher");
+      m_publisher = false;
+      return;
+    }
+#endif
+
+    // A publisher that died mid-write leaves the sequence odd
+    uint32_t sequence = m_pHeader->sequence.load(std::memory_order_relaxed);
+    sequence += (sequence & 1) ? 1 : 2;
+
+    m_pHeader->sequence.store(sequence - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(m_pHeader->data, data.data(), data.size());
+    m_pHeader->dataSize = static_cast<uint32_t>(data.size());
+    m_pHeader->deviceCount = count;
+
+    m_pHeader->sequence.store(sequence, std::memory_order_release);
+
+    CORE_DEBUG("Published " + std::to_string(count) + " devices to the shared snapshot");
+  }
+
+  bool SharedSnapshot::read(std::vector<USBDevicePtr> &devices)
+  {
+    if (m_pHeader == nullptr)
+      return false;
+
+    if (!m_publisher && !publisherAlive())
+      takeOver();
+
+    // Published by a live process of another version, which lays records
+    // out differently
+    if (!_isCurrent(m_pHeader)) {
+      CORE_DEBUG("Ignoring shared snapshot of version " + std::to_string(m_pHeader->version));
+      return false;
+    }
+
+    std::string data;
+
+    for (int attempt = 0; attempt < READ_RETRIES; ++attempt) {
+      uint32_t before = m_pHeader->sequence.load(std::memory_order_acquire);
+
+      if (before & 1)
+        continue;
+
+      uint32_t count = m_pHeader->deviceCount;
+      data.assign(m_pHeader->data, std::min(m_pHeader->dataSize, m_pHeader->capacity));
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (m_pHeader->sequence.load(std::memory_order_relaxed) != before)
+        continue;
+
+      DeviceRegistry &registry = DeviceRegistry::instance();
+      size_t offset = 0;
+
+      devices.clear();
+      devices.reserve(count);
+
+      for (uint32_t i = 0; i < count; ++i) {
+        USBDevicePtr device = registry.create();
+
+        if (!deserializeDevice(data, &offset, *device) || !_deserializeState(data, &offset, *device)) {
+          CORE_ERROR("Shared snapshot holds a corrupt device");
+          return false;
+        }
+
+        devices.push_back(device);
+      }
+
+      return true;
+    }
+
+    CORE_WARNING("Shared snapshot is being written for too long, giving up");
+
+    return false;
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef _SUBDEVIL_SHARED_SNAPSHOT_H__
+#define _SUBDEVIL_SHARED_SNAPSHOT_H__
+
+#include "subdevil.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace Subdevil
+{
+  struct SnapshotHeader;
+
+  /**
+   * A device list shared between processes through a POSIX shared memory
+   * segment. One process, the publisher, enumerates devices and writes
+   * them to the segment under a seqlock; every other process reads the
+   * segment without any system calls. If the publisher stops refreshing
+   * its heartbeat and its process has exited, the next reader to notice
+   * takes over publishing.
+   */
+  class SharedSnapshot
+  {
+  public:
+    static SharedSnapshot &instance()
+    {
+      static SharedSnapshot instance;
+      return instance;
+    }
+
+    /**
+     * Open, or create, the segment with the given name. The publisher is
+     * considered dead once its heartbeat is older than heartbeatTimeout.
+     */
+    bool open(const std::string &name, std::chrono::milliseconds heartbeatTimeout);
+    void close();
+
+    bool isOpen() const { return m_pHeader != nullptr; }
+    bool isPublisher() const { return m_publisher; }
+
+    /**
+     * As the publisher, refresh the heartbeat and republish if devices
+     * changed. Otherwise take over if the publisher is gone.
+     */
+    void tick();
+
+    /**
+     * Read the current snapshot. Returns false if no snapshot is available.
+     */
+    bool read(std::vector<USBDevicePtr> &devices);
+
+  private:
+    SharedSnapshot();
+    SharedSnapshot(const SharedSnapshot &);
+    SharedSnapshot &operator=(const SharedSnapshot &);
+
+    bool publisherAlive() const;
+    bool takeOver();
+    void publish(const std::vector<USBDevicePtr> &devices);
+
+    SnapshotHeader *m_pHeader;
+    size_t m_size;
+    bool m_publisher;
+    uint64_t m_changeToken;
+    std::chrono::milliseconds m_heartbeatTimeout;
+  };
+}
+
+#endif // _SUBDEVIL_SHARED_SNAPSHOT_H__
@@ -1,35 +1,203 @@
 #ifndef _SUBDEVIL_H_
 #define _SUBDEVIL_H_
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 #include <memory>
+#include <chrono>
+
+#include "utils/string_pool.h"
+#include "change_detector.h"
 
 namespace Subdevil
 {
+  // A partition or unpartitioned disk with a file system
+  typedef struct Volume {
+    std::string node;                      // Partition node, e.g. /dev/disk2s1 or \\?\Volume{...}\.
+    std::string label;                     // File system label. Can be empty.
+    std::string uuid;                      // File system UUID or serial number. Can be empty.
+    std::vector<std::string> mountPoints;  // Where the volume is mounted. Can be empty.
+  } Volume;
+
+  // Vendor, product and mount strings are shared between devices through
+  // the string pool, the rest is unique per device.
   typedef struct USBDevice {
-    std::string uid;           // Unique ID for each device.
-    int locationID;            // USB Location ID data.
-    int productID;             // USB product ID data.
-    int vendorID;              // USB vendor ID data.
-    std::string product;       // The product name.
-    std::string serialNumber;  // the full serial number. Can be empty.
-    std::string vendor;        // The vendor name.
-    std::string mountPoint;    // The disk mount point. Can be empty.
+    std::string uid;                   // Unique ID for each device.
+    int locationID;                    // USB Location ID data.
+    int productID;                     // USB product ID data.
+    int vendorID;                      // USB vendor ID data.
+    Utils::InternedString product;     // The product name.
+    std::string serialNumber;          // the full serial number. Can be empty.
+    Utils::InternedString vendor;      // The vendor name.
+    Utils::InternedString mountPoint;  // The first mount point of the first mounted volume. Can be empty.
+    std::vector<Volume> volumes;       // Every volume on the device, in partition order.
+    bool incomplete;                   // Slow lookups missed the scan deadline and are still running.
+    std::string ttyPath;               // Serial port. Set by the tty resolver.
+    std::string hidPath;               // Raw HID node. Set by the hidraw resolver.
+    std::string blockPath;             // Whole disk block device. Set by the block resolver.
+    unsigned resolved;                 // Resolvers with cached results, see resolvers.h.
+    uint64_t sessionID;                // Changes when the device is re-plugged. 0 if unknown.
+    std::string devicePath;            // OS path the device was found through, used to refresh it.
+    std::chrono::steady_clock::time_point refreshedAt;  // When the device was last read from the OS.
+    unsigned liveFields;               // LiveField flags of fields read by opening the device.
   } USBDevice;
 
-  // Shared resource to the USB device
+  // Fields a backend may have to open the device for. All other fields,
+  // and these in passive scans, come from data the OS already has cached.
+  enum LiveField {
+    LIVE_MOUNT = 1 << 0,
+    LIVE_BLOCK = 1 << 1,
+  };
+
+  // Shared resource to the USB device. Allocated by the DeviceRegistry,
+  // with the reference count in the same block as the device.
   // TODO: Make all of this const
   typedef std::shared_ptr<USBDevice> USBDevicePtr;
 
+  typedef struct ScanOptions {
+    // Time budget for the slow lookups (mount resolution) of each device.
+    // Lookups that don't finish in time continue in the background and
+    // the device is returned flagged as incomplete. A scan of n devices
+    // takes at most n times this on top of the enumeration, however many
+    // of them hang. Zero waits for every lookup.
+    std::chrono::milliseconds deadline = std::chrono::milliseconds::zero();
+    // Class specific resolvers to run, a mask of Resolver flags. Results
+    // are cached until the device is re-plugged.
+    unsigned resolve = 0;
+    // Only report data the OS already has cached. Device nodes are never
+    // opened, so autosuspended devices stay asleep. Fields that can't be
+    // read this way are left as they are.
+    bool passive = false;
+    // Read data the scan needs for many devices, such as which disks
+    // belong to which device, with one OS query for the whole scan rather
+    // than one walk per device. Only the OSX backend has batched reads.
+    bool batchReads = true;
+  } ScanOptions;
+
+  // Criteria for findDevices(). Unset criteria match any device.
+  typedef struct DeviceQuery {
+    std::string uid;           // Device UID, unset if empty.
+    std::string serialNumber;  // Exact serial number, unset if empty.
+    int vendorID = -1;         // USB vendor ID, unset if negative.
+    int productID = -1;        // USB product ID, unset if negative.
+    std::string mountPoint;    // Any mount point of any volume, unset if empty.
+    bool mounted = false;      // Only devices with at least one mounted volume.
+  } DeviceQuery;
+
+  typedef struct ScanMetrics {
+    size_t deviceCount;                      // Devices returned so far.
+    std::chrono::microseconds firstDevice;   // Time until the first device was returned.
+    std::chrono::microseconds total;         // Time from the start of the scan until it was closed.
+    uint64_t osCalls;                        // Calls into the OS made while the scan was open.
+  } ScanMetrics;
+
+  /**
+   * Calls into the OS made by the backends so far: registry and device
+   * property queries, enumeration steps and device opens. Slow lookups
+   * running in the background count too.
+   */
+  uint64_t osCallCount();
+
+  /**
+   * Incremental device enumeration. Each call to next() does just enough
+   * work to return the next connected device, so callers can stop as soon
+   * as they have found what they are looking for.
+   *
+   * The OS specific state lives in Impl, which every backend defines
+   * together with the constructor, destructor, fetch() and release().
+   */
+  class DeviceScanner
+  {
+  public:
+    explicit DeviceScanner(const ScanOptions &options = ScanOptions());
+    ~DeviceScanner();
+
+    /**
+     * Get the next connected device, or nullptr once all devices
+     * have been returned.
+     */
+    USBDevicePtr next();
+    /**
+     * Release the OS enumeration resources. Further calls to next()
+     * return nullptr.
+     */
+    void close();
+
+    ScanMetrics metrics() const;
+
+    const ScanOptions &options() const { return m_options; }
+
+    /**
+     * The point in time slow lookups of the device being fetched have to
+     * finish by, or time_point::max() without a deadline.
+     */
+    std::chrono::steady_clock::time_point deadline() const;
+
+  private:
+    DeviceScanner(const DeviceScanner &);
+    DeviceScanner &operator=(const DeviceScanner &);
+
+    USBDevicePtr fetch();
+    void release();
+
+    struct Impl;
+    std::unique_ptr<Impl> m_pImpl;
+
+    ScanOptions m_options;
+    bool m_open = true;
+    size_t m_deviceCount = 0;
+    std::chrono::steady_clock::time_point m_started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point m_firstDevice;
+    std::chrono::steady_clock::time_point m_closed;
+    // Taken before the OS enumeration starts
+    ChangeDetector::Observation m_observation = ChangeDetector::instance().beginObservation();
+    uint64_t m_osCallsAtStart = osCallCount();
+    uint64_t m_osCallsAtClose = 0;
+  };
+
   /**
    * Get data for all connected devices.
    */
-  std::vector<USBDevicePtr> getDevices();
+  std::vector<USBDevicePtr> getDevices(const ScanOptions &options = ScanOptions());
   /**
    * Get a device with the given UID.
    */
   USBDevicePtr getDevice(const std::string &uid);
+  /**
+   * Get a device with the given UID, re-reading just that device from the
+   * OS first if it was last read more than maxAge ago. Unlike a scan, the
+   * re-read always has a deadline: slow lookups that take longer carry on
+   * in the background and the device is returned flagged incomplete.
+   * Returns nullptr for unknown UIDs and devices that have been unplugged.
+   */
+  USBDevicePtr getDevice(const std::string &uid, std::chrono::milliseconds maxAge,
+                         std::chrono::milliseconds deadline = std::chrono::milliseconds(1000));
+
+  /**
+   * Get the connected devices that match the query, from indexes kept up
+   * to date by scans. Devices are only enumerated again, with the given
+   * options, if something changed since the last full scan.
+   */
+  std::vector<USBDevicePtr> findDevices(const DeviceQuery &query,
+                                        const ScanOptions &options = ScanOptions());
+
+  /**
+   * The most OS handles kept open for devices that getDevice() re-reads
+   * after maxAge, so refreshing a known device doesn't look it up again.
+   * The least recently refreshed devices are closed first. 0 closes them
+   * all. Defaults to 64.
+   */
+  void setHandleBudget(size_t handles);
+
+  /**
+   * Limit the devices that are no longer connected but still remembered,
+   * so a device plugged back in keeps what was resolved for it. They are
+   * forgotten once they left longer than maxAge ago, and beyond maxCount
+   * the ones that left first go first. Defaults to an hour and 256.
+   */
+  void setDepartedLimits(std::chrono::milliseconds maxAge, size_t maxCount);
 
   /**
    * Unmount the device with the given UID.
@@ -1,25 +1,632 @@
+var os = require('os');
+var path = require('path');
+
 var SubdevilNative = require('../build/Release/subdevil.node');
 
+// Set while sharing a device snapshot with other processes
+var sharedTimer = null;
+
+// Whether the options change how devices are scanned. The publisher
+// scans with the defaults, so those are answered by a local scan.
+function hasScanOptions(options) {
+  return !!options && (typeof options.deadlineMs === 'number' ||
+                       (options.resolve || []).length > 0 ||
+                       !!options.passive ||
+                       options.batchReads === false);
+}
+
+// null without a snapshot or if the options need a local scan, false if
+// its tag is ifNoneMatch
+function pollShared(options) {
+  if (sharedTimer === null || hasScanOptions(options)) {
+    return null;
+  }
+
+  return SubdevilNative.sharedPoll((options && options.ifNoneMatch) || null);
+}
+
+/**
+ * A mount point the way the native indexes compare them: without
+ * trailing separators, and ignoring case on Windows.
+ */
+function mountKey(mountPoint) {
+  var key = mountPoint;
+
+  while (key.length > 1 && /[\/\\]$/.test(key)) {
+    key = key.slice(0, -1);
+  }
+
+  return os.platform() === 'win32' ? key.toLowerCase() : key;
+}
+
+// Whether any volume of the device is mounted at the mount key
+function hasMount(dev, key) {
+  if (dev.mount !== null && mountKey(dev.mount) === key) {
+    return true;
+  }
+
+  return (dev.volumes || []).some(function(volume) {
+    return volume.mountPoints.some(function(mountPoint) {
+      return mountKey(mountPoint) === key;
+    });
+  });
+}
+
+// Resolved by poll({ifNoneMatch}) when nothing changed
+var NOT_MODIFIED = Object.freeze({ notModified: true });
+
+// Scans waiting to run and the last finished scan, by poll options
+var pollFlights = {};
+var pollResults = {};
+var pollCounters = { scans: 0, joined: 0, cacheHits: 0 };
+
+// Polls with the same key can share a scan
+function pollKey(options) {
+  options = options || {};
+
+  return JSON.stringify([
+    options.deadlineMs || 0,
+    (options.resolve || []).slice().sort(),
+    !!options.passive,
+    options.batchReads !== false
+  ]);
+}
+
+// What a poll resolves with, given the tag the caller already has
+function pollResult(devices, ifNoneMatch) {
+  if (devices === null || (ifNoneMatch && devices.tag === ifNoneMatch)) {
+    return NOT_MODIFIED;
+  }
+
+  // Callers get their own array, the device objects are shared
+  var result = devices.slice();
+  result.tag = devices.tag;
+
+  return result;
+}
+
+function pollNative(options) {
+  var key = pollKey(options);
+  var last = pollResults[key];
+  var ifNoneMatch = (options && options.ifNoneMatch) || null;
+
+  if (last && options && typeof options.maxAgeMs === 'number' &&
+      Date.now() - last.finishedAt <= options.maxAgeMs) {
+    pollCounters.cacheHits++;
+    return Promise.resolve(pollResult(last.devices, ifNoneMatch));
+  }
+
+  var flight = pollFlights[key];
+
+  if (flight) {
+    pollCounters.joined++;
+
+    // The native side can only skip the objects if nobody needs them
+    if (flight.ifNoneMatch !== ifNoneMatch) {
+      flight.ifNoneMatch = null;
+    }
+  } else {
+    pollCounters.scans++;
+
+    // The native scan blocks, so it runs on the next turn of the event
+    // loop, and every poll until then joins it
+    flight = pollFlights[key] = { ifNoneMatch: ifNoneMatch };
+    flight.promise = new Promise(function(resolve, reject) {
+      setImmediate(function() {
+        delete pollFlights[key];
+
+        try {
+          var devices = SubdevilNative.poll(options, flight.ifNoneMatch);
+
+          var cached = pollResults[key];
+
+          if (devices !== null) {
+            pollResults[key] = { devices: devices, finishedAt: Date.now() };
+          } else if (cached && cached.devices.tag === flight.ifNoneMatch) {
+            cached.finishedAt = Date.now();
+          } else {
+            // Unchanged since a tag from another scan, which the cached
+            // devices may not match anymore
+            delete pollResults[key];
+          }
+
+          resolve(devices);
+        } catch (error) {
+          reject(error);
+        }
+      });
+    });
+  }
+
+  return flight.promise.then(function(devices) {
+    return pollResult(devices, ifNoneMatch);
+  });
+}
+
+// Pending waitFor() calls. They are checked when the OS reports a change,
+// or on a timer where it can't.
+var waiters = [];
+var waitTimer = null;
+var WAIT_FALLBACK_INTERVAL_MS = 1000;
+
+function settleWaiter(waiter, error, device) {
+  var index = waiters.indexOf(waiter);
+
+  if (index === -1) {
+    return;
+  }
+
+  waiters.splice(index, 1);
+  clearTimeout(waiter.timer);
+
+  if (waiters.length === 0) {
+    SubdevilNative.onChange(null);
+    clearInterval(waitTimer);
+    waitTimer = null;
+  }
+
+  if (error) {
+    waiter.reject(error);
+  } else {
+    waiter.resolve(device);
+  }
+}
+
+function checkWaiters() {
+  // Only the first lookup after a change enumerates, the rest hit the index
+  waiters.slice().forEach(function(waiter) {
+    var devices;
+
+    try {
+      devices = SubdevilNative.find(waiter.query);
+    } catch (error) {
+      return settleWaiter(waiter, error);
+    }
+
+    if (devices.length > 0) {
+      settleWaiter(waiter, null, devices[0]);
+    }
+  });
+}
+
 module.exports = {
+  NOT_MODIFIED: NOT_MODIFIED,
   /**
    * Get a list of attached devices.
+   *
+   * Polls made before a scan starts share it, so a burst of polls queries
+   * the OS once. The device objects are shared between them and should
+   * not be modified. The array has a `tag` fingerprinting its contents.
+   *
+   * @param {Object} [options]
+   * @param {Number} [options.deadlineMs] Time budget for each device's
+   *   lookups. Devices whose mount lookup doesn't finish in time are
+   *   returned with `incomplete: true`; the lookup finishes in the
+   *   background and later polls pick up the result.
+   * @param {Array<String>} [options.resolve] Device nodes to look up:
+   *   'tty', 'hidraw' and/or 'block'. Each only runs for devices with an
+   *   interface of the matching class, and the result is cached until the
+   *   device is re-plugged.
+   * @param {Boolean} [options.passive] Only report data the OS already has
+   *   cached and never open device nodes, so autosuspended devices aren't
+   *   woken up. Each device's `sources` tells which fields were read from
+   *   the device and which from the cache.
+   * @param {Boolean} [options.batchReads=true] Read data needed for many
+   *   devices with one OS query per poll instead of one per device (OSX).
+   *   Set to false to compare the OS call counts in scan() metrics.
+   * @param {Number} [options.maxAgeMs] Resolve with the devices from the
+   *   last finished poll with the same options if it is at most this old.
+   * @param {String} [options.ifNoneMatch] The `tag` of the devices from an
+   *   earlier poll. If nothing but `refreshedAt` changed since, resolve
+   *   with `subdevil.NOT_MODIFIED` without creating any device objects.
+   * @returns {Promise<Array>}
    */
-  poll: function poll() {
-    return new Promise(function(resolve) {
-      resolve(SubdevilNative.poll());
+  poll: function poll(options) {
+    var shared = pollShared(options);
+
+    if (shared === false) {
+      return Promise.resolve(NOT_MODIFIED);
+    }
+
+    if (shared !== null) {
+      return Promise.resolve(shared);
+    }
+
+    return pollNative(options);
+  },
+  /**
+   * How polls were answered: `scans` that queried the OS, polls that
+   * `joined` a scan another poll started, and `cacheHits` answered from
+   * the last scan because of `maxAgeMs`.
+   *
+   * @param {Object} [options]
+   * @param {Boolean} [options.reset=false] Start over after reading
+   * @returns {Object}
+   */
+  pollStats: function pollStats(options) {
+    var stats = {
+      scans: pollCounters.scans,
+      joined: pollCounters.joined,
+      cacheHits: pollCounters.cacheHits
+    };
+
+    if (options && options.reset) {
+      pollCounters = { scans: 0, joined: 0, cacheHits: 0 };
+    }
+
+    return stats;
+  },
+  /**
+   * Stream attached devices as they are enumerated. The returned object
+   * is an async iterator, so it can be used with `for await`. Devices are
+   * enumerated on a native thread, at most a few ahead of the consumer,
+   * so the event loop isn't blocked, and breaking out of the loop stops
+   * the enumeration. Scans that are dropped without finishing or
+   * `return()` are stopped once they are garbage collected.
+   *
+   * Once the scan is finished, `metrics` holds the number of devices
+   * enumerated, the time to the first device, the total scan time and the
+   * number of calls into the OS.
+   *
+   * @param {Object} [options] Same as for poll()
+   * @returns {Object}
+   */
+  scan: function scan(options) {
+    var handle = SubdevilNative.scanOpen(options);
+    // Settles the next() call waiting for the scan thread, if any
+    var pending = null;
+    var iterator = {
+      metrics: null
+    };
+
+    function close() {
+      if (handle !== null) {
+        iterator.metrics = SubdevilNative.scanClose(handle);
+        handle = null;
+      }
+
+      if (pending !== null) {
+        pending.resolve({ value: undefined, done: true });
+        pending = null;
+      }
+    }
+
+    function pull() {
+      var waiting = pending;
+      var device;
+
+      try {
+        device = SubdevilNative.scanNext(handle, pull);
+      } catch (error) {
+        pending = null;
+        close();
+        return waiting.reject(error);
+      }
+
+      // Called again once the scan thread has a device
+      if (device === undefined) {
+        return;
+      }
+
+      pending = null;
+
+      if (device === null) {
+        close();
+        waiting.resolve({ value: undefined, done: true });
+      } else {
+        waiting.resolve({ value: device, done: false });
+      }
+    }
+
+    iterator.next = function next() {
+      return new Promise(function(resolve, reject) {
+        if (handle === null) {
+          return resolve({ value: undefined, done: true });
+        }
+
+        if (pending !== null) {
+          return reject(new Error('Wait for the previous next() to settle'));
+        }
+
+        pending = { resolve: resolve, reject: reject };
+        pull();
+      });
+    };
+
+    iterator.return = function stop(value) {
+      close();
+      return Promise.resolve({ value: value, done: true });
+    };
+
+    if (typeof Symbol !== 'undefined' && Symbol.asyncIterator) {
+      iterator[Symbol.asyncIterator] = function() {
+        return iterator;
+      };
+    }
+
+    return iterator;
+  },
+  /**
+   * Get a token for the current device state, to pass to hasChanged().
+   *
+   * @returns {Number}
+   */
+  changeToken: function changeToken() {
+    return SubdevilNative.changeToken();
+  },
+  /**
+   * Check if devices were added, removed, mounted or unmounted since the
+   * token was taken. Answered from OS notifications without enumerating.
+   * Always true where notifications are unavailable.
+   *
+   * @param {Number} token
+   * @returns {Boolean}
+   */
+  hasChanged: function hasChanged(token) {
+    return SubdevilNative.hasChanged(token);
+  },
+  /**
+   * Latency from the OS reporting a change to the end of the first scan
+   * that picked it up, over all scans since the last reset. Only recorded
+   * while change notifications are available.
+   *
+   * @param {Object} [options]
+   * @param {Boolean} [options.reset=false] Start over after reading
+   * @returns {Object} count, p50Ms, p99Ms, p999Ms and maxMs
+   */
+  eventLatency: function eventLatency(options) {
+    return SubdevilNative.eventLatency(!!(options && options.reset));
+  },
+  /**
+   * Start recording devices being added, removed, mounted and unmounted
+   * to an append-only log, as seen by the scans of this process. The log
+   * is kept in segment files next to the given path, and compacted once
+   * there are more than `maxSegments` of them. One process should write
+   * to a log at a time.
+   *
+   * @param {String} path
+   * @param {Object} [options]
+   * @param {Number} [options.segmentRecords=65536] Events per segment
+   * @param {Number} [options.maxSegments=32]
+   * @returns {Boolean} false if the log couldn't be opened
+   */
+  openHistory: function openHistory(path, options) {
+    options = options || {};
+
+    return SubdevilNative.historyOpen(path,
+                                      options.segmentRecords || 65536,
+                                      options.maxSegments || 32);
+  },
+  /**
+   * Stop recording to the history log.
+   */
+  closeHistory: function closeHistory() {
+    SubdevilNative.historyClose();
+  },
+  /**
+   * Events of a device from the history log, oldest first. Looked up
+   * through per segment indexes, without reading the whole log.
+   *
+   * @param {Object} query
+   * @param {String} query.serialNumber
+   * @param {Date|Number} [query.since] Date or milliseconds since the epoch
+   * @returns {Array} Objects with type ('add', 'remove', 'mount' or
+   *   'unmount'), time (Date), serialNumber, vendorId, productId, mount and
+   *   durationMs, the time since the add for removes found with their add
+   */
+  history: function history(query) {
+    var since = query.since instanceof Date ? query.since.getTime() : (query.since || 0);
+
+    return SubdevilNative.historyQuery(query.serialNumber, since).map(function(event) {
+      event.time = new Date(event.time);
+      return event;
     });
   },
+  /**
+   * Poll on a timer, but only enumerate when something changed. The
+   * interval doubles while nothing changes and drops back to the minimum
+   * after a change.
+   *
+   * @param {Function} callback Called with (error, devices) after each poll
+   * @param {Object} [options]
+   * @param {Number} [options.minIntervalMs=100]
+   * @param {Number} [options.maxIntervalMs=5000]
+   * @param {Object} [options.poll] Options passed to poll()
+   * @returns {Object} Call `stop()` on it to stop watching.
+   */
+  watch: function watch(callback, options) {
+    var self = this;
+
+    options = options || {};
+
+    var minInterval = options.minIntervalMs || 100;
+    var maxInterval = options.maxIntervalMs || 5000;
+    var interval = minInterval;
+    var token = null;
+    var timer = null;
+    var stopped = false;
+
+    function schedule() {
+      if (!stopped) {
+        timer = setTimeout(tick, interval);
+      }
+    }
+
+    function tick() {
+      if (token !== null && !SubdevilNative.hasChanged(token)) {
+        interval = Math.min(interval * 2, maxInterval);
+        return schedule();
+      }
+
+      // Take the token first, so changes during the poll aren't lost
+      token = SubdevilNative.changeToken();
+      interval = minInterval;
+
+      self.poll(options.poll).then(function(devices) {
+        if (!stopped) {
+          callback(null, devices);
+        }
+      }, function(error) {
+        if (!stopped) {
+          callback(error);
+        }
+      }).then(schedule);
+    }
+
+    tick();
+
+    return {
+      stop: function stop() {
+        stopped = true;
+        clearTimeout(timer);
+      }
+    };
+  },
   /**
    * Get a device by ID
    *
    * @param {String} id
+   * @param {Object} [options]
+   * @param {Number} [options.maxAgeMs] Re-read just this device from the
+   *   OS if it was last read longer ago than this. Resolves to null if the
+   *   device has been unplugged since.
+   * @param {Number} [options.deadlineMs=1000] Time budget for the re-read.
+   *   Slower lookups finish in the background and the device is returned
+   *   with `incomplete` set.
    * @returns {Object}
    */
-  get: function get(id) {
+  get: function get(id, options) {
+    return new Promise(function(resolve) {
+      var fresh = options && typeof options.maxAgeMs === 'number';
+      var shared = fresh ? null : pollShared();
+
+      if (shared !== null) {
+        return resolve(shared.find(function(dev) {
+          return dev.id === id;
+        }) || null);
+      }
+
+      resolve(SubdevilNative.get(id, options));
+    });
+  },
+  /**
+   * Find connected devices by serial number, vendor and product ID or
+   * mount point. Answered from native indexes that scans keep up to date,
+   * so only the matching devices are converted to JS objects. Devices
+   * are only enumerated again if something changed since the last scan.
+   *
+   * @param {Object} query Every given field has to match
+   * @param {String} [query.id]
+   * @param {String} [query.serialNumber]
+   * @param {Number} [query.vendorId]
+   * @param {Number} [query.productId]
+   * @param {String} [query.mount] Any mount point of any volume
+   * @param {Boolean} [query.mounted] At least one volume is mounted
+   * @param {Object} [options] Same as for poll(), used if a scan is needed
+   * @returns {Promise<Array>}
+   */
+  find: function find(query, options) {
     return new Promise(function(resolve) {
-      resolve(SubdevilNative.get(id));
+      var shared = pollShared(options);
+
+      if (shared !== null) {
+        var mount = query.mount === undefined ? undefined : mountKey(query.mount);
+
+        return resolve(shared.filter(function(dev) {
+          return (query.id === undefined || dev.id === query.id) &&
+            (query.serialNumber === undefined || dev.serialNumber === query.serialNumber) &&
+            (query.vendorId === undefined || dev.vendorId === query.vendorId) &&
+            (query.productId === undefined || dev.productId === query.productId) &&
+            (mount === undefined || hasMount(dev, mount)) &&
+            (!query.mounted || dev.mount !== null);
+        }));
+      }
+
+      resolve(SubdevilNative.find(query, options));
+    });
+  },
+  /**
+   * Wait until a device matching the query is connected, and mounted if
+   * asked for. The query is checked right away and then only when the OS
+   * reports a device or mount change, so waiting costs nothing while
+   * nothing happens, however many calls are waiting. Where the OS doesn't
+   * report changes, it is checked every second instead.
+   *
+   * @param {Object} query Every given field has to match
+   * @param {String} [query.id]
+   * @param {String} [query.serialNumber]
+   * @param {Number} [query.vendorId]
+   * @param {Number} [query.productId]
+   * @param {String} [query.mount] Any mount point of any volume
+   * @param {Boolean} [query.mounted] At least one volume is mounted
+   * @param {Object} [options]
+   * @param {Number} [options.timeoutMs] Reject if nothing matched by then
+   * @returns {Promise<Object>} The first matching device
+   */
+  waitFor: function waitFor(query, options) {
+    return new Promise(function(resolve, reject) {
+      var waiter = {
+        query: query,
+        resolve: resolve,
+        reject: reject,
+        timer: null
+      };
+      var devices = SubdevilNative.find(query);
+
+      if (devices.length > 0) {
+        return resolve(devices[0]);
+      }
+
+      if (waiters.push(waiter) === 1 && !SubdevilNative.onChange(checkWaiters)) {
+        waitTimer = setInterval(checkWaiters, WAIT_FALLBACK_INTERVAL_MS);
+      }
+
+      if (options && typeof options.timeoutMs === 'number') {
+        waiter.timer = setTimeout(function() {
+          settleWaiter(waiter, new Error('Timed out waiting for a matching device'));
+        }, options.timeoutMs);
+      }
     });
   },
+  /**
+   * Share one device enumeration between all processes on the host that
+   * use the same name. One process enumerates and publishes snapshots to
+   * shared memory; in the others, poll(), get() and find() read the latest
+   * snapshot instead of querying the OS. Calls with options that change
+   * how devices are scanned, like `deadlineMs`, `resolve` or `passive`,
+   * still scan locally. If the publishing process exits, another one
+   * takes over.
+   *
+   * @param {String} name
+   * @param {Object} [options]
+   * @param {Number} [options.intervalMs=1000] How often the publisher
+   *   checks for changes and readers check on the publisher.
+   * @returns {Boolean} Whether sharing could be set up.
+   */
+  share: function share(name, options) {
+    var interval = (options && options.intervalMs) || 1000;
+
+    this.unshare();
+
+    if (!SubdevilNative.sharedOpen(name, interval * 3)) {
+      return false;
+    }
+
+    sharedTimer = setInterval(SubdevilNative.sharedTick, interval);
+    sharedTimer.unref();
+
+    return true;
+  },
+  /**
+   * Stop sharing and go back to enumerating in this process.
+   */
+  unshare: function unshare() {
+    if (sharedTimer !== null) {
+      clearInterval(sharedTimer);
+      sharedTimer = null;
+      SubdevilNative.sharedClose();
+    }
+  },
   /**
    * Unmount a mass storage device.
    */
@@ -32,11 +639,97 @@ module.exports = {
       }
     });
   },
+  /**
+   * Resolve `vendorName` and `productName` from a usb.ids file. The file
+   * is compiled into a binary index the first time it is used, and the
+   * index is reused until the usb.ids file changes.
+   *
+   * @param {String} idsPath Path to usb.ids
+   * @param {String} [indexPath] Where to keep the compiled index. Defaults
+   *                             to the OS temp directory.
+   * @returns {Boolean} Whether the database was loaded.
+   */
+  setUsbIds: function setUsbIds(idsPath, indexPath) {
+    if (indexPath === undefined) {
+      indexPath = path.join(os.tmpdir(), 'subdevil-' + path.basename(idsPath) + '.idx');
+    }
+
+    return SubdevilNative.setUsbIds(idsPath, indexPath);
+  },
+  /**
+   * The most OS handles kept open for devices re-read by `get()` with
+   * `maxAgeMs`, so a refresh reads the device directly instead of
+   * looking it up again. The least recently refreshed devices are closed
+   * first, and unplugged devices are closed as soon as the OS reports it.
+   *
+   * @param {Number} handles 0 closes them all. Defaults to 64.
+   */
+  setHandleBudget: function setHandleBudget(handles) {
+    SubdevilNative.setHandleBudget(handles);
+  },
+  /**
+   * Limit the unplugged devices that are remembered, so one plugged back
+   * in keeps what was resolved for it. `get()` doesn't return them. Each
+   * full poll forgets the ones that left longer than `maxAgeMs` ago, then
+   * the ones that left first until at most `maxCount` are left.
+   *
+   * @param {Object} limits
+   * @param {Number} [limits.maxAgeMs=3600000]
+   * @param {Number} [limits.maxCount=256]
+   */
+  setDepartedLimits: function setDepartedLimits(limits) {
+    SubdevilNative.setDepartedLimits(
+      typeof limits.maxAgeMs === 'number' ? limits.maxAgeMs : 60 * 60 * 1000,
+      typeof limits.maxCount === 'number' ? limits.maxCount : 256);
+  },
+  /**
+   * How many devices the native registry holds: `present` ones, `departed`
+   * ones still remembered and how many were `evicted` so far, as of full
+   * poll number `generation`.
+   *
+   * @returns {Object}
+   */
+  registryStats: function registryStats() {
+    return SubdevilNative.registryStats();
+  },
   /**
    * Set the log file to use for debug information.
    */
   setLogFile: function setLogFile(filepath) {
     // TODO: Validate file path
     SubdevilNative.setLogFile(filepath);
+  },
+  /**
+   * Log debug information to a fixed size, memory mapped ring file
+   * instead. Writing to it costs no system calls, it keeps what was
+   * logged up to a crash, and once full the oldest entries are
+   * overwritten. Decode it with `subdevil-cli log <file>`.
+   *
+   * @param {String} filepath
+   * @param {Number} [sizeBytes=1048576]
+   * @returns {Boolean} false if the file could not be mapped
+   */
+  setLogRing: function setLogRing(filepath, sizeBytes) {
+    return SubdevilNative.setLogRing(filepath, sizeBytes || 1024 * 1024);
+  },
+  /**
+   * Record timed spans of polls: the whole enumeration, each device, OS
+   * property reads, mount resolution and conversion to JS objects, tagged
+   * with the device ID. Off by default.
+   *
+   * @param {Boolean} enabled
+   */
+  setTracing: function setTracing(enabled) {
+    SubdevilNative.setTracing(!!enabled);
+  },
+  /**
+   * Write the spans recorded since the last dump as Chrome trace-event
+   * JSON, which chrome://tracing and Perfetto can load.
+   *
+   * @param {String} filepath
+   * @returns {Boolean} false if the file could not be written
+   */
+  dumpTrace: function dumpTrace(filepath) {
+    return SubdevilNative.dumpTrace(filepath);
   }
 };
@@ -1,4 +1,13 @@
 #include "usb_common.h"
+#include "device_registry.h"
+#include "utils.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
 static const size_t BUF_SIZE = 100;
 
@@ -6,7 +15,8 @@ namespace Subdevil
 {
   std::string uniqueDeviceID(const USBDevicePtr device)
   {
-    static unsigned long uniqueID = 0;
+    // Scans may run on several threads at once
+    static std::atomic<unsigned long> uniqueID(0);
     std::string uid = device->uid;
 
     if(uid.empty()) {
@@ -22,7 +32,7 @@ namespace Subdevil
       // Always generate unique ID data
       char buf[BUF_SIZE];
 
-      snprintf(buf, sizeof(buf), "%lu", uniqueID++);
+      snprintf(buf, sizeof(buf), "%lu", uniqueID.fetch_add(1));
 
       uid.append("-");
       uid.append(buf);
@@ -30,4 +40,324 @@ namespace Subdevil
 
     return uid;
   }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Slow lookups
+  ////////////////////////////////////////////////////////////////////////////////
+  // Lookups run on a few shared threads, so devices that hang can only
+  // ever hold that many, and only this many more can wait for one. With
+  // more hung devices than threads, the lookups of the others wait behind
+  // them and miss their deadlines until the hung ones return.
+  static const size_t MAX_LOOKUP_THREADS = 8;
+  static const size_t MAX_QUEUED_LOOKUPS = 64;
+
+  struct SlowLookupState {
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    bool abandoned = false;
+    DeviceUpdate update;
+  };
+
+  static void _applyUpdate(const USBDevicePtr &device, const DeviceUpdate &update)
+  {
+    std::vector<HistoryEvent> events;
+
+    {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      update(*device);
+      device->incomplete = false;
+
+      DeviceRegistry::instance().reindex(device, events);
+    }
+
+    // Appending can seal and compact segments, which polls mustn't wait for
+    if (!events.empty())
+      DeviceHistory::instance().append(events);
+  }
+
+  class SlowLookupPool
+  {
+  public:
+    static SlowLookupPool &instance()
+    {
+      // Never destroyed, the threads may still be blocked on a device at exit
+      static SlowLookupPool *pool = new SlowLookupPool();
+      return *pool;
+    }
+
+    /**
+     * Queue a lookup for the device. Returns false if the queue is full or
+     * a lookup for the device is already queued or running.
+     */
+    bool submit(const USBDevicePtr &device, const SlowLookup &lookup,
+                const std::shared_ptr<SlowLookupState> &state)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (m_pending.count(device.get()) > 0) {
+        CORE_DEBUG("Skipping lookup for " + device->uid + ", previous lookup still running");
+        return false;
+      }
+
+      if (m_queue.size() >= MAX_QUEUED_LOOKUPS) {
+        CORE_WARNING("Skipping lookup for " + device->uid + ", too many lookups queued");
+        return false;
+      }
+
+      Task task = { device, lookup, state };
+
+      m_queue.push_back(task);
+      m_pending.insert(device.get());
+
+      if (m_idle == 0 && m_threads < MAX_LOOKUP_THREADS) {
+        m_threads++;
+        std::thread(&SlowLookupPool::work, this).detach();
+      } else {
+        m_ready.notify_one();
+      }
+
+      return true;
+    }
+
+  private:
+    typedef struct Task {
+      USBDevicePtr device;
+      SlowLookup lookup;
+      std::shared_ptr<SlowLookupState> state;
+    } Task;
+
+    SlowLookupPool() {}
+
+    void work()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      for (;;) {
+        m_idle++;
+        m_ready.wait(lock, [this]() { return !m_queue.empty(); });
+        m_idle--;
+
+        Task task = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        run(task);
+        lock.lock();
+      }
+    }
+
+    void run(const Task &task)
+    {
+      DeviceUpdate update = task.lookup();
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.erase(task.device.get());
+      }
+
+      std::unique_lock<std::mutex> lock(task.state->mutex);
+
+      if (task.state->abandoned) {
+        lock.unlock();
+        _applyUpdate(task.device, update);
+
+        CORE_DEBUG("Late lookup finished for " + task.device->uid);
+      } else {
+        task.state->update = update;
+        task.state->finished = true;
+        task.state->done.notify_one();
+      }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<Task> m_queue;
+    std::unordered_set<const USBDevice *> m_pending;
+    size_t m_threads = 0;
+    size_t m_idle = 0;
+  };
+
+  void runSlowLookup(const USBDevicePtr &device, const SlowLookup &lookup,
+                     std::chrono::steady_clock::time_point deadline)
+  {
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+      _applyUpdate(device, lookup());
+      return;
+    }
+
+    auto state = std::make_shared<SlowLookupState>();
+
+    if (!SlowLookupPool::instance().submit(device, lookup, state)) {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      device->incomplete = true;
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    if (state->done.wait_until(lock, deadline, [&state]() { return state->finished; })) {
+      lock.unlock();
+      _applyUpdate(device, state->update);
+      return;
+    }
+
+    // Flag the device before the lookup thread can see it was abandoned,
+    // otherwise a late update could be overwritten.
+    {
+      std::lock_guard<std::mutex> updateLock(DeviceRegistry::instance().updateMutex());
+
+      state->abandoned = true;
+      device->incomplete = true;
+    }
+
+    CORE_WARNING("Lookup for " + device->uid + " missed the scan deadline");
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Scanning
+  ////////////////////////////////////////////////////////////////////////////////
+  static std::atomic<uint64_t> gOSCalls(0);
+
+  void countOSCall(unsigned calls)
+  {
+    gOSCalls.fetch_add(calls, std::memory_order_relaxed);
+  }
+
+  uint64_t osCallCount()
+  {
+    return gOSCalls.load(std::memory_order_relaxed);
+  }
+
+  std::string firstMountPoint(const std::vector<Volume> &volumes)
+  {
+    for(const Volume &volume : volumes) {
+      if(!volume.mountPoints.empty())
+        return volume.mountPoints.front();
+    }
+
+    return "";
+  }
+
+  const FieldSource FIELD_SOURCES[] = {
+    { "productId", 0 },
+    { "vendorId", 0 },
+    { "product", 0 },
+    { "serialNumber", 0 },
+    { "manufacturer", 0 },
+    { "mount", LIVE_MOUNT },
+    { "volumes", LIVE_MOUNT },
+    { "tty", 0 },
+    { "hidraw", 0 },
+    { "block", LIVE_BLOCK },
+  };
+
+  const size_t FIELD_SOURCE_COUNT = sizeof(FIELD_SOURCES) / sizeof(FIELD_SOURCES[0]);
+
+  const char *fieldSource(const USBDevice &device, const FieldSource &field)
+  {
+    return (device.liveFields & field.liveField) ? "device" : "cache";
+  }
+
+  int64_t epochMilliseconds(std::chrono::steady_clock::time_point time)
+  {
+    using namespace std::chrono;
+
+    system_clock::time_point wallTime = system_clock::now() -
+      duration_cast<system_clock::duration>(steady_clock::now() - time);
+
+    return duration_cast<milliseconds>(wallTime.time_since_epoch()).count();
+  }
+
+  USBDevicePtr DeviceScanner::next()
+  {
+    if(!m_open)
+      return nullptr;
+
+    USBDevicePtr device = fetch();
+
+    if(device == nullptr) {
+      close();
+      return nullptr;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    {
+      // Other scans and refreshes share the device
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+      device->refreshedAt = now;
+    }
+
+    if(m_deviceCount++ == 0)
+      m_firstDevice = now;
+
+    return device;
+  }
+
+  void DeviceScanner::close()
+  {
+    if(m_open) {
+      release();
+
+      m_open = false;
+      m_closed = std::chrono::steady_clock::now();
+      m_osCallsAtClose = osCallCount();
+
+      ChangeDetector::instance().endObservation(m_observation);
+    }
+  }
+
+  ScanMetrics DeviceScanner::metrics() const
+  {
+    using std::chrono::microseconds;
+    using std::chrono::duration_cast;
+
+    auto end = m_open ? std::chrono::steady_clock::now() : m_closed;
+
+    ScanMetrics metrics;
+    metrics.deviceCount = m_deviceCount;
+    metrics.firstDevice = m_deviceCount > 0 ? duration_cast<microseconds>(m_firstDevice - m_started)
+                                            : microseconds::zero();
+    metrics.total       = duration_cast<microseconds>(end - m_started);
+    metrics.osCalls     = (m_open ? osCallCount() : m_osCallsAtClose) - m_osCallsAtStart;
+
+    return metrics;
+  }
+
+  std::chrono::steady_clock::time_point DeviceScanner::deadline() const
+  {
+    if (m_options.deadline == std::chrono::milliseconds::zero())
+      return std::chrono::steady_clock::time_point::max();
+
+    // Each device gets the whole budget, counted from when its lookups start
+    return std::chrono::steady_clock::now() + m_options.deadline;
+  }
+
+  std::vector<USBDevicePtr> getDevices(const ScanOptions &options)
+  {
+    Utils::TraceSpan span("getDevices");
+
+    // Taken first, so changes during the scan aren't lost
+    uint64_t token = ChangeDetector::instance().token();
+
+    std::vector<USBDevicePtr> devices;
+    DeviceScanner scanner(options);
+
+    while(auto device = scanner.next()) {
+      devices.push_back(device);
+    }
+
+    ScanMetrics metrics = scanner.metrics();
+
+    CORE_DEBUG("Scanned " + std::to_string(devices.size()) + " devices in " +
+               std::to_string(metrics.total.count()) + "us with " +
+               std::to_string(metrics.osCalls) + " OS calls");
+
+    DeviceRegistry::instance().setConnected(devices, token);
+
+    return devices;
+  }
 }
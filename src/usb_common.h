@@ -3,10 +3,70 @@
 
 #include "subdevil.h"
 #include <string>
+#include <functional>
+#include <chrono>
+#include <stdint.h>
 
 namespace Subdevil
 {
   std::string uniqueDeviceID(const USBDevicePtr device);
+
+  // Applies the result of a slow lookup to a device
+  typedef std::function<void(USBDevice &)> DeviceUpdate;
+  // A slow lookup, run without touching the device
+  typedef std::function<DeviceUpdate()> SlowLookup;
+
+  /**
+   * Run a lookup that can block on the device, such as resolving its mount
+   * point. Without a deadline the lookup runs inline. Otherwise it is
+   * queued for a small, shared pool of threads; if it doesn't finish by
+   * the deadline the device is flagged incomplete and the update is
+   * applied once the lookup returns. Devices with a lookup still queued or
+   * running, and any device while the queue is full, are flagged
+   * incomplete without starting another one.
+   */
+  void runSlowLookup(const USBDevicePtr &device, const SlowLookup &lookup,
+                     std::chrono::steady_clock::time_point deadline);
+
+  /**
+   * Count calls into the OS for osCallCount(). Backends call this next to
+   * every registry, property or device query they make.
+   */
+  void countOSCall(unsigned calls = 1);
+
+  /**
+   * The first mount point of the first mounted volume, or an empty string.
+   */
+  std::string firstMountPoint(const std::vector<Volume> &volumes);
+
+  /**
+   * Re-read a single device from the OS through its device path, with
+   * slow lookups bounded by the deadline like in a scan. Only this device
+   * is read. Defined by every backend. Returns nullptr if the device is no
+   * longer connected.
+   */
+  USBDevicePtr refreshDevice(const USBDevicePtr &device, std::chrono::steady_clock::time_point deadline);
+
+  // A reported field and the LiveField flag it is read with, 0 for fields
+  // that always come from OS caches
+  typedef struct FieldSource {
+    const char *name;
+    unsigned liveField;
+  } FieldSource;
+
+  extern const FieldSource FIELD_SOURCES[];
+  extern const size_t FIELD_SOURCE_COUNT;
+
+  /**
+   * "device" if the field was read by opening the device, else "cache".
+   */
+  const char *fieldSource(const USBDevice &device, const FieldSource &field);
+
+  /**
+   * Milliseconds since the epoch for a steady clock time point, for
+   * timestamps handed out to callers.
+   */
+  int64_t epochMilliseconds(std::chrono::steady_clock::time_point time);
 }
 
 #endif // _SUBDEVIL_USB_COMMON_H__
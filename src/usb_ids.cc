@@ -0,0 +1,450 @@
+#include "usb_ids.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Index layout
+//
+// [UsbIdsHeader][uint32 seeds[bucketCount]][UsbIdsSlot slots[slotCount]][names]
+//
+// A key is hashed once to pick its bucket, and then again with the bucket's
+// seed to pick its slot. The seeds are chosen at compile time so that no two
+// keys share a slot.
+////////////////////////////////////////////////////////////////////////////////
+static const char INDEX_MAGIC[8] = { 'S', 'D', 'U', 'S', 'B', 'I', 'D', 'X' };
+static const uint32_t INDEX_VERSION = 1;
+static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+// Vendor and product keys live in separate ranges
+static const uint64_t VENDOR_KEY  = 1ULL << 32;
+static const uint64_t PRODUCT_KEY = 2ULL << 32;
+
+namespace Subdevil
+{
+  struct UsbIdsHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucketCount;
+    uint32_t slotCount;
+    uint32_t stringsSize;
+    uint64_t sourceSize;   // Size of the usb.ids file the index was built from.
+    int64_t sourceMtime;   // Modification time of that usb.ids file.
+  };
+
+  struct UsbIdsSlot {
+    uint64_t key;
+    uint32_t nameOffset;   // Offset into the names, EMPTY_SLOT if unused.
+    uint32_t reserved;
+  };
+
+  static inline uint64_t _vendorKey(int vendorID)
+  {
+    return VENDOR_KEY | static_cast<uint16_t>(vendorID);
+  }
+
+  static inline uint64_t _productKey(int vendorID, int productID)
+  {
+    return PRODUCT_KEY | (static_cast<uint64_t>(static_cast<uint16_t>(vendorID)) << 16) |
+      static_cast<uint16_t>(productID);
+  }
+
+  static inline uint64_t _hash(uint64_t key, uint64_t seed)
+  {
+    // splitmix64 finalizer
+    uint64_t h = key + 0x9E3779B97F4A7C15ULL * (seed + 1);
+
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+
+    return h ^ (h >> 31);
+  }
+
+  static inline size_t _align8(size_t offset)
+  {
+    return (offset + 7) & ~static_cast<size_t>(7);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Compiling
+  ////////////////////////////////////////////////////////////////////////////////
+  static bool _parseHex4(const char *p, int &value)
+  {
+    value = 0;
+
+    for (int i = 0; i < 4; ++i) {
+      char c = p[i];
+      int digit;
+
+      if (c >= '0' && c <= '9')      digit = c - '0';
+      else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+      else return false;
+
+      value = (value << 4) | digit;
+    }
+
+    return true;
+  }
+
+  /**
+   * Parse the vendor/product part of usb.ids into keys and a names blob.
+   * Other sections (classes, HID usages, languages...) are skipped. Keys
+   * are unique: of repeated vendor or product lines, the first is kept.
+   */
+  static void _parseUsbIds(const std::string &text, std::vector<uint64_t> &keys,
+                           std::vector<uint32_t> &offsets, std::string &names)
+  {
+    std::unordered_map<std::string, uint32_t> nameOffsets;
+    std::unordered_set<uint64_t> seen;
+    int vendorID = -1;
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+      size_t end = text.find('\n', pos);
+      if (end == std::string::npos)
+        end = text.size();
+
+      const char *line = text.c_str() + pos;
+      size_t len = end - pos;
+      pos = end + 1;
+
+      if (len > 0 && line[len - 1] == '\r')
+        --len;
+
+      if (len == 0 || line[0] == '#')
+        continue;
+
+      bool isProduct = line[0] == '\t';
+      const char *entry = isProduct ? line + 1 : line;
+      size_t entryLen = isProduct ? len - 1 : len;
+      int id;
+
+      // Entries are "xxxx  Name"
+      if (entryLen < 7 || entry[0] == '\t' || entry[4] != ' ' || entry[5] != ' ' ||
+          !_parseHex4(entry, id)) {
+        if (!isProduct) {
+          // Start of another section
+          vendorID = -1;
+        }
+        continue;
+      }
+
+      if (isProduct && vendorID < 0)
+        continue;
+
+      if (!isProduct)
+        vendorID = id;
+
+      uint64_t key = isProduct ? _productKey(vendorID, id) : _vendorKey(id);
+
+      // The perfect hash can't tell equal keys apart
+      if (!seen.insert(key).second)
+        continue;
+
+      std::string name(entry + 6, entryLen - 6);
+
+      auto inserted = nameOffsets.insert(std::make_pair(name, static_cast<uint32_t>(names.size())));
+      if (inserted.second) {
+        names.append(name);
+        names.push_back('\0');
+      }
+
+      keys.push_back(key);
+      offsets.push_back(inserted.first->second);
+    }
+  }
+
+  /**
+   * Build the index image for the given usb.ids contents. Uses hash and
+   * displace: buckets are placed largest first, each trying seeds until
+   * all of its keys land in free slots.
+   */
+  // Buckets of distinct keys are placed within a few hundred seeds, this
+  // only stops a hopeless search
+  static const uint32_t MAX_SEED_ATTEMPTS = 1 << 20;
+
+  static bool _compileIndex(const std::string &text, const struct stat &source,
+                            std::vector<char> &image)
+  {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> offsets;
+    std::string names;
+
+    _parseUsbIds(text, keys, offsets, names);
+
+    uint32_t keyCount    = static_cast<uint32_t>(keys.size());
+    uint32_t bucketCount = keyCount / 4 + 1;
+    uint32_t slotCount   = keyCount + keyCount / 4 + 1;
+
+    std::vector<std::vector<uint32_t>> buckets(bucketCount);
+    for (uint32_t i = 0; i < keyCount; ++i) {
+      buckets[_hash(keys[i], 0) % bucketCount].push_back(i);
+    }
+
+    std::vector<uint32_t> order(bucketCount);
+    for (uint32_t b = 0; b < bucketCount; ++b)
+      order[b] = b;
+
+    std::sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+      });
+
+    std::vector<uint32_t> seeds(bucketCount, 0);
+    std::vector<uint32_t> slotKey(slotCount, EMPTY_SLOT);
+    std::vector<uint32_t> placed;
+
+    for (uint32_t b : order) {
+      const std::vector<uint32_t> &bucket = buckets[b];
+
+      if (bucket.empty())
+        break;
+
+      bool found = false;
+
+      for (uint32_t seed = 1; seed <= MAX_SEED_ATTEMPTS && !found; ++seed) {
+        placed.clear();
+        found = true;
+
+        for (uint32_t k : bucket) {
+          uint32_t slot = static_cast<uint32_t>(_hash(keys[k], seed) % slotCount);
+
+          if (slotKey[slot] != EMPTY_SLOT) {
+            found = false;
+            break;
+          }
+
+          slotKey[slot] = k;
+          placed.push_back(slot);
+        }
+
+        if (!found) {
+          for (uint32_t slot : placed)
+            slotKey[slot] = EMPTY_SLOT;
+        } else {
+          seeds[b] = seed;
+        }
+      }
+
+      if (!found) {
+        CORE_ERROR("Failed to find a perfect hash for the usb.ids index");
+        return false;
+      }
+    }
+
+    size_t seedsOffset   = _align8(sizeof(UsbIdsHeader));
+    size_t slotsOffset   = _align8(seedsOffset + bucketCount * sizeof(uint32_t));
+    size_t stringsOffset = slotsOffset + slotCount * sizeof(UsbIdsSlot);
+
+    image.assign(stringsOffset + names.size(), 0);
+
+    UsbIdsHeader *header = reinterpret_cast<UsbIdsHeader *>(&image[0]);
+    memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header->version     = INDEX_VERSION;
+    header->bucketCount = bucketCount;
+    header->slotCount   = slotCount;
+    header->stringsSize = static_cast<uint32_t>(names.size());
+    header->sourceSize  = static_cast<uint64_t>(source.st_size);
+    header->sourceMtime = static_cast<int64_t>(source.st_mtime);
+
+    memcpy(&image[seedsOffset], &seeds[0], bucketCount * sizeof(uint32_t));
+
+    UsbIdsSlot *slots = reinterpret_cast<UsbIdsSlot *>(&image[slotsOffset]);
+    for (uint32_t s = 0; s < slotCount; ++s) {
+      if (slotKey[s] == EMPTY_SLOT) {
+        slots[s].key = 0;
+        slots[s].nameOffset = EMPTY_SLOT;
+      } else {
+        slots[s].key = keys[slotKey[s]];
+        slots[s].nameOffset = offsets[slotKey[s]];
+      }
+    }
+
+    if (!names.empty())
+      memcpy(&image[stringsOffset], names.data(), names.size());
+
+    CORE_DEBUG("Compiled usb.ids index with " + std::to_string(keyCount) + " entries");
+
+    return true;
+  }
+
+  static bool _readFile(const std::string &path, std::string &contents)
+  {
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (file == NULL)
+      return false;
+
+    char buf[65536];
+    size_t n;
+
+    contents.clear();
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      contents.append(buf, n);
+    }
+
+    bool ok = !ferror(file);
+    fclose(file);
+
+    return ok;
+  }
+
+  static bool _writeFile(const std::string &path, const std::vector<char> &image)
+  {
+    // Write next to the target and rename, so readers never see a partial index
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "wb");
+
+    if (file == NULL)
+      return false;
+
+    bool ok = fwrite(&image[0], 1, image.size(), file) == image.size();
+    ok = fclose(file) == 0 && ok;
+
+    if (ok && rename(tmpPath.c_str(), path.c_str()) != 0) {
+      // Windows refuses to rename over an existing file
+      remove(path.c_str());
+      ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+    if (!ok)
+      remove(tmpPath.c_str());
+
+    return ok;
+  }
+
+  static bool _isCurrent(const char *image, size_t size, const struct stat &source)
+  {
+    if (size < sizeof(UsbIdsHeader))
+      return false;
+
+    const UsbIdsHeader *header = reinterpret_cast<const UsbIdsHeader *>(image);
+
+    return memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+      header->version == INDEX_VERSION &&
+      header->sourceSize == static_cast<uint64_t>(source.st_size) &&
+      header->sourceMtime == static_cast<int64_t>(source.st_mtime);
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Database
+  ////////////////////////////////////////////////////////////////////////////////
+  UsbIdsDatabase::UsbIdsDatabase()
+    : m_pImage(nullptr), m_pSeeds(nullptr), m_pSlots(nullptr), m_pStrings(nullptr),
+      m_bucketCount(0), m_slotCount(0), m_stringsSize(0)
+  {
+  }
+
+  bool UsbIdsDatabase::load(const std::string &idsPath, const std::string &indexPath)
+  {
+    unload();
+
+    struct stat source;
+
+    if (stat(idsPath.c_str(), &source) != 0) {
+      CORE_ERROR("Failed to stat usb.ids file " + idsPath + ": " + strerror(errno));
+      return false;
+    }
+
+    struct stat index;
+
+    if (stat(indexPath.c_str(), &index) == 0 && m_file.open(indexPath) &&
+        _isCurrent(m_file.data(), m_file.size(), source)) {
+      CORE_DEBUG("Using usb.ids index " + indexPath);
+      return attach(m_file.data(), m_file.size());
+    }
+
+    m_file.close();
+
+    std::string text;
+    if (!_readFile(idsPath, text)) {
+      CORE_ERROR("Failed to read usb.ids file " + idsPath);
+      return false;
+    }
+
+    std::vector<char> image;
+    if (!_compileIndex(text, source, image))
+      return false;
+
+    if (_writeFile(indexPath, image) && m_file.open(indexPath)) {
+      return attach(m_file.data(), m_file.size());
+    }
+
+    CORE_WARNING("Failed to write usb.ids index " + indexPath + ", keeping it in memory");
+
+    m_memoryImage.swap(image);
+
+    return attach(&m_memoryImage[0], m_memoryImage.size());
+  }
+
+  void UsbIdsDatabase::unload()
+  {
+    m_pImage = nullptr;
+    m_file.close();
+    m_memoryImage.clear();
+  }
+
+  bool UsbIdsDatabase::attach(const char *image, size_t size)
+  {
+    const UsbIdsHeader *header = reinterpret_cast<const UsbIdsHeader *>(image);
+
+    size_t seedsOffset   = _align8(sizeof(UsbIdsHeader));
+    size_t slotsOffset   = _align8(seedsOffset + header->bucketCount * sizeof(uint32_t));
+    size_t stringsOffset = slotsOffset + header->slotCount * sizeof(UsbIdsSlot);
+
+    if (header->bucketCount == 0 || header->slotCount == 0 ||
+        stringsOffset + header->stringsSize > size) {
+      CORE_ERROR("Corrupt usb.ids index");
+      unload();
+      return false;
+    }
+
+    m_pImage      = image;
+    m_bucketCount = header->bucketCount;
+    m_slotCount   = header->slotCount;
+    m_stringsSize = header->stringsSize;
+    m_pSeeds      = reinterpret_cast<const uint32_t *>(image + seedsOffset);
+    m_pSlots      = reinterpret_cast<const UsbIdsSlot *>(image + slotsOffset);
+    m_pStrings    = image + stringsOffset;
+
+    return true;
+  }
+
+  const char *UsbIdsDatabase::lookup(uint64_t key) const
+  {
+    if (m_pImage == nullptr)
+      return nullptr;
+
+    uint32_t seed = m_pSeeds[_hash(key, 0) % m_bucketCount];
+    const UsbIdsSlot &slot = m_pSlots[_hash(key, seed) % m_slotCount];
+
+    if (slot.key != key || slot.nameOffset >= m_stringsSize)
+      return nullptr;
+
+    return m_pStrings + slot.nameOffset;
+  }
+
+  const char *UsbIdsDatabase::vendorName(int vendorID) const
+  {
+    return lookup(_vendorKey(vendorID));
+  }
+
+  const char *UsbIdsDatabase::productName(int vendorID, int productID) const
+  {
+    return lookup(_productKey(vendorID, productID));
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef _SUBDEVIL_USB_IDS_H__
+#define _SUBDEVIL_USB_IDS_H__
+
+#include "utils/mapped_file.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace Subdevil
+{
+  struct UsbIdsSlot;
+
+  /**
+   * Vendor and product names from a usb.ids database
+   * (http://www.linux-usb.org/usb-ids.html).
+   *
+   * The text file is compiled once into a binary index with a perfect
+   * hash over the vendor and product IDs. The index is memory mapped, so
+   * lookups are a couple of array reads and never allocate.
+   */
+  class UsbIdsDatabase
+  {
+  public:
+    static UsbIdsDatabase &instance()
+    {
+      static UsbIdsDatabase instance;
+      return instance;
+    }
+
+    /**
+     * Use the usb.ids file at idsPath. The compiled index is read from
+     * indexPath, and rebuilt from idsPath first if it is missing or out of
+     * date. If the index can't be written, it is kept in memory instead.
+     */
+    bool load(const std::string &idsPath, const std::string &indexPath);
+    void unload();
+
+    /**
+     * Get the vendor name for a vendor ID, or nullptr if unknown.
+     */
+    const char *vendorName(int vendorID) const;
+    /**
+     * Get the product name for a vendor and product ID pair, or nullptr
+     * if unknown.
+     */
+    const char *productName(int vendorID, int productID) const;
+
+  private:
+    UsbIdsDatabase();
+    UsbIdsDatabase(const UsbIdsDatabase &);
+    UsbIdsDatabase &operator=(const UsbIdsDatabase &);
+
+    bool attach(const char *image, size_t size);
+    const char *lookup(uint64_t key) const;
+
+    Utils::MappedFile m_file;
+    std::vector<char> m_memoryImage;  // Used when the index can't be written
+
+    const char *m_pImage;
+    const uint32_t *m_pSeeds;
+    const UsbIdsSlot *m_pSlots;
+    const char *m_pStrings;
+    uint32_t m_bucketCount;
+    uint32_t m_slotCount;
+    uint32_t m_stringsSize;
+  };
+}
+
+#endif // _SUBDEVIL_USB_IDS_H__
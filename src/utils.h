@@ -3,5 +3,6 @@
 
 #include "utils/logger.h"
 #include "utils/formatters.h"
+#include "utils/trace.h"
 
 #endif // _SUBDEVIL_UTILS_H__
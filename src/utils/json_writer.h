@@ -0,0 +1,235 @@
+#ifndef _SUBDEVIL_UTILS_JSON_WRITER_H__
+#define _SUBDEVIL_UTILS_JSON_WRITER_H__
+
+#include <string>
+#include <string.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// JSON output
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    /**
+     * Streaming JSON writer. Output is collected in a fixed buffer and
+     * written to the stream when it fills up or on flush(), so writing a
+     * document doesn't allocate. Commas are inserted automatically.
+     * Strings are expected in UTF-8; invalid bytes, as found in serial
+     * numbers of cheap devices, are written as U+FFFD.
+     */
+    class JsonWriter
+    {
+    public:
+      explicit JsonWriter(FILE *stream)
+        : m_pStream(stream), m_length(0), m_depth(0), m_needComma(false) {}
+
+      ~JsonWriter() { flush(); }
+
+      void beginObject() { separate(); put('{'); open(); }
+      void endObject()   { close(); put('}'); }
+      void beginArray()  { separate(); put('['); open(); }
+      void endArray()    { close(); put(']'); }
+
+      void key(const char *name)
+      {
+        separate();
+        quoted(name, strlen(name));
+        put(':');
+        m_needComma = false;
+      }
+
+      void string(const char *value, size_t len) { separate(); quoted(value, len); }
+      void string(const std::string &value) { string(value.data(), value.size()); }
+      void string(const char *value) { string(value, strlen(value)); }
+
+      void number(long long value)
+      {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", value);
+
+        separate();
+        write(buf, static_cast<size_t>(len));
+      }
+
+      void boolean(bool value)
+      {
+        separate();
+        value ? write("true", 4) : write("false", 5);
+      }
+
+      void null() { separate(); write("null", 4); }
+
+      /**
+       * End a top level value with a newline, as used by NDJSON.
+       */
+      void newline()
+      {
+        put('\n');
+        m_needComma = false;
+      }
+
+      void flush()
+      {
+        if (m_length > 0) {
+          fwrite(m_buffer, 1, m_length, m_pStream);
+          m_length = 0;
+        }
+
+        fflush(m_pStream);
+      }
+
+    private:
+      JsonWriter(const JsonWriter &);
+      JsonWriter &operator=(const JsonWriter &);
+
+      void open()  { ++m_depth; m_needComma = false; }
+      void close() { --m_depth; m_needComma = true; }
+
+      // Called before every value; values in containers are comma separated
+      void separate()
+      {
+        if (m_needComma && m_depth > 0)
+          put(',');
+
+        m_needComma = true;
+      }
+
+      /**
+       * Length of the UTF-8 sequence at p if it is valid. Otherwise 0, with
+       * *invalid set to the number of bytes a single U+FFFD replaces: the
+       * lead byte and the continuation bytes that could still have
+       * completed it.
+       */
+      static size_t utf8Sequence(const unsigned char *p, const unsigned char *end, size_t *invalid)
+      {
+        unsigned char c = p[0];
+        unsigned char lo = 0x80, hi = 0xBF;
+        size_t len;
+
+        // No overlong forms, surrogates or code points past U+10FFFF
+        if (c >= 0xC2 && c <= 0xDF) {
+          len = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+          len = 3;
+          if (c == 0xE0) lo = 0xA0;
+          if (c == 0xED) hi = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+          len = 4;
+          if (c == 0xF0) lo = 0x90;
+          if (c == 0xF4) hi = 0x8F;
+        } else {
+          *invalid = 1;
+          return 0;
+        }
+
+        for (size_t i = 1; i < len; ++i) {
+          if (p + i >= end || p[i] < lo || p[i] > hi) {
+            *invalid = i;
+            return 0;
+          }
+
+          lo = 0x80;
+          hi = 0xBF;
+        }
+
+        return len;
+      }
+
+      void quoted(const char *str, size_t len)
+      {
+        static const char HEX[] = "0123456789abcdef";
+
+        put('"');
+
+        const char *run = str;
+        const char *end = str + len;
+
+        for (const char *p = str; p < end; ++p) {
+          unsigned char c = static_cast<unsigned char>(*p);
+
+          if (c >= 0x80) {
+            const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+            size_t invalid;
+            size_t n = utf8Sequence(u, reinterpret_cast<const unsigned char *>(end), &invalid);
+
+            if (n > 0) {
+              p += n - 1;
+              continue;
+            }
+
+            write(run, static_cast<size_t>(p - run));
+            write("\xEF\xBF\xBD", 3);
+            p += invalid - 1;
+            run = p + 1;
+            continue;
+          }
+
+          if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+          // Copy the unescaped run in one go
+          write(run, static_cast<size_t>(p - run));
+          run = p + 1;
+
+          switch (c) {
+          case '"':  write("\\\"", 2); break;
+          case '\\': write("\\\\", 2); break;
+          case '\b': write("\\b", 2); break;
+          case '\f': write("\\f", 2); break;
+          case '\n': write("\\n", 2); break;
+          case '\r': write("\\r", 2); break;
+          case '\t': write("\\t", 2); break;
+          default: {
+            char escaped[6] = { '\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 0xF] };
+            write(escaped, sizeof(escaped));
+          }
+          }
+        }
+
+        write(run, static_cast<size_t>(end - run));
+        put('"');
+      }
+
+      void put(char c)
+      {
+        if (m_length == sizeof(m_buffer))
+          drain();
+
+        m_buffer[m_length++] = c;
+      }
+
+      void write(const char *data, size_t len)
+      {
+        while (len > 0) {
+          if (m_length == sizeof(m_buffer))
+            drain();
+
+          size_t n = sizeof(m_buffer) - m_length;
+          if (n > len)
+            n = len;
+
+          memcpy(m_buffer + m_length, data, n);
+          m_length += n;
+          data += n;
+          len -= n;
+        }
+      }
+
+      void drain()
+      {
+        fwrite(m_buffer, 1, m_length, m_pStream);
+        m_length = 0;
+      }
+
+      FILE *m_pStream;
+      char m_buffer[16384];
+      size_t m_length;
+      int m_depth;
+      bool m_needComma;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_JSON_WRITER_H__
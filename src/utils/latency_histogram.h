@@ -0,0 +1,121 @@
+#ifndef _SUBDEVIL_UTILS_LATENCY_HISTOGRAM_H__
+#define _SUBDEVIL_UTILS_LATENCY_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Latency histogram
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    /**
+     * Fixed size histogram of microsecond latencies. Buckets are spaced
+     * logarithmically with eight linear steps per power of two, so
+     * percentiles are within 12.5% of the recorded values whatever their
+     * range, and recording never allocates. Not thread safe.
+     */
+    class LatencyHistogram
+    {
+    public:
+      LatencyHistogram() { reset(); }
+
+      void reset()
+      {
+        memset(m_buckets, 0, sizeof(m_buckets));
+        m_count = 0;
+        m_max = 0;
+      }
+
+      void record(int64_t us)
+      {
+        uint64_t value = us > 0 ? static_cast<uint64_t>(us) : 0;
+
+        m_buckets[bucket(value)]++;
+        m_count++;
+
+        if (value > m_max)
+          m_max = value;
+      }
+
+      uint64_t count() const { return m_count; }
+      uint64_t max() const { return m_max; }
+
+      /**
+       * The upper bound of the bucket holding the given percentile
+       * (0-100), or 0 without samples.
+       */
+      uint64_t percentile(double p) const
+      {
+        if (m_count == 0)
+          return 0;
+
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(m_count) + 0.5);
+        uint64_t seen = 0;
+
+        if (rank < 1)
+          rank = 1;
+
+        for (int i = 0; i < BUCKETS; i++) {
+          seen += m_buckets[i];
+
+          if (seen >= rank) {
+            uint64_t bound = upperBound(i);
+            return bound < m_max ? bound : m_max;
+          }
+        }
+
+        return m_max;
+      }
+
+    private:
+      static const int SUB_BITS = 3;
+      static const int SUB_BUCKETS = 1 << SUB_BITS;
+      static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+      static int bucket(uint64_t value)
+      {
+        // Values below SUB_BUCKETS get a bucket each
+        if (value < SUB_BUCKETS)
+          return static_cast<int>(value);
+
+        int exponent = 63 - leadingZeros(value);
+        int shift = exponent - SUB_BITS;
+        int sub = static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+
+        return (shift + 1) * SUB_BUCKETS + sub;
+      }
+
+      static uint64_t upperBound(int index)
+      {
+        if (index < SUB_BUCKETS)
+          return static_cast<uint64_t>(index);
+
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t sub = static_cast<uint64_t>(index % SUB_BUCKETS);
+
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+      }
+
+      static int leadingZeros(uint64_t value)
+      {
+        int n = 0;
+
+        while (!(value & (1ULL << 63))) {
+          value <<= 1;
+          n++;
+        }
+
+        return n;
+      }
+
+      uint64_t m_buckets[BUCKETS];
+      uint64_t m_count;
+      uint64_t m_max;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_LATENCY_HISTOGRAM_H__
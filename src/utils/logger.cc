@@ -1,4 +1,5 @@
 #include "logger.h"
+#include "ring_log.h"
 
 #include <errno.h>
 #include <string.h>
@@ -7,18 +8,63 @@ Logger::Logger()
 {
   // Default to STDOUT
   m_pLogFile = stdout;
+  m_ownsLogFile = false;
 }
 
 Logger::~Logger()
 {
-  if(m_pLogFile != stdout || m_pLogFile != stderr) {
+  closeLogFile();
+}
+
+void Logger::closeLogFile()
+{
+  if(m_ownsLogFile) {
     fclose(m_pLogFile);
+    m_ownsLogFile = false;
   }
 }
 
 void Logger::setLogFile(const char *filename)
 {
-  m_pLogFile = loadFileStream(m_pLogFile, filename);
+  // Opened before locking, so a failure can be logged to the current output
+  FILE *stream = loadFileStream(NULL, filename);
+
+  std::lock_guard<std::mutex> lock(m_outputMutex);
+
+  if(stream != NULL) {
+    closeLogFile();
+
+    m_pLogFile = stream;
+    m_ownsLogFile = true;
+  }
+
+  m_pRing.reset();
+}
+
+void Logger::setLogStream(FILE *stream)
+{
+  std::lock_guard<std::mutex> lock(m_outputMutex);
+
+  closeLogFile();
+
+  m_pLogFile = stream;
+  m_pRing.reset();
+}
+
+bool Logger::setLogRing(const char *filename, size_t size)
+{
+  std::unique_ptr<Subdevil::Utils::RingLog> ring(new Subdevil::Utils::RingLog());
+
+  if(!ring->open(filename, size)) {
+    CORE_ERROR("Failed to open ring log file: " + std::string(filename));
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(m_outputMutex);
+
+  m_pRing = std::move(ring);
+
+  return true;
 }
 
 void Logger::log(const std::string &tag, const std::string &msg,
@@ -28,12 +74,22 @@ void Logger::log(const std::string &tag, const std::string &msg,
 
   fillOutputBuffer(outputBuffer, tag, msg, funcName, sourceFile, lineNum);
 
-  fprintf(m_pLogFile, "%s", outputBuffer.c_str());
+  std::lock_guard<std::mutex> lock(m_outputMutex);
+
+  if(m_pRing) {
+    m_pRing->write(outputBuffer.data(), outputBuffer.size());
+  } else {
+    fprintf(m_pLogFile, "%s", outputBuffer.c_str());
+  }
 }
 
 void Logger::flush()
 {
-  fflush(m_pLogFile);
+  std::lock_guard<std::mutex> lock(m_outputMutex);
+
+  // The ring is written through to the mapping
+  if(!m_pRing)
+    fflush(m_pLogFile);
 }
 
 void Logger::fillOutputBuffer(std::string &outputBuffer, const std::string &tag,
@@ -65,7 +121,8 @@ void Logger::fillOutputBuffer(std::string &outputBuffer, const std::string &tag,
 
 FILE *Logger::loadFileStream(FILE *stream, const char *filename)
 {
-  FILE *newStream = fopen(filename, "w");
+  // Append, so restarts don't wipe out the log of the previous run
+  FILE *newStream = fopen(filename, "a");
 
   if(newStream == NULL) {
     CORE_ERROR("Failed to open logger file: " + std::string(filename) +
@@ -1,9 +1,13 @@
 #ifndef _SUBDEVIL_UTILS_LOGGER_H__
 #define _SUBDEVIL_UTILS_LOGGER_H__
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include <stdio.h>
 
+namespace Subdevil { namespace Utils { class RingLog; } }
+
 ////////////////////////////////////////////////////////////////////////////////
 // Logging
 ////////////////////////////////////////////////////////////////////////////////
@@ -18,7 +22,17 @@ class Logger
 
   ~Logger();
 
+  /**
+   * Append to the given file. Falls back to the current output if the
+   * file can't be opened.
+   */
   void setLogFile(const char *filename);
+  void setLogStream(FILE *stream);
+  /**
+   * Log to a memory mapped ring file of the given size instead, which
+   * survives crashes and never grows. See Subdevil::Utils::RingLog.
+   */
+  bool setLogRing(const char *filename, size_t size);
 
   void log(const std::string &tag, const std::string &msg,
            const char *funcName, const char *sourceFile, unsigned int lineNum);
@@ -38,7 +52,14 @@ class Logger
 
   inline FILE *loadFileStream(FILE *stream, const char *filename);
 
+  void closeLogFile();
+
+  // Held while writing to or swapping the output, which threads log to
+  // at any time
+  std::mutex m_outputMutex;
   FILE *m_pLogFile;
+  bool m_ownsLogFile;
+  std::unique_ptr<Subdevil::Utils::RingLog> m_pRing;
 };
 
 #ifndef NDEBUG // If in debug mode
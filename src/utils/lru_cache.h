@@ -0,0 +1,174 @@
+#ifndef _SUBDEVIL_UTILS_LRU_CACHE_H__
+#define _SUBDEVIL_UTILS_LRU_CACHE_H__
+
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// LRU cache
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    typedef struct LruCacheStats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+    } LruCacheStats;
+
+    /**
+     * Thread safe map that holds at most a given number of values, and
+     * drops the least recently used one to make room. Values are handed
+     * out by copy, so to cache OS handles, store them in a shared_ptr
+     * that releases the handle: one evicted while in use is released by
+     * its last user.
+     */
+    template<typename Key, typename Value>
+    class LruCache
+    {
+    public:
+      explicit LruCache(size_t capacity) : m_capacity(capacity), m_stats() {}
+
+      /**
+       * Copy the value for the key into *value and mark it as most
+       * recently used. Returns false on a miss.
+       */
+      bool get(const Key &key, Value *value)
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(key);
+
+        if (it == m_index.end()) {
+          m_stats.misses++;
+          return false;
+        }
+
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        *value = it->second->second;
+        m_stats.hits++;
+
+        return true;
+      }
+
+      void put(const Key &key, const Value &value)
+      {
+        std::list<Entry> evicted;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(key);
+
+        // The replaced value goes like an evicted one, after the lock
+        if (it != m_index.end()) {
+          evicted.splice(evicted.begin(), m_entries, it->second);
+          m_index.erase(it);
+        }
+
+        if (m_capacity == 0)
+          return;
+
+        m_entries.push_front(std::make_pair(key, value));
+        m_index[key] = m_entries.begin();
+
+        trim(evicted);
+      }
+
+      void erase(const Key &key)
+      {
+        std::list<Entry> erased;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_index.find(key);
+
+        if (it != m_index.end()) {
+          erased.splice(erased.begin(), m_entries, it->second);
+          m_index.erase(it);
+        }
+      }
+
+      /**
+       * Drop every value the predicate returns true for.
+       */
+      void eraseIf(const std::function<bool(const Key &, const Value &)> &predicate)
+      {
+        std::list<Entry> erased;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+          auto next = std::next(it);
+
+          if (predicate(it->first, it->second)) {
+            m_index.erase(it->first);
+            erased.splice(erased.begin(), m_entries, it);
+          }
+
+          it = next;
+        }
+      }
+
+      void clear()
+      {
+        std::list<Entry> erased;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        erased.swap(m_entries);
+        m_index.clear();
+      }
+
+      /**
+       * Change the number of values kept, evicting the least recently
+       * used ones if there are more. 0 disables the cache.
+       */
+      void setCapacity(size_t capacity)
+      {
+        std::list<Entry> evicted;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_capacity = capacity;
+        trim(evicted);
+      }
+
+      size_t size() const
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.size();
+      }
+
+      LruCacheStats stats() const
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stats;
+      }
+
+    private:
+      LruCache(const LruCache &);
+      LruCache &operator=(const LruCache &);
+
+      typedef std::pair<Key, Value> Entry;
+
+      // Dropped values are moved out, so they are destroyed after the lock
+      // is released: releasing a handle may call into the OS
+      void trim(std::list<Entry> &evicted)
+      {
+        while (m_entries.size() > m_capacity) {
+          auto last = std::prev(m_entries.end());
+
+          m_index.erase(last->first);
+          evicted.splice(evicted.begin(), m_entries, last);
+          m_stats.evictions++;
+        }
+      }
+
+      mutable std::mutex m_mutex;
+      size_t m_capacity;
+      std::list<Entry> m_entries;  // Most recently used first.
+      std::unordered_map<Key, typename std::list<Entry>::iterator> m_index;
+      LruCacheStats m_stats;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_LRU_CACHE_H__
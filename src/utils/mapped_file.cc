@@ -0,0 +1,173 @@
+#include "mapped_file.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace Subdevil
+{
+  namespace Utils
+  {
+    MappedFile::MappedFile()
+      : m_pData(nullptr), m_size(0)
+#ifdef _WIN32
+      , m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL)
+#endif
+    {
+    }
+
+    MappedFile::~MappedFile()
+    {
+      close();
+    }
+
+#ifdef _WIN32
+    bool MappedFile::open(const std::string &path, Mode mode, size_t size)
+    {
+      close();
+
+      bool writable = mode == READ_WRITE;
+
+      HANDLE hFile = CreateFileA(path.c_str(),
+                                 writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                 writable ? OPEN_ALWAYS : OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL, NULL);
+
+      if (hFile == INVALID_HANDLE_VALUE) {
+        CORE_ERROR("Failed to open " + path + " for mapping");
+        return false;
+      }
+
+      LARGE_INTEGER fileSize;
+
+      if (writable && size > 0) {
+        fileSize.QuadPart = static_cast<LONGLONG>(size);
+
+        if (!SetFilePointerEx(hFile, fileSize, NULL, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+          CORE_ERROR("Failed to resize " + path);
+          CloseHandle(hFile);
+          return false;
+        }
+      } else if (!GetFileSizeEx(hFile, &fileSize)) {
+        CloseHandle(hFile);
+        return false;
+      }
+
+      if (fileSize.QuadPart == 0) {
+        CloseHandle(hFile);
+        return false;
+      }
+
+      HANDLE hMapping = CreateFileMappingA(hFile, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                           0, 0, NULL);
+
+      if (hMapping == NULL) {
+        CORE_ERROR("Failed to create a file mapping for " + path);
+        CloseHandle(hFile);
+        return false;
+      }
+
+      void *data = MapViewOfFile(hMapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+
+      if (data == NULL) {
+        CORE_ERROR("Failed to map " + path);
+        CloseHandle(hMapping);
+        CloseHandle(hFile);
+        return false;
+      }
+
+      m_hFile    = hFile;
+      m_hMapping = hMapping;
+      m_pData    = static_cast<char *>(data);
+      m_size     = static_cast<size_t>(fileSize.QuadPart);
+
+      return true;
+    }
+
+    void MappedFile::close()
+    {
+      if (m_pData != nullptr) {
+        UnmapViewOfFile(m_pData);
+        CloseHandle(m_hMapping);
+        CloseHandle(m_hFile);
+      }
+
+      m_pData    = nullptr;
+      m_size     = 0;
+      m_hFile    = INVALID_HANDLE_VALUE;
+      m_hMapping = NULL;
+    }
+#else
+    bool MappedFile::open(const std::string &path, Mode mode, size_t size)
+    {
+      close();
+
+      bool writable = mode == READ_WRITE;
+      int fd = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+
+      if (fd < 0) {
+        CORE_ERROR("Failed to open " + path + " for mapping: " + strerror(errno));
+        return false;
+      }
+
+      if (writable && size > 0) {
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+          CORE_ERROR("Failed to resize " + path + ": " + strerror(errno));
+          ::close(fd);
+          return false;
+        }
+      } else {
+        struct stat st;
+
+        if (fstat(fd, &st) != 0) {
+          ::close(fd);
+          return false;
+        }
+
+        size = static_cast<size_t>(st.st_size);
+      }
+
+      if (size == 0) {
+        ::close(fd);
+        return false;
+      }
+
+      void *data = mmap(nullptr, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                        MAP_SHARED, fd, 0);
+
+      // The mapping keeps its own reference to the file
+      ::close(fd);
+
+      if (data == MAP_FAILED) {
+        CORE_ERROR("Failed to map " + path + ": " + strerror(errno));
+        return false;
+      }
+
+      m_pData = static_cast<char *>(data);
+      m_size  = size;
+
+      return true;
+    }
+
+    void MappedFile::close()
+    {
+      if (m_pData != nullptr) {
+        munmap(m_pData, m_size);
+      }
+
+      m_pData = nullptr;
+      m_size  = 0;
+    }
+#endif
+  }
+}
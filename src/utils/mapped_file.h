@@ -0,0 +1,52 @@
+#ifndef _SUBDEVIL_UTILS_MAPPED_FILE_H__
+#define _SUBDEVIL_UTILS_MAPPED_FILE_H__
+
+#include <string>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory mapped files
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    class MappedFile
+    {
+    public:
+      enum Mode {
+        READ_ONLY,
+        READ_WRITE  // Changes are written back to the file.
+      };
+
+      MappedFile();
+      ~MappedFile();
+
+      /**
+       * Map the whole file at the given path. In READ_WRITE mode, a
+       * non-zero size creates the file if needed and resizes it to
+       * exactly that many bytes before mapping.
+       */
+      bool open(const std::string &path, Mode mode = READ_ONLY, size_t size = 0);
+      void close();
+
+      bool isOpen() const { return m_pData != nullptr; }
+
+      char *data() const { return m_pData; }
+      size_t size() const { return m_size; }
+
+    private:
+      MappedFile(const MappedFile &);
+      MappedFile &operator=(const MappedFile &);
+
+      char *m_pData;
+      size_t m_size;
+#ifdef _WIN32
+      void *m_hFile;
+      void *m_hMapping;
+#endif
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_MAPPED_FILE_H__
@@ -0,0 +1,164 @@
+#include "ring_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <time.h>
+
+namespace Subdevil
+{
+  namespace Utils
+  {
+    const char RING_LOG_MAGIC[8] = { 'S', 'D', 'V', 'R', 'I', 'N', 'G', '1' };
+    // Marks the start of a record, so the decoder can find the first whole
+    // record after the writer has wrapped over a part of it
+    const uint32_t RECORD_MAGIC = 0x5344564C;
+
+    struct RingLog::Header {
+      char magic[8];
+      uint64_t capacity;  // Size of the record area.
+      uint64_t head;      // Bytes written since the log was created. Only
+                          // updated once a record has been copied in full.
+    };
+
+    struct RecordHeader {
+      uint32_t magic;
+      uint32_t length;    // Length of the message following the header.
+      int64_t timeUs;     // Microseconds since the epoch.
+    };
+
+    RingLog::Header *RingLog::header() const
+    {
+      return reinterpret_cast<Header *>(m_file.data());
+    }
+
+    char *RingLog::records() const
+    {
+      return m_file.data() + sizeof(Header);
+    }
+
+    /**
+     * Copy into the ring at the given absolute position, wrapping around
+     * the end of the record area.
+     */
+    static void _copyIn(char *ring, uint64_t capacity, uint64_t pos, const void *src, size_t len)
+    {
+      size_t offset = static_cast<size_t>(pos % capacity);
+      size_t first = std::min<size_t>(len, static_cast<size_t>(capacity) - offset);
+
+      memcpy(ring + offset, src, first);
+      memcpy(ring, static_cast<const char *>(src) + first, len - first);
+    }
+
+    static void _copyOut(const char *ring, uint64_t capacity, uint64_t pos, void *dst, size_t len)
+    {
+      size_t offset = static_cast<size_t>(pos % capacity);
+      size_t first = std::min<size_t>(len, static_cast<size_t>(capacity) - offset);
+
+      memcpy(dst, ring + offset, first);
+      memcpy(static_cast<char *>(dst) + first, ring, len - first);
+    }
+
+    bool RingLog::open(const std::string &path, size_t capacity)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (capacity <= sizeof(RecordHeader)) {
+        return false;
+      }
+
+      if (!m_file.open(path, MappedFile::READ_WRITE, sizeof(Header) + capacity)) {
+        return false;
+      }
+
+      Header *h = header();
+
+      // Keep the trail of earlier runs
+      if (memcmp(h->magic, RING_LOG_MAGIC, sizeof(h->magic)) != 0 || h->capacity != capacity) {
+        memcpy(h->magic, RING_LOG_MAGIC, sizeof(h->magic));
+        h->capacity = capacity;
+        h->head = 0;
+      }
+
+      return true;
+    }
+
+    void RingLog::write(const char *msg, size_t len)
+    {
+      using namespace std::chrono;
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+
+      if (!m_file.isOpen()) {
+        return;
+      }
+
+      Header *h = header();
+      uint64_t capacity = h->capacity;
+
+      RecordHeader record;
+      record.magic  = RECORD_MAGIC;
+      record.length = static_cast<uint32_t>(std::min<size_t>(len, capacity - sizeof(RecordHeader)));
+      record.timeUs = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+
+      _copyIn(records(), capacity, h->head, &record, sizeof(record));
+      _copyIn(records(), capacity, h->head + sizeof(record), msg, record.length);
+
+      h->head += sizeof(record) + record.length;
+    }
+
+    bool RingLog::decode(const std::string &path, FILE *out)
+    {
+      MappedFile file;
+
+      if (!file.open(path) || file.size() < sizeof(Header)) {
+        return false;
+      }
+
+      const Header *h = reinterpret_cast<const Header *>(file.data());
+
+      if (memcmp(h->magic, RING_LOG_MAGIC, sizeof(h->magic)) != 0 ||
+          h->capacity != file.size() - sizeof(Header)) {
+        return false;
+      }
+
+      const char *ring = file.data() + sizeof(Header);
+      uint64_t capacity = h->capacity;
+      uint64_t head = h->head;
+      uint64_t pos = head > capacity ? head - capacity : 0;
+
+      std::string msg;
+
+      while (pos + sizeof(RecordHeader) <= head) {
+        RecordHeader record;
+        _copyOut(ring, capacity, pos, &record, sizeof(record));
+
+        // Skip over what is left of overwritten records
+        if (record.magic != RECORD_MAGIC || pos + sizeof(record) + record.length > head) {
+          pos++;
+          continue;
+        }
+
+        msg.resize(record.length);
+        _copyOut(ring, capacity, pos + sizeof(record), &msg[0], record.length);
+
+        time_t seconds = static_cast<time_t>(record.timeUs / 1000000);
+        struct tm tm;
+#ifdef _WIN32
+        gmtime_s(&tm, &seconds);
+#else
+        gmtime_r(&seconds, &tm);
+#endif
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+        // Messages end with a new line already
+        fprintf(out, "%s.%06dZ %s", stamp, static_cast<int>(record.timeUs % 1000000), msg.c_str());
+
+        pos += sizeof(record) + record.length;
+      }
+
+      return true;
+    }
+  }
+}
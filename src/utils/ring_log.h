@@ -0,0 +1,68 @@
+#ifndef _SUBDEVIL_UTILS_RING_LOG_H__
+#define _SUBDEVIL_UTILS_RING_LOG_H__
+
+#include "mapped_file.h"
+
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory mapped ring log
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    /**
+     * A fixed size log file used as a ring buffer. Records are copied
+     * straight into a shared mapping of the file, so writing one takes no
+     * system calls and everything written before a crash is still in the
+     * file afterwards. Once full, the oldest records are overwritten.
+     *
+     * The file is binary, decode() turns it back into text.
+     */
+    class RingLog
+    {
+    public:
+      RingLog() {}
+
+      /**
+       * Map the log at the given path with room for capacity bytes of
+       * records. An existing log of the same capacity is appended to,
+       * anything else is reset.
+       */
+      bool open(const std::string &path, size_t capacity);
+      void close() { m_file.close(); }
+
+      bool isOpen() const { return m_file.isOpen(); }
+
+      /**
+       * Append a record, stamped with the current time. Messages longer
+       * than the capacity are truncated.
+       */
+      void write(const char *msg, size_t len);
+
+      /**
+       * Print the records of the log at the given path, oldest first,
+       * one per line prefixed with their time.
+       */
+      static bool decode(const std::string &path, FILE *out);
+
+    private:
+      RingLog(const RingLog &);
+      RingLog &operator=(const RingLog &);
+
+      struct Header;
+
+      Header *header() const;
+      char *records() const;
+
+      MappedFile m_file;
+      std::mutex m_mutex;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_RING_LOG_H__
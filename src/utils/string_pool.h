@@ -0,0 +1,175 @@
+#ifndef _SUBDEVIL_UTILS_STRING_POOL_H__
+#define _SUBDEVIL_UTILS_STRING_POOL_H__
+
+#include <atomic>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <mutex>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////
+// String interning
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    /**
+     * Process wide pool of unique strings. Vendor, product and mount
+     * strings repeat across many devices, so each value is only stored
+     * once. Entries are reference counted by InternedString and removed
+     * once the last handle to them is gone, so strings of devices that
+     * were forgotten don't stay around.
+     */
+    class StringPool
+    {
+    public:
+      // Node based, so element addresses survive rehashing.
+      typedef std::unordered_map<std::string, std::atomic<size_t>> Strings;
+      typedef Strings::value_type Entry;
+
+      static StringPool &instance()
+      {
+        // Never destroyed, devices may outlive it at exit
+        static StringPool *instance = new StringPool();
+        return *instance;
+      }
+
+      /**
+       * Get the entry for the string, with a reference taken for the
+       * caller.
+       */
+      Entry *intern(const std::string &str)
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Entry &entry = *m_strings.emplace(std::piecewise_construct,
+                                          std::forward_as_tuple(str),
+                                          std::forward_as_tuple(0)).first;
+        entry.second.fetch_add(1, std::memory_order_relaxed);
+
+        return &entry;
+      }
+
+      /**
+       * Take another reference to an entry the caller holds one to.
+       */
+      void retain(Entry *entry)
+      {
+        entry->second.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      /**
+       * Drop a reference, removing the entry with the last one. References
+       * other than the last are dropped without the lock. The last one is
+       * dropped under it, so intern() can't hand out an entry that is being
+       * removed.
+       */
+      void release(Entry *entry)
+      {
+        size_t count = entry->second.load(std::memory_order_relaxed);
+
+        // Others hold references, which can only be taken from one of
+        // them or under the lock, so the entry stays
+        while (count > 1) {
+          if (entry->second.compare_exchange_weak(count, count - 1, std::memory_order_release,
+                                                  std::memory_order_relaxed))
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // intern() may have handed out another reference in the meantime
+        if (entry->second.fetch_sub(1, std::memory_order_acq_rel) == 1)
+          m_strings.erase(entry->first);
+      }
+
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        return m_strings.size();
+      }
+
+    private:
+      StringPool() {}
+      StringPool(const StringPool &);
+      StringPool &operator=(const StringPool &);
+
+      std::mutex m_mutex;
+      Strings m_strings;
+    };
+
+    /**
+     * A pointer sized handle to a pooled string. Copying costs an atomic
+     * increment and equal values compare by address. Empty strings aren't
+     * pooled.
+     */
+    class InternedString
+    {
+    public:
+      InternedString()
+        : m_pEntry(nullptr) {}
+
+      InternedString(const std::string &str)
+        : m_pEntry(str.empty() ? nullptr : StringPool::instance().intern(str)) {}
+
+      InternedString(const char *str)
+        : m_pEntry(*str == '\0' ? nullptr : StringPool::instance().intern(str)) {}
+
+      InternedString(const InternedString &other)
+        : m_pEntry(other.m_pEntry)
+      {
+        if (m_pEntry != nullptr)
+          StringPool::instance().retain(m_pEntry);
+      }
+
+      InternedString(InternedString &&other)
+        : m_pEntry(other.m_pEntry)
+      {
+        other.m_pEntry = nullptr;
+      }
+
+      ~InternedString()
+      {
+        if (m_pEntry != nullptr)
+          StringPool::instance().release(m_pEntry);
+      }
+
+      InternedString &operator=(const InternedString &other)
+      {
+        // Retain first, in case both hold the last reference
+        if (other.m_pEntry != nullptr)
+          StringPool::instance().retain(other.m_pEntry);
+        if (m_pEntry != nullptr)
+          StringPool::instance().release(m_pEntry);
+
+        m_pEntry = other.m_pEntry;
+
+        return *this;
+      }
+
+      const std::string &str() const { return m_pEntry != nullptr ? m_pEntry->first : empty_string(); }
+      operator const std::string &() const { return str(); }
+
+      const char *c_str() const { return str().c_str(); }
+      size_t size() const { return str().size(); }
+      bool empty() const { return m_pEntry == nullptr; }
+
+      bool operator==(const InternedString &other) const { return m_pEntry == other.m_pEntry; }
+      bool operator!=(const InternedString &other) const { return m_pEntry != other.m_pEntry; }
+
+    private:
+      static const std::string &empty_string()
+      {
+        static const std::string *empty = new std::string();
+        return *empty;
+      }
+
+      StringPool::Entry *m_pEntry;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_STRING_POOL_H__
@@ -0,0 +1,172 @@
+#include "trace.h"
+#include "json_writer.h"
+#include "logger.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace Subdevil
+{
+  namespace Utils
+  {
+    // Spans per thread between dumps. Later spans are dropped, so a
+    // forgotten trace can't grow without bound.
+    const size_t MAX_THREAD_SPANS = 64 * 1024;
+
+    // Flags the buffer of a thread once the thread exits. The tracer
+    // keeps it until its spans are dumped, then drops it.
+    struct Tracer::ThreadBufferOwner {
+      std::shared_ptr<ThreadBuffer> buffer;
+
+      ~ThreadBufferOwner()
+      {
+        if (buffer != nullptr) {
+          std::lock_guard<std::mutex> lock(buffer->mutex);
+          buffer->exited = true;
+        }
+      }
+    };
+
+    Tracer::ThreadBuffer &Tracer::threadBuffer()
+    {
+      static thread_local ThreadBufferOwner owner;
+
+      if (owner.buffer == nullptr) {
+        std::shared_ptr<ThreadBuffer> buffer = std::make_shared<ThreadBuffer>();
+
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+
+        pruneBuffers();
+
+        buffer->threadID = m_nextThreadID++;
+        m_buffers.push_back(buffer);
+        owner.buffer = buffer;
+      }
+
+      return *owner.buffer;
+    }
+
+    size_t Tracer::bufferCount()
+    {
+      std::lock_guard<std::mutex> lock(m_buffersMutex);
+      return m_buffers.size();
+    }
+
+    void Tracer::pruneBuffers()
+    {
+      auto drained = [](const std::shared_ptr<ThreadBuffer> &buffer) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        return buffer->exited && buffer->spans.empty();
+      };
+
+      m_buffers.erase(std::remove_if(m_buffers.begin(), m_buffers.end(), drained), m_buffers.end());
+    }
+
+    void Tracer::record(const char *name, const std::string &uid,
+                        std::chrono::steady_clock::time_point start,
+                        std::chrono::steady_clock::time_point end)
+    {
+      using std::chrono::duration_cast;
+      using std::chrono::microseconds;
+
+      ThreadBuffer &buffer = threadBuffer();
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+
+      if (buffer.spans.size() >= MAX_THREAD_SPANS)
+        return;
+
+      Span span;
+      span.name       = name;
+      span.uid        = uid;
+      span.startUs    = duration_cast<microseconds>(start - m_origin).count();
+      span.durationUs = duration_cast<microseconds>(end - start).count();
+
+      buffer.spans.push_back(span);
+    }
+
+    bool Tracer::dump(const std::string &path)
+    {
+      FILE *stream = fopen(path.c_str(), "w");
+
+      if (stream == nullptr) {
+        CORE_ERROR("Failed to open trace file: " + path);
+        return false;
+      }
+
+      std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+      {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        buffers = m_buffers;
+      }
+
+      long long pid = getpid();
+
+      {
+        JsonWriter writer(stream);
+
+        writer.beginObject();
+        writer.key("traceEvents");
+        writer.beginArray();
+
+        for (const auto &buffer : buffers) {
+          std::vector<Span> spans;
+          {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            spans.swap(buffer->spans);
+          }
+
+          for (const Span &span : spans) {
+            // Complete events, see the Trace Event Format
+            writer.beginObject();
+            writer.key("name");
+            writer.string(span.name);
+            writer.key("cat");
+            writer.string("subdevil");
+            writer.key("ph");
+            writer.string("X");
+            writer.key("ts");
+            writer.number(span.startUs);
+            writer.key("dur");
+            writer.number(span.durationUs);
+            writer.key("pid");
+            writer.number(pid);
+            writer.key("tid");
+            writer.number(buffer->threadID);
+
+            if (!span.uid.empty()) {
+              writer.key("args");
+              writer.beginObject();
+              writer.key("uid");
+              writer.string(span.uid);
+              writer.endObject();
+            }
+
+            writer.endObject();
+          }
+        }
+
+        writer.endArray();
+        writer.key("displayTimeUnit");
+        writer.string("ms");
+        writer.endObject();
+      }
+
+      fclose(stream);
+
+      {
+        std::lock_guard<std::mutex> lock(m_buffersMutex);
+        pruneBuffers();
+      }
+
+      return true;
+    }
+  }
+}
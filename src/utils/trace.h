@@ -0,0 +1,127 @@
+#ifndef _SUBDEVIL_UTILS_TRACE_H__
+#define _SUBDEVIL_UTILS_TRACE_H__
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Span tracing
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil
+{
+  namespace Utils
+  {
+    /**
+     * Opt-in recording of timed spans, dumped as Chrome trace-event JSON
+     * that chrome://tracing and Perfetto load. Every thread records into
+     * its own buffer, so tracing doesn't serialize the threads it traces.
+     * While disabled a span costs a single atomic load.
+     */
+    class Tracer
+    {
+    public:
+      static Tracer &instance()
+      {
+        static Tracer instance;
+        return instance;
+      }
+
+      void setEnabled(bool enabled) { m_enabled.store(enabled, std::memory_order_relaxed); }
+      bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+      /**
+       * Record a finished span. The name has to outlive the tracer.
+       */
+      void record(const char *name, const std::string &uid,
+                  std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end);
+
+      /**
+       * Write all recorded spans to the file at the given path and clear
+       * the buffers. Buffers of threads that exited are dropped.
+       */
+      bool dump(const std::string &path);
+
+      /**
+       * Threads with a buffer, including exited ones with spans left.
+       */
+      size_t bufferCount();
+
+    private:
+      Tracer() : m_enabled(false), m_nextThreadID(1) {}
+      Tracer(const Tracer &);
+      Tracer &operator=(const Tracer &);
+
+      struct Span {
+        const char *name;
+        std::string uid;
+        int64_t startUs;
+        int64_t durationUs;
+      };
+
+      struct ThreadBuffer {
+        int threadID;
+        std::mutex mutex;  // Only contended while dumping
+        std::vector<Span> spans;
+        bool exited = false;
+      };
+
+      struct ThreadBufferOwner;
+
+      ThreadBuffer &threadBuffer();
+      // Drop buffers of exited threads with no spans left. Call with
+      // m_buffersMutex held.
+      void pruneBuffers();
+
+      std::atomic<bool> m_enabled;
+      std::mutex m_buffersMutex;
+      std::vector<std::shared_ptr<ThreadBuffer>> m_buffers;
+      int m_nextThreadID;
+      std::chrono::steady_clock::time_point m_origin = std::chrono::steady_clock::now();
+    };
+
+    /**
+     * Records the time from its construction to its destruction as a span,
+     * if tracing was enabled when it was constructed. Tag it with the UID
+     * of the device it is about once that is known.
+     */
+    class TraceSpan
+    {
+    public:
+      explicit TraceSpan(const char *name)
+        : m_name(name), m_active(Tracer::instance().isEnabled())
+      {
+        if (m_active)
+          m_start = std::chrono::steady_clock::now();
+      }
+
+      ~TraceSpan()
+      {
+        if (m_active)
+          Tracer::instance().record(m_name, m_uid, m_start, std::chrono::steady_clock::now());
+      }
+
+      void setUid(const std::string &uid)
+      {
+        if (m_active)
+          m_uid = uid;
+      }
+
+    private:
+      TraceSpan(const TraceSpan &);
+      TraceSpan &operator=(const TraceSpan &);
+
+      const char *m_name;
+      bool m_active;
+      std::string m_uid;
+      std::chrono::steady_clock::time_point m_start;
+    };
+  }
+}
+
+#endif // _SUBDEVIL_UTILS_TRACE_H__
@@ -1,21 +1,37 @@
 #include "../subdevil.h"
 #include "../usb_common.h"
+#include "../device_registry.h"
+#include "../change_detector.h"
+#include "../device_fields.h"
+#include "../device_id.h"
+#include "../resolvers.h"
 
 #include "../utils.h"
+#include "../utils/lru_cache.h"
 
 #include <windows.h>
 #include <windowsx.h>
 #include <devguid.h>
 #include <initguid.h>
 #include <usbiodef.h>
+#include <hidclass.h>
+#include <devpkey.h>
 #include <setupapi.h>
 #include <winioctl.h>
 #include <usbioctl.h>
 #include <cfgmgr32.h>
+#include <dbt.h>
 #include <assert.h>
 
-#include <unordered_map>
+#include <algorithm>
 #include <bitset>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define FORMAT_FLAGS (FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS)
 
@@ -25,10 +41,6 @@ namespace Subdevil {
   typedef unsigned long ulong;
   typedef unsigned int  uint;
 
-  typedef std::unordered_map<std::string, USBDevicePtr> DeviceMap;
-
-  static DeviceMap gAllDevices;
-
   /**
    * Create a new windows SP type and automatically set the property cbSize
    * to the sizeof the type, as required by many functions in the windows
@@ -46,6 +58,8 @@ namespace Subdevil {
   static bool _deviceProperty(HDEVINFO hDeviceInfo, PSP_DEVINFO_DATA device_info_data,
                               DWORD property, std::string &buf_str)
   {
+    Utils::TraceSpan span("readProperty");
+
     DWORD bufLen = MAX_PATH;
     DWORD nSize;
 
@@ -55,6 +69,7 @@ namespace Subdevil {
     bool ok = SetupDiGetDeviceRegistryProperty(hDeviceInfo, device_info_data,
                                                property, NULL, (PBYTE)buf,
                                                bufLen, &nSize);
+    countOSCall();
 
     if (ok)
       buf_str.assign(buf);
@@ -66,176 +81,524 @@ namespace Subdevil {
     return ok;
   }
 
-  static bool _parseDeviceID(const char *device_path, std::string &vid,
-                             std::string &pid, std::string &serial)
+  static ULONG _deviceNumberFromHandle(HANDLE handle)
+  {
+    STORAGE_DEVICE_NUMBER sdn;
+    sdn.DeviceNumber = -1;
+
+    DWORD bytesReturned = 0; // Ignored
+
+    countOSCall();
+
+    if (!DeviceIoControl(handle, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &sdn,
+                        sizeof(sdn), &bytesReturned, NULL)) {
+      CORE_WARNING("Failed to get device number from handle.");
+
+      return -1;
+    }
+
+    return sdn.DeviceNumber;
+  }
+
+  typedef struct DeviceSPData {
+    SP_DEVINFO_DATA info;
+    SP_DEVICE_INTERFACE_DATA inter;
+    SP_DEVICE_INTERFACE_DETAIL_DATA *interDetails;
+  } SPData;
+
+  /**
+   * Get the device number of the disk behind a device interface, or -1.
+   * Opening the interface can block on an unresponsive disk.
+   */
+  static ULONG _deviceNumberForInterface(const std::string &devicePath)
+  {
+    HANDLE handle = CreateFileA(devicePath.c_str(),
+                                0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
+    countOSCall();
+
+    if (handle == INVALID_HANDLE_VALUE) {
+      CORE_ERROR("Failed to create file handle");
+      return -1;
+    }
+
+    ULONG deviceNumber = _deviceNumberFromHandle(handle);
+
+    CloseHandle(handle);
+
+    if (deviceNumber != -1) {
+      CORE_DEBUG("Found device number: " + std::to_string(deviceNumber));
+    } else {
+      CORE_ERROR("Failed to get device number for " + devicePath);
+    }
+
+    return deviceNumber;
+  }
+
+  /**
+   * Drive letters come as E:\, folder mounts as C:\mnt\usb\.
+   */
+  static std::string _trimSeparator(const std::string &path)
+  {
+    if (path.size() > 1 && path[path.size() - 1] == '\\')
+      return path.substr(0, path.size() - 1);
+
+    return path;
+  }
+
+  static std::vector<std::string> _volumeMountPoints(const char *volumeName)
+  {
+    std::vector<std::string> mountPoints;
+    DWORD len = 0;
+
+    // Fails with ERROR_MORE_DATA, returning the size of the list
+    GetVolumePathNamesForVolumeNameA(volumeName, NULL, 0, &len);
+
+    if (len == 0) {
+      return mountPoints;
+    }
+
+    std::vector<char> names(len);
+
+    if (!GetVolumePathNamesForVolumeNameA(volumeName, names.data(), len, &len)) {
+      return mountPoints;
+    }
+
+    for (const char *name = names.data(); *name != '\0'; name += strlen(name) + 1) {
+      mountPoints.push_back(_trimSeparator(name));
+    }
+
+    return mountPoints;
+  }
+
+  /**
+   * Open a volume by its \\?\Volume{GUID}\ name and read the disk and
+   * offset of its partition, its label, serial number and mount points.
+   */
+  static bool _readVolume(const char *volumeName, Volume &volume, ULONG *diskNumber, LONGLONG *offset)
   {
-    const char *p = device_path;
+    // Opened without the separator
+    std::string path = _trimSeparator(volumeName);
+
+    // Open, extents, information and path names
+    countOSCall(4);
+
+    HANDLE handle = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
 
-    if (strncmp(p, "USB\\", 4) != 0) {
+    if (handle == INVALID_HANDLE_VALUE) {
       return false;
     }
-    p += 4;
 
-    if (strncmp(p, "VID_", 4) != 0) {
+    // Volumes of removable disks have a single extent
+    VOLUME_DISK_EXTENTS extents;
+    DWORD bytesReturned;
+
+    BOOL ok = DeviceIoControl(handle, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
+                              &extents, sizeof(extents), &bytesReturned, NULL);
+
+    CloseHandle(handle);
+
+    if (!ok || extents.NumberOfDiskExtents < 1) {
       return false;
     }
-    p += 4;
 
-    vid.assign("0x");
+    volume.node = volumeName;
 
-    while (*p != '&') {
-      if (*p == '\0') {
-        return false;
-      }
-      vid.push_back(tolower(*p));
-      p++;
+    char label[MAX_PATH + 1];
+    DWORD serial;
+
+    if (GetVolumeInformationA(volumeName, label, sizeof(label), &serial, NULL, NULL, NULL, 0)) {
+      char uuid[10];
+      snprintf(uuid, sizeof(uuid), "%04X-%04X",
+               static_cast<unsigned>(serial >> 16), static_cast<unsigned>(serial & 0xFFFF));
+
+      volume.label = label;
+      volume.uuid  = uuid;
     }
-    p++;
 
-    if (strncmp(p, "PID_", 4) != 0) {
-      return false;
+    volume.mountPoints = _volumeMountPoints(volumeName);
+
+    *diskNumber = extents.Extents[0].DiskNumber;
+    *offset     = extents.Extents[0].StartingOffset.QuadPart;
+
+    return true;
+  }
+
+  // The volumes of a disk in partition order
+  static std::vector<Volume> _byOffset(std::vector<std::pair<LONGLONG, Volume>> &partitions)
+  {
+    std::sort(partitions.begin(), partitions.end(),
+              [](const std::pair<LONGLONG, Volume> &a, const std::pair<LONGLONG, Volume> &b) {
+                return a.first < b.first;
+              });
+
+    std::vector<Volume> volumes;
+
+    for (const auto &partition : partitions) {
+      volumes.push_back(partition.second);
     }
-    p += 4;
 
-    // Clear serial, just to be sure we don't have any left over state.
-    serial.clear();
+    return volumes;
+  }
 
-    pid.assign("0x");
+  /**
+   * The volumes of every disk, indexed by the disk's device number. Built
+   * with one pass over all volumes of the system the first time a device
+   * asks for its volumes, and shared by the rest of the scan. Opening the
+   * volumes can block on an unresponsive disk.
+   */
+  class VolumeIndex
+  {
+  public:
+    std::vector<Volume> volumesForDisk(ULONG deviceNumber)
+    {
+      std::call_once(m_built, &VolumeIndex::build, this);
 
-    while (*p != '\\') {
-      if (*p == '\0') {
-        return false;
+      auto it = m_byDisk.find(deviceNumber);
+
+      return it != m_byDisk.end() ? it->second : std::vector<Volume>();
+    }
+
+  private:
+    void build()
+    {
+      Utils::TraceSpan span("buildVolumeIndex");
+
+      char volumeName[MAX_PATH];
+      HANDLE hFind = FindFirstVolumeA(volumeName, MAX_PATH);
+
+      if (hFind == INVALID_HANDLE_VALUE) {
+        CORE_ERROR("FindFirstVolume() failed");
+        return;
       }
-      if (*p == '&') {
-        // No serial.
-        return true;
+
+      // Volumes by disk, with the offset of their partition
+      std::unordered_map<ULONG, std::vector<std::pair<LONGLONG, Volume>>> partitions;
+
+      do {
+        Volume volume;
+        ULONG diskNumber;
+        LONGLONG offset;
+
+        if (_readVolume(volumeName, volume, &diskNumber, &offset))
+          partitions[diskNumber].push_back(std::make_pair(offset, volume));
+      } while (FindNextVolumeA(hFind, volumeName, MAX_PATH));
+
+      FindVolumeClose(hFind);
+
+      for (auto &disk : partitions) {
+        m_byDisk[disk.first] = _byOffset(disk.second);
       }
+    }
+
+    std::once_flag m_built;
+    std::unordered_map<ULONG, std::vector<Volume>> m_byDisk;
+  };
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Resolvers
+  ////////////////////////////////////////////////////////////////////////////////
+  /**
+   * The time the device was last plugged in, which changes on every
+   * re-plug. Only available from Windows 8 on, 0 before that.
+   */
+  static uint64_t _arrivalTime(DEVINST devInst)
+  {
+    FILETIME arrival;
+    DEVPROPTYPE type;
+    ULONG size = sizeof(arrival);
+
+    countOSCall();
 
-      pid.push_back(tolower(*p));
-      p++;
+    if (CM_Get_DevNode_PropertyW(devInst, &DEVPKEY_Device_LastArrivalDate, &type,
+                                 reinterpret_cast<PBYTE>(&arrival), &size, 0) != CR_SUCCESS ||
+        type != DEVPROP_TYPE_FILETIME) {
+      return 0;
     }
-    p++;
 
-    while (*p != '\0') {
-      if (*p == '&') {
-        return true;
-      }
+    return (static_cast<uint64_t>(arrival.dwHighDateTime) << 32) | arrival.dwLowDateTime;
+  }
+
+  static std::string _devNodeProperty(DEVINST devInst, ULONG property)
+  {
+    char buf[MAX_PATH];
+    ULONG len = sizeof(buf);
+
+    countOSCall();
 
-      serial.push_back(toupper(*p));
-      p++;
+    if (CM_Get_DevNode_Registry_PropertyA(devInst, property, NULL, buf, &len, 0) != CR_SUCCESS) {
+      return "";
     }
 
-    return true;
+    // Multi strings end in a double NUL, keep them intact
+    return std::string(buf, len > 0 ? len - 1 : 0);
   }
 
+  /**
+   * The resolvers that apply to a device node, from the USB\Class_xx
+   * entry of its compatible IDs.
+   */
+  static unsigned _resolversForDevNode(DEVINST devInst)
+  {
+    std::string ids = _devNodeProperty(devInst, CM_DRP_COMPATIBLEIDS);
 
-  static ULONG _deviceNumberFromHandle(HANDLE handle)
+    for (const char *id = ids.c_str(); *id != '\0'; id += strlen(id) + 1) {
+      if (strncmp(id, "USB\\Class_", 10) == 0) {
+        return resolversForClass(static_cast<int>(strtol(id + 10, NULL, 16)));
+      }
+    }
+
+    return 0;
+  }
+
+  static std::string _portName(DEVINST devInst)
   {
-    STORAGE_DEVICE_NUMBER sdn;
-    sdn.DeviceNumber = -1;
+    HKEY hKey;
 
-    DWORD bytesReturned = 0; // Ignored
+    if (CM_Open_DevNode_Key(devInst, KEY_READ, 0, RegDisposition_OpenExisting,
+                            &hKey, CM_REGISTRY_HARDWARE) != CR_SUCCESS) {
+      return "";
+    }
 
-    if (!DeviceIoControl(handle, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &sdn,
-                        sizeof(sdn), &bytesReturned, NULL)) {
-      CORE_WARNING("Failed to get device number from handle.");
+    char name[32];
+    DWORD len = sizeof(name);
+    DWORD type;
+    std::string port;
 
-      return -1;
+    if (RegQueryValueExA(hKey, "PortName", NULL, &type, (LPBYTE)name, &len) == ERROR_SUCCESS &&
+        type == REG_SZ) {
+      port = std::string("\\\\.\\") + std::string(name, strnlen(name, len));
     }
 
-    return sdn.DeviceNumber;
+    RegCloseKey(hKey);
+
+    return port;
   }
 
-  static std::string _driveForDeviceNumber(ULONG deviceNumber)
+  static std::string _hidInterfacePath(DEVINST devInst)
   {
-      std::bitset<32> drives(GetLogicalDrives());
+    char devInstID[MAX_DEVICE_ID_LEN];
+    if (CM_Get_Device_ID(devInst, _PSTR(devInstID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+      return "";
+    }
 
-      // We start iteration from ANSI C (65)
-      for (char c = 'D'; c <= 'Z'; c++) {
-        if (!drives[c - 'A']) {
-          continue;
-        }
+    ULONG len = 0;
+    if (CM_Get_Device_Interface_List_SizeA(&len, const_cast<LPGUID>(&GUID_DEVINTERFACE_HID), devInstID,
+                                           CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS || len <= 1) {
+      return "";
+    }
+
+    std::vector<char> list(len);
+    if (CM_Get_Device_Interface_ListA(const_cast<LPGUID>(&GUID_DEVINTERFACE_HID), devInstID, list.data(), len,
+                                      CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS) {
+      return "";
+    }
 
-        std::string path = std::string("\\\\.\\") + c + ":";
+    // The first interface of the list
+    return list.data();
+  }
 
-        HANDLE driveHandle = CreateFileA(path.c_str(), GENERIC_READ,
-                                         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
-                                         FILE_FLAG_NO_BUFFERING | FILE_FLAG_RANDOM_ACCESS, NULL);
+  /**
+   * Run the pending serial and HID resolvers over the device nodes below
+   * the USB device. Nodes are only looked at once an interface of a
+   * matching class has been seen.
+   */
+  static ResolvedNodes _resolveNodes(DEVINST devInst, const std::string &uid, unsigned pending)
+  {
+    Utils::TraceSpan span("resolveNodes");
+    span.setUid(uid);
 
-        if (driveHandle == INVALID_HANDLE_VALUE) {
-          CORE_ERROR("Failed to get file handle to " + path);
-          continue;
-        }
+    unsigned applicable = _resolversForDevNode(devInst);
+    unsigned found = 0;
+    ResolvedNodes nodes;
 
-        ULONG num = _deviceNumberFromHandle(driveHandle);
-        if (num == deviceNumber) {
-          return std::string(1, c).append(":");
+    std::vector<DEVINST> stack;
+    DEVINST child;
+
+    if (CM_Get_Child(&child, devInst, 0) == CR_SUCCESS)
+      stack.push_back(child);
+
+    while (!stack.empty() && found != pending) {
+      DEVINST node = stack.back();
+      stack.pop_back();
+
+      DEVINST next;
+      if (CM_Get_Sibling(&next, node, 0) == CR_SUCCESS)
+        stack.push_back(next);
+      if (CM_Get_Child(&next, node, 0) == CR_SUCCESS)
+        stack.push_back(next);
+
+      applicable |= _resolversForDevNode(node);
+
+      unsigned wanted = pending & applicable & ~found;
+
+      if (wanted == 0)
+        continue;
+
+      std::string setupClass = _devNodeProperty(node, CM_DRP_CLASS);
+
+      if ((wanted & RESOLVE_TTY) && setupClass == "Ports") {
+        std::string port = _portName(node);
+
+        if (!port.empty()) {
+          setResolved(nodes, RESOLVE_TTY, port);
+          found |= RESOLVE_TTY;
         }
+      }
+      else if ((wanted & RESOLVE_HIDRAW) && setupClass == "HIDClass") {
+        std::string path = _hidInterfacePath(node);
 
-        CloseHandle(driveHandle);
+        if (!path.empty()) {
+          setResolved(nodes, RESOLVE_HIDRAW, path);
+          found |= RESOLVE_HIDRAW;
+        }
       }
+    }
 
-      CORE_ERROR("Failed to get drive for device number: " + std::to_string(deviceNumber));
-      return "";
+    // Cache the absence of nodes the device can't have. Nodes of a
+    // matching class may still be installing, so those are retried.
+    unsigned missing = pending & ~applicable;
+
+    if (missing & RESOLVE_TTY)
+      setResolved(nodes, RESOLVE_TTY, "");
+    if (missing & RESOLVE_HIDRAW)
+      setResolved(nodes, RESOLVE_HIDRAW, "");
+
+    return nodes;
+  }
+
+  /**
+   * The device nodes of the volumes on a disk, which the PnP manager lists
+   * as its removal relations.
+   */
+  static std::vector<DEVINST> _volumeNodes(DEVINST devInst)
+  {
+    std::vector<DEVINST> nodes;
+
+    char devInstID[MAX_DEVICE_ID_LEN];
+    if (CM_Get_Device_ID(devInst, _PSTR(devInstID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+      return nodes;
     }
 
-  typedef struct DeviceSPData {
-    SP_DEVINFO_DATA info;
-    SP_DEVICE_INTERFACE_DATA inter;
-    SP_DEVICE_INTERFACE_DETAIL_DATA *interDetails;
-  } SPData;
+    const ULONG flags = CM_GETIDLIST_FILTER_REMOVALRELATIONS;
+    ULONG len = 0;
 
-  static USBDevicePtr _findDeviceByLocationID(const DeviceMap &map, int locationID) {
-    for(auto it = map.begin(); it != map.end(); ++it) {
-      auto device = it->second;
+    if (CM_Get_Device_ID_List_SizeA(&len, devInstID, flags) != CR_SUCCESS || len <= 1) {
+      return nodes;
+    }
+
+    std::vector<char> volumeIDs(len);
+    if (CM_Get_Device_ID_ListA(devInstID, volumeIDs.data(), len, flags) != CR_SUCCESS) {
+      return nodes;
+    }
 
-      if(device->locationID == locationID) {
-        return device;
+    for (char *volumeID = volumeIDs.data(); *volumeID != '\0'; volumeID += strlen(volumeID) + 1) {
+      DEVINST volumeInst;
+      if (CM_Locate_DevNodeA(&volumeInst, volumeID, CM_LOCATE_DEVNODE_NORMAL) == CR_SUCCESS) {
+        nodes.push_back(volumeInst);
       }
     }
 
-    return nullptr;
+    return nodes;
   }
 
-  std::vector<DeviceSPData> _deviceSPs(HDEVINFO hDeviceInfo, const GUID *guid)
+  /**
+   * Get the volumes of a disk without opening it or them, by matching the
+   * volumes the PnP manager lists as its removal relations against the
+   * DOS device names of the drives. Labels and UUIDs aren't known.
+   */
+  static std::vector<Volume> _cachedVolumesForDisk(DEVINST devInst)
   {
-    std::vector<DeviceSPData> sps;
+    std::vector<Volume> volumes;
+    std::bitset<32> drives(GetLogicalDrives());
 
-    uint index = 0;
+    for (DEVINST volumeInst : _volumeNodes(devInst)) {
+      // \Device\HarddiskVolumeN
+      std::string objectName = _devNodeProperty(volumeInst, CM_DRP_PHYSICAL_DEVICE_OBJECT_NAME);
 
-    while(true)
-      {
-        SP_DEVINFO_DATA spDevInfoData = _createSPType<SP_DEVINFO_DATA>();
+      if (objectName.empty()) {
+        continue;
+      }
 
-        if (!SetupDiEnumDeviceInfo(hDeviceInfo, index, &spDevInfoData))
-          {
-            if (GetLastError() != ERROR_NO_MORE_ITEMS)
-              CORE_ERROR("Failed to retrieve device information.");
+      Volume volume;
+      volume.node = "\\\\?\\GLOBALROOT" + objectName;
 
-            break; // We're out of devices
-          }
+      for (char c = 'D'; c <= 'Z'; c++) {
+        if (!drives[c - 'A']) {
+          continue;
+        }
 
-        SP_DEVICE_INTERFACE_DATA spDeviceInterfaceData = _createSPType<SP_DEVICE_INTERFACE_DATA>();
+        char drive[] = { c, ':', '\0' };
+        char target[MAX_PATH];
 
-        if (!SetupDiEnumDeviceInterfaces(hDeviceInfo, 0, guid, index, &spDeviceInterfaceData)) {
-          CORE_ERROR("Failed to get device interfaces.");
-          continue; // Invalid device, skip it
+        if (QueryDosDeviceA(drive, target, MAX_PATH) != 0 && objectName == target) {
+          volume.mountPoints.push_back(drive);
         }
+      }
 
-        DeviceSPData deviceSP;
-        deviceSP.info = spDevInfoData;
-        deviceSP.inter = spDeviceInterfaceData;
+      volumes.push_back(volume);
+    }
+
+    return volumes;
+  }
 
-        sps.push_back(deviceSP);
+  /**
+   * Get the volumes of a single disk like the volume index does, but only
+   * opening the volumes of its removal relations. Used when one device is
+   * refreshed, where indexing every volume of the system would be wasted.
+   */
+  static std::vector<Volume> _volumesForDisk(DEVINST devInst, ULONG deviceNumber)
+  {
+    std::vector<std::pair<LONGLONG, Volume>> partitions;
 
-        ++index;
+    for (DEVINST volumeInst : _volumeNodes(devInst)) {
+      char volumeInstID[MAX_DEVICE_ID_LEN];
+      if (CM_Get_Device_ID(volumeInst, _PSTR(volumeInstID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+        continue;
       }
 
-    return sps;
+      ULONG len = 0;
+
+      countOSCall(3);
+
+      if (CM_Get_Device_Interface_List_SizeA(&len, const_cast<LPGUID>(&GUID_DEVINTERFACE_VOLUME), volumeInstID,
+                                             CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS || len <= 1) {
+        continue;
+      }
+
+      std::vector<char> list(len);
+      if (CM_Get_Device_Interface_ListA(const_cast<LPGUID>(&GUID_DEVINTERFACE_VOLUME), volumeInstID,
+                                        list.data(), len, CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS) {
+        continue;
+      }
+
+      // The interface path only names the volume, the volume GUID path is
+      // what mount points are listed for
+      std::string mountPoint = std::string(list.data()) + "\\";
+      char volumeName[MAX_PATH];
+
+      if (!GetVolumeNameForVolumeMountPointA(mountPoint.c_str(), volumeName, MAX_PATH)) {
+        continue;
+      }
+
+      Volume volume;
+      ULONG diskNumber;
+      LONGLONG offset;
+
+      if (_readVolume(volumeName, volume, &diskNumber, &offset) && diskNumber == deviceNumber)
+        partitions.push_back(std::make_pair(offset, volume));
+    }
+
+    return _byOffset(partitions);
   }
 
-  USBDevicePtr _extractUSBDeviceData(HDEVINFO hDeviceInfo, DeviceSPData &sp)
+  USBDevicePtr _extractUSBDeviceData(HDEVINFO hDeviceInfo, DeviceSPData &sp, const ScanOptions &options,
+                                     const std::shared_ptr<VolumeIndex> &volumeIndex,
+                                     std::chrono::steady_clock::time_point deadline)
   {
+    Utils::TraceSpan span("extractDevice");
+
     std::string deviceName;
     if (!_deviceProperty(hDeviceInfo, &sp.info, SPDRP_FRIENDLYNAME, deviceName)) {
       return nullptr;
@@ -254,41 +617,25 @@ namespace Subdevil {
 
     SP_DEVINFO_DATA spDeviceInfoData = _createSPType<SP_DEVINFO_DATA>();
 
+    // Interface detail, device ID, parent and parent ID
+    countOSCall(4);
+
     if (!SetupDiGetDeviceInterfaceDetail(hDeviceInfo, &sp.inter, spDeviceInterfaceDetail,
                                          interfaceDetailLen, &interfaceDetailLen, &spDeviceInfoData)) {
       CORE_ERROR("Failed to retrieve device interface details.");
+      free(spDeviceInterfaceDetail);
       return nullptr;
     }
 
-    HANDLE handle = CreateFile(spDeviceInterfaceDetail->DevicePath,
-                               0, FILE_SHARE_READ | FILE_SHARE_WRITE,
-                               NULL, OPEN_EXISTING, 0, NULL);
-
-    if (handle == INVALID_HANDLE_VALUE) {
-      CORE_ERROR("Failed to create file handle");
-      return nullptr;
-    }
+    std::string devicePath(spDeviceInterfaceDetail->DevicePath);
 
     free(spDeviceInterfaceDetail);
 
-    std::string mount;
-    ULONG deviceNumber = _deviceNumberFromHandle(handle);
-    if (deviceNumber != -1) {
-      mount = _driveForDeviceNumber(deviceNumber);
-
-      CORE_DEBUG("Found device number: " + std::to_string(deviceNumber));
-
-      if(mount.empty()) {
-        CORE_DEBUG("Mount point not found");
-      } else {
-        CORE_DEBUG("Found mount point: " + mount);
-      }
-    } else {
-      CORE_ERROR("Failed to get device number for " + deviceName);
+    char devInstID[MAX_DEVICE_ID_LEN];
+    if (CM_Get_Device_ID(spDeviceInfoData.DevInst, _PSTR(devInstID), MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+      return nullptr;
     }
 
-    CloseHandle(handle);
-
     DEVINST devInstParent;
     if (CM_Get_Parent(&devInstParent, spDeviceInfoData.DevInst, 0) != CR_SUCCESS) {
       return nullptr;
@@ -299,70 +646,409 @@ namespace Subdevil {
       return nullptr;
     }
 
-    std::string vid, pid, serial;
-    if (!_parseDeviceID(devInstParentID, vid, pid, serial)) {
+    DeviceIDView id;
+    if (!parseInstanceID(devInstParentID, strlen(devInstParentID), id)) {
       return nullptr;
     }
 
-    int locationID = static_cast<int>(deviceNumber);
+    std::string serial(id.serial, id.serialLength);
+    std::transform(serial.begin(), serial.end(), serial.begin(), ::toupper);
+
+    // Emulate location ID using the device instance ID, which unlike the
+    // disk's device number is known without opening the device.
+    int locationID = static_cast<int>(std::hash<std::string>()(devInstID));
 
     CORE_DEBUG("Found location ID: " + std::to_string(locationID));
 
-    USBDevicePtr pUsbDevice = _findDeviceByLocationID(gAllDevices, locationID);
+    // Other scans get the same device for this location
+    USBDevice descriptor = USBDevice();
+    descriptor.locationID   = locationID;
+    descriptor.productID    = id.productID;
+    descriptor.vendorID     = id.vendorID;
+    descriptor.product      = deviceName;
+    descriptor.serialNumber = serial;
+    descriptor.vendor       = vendor;
+    descriptor.devicePath   = devicePath;
+
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    USBDevicePtr pUsbDevice = registry.findOrCreate(locationID);
+
+    std::string uid;
+
+    {
+      // Late lookups of an earlier scan may be reindexing the device
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
+
+      copyDescriptorFields(descriptor, *pUsbDevice);
+      pUsbDevice->uid = uniqueDeviceID(pUsbDevice);
+
+      uid = pUsbDevice->uid;
+    }
+
+    span.setUid(uid);
+
+    // Add to the device registry
+    registry.add(pUsbDevice);
+
+    unsigned pending = 0;
+
+    if (options.resolve != 0) {
+      uint64_t sessionID = _arrivalTime(devInstParent);
+
+      {
+        std::lock_guard<std::mutex> lock(registry.updateMutex());
+        pending = pendingResolvers(*pUsbDevice, options.resolve, sessionID);
+      }
+
+      if (pending & (RESOLVE_TTY | RESOLVE_HIDRAW)) {
+        // The device is registered already, so the results are stored
+        // under the lock like the other fields
+        ResolvedNodes nodes = _resolveNodes(devInstParent, uid, pending & ~RESOLVE_BLOCK);
+
+        std::lock_guard<std::mutex> lock(registry.updateMutex());
+        storeResolved(*pUsbDevice, sessionID, nodes);
+      }
+    }
+
+    if (options.passive) {
+      // The physical drive needs the device number, which means opening
+      // the disk, so it isn't resolved
+      std::vector<Volume> volumes = _cachedVolumesForDisk(spDeviceInfoData.DevInst);
+
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
 
-    if(!pUsbDevice) {
-      CORE_DEBUG("USB device with given location ID not found, creating a new one...");
-      pUsbDevice = USBDevicePtr(new USBDevice());
+      pUsbDevice->volumes    = volumes;
+      pUsbDevice->mountPoint = firstMountPoint(pUsbDevice->volumes);
+      pUsbDevice->liveFields &= ~LIVE_MOUNT;
+
+      return pUsbDevice;
     }
 
-    // Emulate location ID using device numbers
-    pUsbDevice->locationID = locationID;
-    // Convert HEX values to integers
-    pUsbDevice->productID = std::stoi(pid, nullptr, 0);
-    pUsbDevice->vendorID = std::stoi(vid, nullptr, 0);
-    pUsbDevice->product = deviceName;
-    pUsbDevice->serialNumber = serial;
-    pUsbDevice->vendor = vendor;
-    pUsbDevice->mountPoint = mount;
-    pUsbDevice->uid = uniqueDeviceID(pUsbDevice);
+    // Every device found here is a disk. Its physical drive comes with the
+    // device number the mount point lookup already has to open it for.
+    bool resolveBlock = (pending & RESOLVE_BLOCK) != 0;
+
+    // Without a volume index only the volumes of this disk are read
+    DEVINST devInst = spDeviceInfoData.DevInst;
+
+    runSlowLookup(pUsbDevice, [devicePath, devInst, volumeIndex, resolveBlock, uid]() {
+        Utils::TraceSpan span("resolveMount");
+        span.setUid(uid);
+
+        ULONG deviceNumber = _deviceNumberForInterface(devicePath);
+        std::vector<Volume> volumes;
+        std::string block;
+
+        if (deviceNumber != -1) {
+          volumes = volumeIndex != nullptr ? volumeIndex->volumesForDisk(deviceNumber)
+                                           : _volumesForDisk(devInst, deviceNumber);
+          block = "\\\\.\\PhysicalDrive" + std::to_string(deviceNumber);
+        }
+
+        return DeviceUpdate([volumes, block, resolveBlock](USBDevice &device) {
+            device.volumes    = volumes;
+            device.mountPoint = firstMountPoint(volumes);
+            device.liveFields |= LIVE_MOUNT;
 
-    // Add to global device map
-    gAllDevices[pUsbDevice->uid] = pUsbDevice;
+            if (resolveBlock && !block.empty()) {
+              setResolved(device, RESOLVE_BLOCK, block);
+              device.liveFields |= LIVE_BLOCK;
+            }
+          });
+      }, deadline);
 
     return pUsbDevice;
   }
 
-  std::vector<USBDevicePtr> getDevices()
+  ////////////////////////////////////////////////////////////////////////////////
+  // Handle cache
+  ////////////////////////////////////////////////////////////////////////////////
+  /**
+   * The device information set of a known device with its interface
+   * opened, destroyed once it's evicted and no refresh is using it.
+   */
+  class InterfaceHandle
+  {
+  public:
+    InterfaceHandle(HDEVINFO hDeviceInfo, const DeviceSPData &sp) : m_hDeviceInfo(hDeviceInfo), m_sp(sp) {}
+    ~InterfaceHandle() { SetupDiDestroyDeviceInfoList(m_hDeviceInfo); }
+
+    HDEVINFO deviceInfo() const { return m_hDeviceInfo; }
+    DeviceSPData &sp() { return m_sp; }
+    // Device information sets aren't safe to use from several threads
+    std::mutex &mutex() { return m_mutex; }
+
+  private:
+    InterfaceHandle(const InterfaceHandle &);
+    InterfaceHandle &operator=(const InterfaceHandle &);
+
+    HDEVINFO m_hDeviceInfo;
+    DeviceSPData m_sp;
+    std::mutex m_mutex;
+  };
+
+  typedef std::shared_ptr<InterfaceHandle> InterfaceHandlePtr;
+
+  // By device interface path. Notifications spell paths in a different
+  // case than SetupDi does, so keys are lower case.
+  static Utils::LruCache<std::string, InterfaceHandlePtr> &_interfaceCache()
+  {
+    static Utils::LruCache<std::string, InterfaceHandlePtr> cache(64);
+    return cache;
+  }
+
+  static std::string _interfaceKey(std::string path)
+  {
+    std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+    return path;
+  }
+
+  void setHandleBudget(size_t handles)
+  {
+    _interfaceCache().setCapacity(handles);
+  }
+
+  static InterfaceHandlePtr _openInterface(const std::string &devicePath)
+  {
+    HDEVINFO hDeviceInfo = SetupDiCreateDeviceInfoList(&GUID_DEVINTERFACE_DISK, NULL);
+
+    if (hDeviceInfo == INVALID_HANDLE_VALUE) {
+      CORE_ERROR("Failed to create a device information set.");
+      return nullptr;
+    }
+
+    DeviceSPData sp;
+    sp.info = _createSPType<SP_DEVINFO_DATA>();
+    sp.inter = _createSPType<SP_DEVICE_INTERFACE_DATA>();
+
+    countOSCall(2);
+
+    // Interfaces of unplugged devices can still be opened, but aren't active
+    if (SetupDiOpenDeviceInterfaceA(hDeviceInfo, devicePath.c_str(), 0, &sp.inter) &&
+        (sp.inter.Flags & SPINT_ACTIVE) &&
+        SetupDiEnumDeviceInfo(hDeviceInfo, 0, &sp.info)) {
+      return std::make_shared<InterfaceHandle>(hDeviceInfo, sp);
+    }
+
+    SetupDiDestroyDeviceInfoList(hDeviceInfo);
+
+    return nullptr;
+  }
+
+  USBDevicePtr refreshDevice(const USBDevicePtr &device, std::chrono::steady_clock::time_point deadline)
   {
-    std::vector<USBDevicePtr> ret;
+    Utils::LruCache<std::string, InterfaceHandlePtr> &cache = _interfaceCache();
+    std::string devicePath;
+    InterfaceHandlePtr handle;
+
+    // Run the resolvers that ran for the device before
+    ScanOptions options;
+    {
+      std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+      devicePath = device->devicePath;
+      options.resolve = device->resolved;
+    }
+
+    std::string key = _interfaceKey(devicePath);
+
+    // The device node goes away with the device, even if the removal
+    // notification hasn't been handled yet
+    if (cache.get(key, &handle)) {
+      ULONG status, problem;
+
+      countOSCall();
+
+      if (CM_Get_DevNode_Status(&status, &problem, handle->sp().info.DevInst, 0) != CR_SUCCESS) {
+        cache.erase(key);
+        handle = nullptr;
+      }
+    }
+
+    if (handle == nullptr) {
+      handle = _openInterface(devicePath);
 
-    const GUID *guid = &GUID_DEVINTERFACE_DISK;
-    HDEVINFO hDeviceInfo = SetupDiGetClassDevs(guid, NULL, NULL,
+      if (handle == nullptr)
+        return nullptr;
+    }
+
+    USBDevicePtr pDevice;
+    {
+      std::lock_guard<std::mutex> lock(handle->mutex());
+
+      pDevice = _extractUSBDeviceData(handle->deviceInfo(), handle->sp(), options, nullptr, deadline);
+    }
+
+    if (pDevice != nullptr)
+      cache.put(key, handle);
+    else
+      cache.erase(key);
+
+    return pDevice;
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Scanning
+  ////////////////////////////////////////////////////////////////////////////////
+  struct DeviceScanner::Impl {
+    HDEVINFO hDeviceInfo;
+    const GUID *guid;
+    uint index;
+    std::shared_ptr<VolumeIndex> volumeIndex;
+  };
+
+  DeviceScanner::DeviceScanner(const ScanOptions &options)
+    : m_pImpl(new Impl()), m_options(options)
+  {
+    m_pImpl->guid = &GUID_DEVINTERFACE_DISK;
+    m_pImpl->index = 0;
+    m_pImpl->volumeIndex = std::make_shared<VolumeIndex>();
+    m_pImpl->hDeviceInfo = SetupDiGetClassDevs(m_pImpl->guid, NULL, NULL,
                                                (DIGCF_PRESENT | DIGCF_DEVICEINTERFACE));
 
-    if (hDeviceInfo != INVALID_HANDLE_VALUE) {
-      std::vector<DeviceSPData> spsData = _deviceSPs(hDeviceInfo, guid);
+    if (m_pImpl->hDeviceInfo == INVALID_HANDLE_VALUE)
+      CORE_ERROR("Failed to get the device information set.");
+  }
+
+  DeviceScanner::~DeviceScanner()
+  {
+    close();
+  }
+
+  USBDevicePtr DeviceScanner::fetch()
+  {
+    HDEVINFO hDeviceInfo = m_pImpl->hDeviceInfo;
+
+    if (hDeviceInfo == INVALID_HANDLE_VALUE)
+      return nullptr;
+
+    while(true)
+      {
+        uint index = m_pImpl->index++;
+
+        SP_DEVINFO_DATA spDevInfoData = _createSPType<SP_DEVINFO_DATA>();
 
-      for (auto &sp : spsData)
-        {
-          auto pDevice = _extractUSBDeviceData(hDeviceInfo, sp);
+        countOSCall(2);
 
-          if (pDevice != nullptr) {
-            ret.push_back(pDevice);
+        if (!SetupDiEnumDeviceInfo(hDeviceInfo, index, &spDevInfoData))
+          {
+            if (GetLastError() != ERROR_NO_MORE_ITEMS)
+              CORE_ERROR("Failed to retrieve device information.");
+
+            return nullptr; // We're out of devices
           }
+
+        SP_DEVICE_INTERFACE_DATA spDeviceInterfaceData = _createSPType<SP_DEVICE_INTERFACE_DATA>();
+
+        if (!SetupDiEnumDeviceInterfaces(hDeviceInfo, 0, m_pImpl->guid, index, &spDeviceInterfaceData)) {
+          CORE_ERROR("Failed to get device interfaces.");
+          continue; // Invalid device, skip it
         }
-    }
 
-    return ret;
+        DeviceSPData sp;
+        sp.info = spDevInfoData;
+        sp.inter = spDeviceInterfaceData;
+
+        auto pDevice = _extractUSBDeviceData(hDeviceInfo, sp, options(), m_pImpl->volumeIndex, deadline());
+
+        if (pDevice != nullptr) {
+          return pDevice;
+        }
+      }
   }
 
-  USBDevicePtr getDevice(const std::string &uid)
+  void DeviceScanner::release()
   {
-    return gAllDevices[uid];
+    if (m_pImpl->hDeviceInfo != INVALID_HANDLE_VALUE) {
+      SetupDiDestroyDeviceInfoList(m_pImpl->hDeviceInfo);
+    }
   }
 
   bool unmount(const std::string &uid)
   {
     return false;
 	}
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Change detection
+  ////////////////////////////////////////////////////////////////////////////////
+  static LRESULT CALLBACK _changeWindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+  {
+    if (msg == WM_DEVICECHANGE &&
+        (wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE)) {
+      DEV_BROADCAST_HDR *header = reinterpret_cast<DEV_BROADCAST_HDR *>(lParam);
+
+      // Close the handles of unplugged devices right away
+      if (wParam == DBT_DEVICEREMOVECOMPLETE && header != nullptr &&
+          header->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE) {
+        DEV_BROADCAST_DEVICEINTERFACE_A *broadcast = reinterpret_cast<DEV_BROADCAST_DEVICEINTERFACE_A *>(header);
+        _interfaceCache().erase(_interfaceKey(broadcast->dbcc_name));
+      }
+
+      ChangeDetector::instance().notify();
+    }
+
+    return DefWindowProcA(hwnd, msg, wParam, lParam);
+  }
+
+  /**
+   * Receive disk and volume interface notifications on a message-only
+   * window. Runs the message loop for the life of the process.
+   */
+  static void _changeNotificationLoop(std::shared_ptr<std::promise<bool>> started)
+  {
+    WNDCLASSEXA wc = { 0 };
+    wc.cbSize        = sizeof(wc);
+    wc.lpfnWndProc   = _changeWindowProc;
+    wc.hInstance     = GetModuleHandleA(NULL);
+    wc.lpszClassName = "SubdevilChangeDetector";
+
+    HWND hwnd = NULL;
+
+    if (RegisterClassExA(&wc)) {
+      hwnd = CreateWindowExA(0, wc.lpszClassName, "", 0, 0, 0, 0, 0,
+                             HWND_MESSAGE, NULL, wc.hInstance, NULL);
+    }
+
+    if (hwnd == NULL) {
+      CORE_ERROR("Failed to create the device notification window");
+      started->set_value(false);
+      return;
+    }
+
+    // Disks come and go with the USB device, volumes with mounts
+    const GUID *guids[] = { &GUID_DEVINTERFACE_DISK, &GUID_DEVINTERFACE_VOLUME };
+
+    for (const GUID *guid : guids) {
+      DEV_BROADCAST_DEVICEINTERFACE_A filter = { 0 };
+      filter.dbcc_size       = sizeof(filter);
+      filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+      filter.dbcc_classguid  = *guid;
+
+      if (RegisterDeviceNotificationA(hwnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE) == NULL) {
+        CORE_ERROR("RegisterDeviceNotification() failed");
+        DestroyWindow(hwnd);
+        started->set_value(false);
+        return;
+      }
+    }
+
+    started->set_value(true);
+
+    MSG msg;
+    while (GetMessageA(&msg, NULL, 0, 0) > 0) {
+      TranslateMessage(&msg);
+      DispatchMessageA(&msg);
+    }
+  }
+
+  bool ChangeDetector::start()
+  {
+    auto started = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = started->get_future();
+
+    std::thread(_changeNotificationLoop, started).detach();
+
+    return result.get();
+  }
 }  // namespace usb_driver
@@ -0,0 +1,66 @@
+var assert = require('chai').assert;
+var os = require('os');
+var mock = require('./support/native_mock');
+
+describe('find', function() {
+  var snapshot;
+  var subdevil;
+
+  beforeEach(function() {
+    snapshot = mock.devices('s1', ['a', 'b']);
+    snapshot[0].mount = '/Volumes/A';
+    snapshot[0].volumes = [
+      { node: '/dev/disk4s1', mountPoints: ['/Volumes/A'] },
+      { node: '/dev/disk4s2', mountPoints: ['/Volumes/A2/', '/mnt/a2'] }
+    ];
+
+    subdevil = mock.load({
+      find: function() {
+        throw new Error('Shared snapshots are searched in JS');
+      },
+      sharedOpen: function() { return true; },
+      sharedTick: function() {},
+      sharedClose: function() {},
+      sharedPoll: function() { return snapshot; }
+    });
+
+    subdevil.share('test');
+  });
+
+  afterEach(function() {
+    subdevil.unshare();
+  });
+
+  function ids(devices) {
+    return devices.map(function(dev) {
+      return dev.id;
+    });
+  }
+
+  it('matches any mount point of any volume in a shared snapshot', function() {
+    return subdevil.find({ mount: '/mnt/a2' }).then(function(devices) {
+      assert.deepEqual(ids(devices), ['a']);
+      return subdevil.find({ mount: '/Volumes/A2' });
+    }).then(function(devices) {
+      assert.deepEqual(ids(devices), ['a']);
+      return subdevil.find({ mount: '/Volumes/B' });
+    }).then(function(devices) {
+      assert.deepEqual(devices, []);
+    });
+  });
+
+  it('ignores trailing separators like the native index', function() {
+    return subdevil.find({ mount: '/Volumes/A//' }).then(function(devices) {
+      assert.deepEqual(ids(devices), ['a']);
+      return subdevil.find({ mount: '/Volumes/A\\' });
+    }).then(function(devices) {
+      assert.deepEqual(ids(devices), ['a']);
+    });
+  });
+
+  it('ignores the case of mount points on Windows only', function() {
+    return subdevil.find({ mount: '/volumes/a' }).then(function(devices) {
+      assert.deepEqual(ids(devices), os.platform() === 'win32' ? ['a'] : []);
+    });
+  });
+});
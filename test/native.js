@@ -0,0 +1,16 @@
+var assert = require('chai').assert;
+var childProcess = require('child_process');
+var path = require('path');
+
+var TESTS = path.join(__dirname, '..', 'build', 'Release', 'subdevil-tests');
+
+describe('native', function() {
+  this.timeout(120000);
+
+  it('passes the native tests', function() {
+    var result = childProcess.spawnSync(TESTS, [], { encoding: 'utf8' });
+
+    assert.isUndefined(result.error, 'subdevil-tests could not be run, build it first');
+    assert.equal(result.status, 0, result.stdout + result.stderr);
+  });
+});
@@ -0,0 +1,114 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/device_registry.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+
+using namespace Subdevil;
+
+// Sticks with one partition, next to hubs and input devices without media
+static std::vector<Fake::FakeDevice> _devices(int firstLocationID, int count)
+{
+  std::vector<Fake::FakeDevice> fakes;
+
+  for (int i = 0; i < count; i++) {
+    Fake::FakeDevice fake = Fake::makeDevice(firstLocationID + i);
+
+    if (i % 3 == 2) {
+      fake.volumes.clear();
+      fake.registryEntries = 4;
+    }
+
+    fakes.push_back(fake);
+  }
+
+  return fakes;
+}
+
+static ScanMetrics _scan(bool batchReads, std::vector<USBDevicePtr> &devices)
+{
+  ScanOptions options;
+  options.batchReads = batchReads;
+
+  DeviceScanner scanner(options);
+  USBDevicePtr device;
+
+  devices.clear();
+  while ((device = scanner.next()) != nullptr) {
+    devices.push_back(device);
+  }
+
+  scanner.close();
+
+  return scanner.metrics();
+}
+
+static std::vector<std::string> _mountPoints(const std::vector<USBDevicePtr> &devices)
+{
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+  std::vector<std::string> mountPoints;
+
+  for (const USBDevicePtr &device : devices) {
+    mountPoints.push_back(device->mountPoint.str());
+  }
+
+  return mountPoints;
+}
+
+TEST(batch_reads_find_the_same_media_with_fewer_os_calls)
+{
+  Fake::setDevices(_devices(3900, 30));
+
+  std::vector<USBDevicePtr> walked;
+  std::vector<USBDevicePtr> batched;
+  ScanMetrics walk = _scan(false, walked);
+  ScanMetrics batch = _scan(true, batched);
+
+  CHECK_EQ(walked.size(), 30u);
+  CHECK_EQ(batched.size(), 30u);
+  CHECK(_mountPoints(walked) == _mountPoints(batched));
+  CHECK(batch.osCalls * 3 < walk.osCalls * 2);
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+}
+
+BENCHMARK(batch_reads_os_calls_and_scan_time)
+{
+  static const int COUNTS[] = { 10, 100, 1000 };
+  static const int SCANS = 5;
+
+  // Roughly an IORegistry property read
+  Fake::setOSCallCost(std::chrono::microseconds(2));
+
+  for (int count : COUNTS) {
+    Fake::setDevices(_devices(4000, count));
+
+    for (int batchReads = 0; batchReads < 2; batchReads++) {
+      std::vector<USBDevicePtr> devices;
+      std::vector<double> times;
+      uint64_t osCalls = 0;
+
+      for (int scan = 0; scan < SCANS; scan++) {
+        ScanMetrics metrics = _scan(batchReads != 0, devices);
+
+        CHECK_EQ(devices.size(), static_cast<size_t>(count));
+
+        times.push_back(metrics.total.count() / 1000.0);
+        osCalls = metrics.osCalls;
+      }
+
+      std::sort(times.begin(), times.end());
+
+      std::string name = std::to_string(count) + " devices, batchReads " +
+        (batchReads ? "true" : "false");
+
+      Test::report(name + " os calls", static_cast<double>(osCalls), "/scan");
+      Test::report(name + " scan p50", times[SCANS / 2], "ms");
+    }
+  }
+
+  Fake::setOSCallCost(std::chrono::nanoseconds::zero());
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+}
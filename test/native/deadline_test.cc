@@ -0,0 +1,146 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/device_registry.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+using namespace Subdevil;
+
+static ScanOptions _withDeadline(int ms)
+{
+  ScanOptions options;
+  options.deadline = std::chrono::milliseconds(ms);
+  return options;
+}
+
+static bool _incomplete(const USBDevicePtr &device)
+{
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+  return device->incomplete;
+}
+
+TEST(deadline_returns_slow_devices_incomplete)
+{
+  Fake::FakeDevice slow = Fake::makeDevice(100);
+  slow.lookupDelay = std::chrono::milliseconds(300);
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>(1, slow));
+
+  auto started = std::chrono::steady_clock::now();
+  std::vector<USBDevicePtr> devices = getDevices(_withDeadline(20));
+
+  CHECK(Test::elapsedMs(started) < 200);
+  CHECK_EQ(devices.size(), 1u);
+  CHECK(_incomplete(devices[0]));
+
+  // The lookup finishes in the background
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+  CHECK(!devices[0]->incomplete);
+  CHECK_EQ(devices[0]->mountPoint.str(), std::string("/Volumes/FAKE100"));
+}
+
+TEST(deadline_is_per_device)
+{
+  // A hung device must not use up the budget of the ones after it
+  Fake::FakeDevice hung = Fake::makeDevice(200);
+  hung.lookupDelay = std::chrono::milliseconds(1000);
+
+  Fake::FakeDevice quick = Fake::makeDevice(201);
+  quick.lookupDelay = std::chrono::milliseconds(5);
+
+  std::vector<Fake::FakeDevice> fakes;
+  fakes.push_back(hung);
+  fakes.push_back(quick);
+  Fake::setDevices(fakes);
+
+  std::vector<USBDevicePtr> devices = getDevices(_withDeadline(50));
+
+  CHECK_EQ(devices.size(), 2u);
+  CHECK(_incomplete(devices[0]));
+  CHECK(!_incomplete(devices[1]));
+}
+
+TEST(deadline_bounds_single_device_refresh)
+{
+  Fake::FakeDevice fake = Fake::makeDevice(300);
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>(1, fake));
+
+  std::vector<USBDevicePtr> devices = getDevices(ScanOptions());
+
+  CHECK_EQ(devices.size(), 1u);
+
+  if (devices.empty())
+    return;
+
+  std::string uid;
+  {
+    std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+    uid = devices[0]->uid;
+  }
+
+  // The disk stopped responding after the scan
+  fake.lookupDelay = std::chrono::milliseconds(2000);
+  Fake::setDevices(std::vector<Fake::FakeDevice>(1, fake));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+  auto started = std::chrono::steady_clock::now();
+  USBDevicePtr device = getDevice(uid, std::chrono::milliseconds::zero(), std::chrono::milliseconds(50));
+
+  CHECK(Test::elapsedMs(started) < 1000);
+  CHECK(device != nullptr);
+
+  if (device != nullptr)
+    CHECK(_incomplete(device));
+}
+
+TEST(deadline_bounds_scan_time_p99_with_faults)
+{
+  const int deviceCount = 32;
+  const int deadlineMs = 25;
+  const int scans = 60;
+
+  // Devices that hang for seconds, next to ones with a few ms of jitter
+  Test::Random random(29);
+  std::vector<Fake::FakeDevice> fakes;
+
+  for (int i = 0; i < deviceCount; i++) {
+    Fake::FakeDevice fake = Fake::makeDevice(300 + i);
+    fake.lookupDelay = std::chrono::milliseconds(i % 8 == 0 ? 2000 : random.below(5));
+    fakes.push_back(fake);
+  }
+
+  Fake::setDevices(fakes);
+
+  std::vector<double> times;
+
+  for (int scan = 0; scan < scans; scan++) {
+    auto started = std::chrono::steady_clock::now();
+    std::vector<USBDevicePtr> devices = getDevices(_withDeadline(deadlineMs));
+    times.push_back(Test::elapsedMs(started));
+
+    CHECK_EQ(devices.size(), static_cast<size_t>(deviceCount));
+
+    for (size_t i = 0; i < devices.size(); i++) {
+      if (i % 8 != 0)
+        CHECK(!_incomplete(devices[i]));
+    }
+  }
+
+  std::sort(times.begin(), times.end());
+
+  double p99 = times[times.size() * 99 / 100];
+  // Every hung device may use its whole budget, the others a few ms each
+  double bound = (deviceCount / 8) * deadlineMs + deviceCount * 5 + 50;
+
+  Test::report("scan p50", times[times.size() / 2], "ms");
+  Test::report("scan p99", p99, "ms");
+
+  CHECK(p99 < bound);
+}
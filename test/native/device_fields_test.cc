@@ -0,0 +1,326 @@
+#include "test.h"
+#include "../../src/device_fields.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using namespace Subdevil;
+
+static USBDevice _device(int locationID)
+{
+  USBDevice device = USBDevice();
+
+  device.uid          = "1921-21863-FAKE" + std::to_string(locationID);
+  device.locationID   = locationID;
+  device.vendorID     = 0x0781;
+  device.productID    = 0x5567;
+  device.product      = "Cruzer Blade";
+  device.serialNumber = "4C530001220528115445";
+  device.vendor       = "SanDisk";
+  device.mountPoint   = "/Volumes/FAKE";
+  device.ttyPath      = "/dev/tty.usbmodem" + std::to_string(locationID);
+  device.resolved     = RESOLVE_TTY;
+  device.sessionID    = 42;
+  device.devicePath   = "IOService:/FAKE" + std::to_string(locationID);
+  device.refreshedAt  = std::chrono::steady_clock::now();
+
+  Volume volume;
+  volume.node  = "/dev/disk4s1";
+  volume.label = "FAKE";
+  volume.uuid  = "5E1B-2C4A";
+  volume.mountPoints.push_back("/Volumes/FAKE");
+  device.volumes.push_back(volume);
+
+  return device;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Hand written equivalents
+////////////////////////////////////////////////////////////////////////////////
+// What the schema replaces, field by field, to check the generated code
+// against
+static void _fnv(uint64_t &hash, const void *data, size_t size)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+}
+
+static void _fnvString(uint64_t &hash, const std::string &str)
+{
+  uint64_t size = str.size();
+
+  _fnv(hash, &size, sizeof(size));
+  _fnv(hash, str.data(), str.size());
+}
+
+static uint64_t _handHash(const USBDevice &device)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint64_t count = device.volumes.size();
+
+  _fnvString(hash, device.uid);
+  _fnv(hash, &device.productID, sizeof(device.productID));
+  _fnv(hash, &device.vendorID, sizeof(device.vendorID));
+  _fnvString(hash, device.product.str());
+  _fnvString(hash, device.serialNumber);
+  _fnvString(hash, device.vendor.str());
+  _fnvString(hash, device.mountPoint.str());
+  _fnv(hash, &count, sizeof(count));
+
+  for (const Volume &volume : device.volumes) {
+    uint64_t mountCount = volume.mountPoints.size();
+
+    _fnvString(hash, volume.node);
+    _fnvString(hash, volume.label);
+    _fnvString(hash, volume.uuid);
+    _fnv(hash, &mountCount, sizeof(mountCount));
+
+    for (const std::string &mountPoint : volume.mountPoints) {
+      _fnvString(hash, mountPoint);
+    }
+  }
+
+  _fnvString(hash, device.ttyPath);
+  _fnvString(hash, device.hidPath);
+  _fnvString(hash, device.blockPath);
+  _fnv(hash, &device.locationID, sizeof(device.locationID));
+  _fnv(hash, &device.resolved, sizeof(device.resolved));
+  _fnv(hash, &device.sessionID, sizeof(device.sessionID));
+  _fnvString(hash, device.devicePath);
+
+  return hash;
+}
+
+static std::vector<const char *> _handDiff(const USBDevice &a, const USBDevice &b)
+{
+  std::vector<const char *> changed;
+  bool volumes = a.volumes.size() == b.volumes.size();
+
+  for (size_t i = 0; volumes && i < a.volumes.size(); i++) {
+    volumes = a.volumes[i].node == b.volumes[i].node && a.volumes[i].label == b.volumes[i].label &&
+      a.volumes[i].uuid == b.volumes[i].uuid && a.volumes[i].mountPoints == b.volumes[i].mountPoints;
+  }
+
+  if (a.uid != b.uid)                   changed.push_back("id");
+  if (a.productID != b.productID)       changed.push_back("productId");
+  if (a.vendorID != b.vendorID)         changed.push_back("vendorId");
+  if (!(a.product == b.product))        changed.push_back("product");
+  if (a.serialNumber != b.serialNumber) changed.push_back("serialNumber");
+  if (!(a.vendor == b.vendor))          changed.push_back("manufacturer");
+  if (!(a.mountPoint == b.mountPoint))  changed.push_back("mount");
+  if (!volumes)                         changed.push_back("volumes");
+  if (a.incomplete != b.incomplete)     changed.push_back("incomplete");
+  if (a.ttyPath != b.ttyPath)           changed.push_back("tty");
+  if (a.hidPath != b.hidPath)           changed.push_back("hidraw");
+  if (a.blockPath != b.blockPath)       changed.push_back("block");
+  if (a.locationID != b.locationID)     changed.push_back("locationId");
+  if (a.resolved != b.resolved)         changed.push_back("resolved");
+  if (a.sessionID != b.sessionID)       changed.push_back("sessionId");
+  if (a.devicePath != b.devicePath)     changed.push_back("devicePath");
+
+  return changed;
+}
+
+// Collects the names of the fields reported for a device
+struct ReportedNames {
+  const USBDevice &device;
+  std::vector<std::string> names;
+
+  explicit ReportedNames(const USBDevice &device) : device(device) {}
+
+  template<typename T>
+  void operator()(const Field &field, T USBDevice::*)
+  {
+    if (isReported(field, device))
+      names.push_back(field.name);
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+////////////////////////////////////////////////////////////////////////////////
+TEST(schema_serializes_content_fields)
+{
+  USBDevice device = _device(1);
+  std::string data;
+
+  serializeDevice(device, data);
+  serializeDevice(_device(2), data);
+
+  USBDevice first = USBDevice();
+  USBDevice second = USBDevice();
+  size_t offset = 0;
+
+  CHECK(deserializeDevice(data, &offset, first));
+  CHECK(deserializeDevice(data, &offset, second));
+  CHECK_EQ(offset, data.size());
+
+  CHECK(!deserializeDevice(data, &offset, second));
+
+  // Everything but the fields that aren't read from the OS
+  first.incomplete = device.incomplete;
+  first.refreshedAt = device.refreshedAt;
+
+  CHECK(diffFields(device, first).empty());
+  CHECK_EQ(contentHash(first), contentHash(device));
+  CHECK_EQ(second.locationID, 2);
+
+  // Truncated data is rejected
+  std::string truncated = data.substr(0, data.size() - 1);
+  offset = 0;
+
+  CHECK(deserializeDevice(truncated, &offset, first));
+  CHECK(!deserializeDevice(truncated, &offset, second));
+}
+
+TEST(schema_diffs_and_hashes_like_hand_written_code)
+{
+  USBDevice device = _device(1);
+  USBDevice later = device;
+
+  CHECK_EQ(contentHash(device), _handHash(device));
+
+  // Reading the device again changes nothing
+  later.refreshedAt += std::chrono::seconds(1);
+
+  CHECK(diffFields(device, later).empty());
+  CHECK_EQ(contentHash(later), contentHash(device));
+
+  later.volumes[0].mountPoints.clear();
+  later.incomplete = true;
+
+  std::vector<const char *> changed = diffFields(device, later);
+
+  CHECK(changed == _handDiff(device, later));
+  CHECK_EQ(changed.size(), 2u);
+  CHECK(contentHash(later) != contentHash(device));
+  CHECK_EQ(contentHash(later), _handHash(later));
+}
+
+TEST(schema_reports_resolved_fields_only)
+{
+  USBDevice device = _device(1);
+  ReportedNames reported(device);
+
+  forEachField(reported);
+
+  // Only the tty resolver ran
+  CHECK_EQ(reported.names.size(), 11u);
+  CHECK_EQ(reported.names.back(), std::string("tty"));
+}
+
+TEST(schema_copies_descriptor_fields_only)
+{
+  USBDevice device = _device(1);
+  USBDevice descriptor = USBDevice();
+
+  descriptor.locationID   = 7;
+  descriptor.vendorID     = 0x046d;
+  descriptor.productID    = 0xc52b;
+  descriptor.product      = "Unifying Receiver";
+  descriptor.vendor       = "Logitech";
+  descriptor.devicePath   = "IOService:/OTHER";
+
+  copyDescriptorFields(descriptor, device);
+
+  CHECK_EQ(device.locationID, 7);
+  CHECK_EQ(device.vendorID, 0x046d);
+  CHECK_EQ(device.product.str(), std::string("Unifying Receiver"));
+  CHECK(device.serialNumber.empty());
+  CHECK_EQ(device.devicePath, std::string("IOService:/OTHER"));
+
+  // What lookups and resolvers found is left alone
+  CHECK_EQ(device.uid, std::string("1921-21863-FAKE1"));
+  CHECK_EQ(device.mountPoint.str(), std::string("/Volumes/FAKE"));
+  CHECK_EQ(device.volumes.size(), 1u);
+  CHECK_EQ(device.ttyPath, std::string("/dev/tty.usbmodem1"));
+  CHECK_EQ(device.resolved, static_cast<unsigned>(RESOLVE_TTY));
+  CHECK_EQ(device.sessionID, 42u);
+}
+
+BENCHMARK(schema_against_hand_written_code)
+{
+  static const int COUNT = 200000;
+
+  std::vector<USBDevice> devices;
+
+  for (int i = 0; i < 100; i++) {
+    devices.push_back(_device(i));
+  }
+
+  uint64_t hashes = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    hashes += contentHash(devices[i % devices.size()]);
+  }
+
+  Test::report("contentHash", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    hashes -= _handHash(devices[i % devices.size()]);
+  }
+
+  Test::report("hand written hash", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  // Same fields, same order, same result
+  CHECK_EQ(hashes, 0u);
+
+  size_t changed = 0;
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    changed += diffFields(devices[i % devices.size()], devices[(i + 1) % devices.size()]).size();
+  }
+
+  Test::report("diffFields", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    changed -= _handDiff(devices[i % devices.size()], devices[(i + 1) % devices.size()]).size();
+  }
+
+  Test::report("hand written diff", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  CHECK_EQ(changed, 0u);
+
+  std::vector<const char *> names;
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    diffFields(devices[i % devices.size()], devices[(i + 1) % devices.size()], names);
+    changed += names.size();
+  }
+
+  Test::report("diffFields into a kept vector", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  CHECK_EQ(changed, 4u * COUNT);
+
+  std::string data;
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    data.clear();
+    serializeDevice(devices[i % devices.size()], data);
+  }
+
+  Test::report("serializeDevice", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+
+  USBDevice device = USBDevice();
+  start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < COUNT; i++) {
+    size_t offset = 0;
+    deserializeDevice(data, &offset, device);
+  }
+
+  Test::report("deserializeDevice", Test::elapsedMs(start) * 1e6 / COUNT, "ns/device");
+}
@@ -0,0 +1,250 @@
+#include "test.h"
+#include "../../src/device_history.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+using namespace Subdevil;
+
+static HistoryEvent _event(HistoryEventType type, const std::string &serialNumber, int64_t timeMs,
+                           const std::string &mountPoint = "")
+{
+  HistoryEvent event;
+  event.type         = type;
+  event.timeMs       = timeMs;
+  event.deviceKey    = historyDeviceKey(serialNumber, 0x0781, 0x5567, 1);
+  event.vendorID     = 0x0781;
+  event.productID    = 0x5567;
+  event.serialNumber = serialNumber;
+  event.mountPoint   = mountPoint;
+  event.durationMs   = -1;
+
+  return event;
+}
+
+// Plugged, mounted, unmounted and unplugged: 4 events, 300 ms apart from
+// add to remove
+static std::vector<HistoryEvent> _session(const std::string &serialNumber, int64_t timeMs)
+{
+  std::vector<HistoryEvent> events;
+
+  events.push_back(_event(HISTORY_ADD, serialNumber, timeMs));
+  events.push_back(_event(HISTORY_MOUNT, serialNumber, timeMs + 100, "/Volumes/" + serialNumber));
+  events.push_back(_event(HISTORY_UNMOUNT, serialNumber, timeMs + 200, "/Volumes/" + serialNumber));
+  events.push_back(_event(HISTORY_REMOVE, serialNumber, timeMs + 300));
+
+  return events;
+}
+
+static long _fileSize(const std::string &path)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+
+  if (file == NULL)
+    return -1;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+
+  return size;
+}
+
+static void _writeBytes(const std::string &path, const char *mode, const std::string &data)
+{
+  FILE *file = fopen(path.c_str(), mode);
+
+  if (file != NULL) {
+    fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+  }
+}
+
+static void _removeHistory(const std::string &path)
+{
+  remove(path.c_str());
+  remove((path + ".tmp").c_str());
+
+  for (int segment = 0; segment < 16; segment++) {
+    remove((path + "." + std::to_string(segment)).c_str());
+    remove((path + "." + std::to_string(segment) + ".idx").c_str());
+  }
+}
+
+TEST(history_seals_segments_and_finds_records_through_their_index)
+{
+  DeviceHistory &history = DeviceHistory::instance();
+  std::string path = Test::tempPath("history-seal");
+
+  _removeHistory(path);
+
+  CHECK(history.open(path, 4, 8));
+
+  // Two devices, interleaved over three segments
+  std::vector<HistoryEvent> a = _session("A", 1000);
+  std::vector<HistoryEvent> b = _session("B", 1050);
+
+  for (size_t i = 0; i < a.size(); i++) {
+    history.append(std::vector<HistoryEvent>(1, a[i]));
+    history.append(std::vector<HistoryEvent>(1, b[i]));
+  }
+
+  history.append(std::vector<HistoryEvent>(1, _event(HISTORY_ADD, "A", 2000)));
+
+  // Sealed segments have an index, the active one doesn't
+  CHECK_EQ(_fileSize(path + ".0"), 4 * 128);
+  CHECK_EQ(_fileSize(path + ".1"), 4 * 128);
+  CHECK_EQ(_fileSize(path + ".2"), 128);
+  CHECK(_fileSize(path + ".0.idx") > 0);
+  CHECK(_fileSize(path + ".1.idx") > 0);
+  CHECK_EQ(_fileSize(path + ".2.idx"), -1);
+
+  std::vector<HistoryEvent> events = history.query("A", 0);
+
+  CHECK_EQ(events.size(), 5u);
+
+  if (events.size() == 5) {
+    CHECK_EQ(events[0].type, HISTORY_ADD);
+    CHECK_EQ(events[1].mountPoint, "/Volumes/A");
+    CHECK_EQ(events[3].type, HISTORY_REMOVE);
+    CHECK_EQ(events[3].durationMs, 300);
+    CHECK_EQ(events[4].timeMs, 2000);
+    CHECK_EQ(events[4].durationMs, -1);
+  }
+
+  // Only events since the given time
+  events = history.query("B", 1200);
+
+  CHECK_EQ(events.size(), 2u);
+
+  if (events.size() == 2) {
+    CHECK_EQ(events[0].type, HISTORY_UNMOUNT);
+    // The add is older, so the duration isn't known
+    CHECK_EQ(events[1].durationMs, -1);
+  }
+
+  CHECK(history.query("C", 0).empty());
+
+  // Sealed segments are only read through their index
+  _writeBytes(path + ".0.idx", "wb", std::string(64, '\0'));
+
+  CHECK_EQ(history.query("A", 0).size(), 3u);
+
+  history.close();
+  _removeHistory(path);
+}
+
+TEST(history_pads_records_torn_by_a_crash)
+{
+  DeviceHistory &history = DeviceHistory::instance();
+  std::string path = Test::tempPath("history-torn");
+
+  _removeHistory(path);
+
+  CHECK(history.open(path, 16, 8));
+  history.append(_session("A", 1000));
+  history.close();
+
+  // Half a record, as if the process died while writing it
+  _writeBytes(path + ".0", "ab", std::string(50, '\x7f'));
+
+  CHECK(history.open(path, 16, 8));
+  history.append(std::vector<HistoryEvent>(1, _event(HISTORY_ADD, "A", 2000)));
+
+  CHECK_EQ(_fileSize(path + ".0"), 6 * 128);
+
+  std::vector<HistoryEvent> events = history.query("A", 0);
+
+  CHECK_EQ(events.size(), 5u);
+
+  if (!events.empty())
+    CHECK_EQ(events.back().timeMs, 2000);
+
+  history.close();
+  _removeHistory(path);
+}
+
+TEST(history_compaction_keeps_a_segment_of_adds_and_removes)
+{
+  DeviceHistory &history = DeviceHistory::instance();
+  std::string path = Test::tempPath("history-compact");
+
+  _removeHistory(path);
+
+  CHECK(history.open(path, 4, 2));
+
+  // A segment per device
+  const char *serials[] = { "S0", "S1", "S2", "S3", "S4", "S5" };
+
+  for (int i = 0; i < 6; i++) {
+    history.append(_session(serials[i], 1000 * i));
+  }
+
+  // Two sealed segments and the active one are left. The older one holds
+  // the newest adds and removes of the compacted segments, S2 and S3.
+  CHECK_EQ(_fileSize(path + ".2"), -1);
+  CHECK_EQ(_fileSize(path + ".3"), 4 * 128);
+  CHECK_EQ(_fileSize(path + ".4"), 4 * 128);
+  CHECK_EQ(_fileSize(path + ".5"), 4 * 128);
+
+  CHECK(history.query("S0", 0).empty());
+  CHECK(history.query("S1", 0).empty());
+
+  std::vector<HistoryEvent> events = history.query("S2", 0);
+
+  CHECK_EQ(events.size(), 2u);
+
+  if (events.size() == 2) {
+    CHECK_EQ(events[0].type, HISTORY_ADD);
+    CHECK_EQ(events[1].type, HISTORY_REMOVE);
+    CHECK_EQ(events[1].durationMs, 300);
+  }
+
+  CHECK_EQ(history.query("S4", 0).size(), 4u);
+
+  history.close();
+
+  // A lower limit is applied when the log is opened again
+  CHECK(history.open(path, 4, 1));
+
+  CHECK_EQ(_fileSize(path + ".3"), -1);
+  CHECK_EQ(_fileSize(path + ".4"), 4 * 128);
+  CHECK(history.query("S2", 0).empty());
+  CHECK_EQ(history.query("S3", 0).size(), 2u);
+  CHECK_EQ(history.query("S4", 0).size(), 2u);
+  CHECK_EQ(history.query("S5", 0).size(), 4u);
+
+  history.close();
+  _removeHistory(path);
+}
+
+TEST(history_survives_a_crash_while_replacing_the_manifest)
+{
+  DeviceHistory &history = DeviceHistory::instance();
+  std::string path = Test::tempPath("history-manifest");
+
+  _removeHistory(path);
+
+  CHECK(history.open(path, 2, 8));
+  history.append(_session("A", 1000));
+  history.close();
+
+  // A torn temp file next to the manifest is ignored
+  _writeBytes(path + ".tmp", "wb", "SDV");
+
+  CHECK(history.open(path, 2, 8));
+  CHECK_EQ(history.query("A", 0).size(), 4u);
+  history.close();
+
+  // The old manifest was removed, but the new one not renamed yet
+  rename(path.c_str(), (path + ".tmp").c_str());
+
+  CHECK(history.open(path, 2, 8));
+  CHECK_EQ(history.query("A", 0).size(), 4u);
+  CHECK_EQ(_fileSize(path), 16);
+  history.close();
+
+  _removeHistory(path);
+}
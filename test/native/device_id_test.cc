@@ -0,0 +1,305 @@
+#include "test.h"
+#include "../../src/device_id.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+using namespace Subdevil;
+
+static bool _parse(const char *str, DeviceIDView &id)
+{
+  return parseDeviceID(str, strlen(str), id);
+}
+
+static std::string _serial(const DeviceIDView &id)
+{
+  return std::string(id.serial, id.serialLength);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reference parser
+////////////////////////////////////////////////////////////////////////////////
+// Reads the formats one character at a time, the way the backends used to,
+// to check the parser against.
+static int _hexDigit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Reads min to max hex digits at pos, fails if there are more
+static bool _refHex(const std::string &str, size_t &pos, size_t min, size_t max, uint16_t &value)
+{
+  uint32_t result = 0;
+  size_t count = 0;
+
+  while (pos < str.size() && _hexDigit(str[pos]) >= 0) {
+    if (++count > max)
+      return false;
+
+    result = (result << 4) | _hexDigit(str[pos++]);
+  }
+
+  value = static_cast<uint16_t>(result);
+
+  return count >= min;
+}
+
+// Reads exactly four hex digits at pos, whatever follows them
+static bool _refHex4(const std::string &str, size_t pos, uint16_t &value)
+{
+  if (pos + 4 > str.size())
+    return false;
+
+  std::string digits = str.substr(pos, 4);
+  size_t start = 0;
+
+  return _refHex(digits, start, 4, 4, value);
+}
+
+static bool _refLiteral(const std::string &str, size_t pos, const char *literal)
+{
+  return str.compare(pos, strlen(literal), literal) == 0;
+}
+
+static bool _refParse(const std::string &str, DeviceIDView &id, std::string &serial)
+{
+  serial.clear();
+
+  if (_refLiteral(str, 0, "USB\\")) {
+    if (!_refLiteral(str, 0, "USB\\VID_") || !_refHex4(str, 8, id.vendorID) ||
+        !_refLiteral(str, 12, "&PID_") || !_refHex4(str, 17, id.productID)) {
+      return false;
+    }
+
+    if (str.size() == 21 || str[21] == '&')
+      return true;
+
+    if (str[21] != '\\')
+      return false;
+
+    size_t amp = str.find('&', 22);
+
+    serial = str.substr(22, amp == std::string::npos ? std::string::npos : amp - 22);
+
+    return true;
+  }
+
+  if (_refLiteral(str, 0, "usb:")) {
+    return _refLiteral(str, 0, "usb:v") && _refHex4(str, 5, id.vendorID) &&
+      _refLiteral(str, 9, "p") && _refHex4(str, 10, id.productID);
+  }
+
+  size_t pos = _refLiteral(str, 0, "PRODUCT=") ? 8 : 0;
+
+  if (!_refHex(str, pos, 1, 4, id.vendorID) || !_refLiteral(str, pos++, "/"))
+    return false;
+
+  return _refHex(str, pos, 1, 4, id.productID) && (pos == str.size() || str[pos] == '/');
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Generated IDs
+////////////////////////////////////////////////////////////////////////////////
+static const char HEX[] = "0123456789abcdefABCDEF";
+
+static std::string _hex(Test::Random &random, size_t digits)
+{
+  std::string result;
+
+  for (size_t i = 0; i < digits; i++) {
+    result += HEX[random.below(sizeof(HEX) - 1)];
+  }
+
+  return result;
+}
+
+// A well formed ID in one of the formats, like the ones the OS reports
+static std::string _randomID(Test::Random &random)
+{
+  switch (random.below(5)) {
+  case 0:
+    return "USB\\VID_" + _hex(random, 4) + "&PID_" + _hex(random, 4) + "\\" + _hex(random, random.below(20));
+  case 1:
+    return "USB\\VID_" + _hex(random, 4) + "&PID_" + _hex(random, 4) + "&MI_0" + _hex(random, 1) + "\\6&1b3c&0&000" + _hex(random, 1);
+  case 2:
+    return "usb:v" + _hex(random, 4) + "p" + _hex(random, 4) + "d0100dc00dsc00dp00ic08isc06ip50in00";
+  case 3:
+    return "PRODUCT=" + _hex(random, 1 + random.below(4)) + "/" + _hex(random, 1 + random.below(4)) + "/100";
+  default:
+    return _hex(random, 1 + random.below(4)) + "/" + _hex(random, 1 + random.below(4));
+  }
+}
+
+// Characters around the edges of the hex ranges and the separators
+static const char NOISE[] = "/\\&:=_ @G`gFf09Pp\x7f\x80\xff";
+
+static std::string _mutate(Test::Random &random, std::string str)
+{
+  switch (random.below(4)) {
+  case 0:
+    if (!str.empty())
+      str[random.below(str.size())] = NOISE[random.below(sizeof(NOISE) - 1)];
+    break;
+  case 1:
+    str.resize(random.below(str.size() + 1));
+    break;
+  case 2:
+    str.insert(random.below(str.size() + 1), 1, NOISE[random.below(sizeof(NOISE))]);
+    break;
+  default:
+    if (!str.empty())
+      str.erase(random.below(str.size()), 1);
+    break;
+  }
+
+  return str;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+////////////////////////////////////////////////////////////////////////////////
+TEST(device_id_parses_instance_ids)
+{
+  DeviceIDView id;
+
+  CHECK(_parse("USB\\VID_0781&PID_5581\\4C530001220528115445", id));
+  CHECK_EQ(id.vendorID, 0x0781);
+  CHECK_EQ(id.productID, 0x5581);
+  CHECK_EQ(_serial(id), "4C530001220528115445");
+
+  CHECK(_parse("USB\\VID_abcd&PID_EF01", id));
+  CHECK_EQ(id.vendorID, 0xABCD);
+  CHECK_EQ(id.productID, 0xEF01);
+  CHECK_EQ(id.serialLength, 0u);
+
+  // Interfaces of composite devices have no serial
+  CHECK(_parse("USB\\VID_046D&PID_C52B&MI_00\\7&2a4c3e1&0&0000", id));
+  CHECK_EQ(id.productID, 0xC52B);
+  CHECK_EQ(id.serialLength, 0u);
+
+  CHECK(!_parse("USB\\VID_0781&PID_558", id));
+  CHECK(!_parse("USB\\VID_0781&PID_55812", id));
+  CHECK(!_parse("USB\\VID_078G&PID_5581", id));
+  CHECK(!_parse("USB\\PID_5581&VID_0781", id));
+  CHECK(!_parse("USB\\ROOT_HUB30\\4&1b3c&0&0", id));
+}
+
+TEST(device_id_parses_modaliases)
+{
+  DeviceIDView id;
+
+  CHECK(_parse("usb:v1D6Bp0003d0515dc09dsc00dp03ic09isc00ip00in00", id));
+  CHECK_EQ(id.vendorID, 0x1D6B);
+  CHECK_EQ(id.productID, 0x0003);
+  CHECK_EQ(id.serialLength, 0u);
+
+  CHECK(_parse("usb:vffffp0000", id));
+  CHECK_EQ(id.vendorID, 0xFFFF);
+
+  CHECK(!_parse("usb:v1D6B", id));
+  CHECK(!_parse("usb:v1D6Bx0003", id));
+  CHECK(!_parse("usb:p0003v1D6B", id));
+  CHECK(!_parse("usb:v1D6Bp00 3", id));
+}
+
+TEST(device_id_parses_uevent_products)
+{
+  DeviceIDView id;
+
+  CHECK(_parse("PRODUCT=781/5581/100", id));
+  CHECK_EQ(id.vendorID, 0x0781);
+  CHECK_EQ(id.productID, 0x5581);
+
+  CHECK(_parse("1d6b/3", id));
+  CHECK_EQ(id.vendorID, 0x1D6B);
+  CHECK_EQ(id.productID, 0x0003);
+
+  CHECK(!_parse("PRODUCT=", id));
+  CHECK(!_parse("PRODUCT=781", id));
+  CHECK(!_parse("PRODUCT=781/", id));
+  CHECK(!_parse("PRODUCT=12345/1", id));
+  CHECK(!_parse("PRODUCT=781/5581x", id));
+  CHECK(!_parse("", id));
+}
+
+TEST(device_id_matches_reference_parser)
+{
+  Test::Random random(33);
+  size_t parsed = 0;
+
+  for (int i = 0; i < 200000; i++) {
+    std::string str = _randomID(random);
+    int mutations = random.below(4);
+
+    for (int m = 0; m < mutations; m++) {
+      str = _mutate(random, str);
+    }
+
+    // An exactly sized copy, so reads past the end show up in sanitizer builds
+    std::vector<char> buf(str.begin(), str.end());
+    const char *data = buf.empty() ? "" : &buf[0];
+
+    DeviceIDView id, expected;
+    std::string expectedSerial;
+
+    bool ok = parseDeviceID(data, buf.size(), id);
+
+    if (ok != _refParse(str, expected, expectedSerial)) {
+      Test::fail(__FILE__, __LINE__, "Result differs for \"" + str + "\"");
+      continue;
+    }
+
+    if (!ok)
+      continue;
+
+    parsed++;
+
+    CHECK_EQ(id.vendorID, expected.vendorID);
+    CHECK_EQ(id.productID, expected.productID);
+    CHECK_EQ(_serial(id), expectedSerial);
+    CHECK(id.serial >= data && id.serial + id.serialLength <= data + buf.size());
+  }
+
+  // Most unmutated IDs parse
+  CHECK(parsed > 50000);
+}
+
+BENCHMARK(device_id_parse_million)
+{
+  static const size_t COUNT = 1000000;
+
+  Test::Random random(1);
+  std::vector<std::string> ids;
+
+  ids.reserve(COUNT);
+
+  for (size_t i = 0; i < COUNT; i++) {
+    ids.push_back(_randomID(random));
+  }
+
+  int64_t allocated = Test::allocatedBytes();
+  uint32_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (const std::string &str : ids) {
+    DeviceIDView id;
+
+    if (parseDeviceID(str.data(), str.size(), id))
+      checksum += id.vendorID ^ id.productID ^ static_cast<uint32_t>(id.serialLength);
+  }
+
+  double ms = Test::elapsedMs(start);
+
+  // Parsing allocates nothing
+  CHECK_EQ(Test::allocatedBytes(), allocated);
+
+  // Also keeps the loop from being optimized away
+  CHECK(checksum != 0);
+
+  Test::report("parse", ms * 1e6 / COUNT, "ns/id");
+}
@@ -0,0 +1,254 @@
+#include "fake_backend.h"
+#include "../../src/usb_common.h"
+#include "../../src/device_registry.h"
+#include "../../src/change_detector.h"
+#include "../../src/device_fields.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace Subdevil { namespace Fake
+{
+  static std::mutex gDevicesMutex;
+  static std::vector<FakeDevice> gDevices;
+  static std::atomic<uint64_t> gDeviceOpens(0);
+  static std::atomic<int64_t> gOSCallCostNs(0);
+
+  // Parents between a leaf media and its USB device on OSX: partition,
+  // partition scheme, whole media, block storage driver, SCSI nub and
+  // mass storage interface
+  static const unsigned MEDIA_DEPTH = 6;
+
+  FakeDevice makeDevice(int locationID)
+  {
+    FakeDevice device;
+    device.locationID   = locationID;
+    device.vendorID     = 0x0781;
+    device.productID    = 0x5567;
+    device.serialNumber = "FAKE" + std::to_string(locationID);
+    device.vendor       = "SanDisk";
+    device.product      = "Cruzer Blade";
+    device.lookupDelay  = std::chrono::milliseconds::zero();
+    // Interface, drivers, nubs and the media of one partition
+    device.registryEntries = 12;
+
+    Volume volume;
+    volume.node  = "/dev/fake" + std::to_string(locationID) + "s1";
+    volume.label = "FAKE" + std::to_string(locationID);
+    volume.mountPoints.push_back("/Volumes/FAKE" + std::to_string(locationID));
+    device.volumes.push_back(volume);
+
+    return device;
+  }
+
+  void setDevices(const std::vector<FakeDevice> &devices)
+  {
+    std::lock_guard<std::mutex> lock(gDevicesMutex);
+    gDevices = devices;
+  }
+
+  uint64_t deviceOpens()
+  {
+    return gDeviceOpens.load();
+  }
+
+  void setOSCallCost(std::chrono::nanoseconds cost)
+  {
+    gOSCallCostNs = cost.count();
+  }
+
+  static std::vector<FakeDevice> _devices()
+  {
+    std::lock_guard<std::mutex> lock(gDevicesMutex);
+    return gDevices;
+  }
+
+  static void _osCall(unsigned calls = 1)
+  {
+    countOSCall(calls);
+
+    int64_t costNs = gOSCallCostNs.load();
+
+    if (costNs == 0)
+      return;
+
+    // Sleeping is far too coarse for calls of a few microseconds
+    auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(costNs * calls);
+
+    while (std::chrono::steady_clock::now() < until) {
+    }
+  }
+
+  /**
+   * Follows the OSX MediaIndex: the leaf media of all devices are found
+   * with one query when the first device asks, after which each device
+   * costs a single lookup.
+   */
+  class MediaIndex
+  {
+  public:
+    explicit MediaIndex(const std::vector<FakeDevice> &devices) : m_devices(devices) {}
+
+    void find()
+    {
+      std::call_once(m_built, &MediaIndex::build, this);
+      _osCall();
+    }
+
+  private:
+    void build()
+    {
+      _osCall();
+
+      // Each leaf media is read and followed up to its device
+      for (const FakeDevice &fake : m_devices) {
+        _osCall(static_cast<unsigned>(fake.volumes.size()) * (2 + 2 * MEDIA_DEPTH + 1));
+      }
+    }
+
+    const std::vector<FakeDevice> &m_devices;
+    std::once_flag m_built;
+  };
+
+  // Without an index, follows the walk over every entry below the device
+  static void _findMedia(const FakeDevice &fake, MediaIndex *mediaIndex)
+  {
+    if (mediaIndex != nullptr) {
+      mediaIndex->find();
+      return;
+    }
+
+    unsigned media = fake.volumes.empty() ? 0 : static_cast<unsigned>(fake.volumes.size()) + 1;
+
+    _osCall(1 + 2 * static_cast<unsigned>(fake.registryEntries) + media);
+  }
+
+  // Follows the Windows backend, which has the most to do per device
+  static USBDevicePtr _extractDevice(const FakeDevice &fake, const ScanOptions &options,
+                                     std::chrono::steady_clock::time_point deadline,
+                                     MediaIndex *mediaIndex)
+  {
+    _osCall();
+
+    USBDevice descriptor = USBDevice();
+    descriptor.locationID   = fake.locationID;
+    descriptor.vendorID     = fake.vendorID;
+    descriptor.productID    = fake.productID;
+    descriptor.serialNumber = fake.serialNumber;
+    descriptor.vendor       = fake.vendor;
+    descriptor.product      = fake.product;
+    descriptor.devicePath   = "fake:" + std::to_string(fake.locationID);
+
+    DeviceRegistry &registry = DeviceRegistry::instance();
+    USBDevicePtr device = registry.findOrCreate(fake.locationID);
+
+    {
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
+
+      copyDescriptorFields(descriptor, *device);
+      device->uid = uniqueDeviceID(device);
+    }
+
+    registry.add(device);
+
+    if (options.passive) {
+      // The OS knows the mount points without asking the device
+      std::lock_guard<std::mutex> lock(registry.updateMutex());
+
+      device->volumes    = fake.volumes;
+      device->mountPoint = firstMountPoint(device->volumes);
+      device->liveFields &= ~LIVE_MOUNT;
+
+      return device;
+    }
+
+    _findMedia(fake, mediaIndex);
+
+    std::vector<Volume> volumes = fake.volumes;
+    std::chrono::milliseconds delay = fake.lookupDelay;
+
+    runSlowLookup(device, [volumes, delay]() {
+        gDeviceOpens++;
+        _osCall();
+
+        if (delay > std::chrono::milliseconds::zero())
+          std::this_thread::sleep_for(delay);
+
+        return DeviceUpdate([volumes](USBDevice &device) {
+            device.volumes    = volumes;
+            device.mountPoint = firstMountPoint(volumes);
+            device.liveFields |= LIVE_MOUNT;
+          });
+      }, deadline);
+
+    return device;
+  }
+} }
+
+namespace Subdevil
+{
+  ////////////////////////////////////////////////////////////////////////////////
+  // Backend
+  ////////////////////////////////////////////////////////////////////////////////
+  struct DeviceScanner::Impl {
+    std::vector<Fake::FakeDevice> devices;
+    size_t next;
+    Fake::MediaIndex mediaIndex;
+
+    Impl() : next(0), mediaIndex(devices) {}
+  };
+
+  DeviceScanner::DeviceScanner(const ScanOptions &options)
+    : m_pImpl(new Impl()), m_options(options)
+  {
+    m_pImpl->devices = Fake::_devices();
+  }
+
+  DeviceScanner::~DeviceScanner()
+  {
+    close();
+  }
+
+  USBDevicePtr DeviceScanner::fetch()
+  {
+    if (m_pImpl->next >= m_pImpl->devices.size())
+      return nullptr;
+
+    Fake::MediaIndex *mediaIndex = options().batchReads ? &m_pImpl->mediaIndex : nullptr;
+
+    return Fake::_extractDevice(m_pImpl->devices[m_pImpl->next++], options(), deadline(), mediaIndex);
+  }
+
+  void DeviceScanner::release()
+  {
+    m_pImpl->devices.clear();
+  }
+
+  USBDevicePtr refreshDevice(const USBDevicePtr &device, std::chrono::steady_clock::time_point deadline)
+  {
+    for (const Fake::FakeDevice &fake : Fake::_devices()) {
+      if (fake.locationID == device->locationID) {
+        ScanOptions options;
+        return Fake::_extractDevice(fake, options, deadline, nullptr);
+      }
+    }
+
+    return nullptr;
+  }
+
+  void setHandleBudget(size_t handles)
+  {
+  }
+
+  bool unmount(const std::string &uid)
+  {
+    return false;
+  }
+
+  // Tests report changes with ChangeDetector::notify()
+  bool ChangeDetector::start()
+  {
+    return true;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef _SUBDEVIL_FAKE_BACKEND_H__
+#define _SUBDEVIL_FAKE_BACKEND_H__
+
+#include "../../src/subdevil.h"
+
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// A backend for the tests, reporting devices set up by the test instead of
+// querying the OS. Faults are injected per device.
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil { namespace Fake
+{
+  typedef struct FakeDevice {
+    int locationID;
+    int vendorID;
+    int productID;
+    std::string serialNumber;
+    std::string vendor;
+    std::string product;
+    std::vector<Volume> volumes;            // What the mount lookup finds.
+    std::chrono::milliseconds lookupDelay;  // How long the mount lookup blocks.
+    int registryEntries;                    // Entries below the device, walked to find its media
+                                            // without batchReads.
+  } FakeDevice;
+
+  /**
+   * A SanDisk stick at the given location, with one volume mounted at
+   * /Volumes/FAKE<locationID>.
+   */
+  FakeDevice makeDevice(int locationID);
+
+  /**
+   * Replace the connected devices. Scans already running keep the
+   * devices they started with.
+   */
+  void setDevices(const std::vector<FakeDevice> &devices);
+
+  /**
+   * Mount lookups started so far, each of which "opens" the device.
+   * Passive scans never start one.
+   */
+  uint64_t deviceOpens();
+
+  /**
+   * Make every OS call of the fake backend take the given time, so scans
+   * can be timed like on a real registry. Zero by default.
+   */
+  void setOSCallCost(std::chrono::nanoseconds cost);
+} }
+
+#endif // _SUBDEVIL_FAKE_BACKEND_H__
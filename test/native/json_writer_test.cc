@@ -0,0 +1,73 @@
+#include "test.h"
+#include "../../src/utils/json_writer.h"
+
+#include <stdio.h>
+
+#include <string>
+
+using namespace Subdevil;
+using Subdevil::Utils::JsonWriter;
+
+// The JSON a writer produces for a single string value
+static std::string _quoted(const std::string &value)
+{
+  FILE *stream = tmpfile();
+
+  {
+    JsonWriter writer(stream);
+    writer.string(value);
+  }
+
+  std::string json;
+  char buf[256];
+  size_t n;
+
+  rewind(stream);
+
+  while ((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
+    json.append(buf, n);
+  }
+
+  fclose(stream);
+
+  return json;
+}
+
+TEST(json_escapes_quotes_backslashes_and_control_characters)
+{
+  CHECK_EQ(_quoted("plain"), std::string("\"plain\""));
+  CHECK_EQ(_quoted("say \"hi\""), std::string("\"say \\\"hi\\\"\""));
+  CHECK_EQ(_quoted("C:\\Windows"), std::string("\"C:\\\\Windows\""));
+  CHECK_EQ(_quoted("a\nb\tc\rd\be\ff"), std::string("\"a\\nb\\tc\\rd\\be\\ff\""));
+  CHECK_EQ(_quoted(std::string("\x01\x1f", 2)), std::string("\"\\u0001\\u001f\""));
+  CHECK_EQ(_quoted(std::string("a\0b", 3)), std::string("\"a\\u0000b\""));
+  CHECK_EQ(_quoted("\x7f"), std::string("\"\x7f\""));
+}
+
+TEST(json_keeps_valid_utf8)
+{
+  // 2, 3 and 4 byte sequences, including the highest code point
+  std::string text = "\xc3\xa9 \xe2\x82\xac \xf0\x9f\x94\x8c \xf4\x8f\xbf\xbf";
+
+  CHECK_EQ(_quoted(text), "\"" + text + "\"");
+}
+
+TEST(json_replaces_invalid_utf8)
+{
+  const std::string fffd = "\xef\xbf\xbd";
+
+  // Stray continuation byte and bytes that never start a sequence
+  CHECK_EQ(_quoted("a\x80z"), "\"a" + fffd + "z\"");
+  CHECK_EQ(_quoted("\xc0\xaf"), "\"" + fffd + fffd + "\"");
+  CHECK_EQ(_quoted("\xff"), "\"" + fffd + "\"");
+
+  // A truncated sequence is replaced once, whatever follows it
+  CHECK_EQ(_quoted("\xe2\x82"), "\"" + fffd + "\"");
+  CHECK_EQ(_quoted("\xe2\x82\"x"), "\"" + fffd + "\\\"x\"");
+  CHECK_EQ(_quoted("\xf0\x9f\x94"), "\"" + fffd + "\"");
+
+  // Overlong forms, surrogates and code points past U+10FFFF
+  CHECK_EQ(_quoted("\xe0\x80\xaf"), "\"" + fffd + fffd + fffd + "\"");
+  CHECK_EQ(_quoted("\xed\xa0\x80"), "\"" + fffd + fffd + fffd + "\"");
+  CHECK_EQ(_quoted("\xf4\x90\x80\x80"), "\"" + fffd + fffd + fffd + fffd + "\"");
+}
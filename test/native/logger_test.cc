@@ -0,0 +1,61 @@
+#include "test.h"
+#include "../../src/utils/logger.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace Subdevil;
+
+TEST(logger_swaps_outputs_while_threads_log)
+{
+  Logger &logger = Logger::instance();
+  std::string path = Test::tempPath("logger.log");
+  std::string ringPath = Test::tempPath("logger.ring");
+  std::vector<FILE *> streams;
+  std::vector<std::thread> threads;
+  std::atomic<bool> done(false);
+
+  for (int i = 0; i < 4; i++) {
+    threads.push_back(std::thread([&done]() {
+          while (!done) {
+            Logger::instance().log("TEST", "logging while the output changes", NULL, NULL, 0);
+            Logger::instance().flush();
+          }
+        }));
+  }
+
+  for (int round = 0; round < 200; round++) {
+    switch (round % 3) {
+    case 0:
+      streams.push_back(tmpfile());
+      logger.setLogStream(streams.back());
+      break;
+    case 1:
+      logger.setLogFile(path.c_str());
+      break;
+    default:
+      CHECK(logger.setLogRing(ringPath.c_str(), 64 * 1024));
+      break;
+    }
+  }
+
+  done = true;
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // Back to a scratch stream like the runner's, the others can go
+  streams.push_back(tmpfile());
+  logger.setLogStream(streams.back());
+
+  for (size_t i = 0; i + 1 < streams.size(); i++) {
+    fclose(streams[i]);
+  }
+
+  remove(path.c_str());
+  remove(ringPath.c_str());
+}
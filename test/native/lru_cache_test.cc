@@ -0,0 +1,141 @@
+#include "test.h"
+#include "../../src/utils/lru_cache.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+using namespace Subdevil;
+
+typedef Utils::LruCache<std::string, int> Cache;
+
+static bool _has(Cache &cache, const std::string &key)
+{
+  int value;
+  return cache.get(key, &value);
+}
+
+TEST(lru_cache_evicts_least_recently_used_first)
+{
+  Cache cache(3);
+  int value = 0;
+
+  cache.put("a", 1);
+  cache.put("b", 2);
+  cache.put("c", 3);
+
+  // a is used again, so b is now the oldest
+  CHECK(cache.get("a", &value));
+  CHECK_EQ(value, 1);
+
+  cache.put("d", 4);
+
+  CHECK(!_has(cache, "b"));
+  CHECK(_has(cache, "a"));
+  CHECK(_has(cache, "c"));
+  CHECK(_has(cache, "d"));
+
+  // Replacing a value counts as a use
+  cache.put("a", 10);
+  cache.put("e", 5);
+
+  CHECK(!_has(cache, "c"));
+  CHECK(cache.get("a", &value));
+  CHECK_EQ(value, 10);
+  CHECK_EQ(cache.size(), 3u);
+
+  Utils::LruCacheStats stats = cache.stats();
+
+  CHECK_EQ(stats.evictions, 2u);
+  CHECK_EQ(stats.misses, 2u);
+}
+
+TEST(lru_cache_of_capacity_0_keeps_nothing)
+{
+  Cache cache(0);
+
+  cache.put("a", 1);
+
+  CHECK_EQ(cache.size(), 0u);
+  CHECK(!_has(cache, "a"));
+  CHECK_EQ(cache.stats().evictions, 0u);
+}
+
+TEST(lru_cache_shrinks_to_a_new_capacity)
+{
+  Cache cache(4);
+
+  cache.put("a", 1);
+  cache.put("b", 2);
+  cache.put("c", 3);
+  cache.put("d", 4);
+  _has(cache, "a");
+
+  cache.setCapacity(2);
+
+  CHECK_EQ(cache.size(), 2u);
+  CHECK(_has(cache, "a"));
+  CHECK(_has(cache, "d"));
+  CHECK(!_has(cache, "b"));
+  CHECK(!_has(cache, "c"));
+  CHECK_EQ(cache.stats().evictions, 2u);
+
+  cache.setCapacity(0);
+
+  CHECK_EQ(cache.size(), 0u);
+}
+
+TEST(lru_cache_erases_matching_values)
+{
+  Cache cache(8);
+
+  for (int i = 0; i < 6; i++) {
+    cache.put(std::to_string(i), i);
+  }
+
+  cache.eraseIf([](const std::string &, const int &value) { return value % 2 == 0; });
+
+  CHECK_EQ(cache.size(), 3u);
+  CHECK(!_has(cache, "0"));
+  CHECK(_has(cache, "1"));
+  CHECK(!_has(cache, "4"));
+  CHECK(_has(cache, "5"));
+
+  // Erased values aren't evictions
+  CHECK_EQ(cache.stats().evictions, 0u);
+}
+
+TEST(lru_cache_releases_replaced_values_after_the_lock)
+{
+  typedef Utils::LruCache<std::string, std::shared_ptr<int>> HandleCache;
+
+  // Leaked, so a thread stuck on a held lock can't outlive it
+  HandleCache &cache = *new HandleCache(4);
+  bool unlocked = false;
+
+  // Like an OS handle whose release takes long: the cache must be usable
+  // from another thread meanwhile
+  std::shared_ptr<int> handle(new int(1), [&cache, &unlocked](int *p) {
+      std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+
+      std::thread([&cache, done]() {
+          cache.size();
+          *done = true;
+        }).detach();
+
+      for (int i = 0; i < 100 && !*done; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+
+      unlocked = *done;
+      delete p;
+    });
+
+  cache.put("disk", handle);
+  handle.reset();
+  cache.put("disk", std::make_shared<int>(2));
+
+  CHECK(unlocked);
+  CHECK_EQ(cache.size(), 1u);
+}
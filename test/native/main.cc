@@ -0,0 +1,184 @@
+#include "test.h"
+#include "../../src/utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <new>
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation counting
+////////////////////////////////////////////////////////////////////////////////
+// Every allocation is prefixed with its size, so the live heap bytes can
+// be measured without platform specific allocator hooks.
+static std::atomic<int64_t> gAllocatedBytes(0);
+static const size_t ALLOC_HEADER = 16;
+
+static void *_allocate(size_t size)
+{
+  char *block = static_cast<char *>(malloc(size + ALLOC_HEADER));
+
+  if(block == NULL)
+    return NULL;
+
+  *reinterpret_cast<size_t *>(block) = size;
+  gAllocatedBytes += static_cast<int64_t>(size);
+
+  return block + ALLOC_HEADER;
+}
+
+static void _deallocate(void *ptr)
+{
+  if(ptr == NULL)
+    return;
+
+  char *block = static_cast<char *>(ptr) - ALLOC_HEADER;
+
+  gAllocatedBytes -= static_cast<int64_t>(*reinterpret_cast<size_t *>(block));
+  free(block);
+}
+
+void *operator new(size_t size)
+{
+  void *ptr = _allocate(size);
+
+  // Tests don't recover from running out of memory, and exceptions may be off
+  if(ptr == NULL)
+    abort();
+
+  return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) throw() { return _allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) throw() { return _allocate(size); }
+void operator delete(void *ptr) throw() { _deallocate(ptr); }
+void operator delete[](void *ptr) throw() { _deallocate(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) throw() { _deallocate(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) throw() { _deallocate(ptr); }
+// Called instead of the above where sized deallocation is on (C++14)
+void operator delete(void *ptr, size_t) throw() { _deallocate(ptr); }
+void operator delete[](void *ptr, size_t) throw() { _deallocate(ptr); }
+
+namespace Subdevil { namespace Test
+{
+  // CHECKs may fail on any thread a test starts
+  static std::atomic<unsigned> gFailures(0);
+
+  int64_t allocatedBytes()
+  {
+    return gAllocatedBytes.load();
+  }
+
+  std::vector<TestCase> &registry()
+  {
+    static std::vector<TestCase> tests;
+    return tests;
+  }
+
+  void fail(const char *file, unsigned int line, const std::string &message)
+  {
+    fprintf(stderr, "  %s:%u: CHECK(%s) failed\n", file, line, message.c_str());
+    gFailures++;
+  }
+
+  std::string tempPath(const std::string &name)
+  {
+    const char *dir = getenv("TMPDIR");
+
+    if(dir == NULL)
+      dir = getenv("TEMP");
+
+#ifdef _WIN32
+    if(dir == NULL)
+      dir = ".";
+
+    std::string path = std::string(dir) + "\\";
+#else
+    if(dir == NULL)
+      dir = "/tmp";
+
+    std::string path = std::string(dir) + "/";
+#endif
+
+    static unsigned long run = static_cast<unsigned long>(
+      std::chrono::system_clock::now().time_since_epoch().count() % 1000000);
+
+    return path + "subdevil-tests-" + std::to_string(run) + "-" + name;
+  }
+
+  void report(const std::string &name, double value, const char *unit)
+  {
+    printf("  %s: %.2f %s\n", name.c_str(), value, unit);
+  }
+} }
+
+using namespace Subdevil;
+
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: subdevil-tests [--bench] [--verbose] [filter]\n"
+          "\n"
+          "Runs the tests whose name contains filter, or all of them.\n"
+          "  --bench          Run the benchmarks instead of the tests\n"
+          "  --verbose        Keep the library's debug output\n");
+}
+
+int main(int argc, char **argv)
+{
+  bool bench = false;
+  bool verbose = false;
+  const char *filter = "";
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--bench") == 0) {
+      bench = true;
+    } else if(strcmp(argv[i], "--verbose") == 0) {
+      verbose = true;
+    } else if(argv[i][0] == '-') {
+      usage();
+      return 2;
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  if(!verbose) {
+    // Deadline and fault tests log plenty of expected warnings
+    FILE *sink = tmpfile();
+
+    if(sink != NULL)
+      Logger::instance().setLogStream(sink);
+  }
+
+  unsigned run = 0;
+  unsigned failed = 0;
+
+  for(const Test::TestCase &test : Test::registry()) {
+    if(test.benchmark != bench || strstr(test.name, filter) == NULL)
+      continue;
+
+    printf("%s\n", test.name);
+    fflush(stdout);
+
+    unsigned failuresBefore = Test::gFailures;
+    auto started = std::chrono::steady_clock::now();
+
+    test.run();
+
+    run++;
+
+    if(Test::gFailures != failuresBefore) {
+      printf("  FAILED\n");
+      failed++;
+    } else {
+      printf("  ok (%.0f ms)\n", Test::elapsedMs(started));
+    }
+  }
+
+  printf("%u %s, %u failed\n", run, bench ? "benchmarks" : "tests", failed);
+
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/device_registry.h"
+#include "../../src/usb_common.h"
+
+#include <mutex>
+#include <string>
+
+using namespace Subdevil;
+
+static std::vector<Fake::FakeDevice> _devices(int firstLocationID, int count)
+{
+  std::vector<Fake::FakeDevice> fakes;
+
+  for (int i = 0; i < count; i++) {
+    fakes.push_back(Fake::makeDevice(firstLocationID + i));
+  }
+
+  return fakes;
+}
+
+static std::string _source(const USBDevicePtr &device, const char *name)
+{
+  for (size_t i = 0; i < FIELD_SOURCE_COUNT; i++) {
+    if (std::string(FIELD_SOURCES[i].name) == name)
+      return fieldSource(*device, FIELD_SOURCES[i]);
+  }
+
+  return "";
+}
+
+TEST(passive_scans_never_open_devices)
+{
+  Fake::setDevices(_devices(3600, 20));
+
+  ScanOptions options;
+  options.passive = true;
+
+  uint64_t opens = Fake::deviceOpens();
+  std::vector<USBDevicePtr> devices = getDevices(options);
+
+  CHECK_EQ(devices.size(), 20u);
+  CHECK_EQ(Fake::deviceOpens(), opens);
+
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+  for (const USBDevicePtr &device : devices) {
+    // Cached data is still reported, and every field says so
+    CHECK(!device->mountPoint.empty());
+    CHECK_EQ(device->volumes.size(), 1u);
+
+    for (size_t i = 0; i < FIELD_SOURCE_COUNT; i++) {
+      CHECK_EQ(std::string(fieldSource(*device, FIELD_SOURCES[i])), std::string("cache"));
+    }
+  }
+}
+
+TEST(passive_scans_mark_fields_read_before_as_cached)
+{
+  Fake::setDevices(_devices(3700, 5));
+
+  // A normal scan reads the mounts from the devices
+  uint64_t opens = Fake::deviceOpens();
+  std::vector<USBDevicePtr> devices = getDevices(ScanOptions());
+
+  CHECK_EQ(Fake::deviceOpens(), opens + 5);
+
+  {
+    std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+    CHECK_EQ(_source(devices[0], "mount"), std::string("device"));
+    CHECK_EQ(_source(devices[0], "volumes"), std::string("device"));
+    CHECK_EQ(_source(devices[0], "vendorId"), std::string("cache"));
+  }
+
+  // The same devices found by a passive scan report no live fields
+  ScanOptions options;
+  options.passive = true;
+
+  devices = getDevices(options);
+
+  CHECK_EQ(Fake::deviceOpens(), opens + 5);
+
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+
+  for (const USBDevicePtr &device : devices) {
+    CHECK_EQ(_source(device, "mount"), std::string("cache"));
+    CHECK_EQ(_source(device, "volumes"), std::string("cache"));
+  }
+}
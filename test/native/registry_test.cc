@@ -0,0 +1,253 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/device_registry.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace Subdevil;
+
+// Devices that are plugged in for one scan and then never again
+static std::vector<Fake::FakeDevice> _generation(int scan, int perScan, int firstLocationID = 1000000)
+{
+  std::vector<Fake::FakeDevice> fakes;
+
+  for (int i = 0; i < perScan; i++) {
+    fakes.push_back(Fake::makeDevice(firstLocationID + scan * perScan + i));
+  }
+
+  return fakes;
+}
+
+static double _maxRssKb()
+{
+#if defined(__APPLE__)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+#elif !defined(_WIN32)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+#else
+  return -1;
+#endif
+}
+
+static std::string _uid(const USBDevicePtr &device)
+{
+  std::lock_guard<std::mutex> lock(DeviceRegistry::instance().updateMutex());
+  return device->uid;
+}
+
+TEST(registry_evicts_departed_devices_in_a_soak)
+{
+  const int scans = 5000;
+  const int perScan = 4;
+  const size_t maxDeparted = 64;
+
+  DeviceRegistry &registry = DeviceRegistry::instance();
+  RegistryStats before = registry.stats();
+
+  setDepartedLimits(std::chrono::hours(1), maxDeparted);
+
+  size_t largest = 0;
+
+  for (int scan = 0; scan < scans; scan++) {
+    Fake::setDevices(_generation(scan, perScan));
+    getDevices();
+
+    RegistryStats stats = registry.stats();
+
+    CHECK(stats.departed <= maxDeparted);
+    CHECK_EQ(stats.present, static_cast<size_t>(perScan));
+
+    if (registry.size() > largest)
+      largest = registry.size();
+  }
+
+  RegistryStats after = registry.stats();
+
+  Test::report("largest registry", static_cast<double>(largest), "devices");
+  Test::report("evicted", static_cast<double>(after.evicted - before.evicted), "devices");
+
+  CHECK(largest <= maxDeparted + perScan * 2);
+  CHECK(after.evicted - before.evicted >= static_cast<uint64_t>(scans * perScan) - maxDeparted - perScan * 2);
+
+  setDepartedLimits(std::chrono::hours(1), 256);
+}
+
+BENCHMARK(registry_soak_1m_plug_unplug_cycles)
+{
+  // Each scan plugs in a new generation and unplugs the last one
+  const int cycles = 1000000;
+  const int perScan = 16;
+  const int scans = cycles / perScan;
+  const size_t maxDeparted = 64;
+
+  DeviceRegistry &registry = DeviceRegistry::instance();
+  RegistryStats before = registry.stats();
+
+  setDepartedLimits(std::chrono::hours(1), maxDeparted);
+
+  auto start = std::chrono::steady_clock::now();
+  double warmRssKb = 0;
+  int64_t warmHeap = 0;
+
+  for (int scan = 0; scan < scans; scan++) {
+    Fake::setDevices(_generation(scan, perScan, 10000000));
+    getDevices();
+
+    // Everything the soak needs is allocated by the first tenth
+    if (scan == scans / 10) {
+      warmRssKb = _maxRssKb();
+      warmHeap = Test::allocatedBytes();
+    }
+
+    if ((scan + 1) % (scans / 4) == 0) {
+      Test::report("max RSS after " + std::to_string((scan + 1) * perScan) + " cycles", _maxRssKb(), "KiB");
+    }
+  }
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+  getDevices();
+
+  RegistryStats after = registry.stats();
+  double endRssKb = _maxRssKb();
+  int64_t heapGrowth = Test::allocatedBytes() - warmHeap;
+
+  Test::report("time per cycle", Test::elapsedMs(start) * 1000 / cycles, "us");
+  Test::report("evicted", static_cast<double>(after.evicted - before.evicted), "devices");
+  Test::report("heap growth after warm-up", static_cast<double>(heapGrowth) / 1024, "KiB");
+
+  CHECK(registry.size() <= maxDeparted);
+  CHECK(after.evicted - before.evicted >= static_cast<uint64_t>(cycles) - maxDeparted);
+  // Neither the heap nor the process grow once the soak has warmed up
+  CHECK(heapGrowth < 1024 * 1024);
+  CHECK(warmRssKb < 0 || endRssKb - warmRssKb < 8 * 1024);
+
+  setDepartedLimits(std::chrono::hours(1), 256);
+}
+
+TEST(registry_concurrent_scans_register_devices_once)
+{
+  const int rounds = 20;
+  const int perRound = 64;
+
+  for (int round = 0; round < rounds; round++) {
+    // Devices none of the scans has seen yet
+    Fake::setDevices(_generation(-100 - round, perRound));
+
+    std::mutex mutex;
+    std::set<const USBDevice *> devices;
+    std::set<std::string> uids;
+    std::vector<std::thread> scans;
+
+    for (int i = 0; i < 4; i++) {
+      scans.push_back(std::thread([&]() {
+            for (const USBDevicePtr &device : getDevices()) {
+              std::lock_guard<std::mutex> lock(mutex);
+
+              devices.insert(device.get());
+              uids.insert(_uid(device));
+            }
+          }));
+    }
+
+    for (std::thread &scan : scans) {
+      scan.join();
+    }
+
+    CHECK_EQ(devices.size(), static_cast<size_t>(perRound));
+    CHECK_EQ(uids.size(), static_cast<size_t>(perRound));
+  }
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+  getDevices();
+}
+
+TEST(registry_evicts_departed_devices_by_age)
+{
+  DeviceRegistry &registry = DeviceRegistry::instance();
+
+  setDepartedLimits(std::chrono::milliseconds(50), 256);
+
+  Fake::setDevices(_generation(-1, 8));
+  getDevices();
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+  getDevices();
+
+  CHECK(registry.stats().departed >= 8u);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  getDevices();
+
+  CHECK_EQ(registry.stats().departed, 0u);
+
+  setDepartedLimits(std::chrono::hours(1), 256);
+}
+
+TEST(registry_lookups_race_with_eviction)
+{
+  // Lookups by UID and location while scans mark and evict devices
+  DeviceRegistry &registry = DeviceRegistry::instance();
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> found(0);
+
+  setDepartedLimits(std::chrono::hours(1), 8);
+
+  std::vector<std::thread> readers;
+
+  for (int i = 0; i < 4; i++) {
+    readers.push_back(std::thread([&registry, &done, &found, i]() {
+          Test::Random random(i);
+
+          while (!done) {
+            int locationID = 2000000 + static_cast<int>(random.below(2000));
+            USBDevicePtr device = registry.findByLocationID(locationID);
+
+            if (device != nullptr) {
+              std::string uid;
+
+              {
+                std::lock_guard<std::mutex> lock(registry.updateMutex());
+                uid = device->uid;
+              }
+
+              if (registry.find(uid) != nullptr)
+                found++;
+            }
+
+            registry.stats();
+          }
+        }));
+  }
+
+  for (int scan = 0; scan < 500; scan++) {
+    std::vector<Fake::FakeDevice> fakes;
+
+    for (int i = 0; i < 4; i++) {
+      fakes.push_back(Fake::makeDevice(2000000 + scan * 4 + i));
+    }
+
+    Fake::setDevices(fakes);
+    getDevices();
+  }
+
+  done = true;
+
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+
+  CHECK(registry.stats().departed <= 8u);
+
+  setDepartedLimits(std::chrono::hours(1), 256);
+}
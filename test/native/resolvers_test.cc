@@ -0,0 +1,30 @@
+#include "test.h"
+#include "../../src/device_registry.h"
+#include "../../src/resolvers.h"
+
+using namespace Subdevil;
+
+TEST(resolvers_store_results_of_the_current_session)
+{
+  USBDevicePtr device = DeviceRegistry::instance().create();
+
+  CHECK_EQ(pendingResolvers(*device, RESOLVE_TTY | RESOLVE_BLOCK, 7), unsigned(RESOLVE_TTY | RESOLVE_BLOCK));
+
+  ResolvedNodes nodes;
+  setResolved(nodes, RESOLVE_TTY, "/dev/tty.usbmodem1");
+  setResolved(nodes, RESOLVE_BLOCK, "");
+
+  storeResolved(*device, 7, nodes);
+
+  CHECK_EQ(device->ttyPath, "/dev/tty.usbmodem1");
+  CHECK_EQ(device->resolved, unsigned(RESOLVE_TTY | RESOLVE_BLOCK));
+  CHECK_EQ(pendingResolvers(*device, RESOLVE_TTY | RESOLVE_BLOCK, 7), 0u);
+
+  // Re-plugged while the resolvers ran
+  CHECK_EQ(pendingResolvers(*device, RESOLVE_TTY, 8), unsigned(RESOLVE_TTY));
+
+  storeResolved(*device, 7, nodes);
+
+  CHECK(device->ttyPath.empty());
+  CHECK_EQ(device->resolved, 0u);
+}
@@ -0,0 +1,180 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/shared_snapshot.h"
+
+#ifndef _WIN32
+#include <atomic>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace Subdevil;
+
+// The start of the segment header, which every version keeps
+typedef struct HeaderPrefix {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  std::atomic<uint32_t> sequence;
+  std::atomic<int32_t> publisherPid;
+  std::atomic<int64_t> heartbeatMs;
+} HeaderPrefix;
+
+static int64_t _steadyMs()
+{
+  using namespace std::chrono;
+
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static HeaderPrefix *_mapHeader(const std::string &shmName)
+{
+  int fd = shm_open(shmName.c_str(), O_RDWR, 0600);
+
+  if (fd < 0)
+    return nullptr;
+
+  void *data = mmap(nullptr, sizeof(HeaderPrefix), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  return data != MAP_FAILED ? static_cast<HeaderPrefix *>(data) : nullptr;
+}
+
+TEST(shared_snapshot_carries_every_reported_field)
+{
+  std::string name = "test-fields-" + std::to_string(getpid());
+  SharedSnapshot &snapshot = SharedSnapshot::instance();
+  std::vector<USBDevicePtr> devices;
+
+  Fake::FakeDevice fake = Fake::makeDevice(3200);
+  Volume second;
+  second.node = "/dev/fake3200s2";
+  second.mountPoints.push_back("/Volumes/FAKE3200-2");
+  fake.volumes.push_back(second);
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>(1, fake));
+
+  CHECK(snapshot.open(name, std::chrono::milliseconds(1000)));
+  CHECK(snapshot.read(devices));
+  CHECK_EQ(devices.size(), 1u);
+
+  if (devices.size() == 1) {
+    const USBDevice &device = *devices[0];
+
+    CHECK_EQ(device.serialNumber, std::string("FAKE3200"));
+    CHECK_EQ(device.mountPoint.str(), std::string("/Volumes/FAKE3200"));
+    CHECK_EQ(device.volumes.size(), 2u);
+    CHECK(!device.incomplete);
+    CHECK_EQ(device.liveFields & LIVE_MOUNT, static_cast<unsigned>(LIVE_MOUNT));
+
+    if (device.volumes.size() == 2)
+      CHECK_EQ(device.volumes[1].mountPoints[0], std::string("/Volumes/FAKE3200-2"));
+  }
+
+  snapshot.close();
+  shm_unlink(("/subdevil-" + name).c_str());
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+}
+
+TEST(shared_snapshot_only_replaces_exited_publishers)
+{
+  std::string name = "test-takeover-" + std::to_string(getpid());
+  std::string shmName = "/subdevil-" + name;
+  SharedSnapshot &snapshot = SharedSnapshot::instance();
+  std::vector<USBDevicePtr> devices;
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>(1, Fake::makeDevice(3300)));
+
+  CHECK(snapshot.open(name, std::chrono::milliseconds(1000)));
+  CHECK(snapshot.isPublisher());
+
+  HeaderPrefix *header = _mapHeader(shmName);
+  CHECK(header != nullptr);
+
+  if (header == nullptr)
+    return;
+
+  // Another publisher took over, then stalled without exiting
+  header->publisherPid = getppid();
+  header->heartbeatMs = 0;
+
+  snapshot.tick();
+
+  CHECK(!snapshot.isPublisher());
+  CHECK(snapshot.read(devices));
+  CHECK(!snapshot.isPublisher());
+  CHECK_EQ(header->publisherPid.load(), getppid());
+  CHECK_EQ(devices.size(), 1u);
+
+  // Once it has exited
+  header->publisherPid = 0x7ffffff0;
+
+  CHECK(snapshot.read(devices));
+  CHECK(snapshot.isPublisher());
+  CHECK_EQ(header->publisherPid.load(), getpid());
+
+  munmap(header, sizeof(HeaderPrefix));
+  snapshot.close();
+  shm_unlink(shmName.c_str());
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+}
+
+TEST(shared_snapshot_rejects_other_versions)
+{
+  std::string name = "test-" + std::to_string(getpid());
+  std::string shmName = "/subdevil-" + name;
+  SharedSnapshot &snapshot = SharedSnapshot::instance();
+  std::vector<USBDevicePtr> devices;
+
+  std::vector<Fake::FakeDevice> fakes;
+  fakes.push_back(Fake::makeDevice(3100));
+  fakes.push_back(Fake::makeDevice(3101));
+  Fake::setDevices(fakes);
+
+  CHECK(snapshot.open(name, std::chrono::milliseconds(1000)));
+  CHECK(snapshot.isPublisher());
+  CHECK(snapshot.read(devices));
+  CHECK_EQ(devices.size(), 2u);
+
+  int fd = shm_open(shmName.c_str(), O_RDWR, 0600);
+  CHECK(fd >= 0);
+
+  void *data = mmap(nullptr, sizeof(HeaderPrefix), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  CHECK(data != MAP_FAILED);
+
+  if (fd < 0 || data == MAP_FAILED)
+    return;
+
+  HeaderPrefix *header = static_cast<HeaderPrefix *>(data);
+  uint32_t version = header->version;
+
+  // A live process of another version took over
+  header->version = version + 1;
+  header->publisherPid = getppid();
+  header->heartbeatMs = _steadyMs();
+
+  snapshot.tick();
+
+  CHECK(!snapshot.isPublisher());
+  CHECK(!snapshot.read(devices));
+
+  // Once it is gone, the segment is initialized again
+  header->publisherPid = 0x7ffffff0;
+  header->heartbeatMs = 0;
+
+  CHECK(snapshot.read(devices));
+  CHECK(snapshot.isPublisher());
+  CHECK_EQ(header->version, version);
+  CHECK_EQ(devices.size(), 2u);
+
+  munmap(data, sizeof(HeaderPrefix));
+  snapshot.close();
+  shm_unlink(shmName.c_str());
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+}
+#endif
@@ -0,0 +1,188 @@
+#include "test.h"
+#include "fake_backend.h"
+#include "../../src/change_detector.h"
+
+#include <algorithm>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace Subdevil;
+
+////////////////////////////////////////////////////////////////////////////////
+// Hotplug storm
+////////////////////////////////////////////////////////////////////////////////
+// Devices plugged at once; every event plugs one and unplugs the oldest
+static const int STORM_WINDOW = 32;
+
+typedef struct StormResult {
+  size_t events;
+  size_t scans;
+  std::vector<double> latencyMs;  // Event to the first scan that saw it, sorted.
+  double cpuMs;                   // -1 where not measured.
+  double maxRssKb;
+} StormResult;
+
+static double _cpuMs()
+{
+#ifndef _WIN32
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+#else
+  return -1;
+#endif
+}
+
+static double _maxRssKb()
+{
+#if defined(__APPLE__)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+#elif !defined(_WIN32)
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+#else
+  return -1;
+#endif
+}
+
+static double _percentile(const std::vector<double> &sorted, double fraction)
+{
+  if (sorted.empty())
+    return 0;
+
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * fraction))];
+}
+
+/**
+ * Plug and unplug fake devices at the given rate, reporting each change
+ * like an OS notification, while the calling thread polls the way a
+ * client would: scan whenever hasChanged() says so, else sleep a
+ * millisecond. Measures how long each event takes to show up in a scan.
+ */
+static StormResult _storm(int eventsPerSecond, int durationMs)
+{
+  // Location IDs unique to the run, so events can be told apart
+  static int nextRun = 0;
+  int base = 1000000 * ++nextRun;
+
+  size_t total = static_cast<size_t>(eventsPerSecond) * durationMs / 1000;
+  std::vector<std::chrono::steady_clock::time_point> sent(total);
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+
+  ChangeDetector &detector = ChangeDetector::instance();
+  uint64_t token = detector.token();
+
+  StormResult result = StormResult();
+  double cpuStart = _cpuMs();
+  auto started = std::chrono::steady_clock::now();
+
+  std::thread generator([&]() {
+      std::vector<Fake::FakeDevice> plugged;
+      auto period = std::chrono::microseconds(1000000 / eventsPerSecond);
+
+      for (size_t i = 0; i < total; i++) {
+        std::this_thread::sleep_until(started + period * static_cast<int>(i));
+
+        plugged.push_back(Fake::makeDevice(base + static_cast<int>(i)));
+
+        if (plugged.size() > static_cast<size_t>(STORM_WINDOW))
+          plugged.erase(plugged.begin());
+
+        sent[i] = std::chrono::steady_clock::now();
+        Fake::setDevices(plugged);
+        detector.notify();
+      }
+    });
+
+  size_t seen = 0;
+
+  while (seen < total) {
+    if (!detector.hasChanged(token)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    token = detector.token();
+
+    std::vector<USBDevicePtr> devices = getDevices(ScanOptions());
+    auto now = std::chrono::steady_clock::now();
+    size_t newest = 0;
+
+    result.scans++;
+
+    for (const USBDevicePtr &device : devices) {
+      newest = std::max(newest, static_cast<size_t>(device->locationID - base + 1));
+    }
+
+    // Events up to the newest device plugged have all been seen
+    for (; seen < newest; seen++) {
+      result.latencyMs.push_back(std::chrono::duration<double, std::milli>(now - sent[seen]).count());
+    }
+  }
+
+  generator.join();
+
+  std::sort(result.latencyMs.begin(), result.latencyMs.end());
+
+  result.events = total;
+  result.cpuMs = cpuStart < 0 ? -1 : _cpuMs() - cpuStart;
+  result.maxRssKb = _maxRssKb();
+
+  Fake::setDevices(std::vector<Fake::FakeDevice>());
+
+  return result;
+}
+
+TEST(storm_every_change_becomes_visible)
+{
+  ChangeDetector::instance().latency(true);
+
+  StormResult result = _storm(1000, 300);
+
+  CHECK_EQ(result.latencyMs.size(), result.events);
+  CHECK(result.scans <= result.events);
+  CHECK(_percentile(result.latencyMs, 0.99) < 250);
+
+  EventLatency latency = ChangeDetector::instance().latency();
+
+  CHECK(latency.count > 0);
+  CHECK(latency.p99 < std::chrono::milliseconds(250));
+}
+
+BENCHMARK(storm_event_latency)
+{
+  static const int RATES[] = { 1, 100, 10000 };
+
+  for (int rate : RATES) {
+    ChangeDetector::instance().latency(true);
+
+    // Long enough for a few events at the lowest rate
+    StormResult result = _storm(rate, rate < 10 ? 5000 : 3000);
+    EventLatency latency = ChangeDetector::instance().latency();
+    std::string name = std::to_string(rate) + "/s ";
+
+    CHECK_EQ(result.latencyMs.size(), result.events);
+
+    Test::report(name + "events", result.events, "");
+    Test::report(name + "scans", result.scans, "");
+    Test::report(name + "visible p50", _percentile(result.latencyMs, 0.5), "ms");
+    Test::report(name + "visible p99", _percentile(result.latencyMs, 0.99), "ms");
+    Test::report(name + "visible p999", _percentile(result.latencyMs, 0.999), "ms");
+    Test::report(name + "visible max", result.latencyMs.empty() ? 0 : result.latencyMs.back(), "ms");
+    Test::report(name + "scan latency p99", latency.p99.count() / 1000.0, "ms");
+
+    if (result.cpuMs >= 0) {
+      Test::report(name + "cpu", result.cpuMs, "ms");
+      Test::report(name + "max rss", result.maxRssKb, "KB");
+    }
+  }
+}
@@ -0,0 +1,181 @@
+#include "test.h"
+#include "../../src/device_registry.h"
+
+#include <thread>
+
+using namespace Subdevil;
+
+// Devices like a registry full of thumb drives: a few vendors and
+// products, and a mount point of their own each
+static std::vector<USBDevicePtr> _makeDevices(size_t count, const std::string &prefix)
+{
+  static const char *VENDORS[] = { "SanDisk", "Kingston", "Samsung", "Lexar" };
+  static const char *PRODUCTS[] = { "Cruzer Blade", "DataTraveler", "BAR Plus", "JumpDrive" };
+
+  DeviceRegistry &registry = DeviceRegistry::instance();
+  std::vector<USBDevicePtr> devices;
+
+  for (size_t i = 0; i < count; i++) {
+    USBDevicePtr device = registry.create();
+    device->vendor       = VENDORS[i % 4];
+    device->product      = PRODUCTS[i % 4];
+    device->serialNumber = prefix + std::to_string(i);
+    device->mountPoint   = "/Volumes/" + prefix + std::to_string(i);
+    devices.push_back(device);
+  }
+
+  return devices;
+}
+
+TEST(string_pool_shares_equal_strings)
+{
+  Utils::InternedString a = std::string("SanDisk");
+  Utils::InternedString b = "SanDisk";
+  Utils::InternedString c = "Kingston";
+
+  CHECK(a == b);
+  CHECK(a != c);
+  CHECK_EQ(a.c_str(), b.c_str());
+  CHECK(Utils::InternedString().empty());
+  CHECK(Utils::InternedString("") == Utils::InternedString());
+}
+
+TEST(string_pool_removes_unused_strings)
+{
+  Utils::StringPool &pool = Utils::StringPool::instance();
+  size_t before = pool.size();
+
+  {
+    std::vector<USBDevicePtr> devices = _makeDevices(1000, "POOL");
+
+    // Up to four vendors and four products, and a mount point per device
+    CHECK(pool.size() >= before + 1000);
+    CHECK(pool.size() <= before + 1008);
+
+    // Mount points change when volumes are remounted
+    for (const USBDevicePtr &device : devices) {
+      device->mountPoint = "";
+    }
+
+    CHECK(pool.size() <= before + 8);
+
+    Utils::InternedString copy = devices[0]->vendor;
+    devices.clear();
+
+    CHECK_EQ(copy.str(), std::string("SanDisk"));
+    CHECK(pool.size() <= before + 1);
+  }
+
+  CHECK_EQ(pool.size(), before);
+}
+
+TEST(string_pool_releases_from_many_threads)
+{
+  Utils::StringPool &pool = Utils::StringPool::instance();
+  size_t before = pool.size();
+  std::vector<std::thread> threads;
+
+  // Copies of a shared value go without the lock, while other threads
+  // keep interning a value down to its last reference and back
+  Utils::InternedString shared = "Shared Vendor";
+
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&shared, t]() {
+          for (int i = 0; i < 20000; i++) {
+            Utils::InternedString copy = shared;
+            Utils::InternedString fleeting = (t % 2 == 0) ? "Fleeting Vendor" : "Shared Vendor";
+
+            if (copy != shared || fleeting.empty())
+              Test::fail(__FILE__, __LINE__, "interned string changed");
+          }
+        }));
+  }
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  CHECK_EQ(shared.str(), std::string("Shared Vendor"));
+  CHECK_EQ(pool.size(), before + 1);
+}
+
+// USBDevice as it was before vendor, product and mount point were
+// interned, for the before and after comparison
+typedef struct PlainDevice {
+  std::string uid;
+  int locationID;
+  int productID;
+  int vendorID;
+  std::string product;
+  std::string serialNumber;
+  std::string vendor;
+  std::string mountPoint;
+  std::vector<Volume> volumes;
+  bool incomplete;
+  std::string ttyPath;
+  std::string hidPath;
+  std::string blockPath;
+  unsigned resolved;
+  uint64_t sessionID;
+  std::string devicePath;
+  std::chrono::steady_clock::time_point refreshedAt;
+  unsigned liveFields;
+} PlainDevice;
+
+static std::vector<std::shared_ptr<PlainDevice>> _makePlainDevices(size_t count, const std::string &prefix)
+{
+  static const char *VENDORS[] = { "SanDisk", "Kingston", "Samsung", "Lexar" };
+  static const char *PRODUCTS[] = { "Cruzer Blade", "DataTraveler", "BAR Plus", "JumpDrive" };
+
+  std::vector<std::shared_ptr<PlainDevice>> devices;
+
+  for (size_t i = 0; i < count; i++) {
+    std::shared_ptr<PlainDevice> device = std::make_shared<PlainDevice>();
+    device->vendor       = VENDORS[i % 4];
+    device->product      = PRODUCTS[i % 4];
+    device->serialNumber = prefix + std::to_string(i);
+    device->mountPoint   = "/Volumes/" + prefix + std::to_string(i);
+    devices.push_back(device);
+  }
+
+  return devices;
+}
+
+static void _measure(size_t count)
+{
+  std::string label = std::to_string(count) + " devices";
+  int64_t before = Test::allocatedBytes();
+  int64_t plain;
+
+  {
+    std::vector<std::shared_ptr<PlainDevice>> devices = _makePlainDevices(count, "MEASURE");
+    plain = Test::allocatedBytes() - before;
+  }
+
+  before = Test::allocatedBytes();
+  int64_t used;
+
+  {
+    std::vector<USBDevicePtr> devices = _makeDevices(count, "MEASURE");
+    used = Test::allocatedBytes() - before;
+  }
+
+  int64_t left = Test::allocatedBytes() - before;
+
+  Test::report(label + ", plain strings", static_cast<double>(plain) / count, "bytes/device");
+  Test::report(label + ", interned", static_cast<double>(used) / count, "bytes/device");
+
+  // Only the pool's hash buckets stay behind once the devices are gone
+  Test::report(label + " released", static_cast<double>(left) / 1024, "KiB");
+  CHECK(left < used / 10);
+}
+
+BENCHMARK(string_pool_memory_1k_devices)
+{
+  _measure(1000);
+}
+
+BENCHMARK(string_pool_memory_10k_devices)
+{
+  _measure(10000);
+}
@@ -0,0 +1,108 @@
+#ifndef _SUBDEVIL_TEST_H__
+#define _SUBDEVIL_TEST_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+// A minimal test runner for the native code, see main.cc
+////////////////////////////////////////////////////////////////////////////////
+namespace Subdevil { namespace Test
+{
+  typedef void (*TestFunction)();
+
+  typedef struct TestCase {
+    const char *name;
+    TestFunction run;
+    bool benchmark;  // Only run with --bench.
+  } TestCase;
+
+  std::vector<TestCase> &registry();
+
+  struct Registration {
+    Registration(const char *name, TestFunction run, bool benchmark)
+    {
+      TestCase test = { name, run, benchmark };
+      registry().push_back(test);
+    }
+  };
+
+  /**
+   * Record a failed check. The test keeps running, the run fails.
+   */
+  void fail(const char *file, unsigned int line, const std::string &message);
+
+  /**
+   * Heap bytes allocated with new and not deleted yet.
+   */
+  int64_t allocatedBytes();
+
+  /**
+   * A path for a scratch file in the temp directory, unique to the run.
+   */
+  std::string tempPath(const std::string &name);
+
+  /**
+   * Print a measurement, e.g. "parse: 42 ns/op".
+   */
+  void report(const std::string &name, double value, const char *unit);
+
+  inline double elapsedMs(std::chrono::steady_clock::time_point since)
+  {
+    using namespace std::chrono;
+    return duration_cast<duration<double, std::milli> >(steady_clock::now() - since).count();
+  }
+
+  /**
+   * Deterministic generator, so failures found by randomized tests can be
+   * reproduced.
+   */
+  class Random
+  {
+  public:
+    explicit Random(uint64_t seed) : m_state(seed * 2 + 1) {}
+
+    uint32_t next()
+    {
+      m_state ^= m_state << 13;
+      m_state ^= m_state >> 7;
+      m_state ^= m_state << 17;
+      return static_cast<uint32_t>(m_state >> 32);
+    }
+
+    uint32_t below(uint32_t n) { return n == 0 ? 0 : next() % n; }
+
+  private:
+    uint64_t m_state;
+  };
+} }
+
+#define TEST_CASE(name, benchmark)                                      \
+  static void name();                                                   \
+  static Subdevil::Test::Registration name##_registration(#name, name, benchmark); \
+  static void name()
+
+#define TEST(name) TEST_CASE(name, false)
+#define BENCHMARK(name) TEST_CASE(name, true)
+
+#define CHECK(expr)                                                     \
+  do                                                                    \
+    {                                                                   \
+      if(!(expr))                                                       \
+        Subdevil::Test::fail(__FILE__, __LINE__, #expr);                \
+    }                                                                   \
+  while(0)                                                              \
+
+#define CHECK_EQ(actual, expected)                                      \
+  do                                                                    \
+    {                                                                   \
+      if(!((actual) == (expected)))                                     \
+        Subdevil::Test::fail(__FILE__, __LINE__, #actual " == " #expected); \
+    }                                                                   \
+  while(0)                                                              \
+
+#endif // _SUBDEVIL_TEST_H__
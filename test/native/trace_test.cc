@@ -0,0 +1,80 @@
+#include "test.h"
+#include "../../src/utils/trace.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Subdevil;
+
+static std::string _readFile(const std::string &path)
+{
+  std::string contents;
+  FILE *stream = fopen(path.c_str(), "rb");
+
+  if(stream == NULL)
+    return contents;
+
+  char buf[4096];
+  size_t read;
+
+  while((read = fread(buf, 1, sizeof(buf), stream)) > 0) {
+    contents.append(buf, read);
+  }
+
+  fclose(stream);
+
+  return contents;
+}
+
+static size_t _count(const std::string &haystack, const std::string &needle)
+{
+  size_t count = 0;
+
+  for(size_t pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1)) {
+    count++;
+  }
+
+  return count;
+}
+
+static void _traceOnThreads(int threads)
+{
+  std::vector<std::thread> workers;
+
+  for(int i = 0; i < threads; i++) {
+    workers.push_back(std::thread([]() {
+          Utils::TraceSpan span("testSpan");
+        }));
+  }
+
+  for(std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+TEST(trace_drops_buffers_of_exited_threads)
+{
+  Utils::Tracer &tracer = Utils::Tracer::instance();
+  std::string path = Test::tempPath("trace.json");
+
+  tracer.setEnabled(true);
+
+  for(int round = 0; round < 10; round++) {
+    _traceOnThreads(50);
+
+    // Spans of exited threads are kept until they are dumped
+    CHECK(tracer.bufferCount() >= 50);
+    CHECK(tracer.dump(path));
+    CHECK_EQ(_count(_readFile(path), "\"testSpan\""), 50u);
+  }
+
+  tracer.setEnabled(false);
+
+  // Only threads still running keep a buffer
+  CHECK(tracer.bufferCount() < 50);
+
+  remove(path.c_str());
+}
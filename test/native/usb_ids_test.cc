@@ -0,0 +1,207 @@
+#include "test.h"
+#include "../../src/usb_ids.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include <string>
+
+using namespace Subdevil;
+
+static const char *FIXTURE =
+  "# List of USB ID's\n"
+  "#\n"
+  "0781  SanDisk Corp.\n"
+  "\t5567  Cruzer Blade\n"
+  "\t5581  Ultra\n"
+  "\t558c  Extreme Portable SSD\n"
+  "05ac  Apple, Inc.\n"
+  "\t12a8  iPhone 5/5C/5S/6/SE/7/8/X/XR\n"
+  "\t8286  Bluetooth Host Controller\n"
+  "0bda  Realtek Semiconductor Corp.\n"
+  "\t0129  RTS5129 Card Reader Controller\n"
+  "\r\n"
+  "# List of known device classes, subclasses and protocols\n"
+  "C 00  (Defined at Interface level)\n"
+  "C 08  Mass Storage\n"
+  "\t06  SCSI\n"
+  "\t\t50  Bulk-Only\n";
+
+static void _writeText(const std::string &path, const std::string &text)
+{
+  FILE *file = fopen(path.c_str(), "wb");
+
+  if (file != NULL) {
+    fwrite(text.data(), 1, text.size(), file);
+    fclose(file);
+  }
+}
+
+static void _setMtime(const std::string &path, time_t mtime)
+{
+  struct utimbuf times;
+  times.actime = mtime;
+  times.modtime = mtime;
+
+  utime(path.c_str(), &times);
+}
+
+static time_t _mtime(const std::string &path)
+{
+  struct stat info;
+
+  return stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+static bool _nameIs(const char *name, const char *expected)
+{
+  return name != nullptr && strcmp(name, expected) == 0;
+}
+
+TEST(usb_ids_compiles_and_looks_up_names)
+{
+  UsbIdsDatabase &database = UsbIdsDatabase::instance();
+  std::string idsPath = Test::tempPath("usb-compile.ids");
+  std::string indexPath = Test::tempPath("usb-compile.idx");
+
+  _writeText(idsPath, FIXTURE);
+  remove(indexPath.c_str());
+
+  CHECK(database.load(idsPath, indexPath));
+
+  CHECK(_nameIs(database.vendorName(0x0781), "SanDisk Corp."));
+  CHECK(_nameIs(database.vendorName(0x0bda), "Realtek Semiconductor Corp."));
+  CHECK(_nameIs(database.productName(0x0781, 0x5567), "Cruzer Blade"));
+  CHECK(_nameIs(database.productName(0x05ac, 0x12a8), "iPhone 5/5C/5S/6/SE/7/8/X/XR"));
+  CHECK(_nameIs(database.productName(0x0bda, 0x0129), "RTS5129 Card Reader Controller"));
+
+  // Unknown IDs, products under the wrong vendor and other sections
+  CHECK(database.vendorName(0x1234) == nullptr);
+  CHECK(database.productName(0x0781, 0x12a8) == nullptr);
+  CHECK(database.productName(0x05ac, 0x5567) == nullptr);
+  CHECK(database.vendorName(0x0008) == nullptr);
+  CHECK(database.productName(0x0008, 0x0006) == nullptr);
+
+  // The index was written, and is used the next time
+  struct stat index;
+  CHECK(stat(indexPath.c_str(), &index) == 0);
+
+  database.unload();
+
+  CHECK(database.vendorName(0x0781) == nullptr);
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.productName(0x0781, 0x5581), "Ultra"));
+
+  database.unload();
+  remove(idsPath.c_str());
+  remove(indexPath.c_str());
+}
+
+TEST(usb_ids_keeps_the_first_of_duplicate_entries)
+{
+  UsbIdsDatabase &database = UsbIdsDatabase::instance();
+  std::string idsPath = Test::tempPath("usb-duplicates.ids");
+  std::string indexPath = Test::tempPath("usb-duplicates.idx");
+
+  // Repeated vendor and product lines, as in hand-merged files
+  std::string text = FIXTURE;
+  text += "0781  SanDisk Again\n"
+    "\t5567  Cruzer Again\n"
+    "\t5567  Cruzer Once More\n"
+    "\t5590  Ultra Dual\n";
+
+  _writeText(idsPath, text);
+  remove(indexPath.c_str());
+
+  auto started = std::chrono::steady_clock::now();
+
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(Test::elapsedMs(started) < 1000);
+
+  CHECK(_nameIs(database.vendorName(0x0781), "SanDisk Corp."));
+  CHECK(_nameIs(database.productName(0x0781, 0x5567), "Cruzer Blade"));
+  // New products under a repeated vendor line are still added
+  CHECK(_nameIs(database.productName(0x0781, 0x5590), "Ultra Dual"));
+
+  database.unload();
+  remove(idsPath.c_str());
+  remove(indexPath.c_str());
+}
+
+TEST(usb_ids_rebuilds_the_index_when_the_file_changes)
+{
+  UsbIdsDatabase &database = UsbIdsDatabase::instance();
+  std::string idsPath = Test::tempPath("usb-stale.ids");
+  std::string indexPath = Test::tempPath("usb-stale.idx");
+  std::string text = FIXTURE;
+
+  _writeText(idsPath, text);
+  _setMtime(idsPath, 1500000000);
+  remove(indexPath.c_str());
+
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.vendorName(0x0bda), "Realtek Semiconductor Corp."));
+  database.unload();
+
+  // Same size and mtime: the index is trusted, so the old name is still seen
+  std::string renamed = text;
+  renamed.replace(renamed.find("Realtek"), 7, "RealTEK");
+
+  _writeText(idsPath, renamed);
+  _setMtime(idsPath, 1500000000);
+
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.vendorName(0x0bda), "Realtek Semiconductor Corp."));
+  database.unload();
+
+  // Only the mtime changed
+  _setMtime(idsPath, 1500000060);
+
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.vendorName(0x0bda), "RealTEK Semiconductor Corp."));
+  database.unload();
+
+  // Only the size changed
+  _writeText(idsPath, renamed + "1d6b  Linux Foundation\n");
+  _setMtime(idsPath, 1500000060);
+
+  CHECK_EQ(_mtime(idsPath), static_cast<time_t>(1500000060));
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.vendorName(0x1d6b), "Linux Foundation"));
+
+  database.unload();
+  remove(idsPath.c_str());
+  remove(indexPath.c_str());
+}
+
+TEST(usb_ids_keeps_the_index_in_memory_when_it_cant_be_written)
+{
+  UsbIdsDatabase &database = UsbIdsDatabase::instance();
+  std::string idsPath = Test::tempPath("usb-memory.ids");
+  std::string indexPath = Test::tempPath("usb-missing-dir") + "/usb.idx";
+
+  _writeText(idsPath, FIXTURE);
+
+  CHECK(database.load(idsPath, indexPath));
+  CHECK(_nameIs(database.vendorName(0x05ac), "Apple, Inc."));
+  CHECK(_nameIs(database.productName(0x05ac, 0x8286), "Bluetooth Host Controller"));
+  CHECK(database.productName(0x05ac, 0x0000) == nullptr);
+
+  struct stat index;
+  CHECK(stat(indexPath.c_str(), &index) != 0);
+
+  database.unload();
+
+  // A missing usb.ids file is an error, not an empty database
+  CHECK(!database.load(Test::tempPath("usb-missing.ids"), indexPath));
+  CHECK(database.vendorName(0x05ac) == nullptr);
+
+  remove(idsPath.c_str());
+}
@@ -0,0 +1,95 @@
+var assert = require('chai').assert;
+var mock = require('./support/native_mock');
+
+describe('poll', function() {
+  var state;
+  var subdevil;
+
+  beforeEach(function() {
+    state = { tag: 't1', scans: 0, snapshot: null };
+
+    subdevil = mock.load({
+      poll: function(options, ifNoneMatch) {
+        state.scans++;
+        return ifNoneMatch === state.tag ? null : mock.devices(state.tag, [state.tag]);
+      },
+      sharedOpen: function() { return true; },
+      sharedTick: function() {},
+      sharedClose: function() {},
+      sharedPoll: function(ifNoneMatch) {
+        if (state.snapshot === null) {
+          return null;
+        }
+
+        return ifNoneMatch === state.snapshot.tag ? false : state.snapshot;
+      }
+    });
+  });
+
+  it('answers an unchanged tag with NOT_MODIFIED', function() {
+    return subdevil.poll().then(function(devices) {
+      assert.equal(devices.tag, 't1');
+      return subdevil.poll({ ifNoneMatch: devices.tag });
+    }).then(function(result) {
+      assert.strictEqual(result, subdevil.NOT_MODIFIED);
+    });
+  });
+
+  it('keeps cached devices only while their tag is current', function() {
+    return subdevil.poll({ maxAgeMs: 60000 }).then(function(devices) {
+      assert.equal(devices.tag, 't1');
+
+      // Another process or poll saw t2, the cache still holds t1
+      state.tag = 't2';
+      return subdevil.poll({ ifNoneMatch: 't2' });
+    }).then(function(result) {
+      assert.strictEqual(result, subdevil.NOT_MODIFIED);
+      return subdevil.poll({ maxAgeMs: 60000 });
+    }).then(function(devices) {
+      assert.equal(devices.tag, 't2');
+      assert.equal(state.scans, 3);
+    });
+  });
+
+  it('refreshes the cache when its tag is confirmed', function() {
+    return subdevil.poll({ maxAgeMs: 60000 }).then(function(devices) {
+      return subdevil.poll({ ifNoneMatch: devices.tag });
+    }).then(function() {
+      return subdevil.poll({ maxAgeMs: 60000 });
+    }).then(function(devices) {
+      assert.equal(devices.tag, 't1');
+      assert.equal(state.scans, 2);
+    });
+  });
+
+  it('tags shared snapshots and honours ifNoneMatch', function() {
+    state.snapshot = mock.devices('s1', ['a', 'b']);
+    subdevil.share('test');
+
+    return subdevil.poll().then(function(devices) {
+      assert.equal(devices.tag, 's1');
+      return subdevil.poll({ ifNoneMatch: 's1' });
+    }).then(function(result) {
+      assert.strictEqual(result, subdevil.NOT_MODIFIED);
+      assert.equal(state.scans, 0);
+      subdevil.unshare();
+    });
+  });
+
+  it('scans locally for options the shared snapshot was not scanned with', function() {
+    state.snapshot = mock.devices('s1', ['a', 'b']);
+    subdevil.share('test');
+
+    return subdevil.poll({ resolve: ['tty'] }).then(function(devices) {
+      assert.equal(devices.tag, 't1');
+      return subdevil.poll({ deadlineMs: 100 });
+    }).then(function(devices) {
+      assert.equal(devices.tag, 't1');
+      return subdevil.poll({ maxAgeMs: 0 });
+    }).then(function(devices) {
+      assert.equal(devices.tag, 's1');
+      assert.equal(state.scans, 2);
+      subdevil.unshare();
+    });
+  });
+});
@@ -0,0 +1,111 @@
+var assert = require('chai').assert;
+var mock = require('./support/native_mock');
+
+describe('scan', function() {
+  var state;
+  var subdevil;
+
+  beforeEach(function() {
+    state = { devices: ['a', 'b', 'c'], ready: 0, closed: 0, callback: null };
+
+    subdevil = mock.load({
+      scanOpen: function() {
+        return { position: 0 };
+      },
+      // Like the addon, hands out what the scan thread has enumerated and
+      // otherwise keeps the callback for when it has more
+      scanNext: function(handle, callback) {
+        if (handle.position === state.devices.length) {
+          return null;
+        }
+
+        if (handle.position === state.ready) {
+          state.callback = callback;
+          return undefined;
+        }
+
+        return { id: state.devices[handle.position++] };
+      },
+      scanClose: function(handle) {
+        state.closed++;
+        return { count: handle.position };
+      }
+    });
+  });
+
+  // Let the fake scan thread enumerate another device
+  function produce() {
+    var callback = state.callback;
+
+    state.ready++;
+    state.callback = null;
+
+    if (callback) {
+      callback();
+    }
+  }
+
+  it('waits for the scan thread', function() {
+    var scan = subdevil.scan();
+    var next = scan.next();
+
+    assert.isFunction(state.callback);
+    setTimeout(produce, 1);
+
+    return next.then(function(result) {
+      assert.deepEqual(result, { value: { id: 'a' }, done: false });
+    });
+  });
+
+  it('closes the scan once it is finished', function() {
+    var scan = subdevil.scan();
+    var ids = [];
+
+    state.ready = state.devices.length;
+
+    function step() {
+      return scan.next().then(function(result) {
+        if (result.done) {
+          return;
+        }
+
+        ids.push(result.value.id);
+        return step();
+      });
+    }
+
+    return step().then(function() {
+      assert.deepEqual(ids, ['a', 'b', 'c']);
+      assert.equal(state.closed, 1);
+      assert.deepEqual(scan.metrics, { count: 3 });
+    });
+  });
+
+  it('settles a waiting next() when returned', function() {
+    var scan = subdevil.scan();
+    var next = scan.next();
+
+    return scan.return().then(function() {
+      return next;
+    }).then(function(result) {
+      assert.isTrue(result.done);
+      assert.equal(state.closed, 1);
+      return scan.next();
+    }).then(function(result) {
+      assert.isTrue(result.done);
+    });
+  });
+
+  it('rejects overlapping next() calls', function() {
+    var scan = subdevil.scan();
+
+    scan.next();
+
+    return scan.next().then(function() {
+      assert.fail('second next() resolved');
+    }, function(error) {
+      assert.match(error.message, /previous next/);
+      return scan.return();
+    });
+  });
+});
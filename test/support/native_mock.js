@@ -0,0 +1,43 @@
+var Module = require('module');
+var path = require('path');
+
+var SUBDEVIL = path.join(__dirname, '..', '..', 'src', 'subdevil.js');
+
+/**
+ * Load a fresh copy of subdevil.js with the native addon replaced by the
+ * given object, so the JS side can be tested without devices.
+ *
+ * @param {Object} native Functions standing in for the addon's
+ * @returns {Object} The subdevil module
+ */
+exports.load = function load(native) {
+  var originalLoad = Module._load;
+
+  Module._load = function(request) {
+    if (/subdevil\.node$/.test(request)) {
+      return native;
+    }
+
+    return originalLoad.apply(this, arguments);
+  };
+
+  try {
+    delete require.cache[SUBDEVIL];
+    return require(SUBDEVIL);
+  } finally {
+    Module._load = originalLoad;
+  }
+};
+
+/**
+ * A list of devices tagged like the addon's poll() results.
+ */
+exports.devices = function devices(tag, ids) {
+  var result = ids.map(function(id) {
+    return { id: id, mount: null, volumes: [] };
+  });
+
+  result.tag = tag;
+
+  return result;
+};